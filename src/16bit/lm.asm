@@ -9,6 +9,8 @@ global  lm_check
 global  lm_enter
 
 extern  bootmain
+extern  __bss_start
+extern  __bss_end
 
 section .text
 
@@ -74,7 +76,7 @@ lm_check:
 lm_enter:
     
 ; create the page tables
-; 1 gb identity mapping using a single huge 1gb page
+; 4 gb identity mapping using 4 huge 1gb pages (includes the MMIO region of PCI devices)
 ; -> 2 page tables in total (PML4, PDPD placed in sequence)
 
     ; clear page tables using stosd
@@ -92,7 +94,14 @@ lm_enter:
     ; prepare the PDPT
     mov     eax, 0                                      ; identity mapping 0 -> 0
     or      eax, PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE  ; huge 1gb page
-    mov     [PDPT_LOCATION], eax
+    mov     edi, PDPT_LOCATION
+    mov     cx, 4                                       ; 4 entries -> 4 gb
+
+.map_page:
+    mov     [edi], eax
+    add     eax, 0x40000000                             ; next 1gb
+    add     edi, 8                                      ; next entry
+    loop    .map_page
 
 ; enter long mode
 
@@ -150,6 +159,14 @@ LM_START:
     mov     gs, ax
     mov     ss, ax
 
+    ; clear .bss (it is not part of the image, the memory behind it holds whatever was there before)
+    mov     rdi, __bss_start
+    mov     rcx, __bss_end
+    sub     rcx, rdi
+    xor     eax, eax
+    cld
+    rep     stosb
+
     ; jump to the bootloader main function written in C
     jmp     bootmain
 
@@ -44,8 +44,15 @@ MBR_START:
 
     ; load the second part of the bootloader 
     ; the correct values for reading are already present in the dap (see at the bottom)
+    ; it is read in chunks as a single read can not cross a segment
+.load_chunk:
     call    disk_read
 
+    add     word [buf + 2], STAGE2_CHUNK_SECS * 512 / 16   ; next segment
+    add     dword [lba], STAGE2_CHUNK_SECS                  ; next part on the disk
+    dec     word [n_chunks_left]
+    jnz     .load_chunk
+
     ; jump to the start of the second part of the bootloader
     jmp     PREP_START
 
@@ -99,10 +106,14 @@ BOOT_STACK          equ     0x7c00
 BOOT_PART_BOOTABLE  equ     0x7c00 + 0x1be
 STAGE2_LOAD_ADDR    equ     0x7c00 + 0x200
 
-STAGE2_SIZE_SECS    equ     0x20
+STAGE2_SIZE_SECS    equ     0x200
+STAGE2_CHUNK_SECS   equ     0x40
 STAGE2_START_LBA    equ     0x01
 
 
+n_chunks_left:      dw      STAGE2_SIZE_SECS / STAGE2_CHUNK_SECS
+
+
 align 4
 
 ; structure of the DAP (Disk Access Packet)
@@ -111,7 +122,7 @@ dap:
     db	0x10                ; size 16 bytes
     db	0x00                ; always 0
 num_sectors:	
-    dw	STAGE2_SIZE_SECS	; will be set to the sectors actually written
+    dw	STAGE2_CHUNK_SECS	; will be set to the sectors actually written
 buf:	
     dw	STAGE2_LOAD_ADDR	; memory buffer destination address for the rest of the bootloader
     dw	0		            ; segment (unused in this case)
@@ -2,7 +2,7 @@ bits    16
 
 
 global  PREP_START
-global  mmap_entries
+global  n_mmap_entries
 
 extern  a20_enable
 extern  error_a20
@@ -0,0 +1,267 @@
+#include <types.h>
+#include <bench.h>
+#include <drive.h>
+#include <part.h>
+#include <fat32.h>
+#include <vfs.h>
+#include <mmap.h>
+#include <layout.h>
+#include <tsc.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+static const char *bench_type_names[] = {
+    "none", "ata", "sata", "atapi", "nvme", "virtio", "usb", "sd"
+};
+
+static u8 *bench_buf = 0;
+static u64 bench_lat[BENCH_MAX_OPS];
+static u64 bench_rand_state = BENCH_SEED;
+
+
+// benchmarks every usable drive and the FAT32 partitions on it
+void bench_run_all(void) {
+
+    bench_buf = mmap_reserve_high(BENCH_BUF_BYTES, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!bench_buf) {
+        log_warn("Benchmark: not enough memory\n");
+        return;
+    }
+
+    bench_puts("bench begin");
+    bench_field("tsc_khz", tsc_khz);
+    bench_puts("\n");
+
+    u64 index = 0;
+    for (drive_t *drive = drive_next(0); drive; drive = drive_next(drive)) {
+        if ((drive->type == DRIVE_NONE) || !drive->read) continue;
+
+        log_info("Benchmarking drive %u (%s)\n", index, bench_type_names[drive->type]);
+        bench_drive(drive, index++);
+    }
+
+    bench_puts("bench end\n");
+}
+
+
+// runs all tests on a drive
+void bench_drive(drive_t *drive, u64 index) {
+
+    u64 seq_sizes[BENCH_SEQ_N_SIZES] = BENCH_SEQ_SIZES;
+
+    for (u64 i = 0; i < BENCH_SEQ_N_SIZES; i++) bench_seq(drive, index, seq_sizes[i]);
+
+    bench_rand(drive, index);
+
+    for (u64 i = 0; i < n_vfs_mounts; i++) {
+        fs_t *fs = vfs_mounts[i];
+        if ((fs->drive == drive) && (fs->type == FS_FAT32)) bench_file((fat32_t*)fs, index);
+    }
+}
+
+
+// sequential reads of <n_bytes_op> starting at LBA 0
+void bench_seq(drive_t *drive, u64 index, u64 n_bytes_op) {
+
+    u64 n_bytes_drive = drive->n_secs * 512;
+    if (n_bytes_op > n_bytes_drive) return;
+
+    u64 n_ops = MIN(MIN(BENCH_SEQ_BYTES, n_bytes_drive) / n_bytes_op, BENCH_MAX_OPS);
+    u64 n_secs_op = n_bytes_op / 512;
+
+    u64 start = x86_rdtsc();
+
+    for (u64 i = 0; i < n_ops; i++) {
+        u64 t = x86_rdtsc();
+        u64 n_bytes = drive->read(drive, bench_buf, i * n_secs_op, n_secs_op);
+        bench_lat[i] = x86_rdtsc() - t;
+
+        if (n_bytes != n_bytes_op) {
+            log_warn("Benchmark: sequential read at LBA %u failed\n", i * n_secs_op);
+            return;
+        }
+    }
+
+    bench_report(drive, index, "seq", n_bytes_op, n_ops, x86_rdtsc() - start);
+}
+
+
+// random 4 KiB aligned reads (the same sequence on every run)
+void bench_rand(drive_t *drive, u64 index) {
+
+    u64 n_blks = drive->n_secs * 512 / BENCH_RAND_BYTES;
+    if (n_blks == 0) return;
+
+    u64 n_secs_op = BENCH_RAND_BYTES / 512;
+    bench_rand_state = BENCH_SEED;
+
+    u64 start = x86_rdtsc();
+
+    for (u64 i = 0; i < BENCH_RAND_OPS; i++) {
+        u64 lba = (bench_rand_next() % n_blks) * n_secs_op;
+
+        u64 t = x86_rdtsc();
+        u64 n_bytes = drive->read(drive, bench_buf, lba, n_secs_op);
+        bench_lat[i] = x86_rdtsc() - t;
+
+        if (n_bytes != BENCH_RAND_BYTES) {
+            log_warn("Benchmark: random read at LBA %u failed\n", lba);
+            return;
+        }
+    }
+
+    bench_report(drive, index, "rand", BENCH_RAND_BYTES, BENCH_RAND_OPS, x86_rdtsc() - start);
+}
+
+
+// loads the largest file of the root directory, raw and through vfs_load
+void bench_file(fat32_t *fs, u64 index) {
+
+    u64 n_bytes_cluster = fs->secs_per_cluster * 512;
+    fat32_dir_entry_t *entries = (fat32_dir_entry_t*)fs->cache_root;
+    fat32_dir_entry_t *file = 0;
+
+    for (u64 i = 0; i < n_bytes_cluster / sizeof(fat32_dir_entry_t); i++) {
+
+        fat32_dir_entry_t *entry = &entries[i];
+
+        // end of the directory, deleted entries, long names, volume labels and directories
+        if (entry->name[0] == 0) break;
+        if ((u8)entry->name[0] == FAT32_DELETED) continue;
+        if (entry->attr & (FAT32_DIR | FAT32_VOLUME_ID)) continue;
+
+        if ((entry->filesize > BENCH_BUF_BYTES) || (entry->filesize == 0)) continue;
+        if (!file || (entry->filesize > file->filesize)) file = entry;
+    }
+
+    if (!file) return;
+
+    // "/NAME.EXT"
+    char path[1 + FAT32_NAME + 1 + FAT32_EXT + 1];
+    path[0] = '/';
+    fat32_entry_name(file, path + 1);
+
+    u64 n_bytes = file->filesize;
+    u64 n_clusters = (n_bytes + n_bytes_cluster - 1) / n_bytes_cluster;
+
+    u64 n_clusters_before = fs->n_clusters_loaded;
+    u64 n_reads_before = fs->n_reads;
+
+    u64 start = x86_rdtsc();
+    fat32_load_file(fs, path, bench_buf, n_clusters);
+    u64 ticks = x86_rdtsc() - start;
+
+    bench_lat[0] = ticks;
+    bench_report(fs->base.drive, index, "file", n_bytes, 1, ticks);
+
+    // reads of the data clusters: one per cluster without merging vs. one per extent
+    bench_puts("bench");
+    bench_field("drive", index);
+    bench_puts(" test=file_reads");
+    bench_field("clusters", fs->n_clusters_loaded - n_clusters_before);
+    bench_field("reads", fs->n_reads - n_reads_before);
+    bench_puts("\n");
+
+    // the same file through vfs_load (decompressed while it is read if it is LZ4 compressed)
+    file_t f;
+    if (!vfs_open(&fs->base, path, &f)) return;
+
+    start = x86_rdtsc();
+    u64 n_bytes_loaded = vfs_load(&f, bench_buf, BENCH_BUF_BYTES, 0);
+    ticks = x86_rdtsc() - start;
+
+    vfs_close(&f);
+
+    bench_lat[0] = ticks;
+    bench_report(fs->base.drive, index, "file_load", n_bytes_loaded, 1, ticks);
+}
+
+
+// prints a result line with throughput and the latency distribution of <bench_lat>
+void bench_report(drive_t *drive, u64 index, const char *test, u64 n_bytes_op, u64 n_ops, u64 ticks) {
+
+    u64 us = MAX(tsc_us(ticks), 1);
+    u64 n_bytes = n_bytes_op * n_ops;
+
+    bench_sort(bench_lat, n_ops);
+
+    bench_puts("bench");
+    bench_field("drive", index);
+    bench_puts(" type=");
+    bench_puts(bench_type_names[drive->type]);
+    bench_puts(" test=");
+    bench_puts(test);
+    bench_field("op_bytes", n_bytes_op);
+    bench_field("ops", n_ops);
+    bench_field("bytes", n_bytes);
+    bench_field("us", us);
+
+    // bytes per microsecond = MB/s, with two decimal places
+    u64 mb_s = n_bytes * 100 / us;
+    bench_field("mb_s", mb_s / 100);
+    x86_outb(DBG_PORT, '.');
+    x86_outb(DBG_PORT, '0' + (mb_s / 10) % 10);
+    x86_outb(DBG_PORT, '0' + mb_s % 10);
+
+    bench_field("iops", n_ops * 1000000 / us);
+    bench_field("lat_min_ns", tsc_ns(bench_lat[0]));
+    bench_field("lat_p50_ns", tsc_ns(bench_lat[(n_ops - 1) * 50 / 100]));
+    bench_field("lat_p90_ns", tsc_ns(bench_lat[(n_ops - 1) * 90 / 100]));
+    bench_field("lat_p99_ns", tsc_ns(bench_lat[(n_ops - 1) * 99 / 100]));
+    bench_field("lat_max_ns", tsc_ns(bench_lat[n_ops - 1]));
+    bench_puts("\n");
+}
+
+
+// sorts in ascending order (insertion sort, at most BENCH_MAX_OPS values)
+void bench_sort(u64 *vals, u64 n) {
+
+    for (u64 i = 1; i < n; i++) {
+        u64 val = vals[i];
+        u64 j = i;
+
+        for (; (j > 0) && (vals[j - 1] > val); j--) vals[j] = vals[j - 1];
+        vals[j] = val;
+    }
+}
+
+
+// xorshift64
+u64 bench_rand_next(void) {
+
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+
+    return bench_rand_state;
+}
+
+
+// writes directly to the debug port (not to the screen)
+void bench_puts(const char *str) {
+    for (u64 i = 0; str[i]; i++) x86_outb(DBG_PORT, str[i]);
+}
+
+
+void bench_putu(u64 num) {
+
+    char buf[20];
+    s64 i = 0;
+
+    do {
+        buf[i++] = num % 10 + '0';
+    } while ((num /= 10) != 0);
+
+    while (--i >= 0) x86_outb(DBG_PORT, buf[i]);
+}
+
+
+// writes " <key>=<val>"
+void bench_field(const char *key, u64 val) {
+    x86_outb(DBG_PORT, ' ');
+    bench_puts(key);
+    x86_outb(DBG_PORT, '=');
+    bench_putu(val);
+}
@@ -12,6 +12,17 @@
 #include <heap.h>
 #include <ata.h>
 #include <layout.h>
+#include <cache.h>
+#include <dcache.h>
+#include <cpu.h>
+#include <crc32.h>
+#include <sha256.h>
+#include <verify.h>
+#include <elf.h>
+#include <linux.h>
+#include <part.h>
+#include <tsc.h>
+#include <bench.h>
 
 
 u8 drives[PAGE_SIZE];
@@ -22,6 +33,14 @@ heap_t heap_drives = {
     drives
 };
 
+ALIGNED(PAGE_SIZE) u8 dma[64 * PAGE_SIZE];
+heap_t heap_dma = {
+    64 * PAGE_SIZE,
+    64 * PAGE_SIZE,
+    0,
+    dma
+};
+
 u8 filesystems[PAGE_SIZE];
 heap_t heap_filesystems = {
     PAGE_SIZE,
@@ -41,12 +60,59 @@ void bootmain(void) {
 
     log_info("Successfully entered Long Mode.\n");
 
+    // SSE and optional instruction set extensions
+    cpu_init();
+    crc32_init();
+    sha256_init();
+    tsc_init();
+
    // interrupts
     idt_init();
     pic_init();
 
+    // block and dentry caches in the memory above 1 MiB
+    cache_init();
+    dcache_init();
+
     // scan devices
     pci_scan_all();
 
+    // partitions of all usable drives
+    for (drive_t *drive = drive_next(0); drive; drive = drive_next(drive)) {
+        if ((drive->type != DRIVE_NONE) && drive->read) part_scan(drive);
+    }
+
+    // filesystems on them
+    vfs_mount_all();
+
+    // hash backends and the manifests of files that are verified while they are loaded
+    verify_init();
+
+#ifdef BENCH
+    bench_run_all();
+#endif
+
+    // start the first kernel that is found (Linux before ELF on the same filesystem)
+    for (u64 i = 0; i < n_vfs_mounts; i++) {
+        fs_t *fs = vfs_mounts[i];
+        fs_stat_t stat;
+
+        // the counters of both caches are printed once the kernel is loaded (nothing is read after it)
+        if (vfs_stat(fs, LINUX_KERNEL_PATH, &stat) && !stat.dir) {
+            u64 kernel = linux_load(fs);
+            cache_print_stats();
+            dcache_print_stats();
+            linux_start(kernel);
+        }
+        if (vfs_stat(fs, ELF_KERNEL_PATH, &stat) && !stat.dir) {
+            u64 entry = elf_load(fs, ELF_KERNEL_PATH);
+            cache_print_stats();
+            dcache_print_stats();
+            elf_start(entry);
+        }
+    }
+
+    log_warn("No kernel found (%s or %s)\n", LINUX_KERNEL_PATH, ELF_KERNEL_PATH);
+
     while(1);
 }
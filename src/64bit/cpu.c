@@ -0,0 +1,48 @@
+#include <types.h>
+#include <cpu.h>
+#include <x86.h>
+#include <log.h>
+#include <tty.h>
+
+
+cpu_features_t cpu_features = {0};
+
+
+// detects the instruction set extensions and enables SSE
+// irq_common saves the x87/SSE state, so SSE can be used everywhere once this has run
+void cpu_init(void) {
+
+    u32 eax, ebx, ecx, edx;
+    x86_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPUID_1_EDX_FXSR) || !(edx & CPUID_1_EDX_SSE2)) {
+        log_warn("CPU without SSE2\n");
+        return;
+    }
+
+    // no x87 emulation, fxsave/fxrstor and SSE exceptions are handled by the OS
+    x86_set_cr0((x86_get_cr0() & ~CR0_EM) | CR0_MP);
+    x86_set_cr4(x86_get_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+    cpu_features.sse = true;
+    cpu_features.ssse3 = (ecx & CPUID_1_ECX_SSSE3) != 0;
+    cpu_features.sse41 = (ecx & CPUID_1_ECX_SSE41) != 0;
+    cpu_features.sse42 = (ecx & CPUID_1_ECX_SSE42) != 0;
+    cpu_features.pclmul = (ecx & CPUID_1_ECX_PCLMUL) != 0;
+
+    // leaf 7 only exists if the highest leaf (eax of leaf 0) reaches it
+    u32 max_leaf;
+    x86_cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+    if (max_leaf >= 7) {
+        x86_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        cpu_features.sha = (ebx & CPUID_7_EBX_SHA) != 0;
+    }
+
+    log_info("CPU features: SSSE3 %s, SSE4.1 %s, SSE4.2 %s, PCLMULQDQ %s, SHA %s\n",
+            cpu_features.ssse3 ? "yes" : "no",
+            cpu_features.sse41 ? "yes" : "no",
+            cpu_features.sse42 ? "yes" : "no",
+            cpu_features.pclmul ? "yes" : "no",
+            cpu_features.sha ? "yes" : "no");
+}
@@ -0,0 +1,278 @@
+#include <types.h>
+#include <crc32.h>
+#include <cpu.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+
+
+crc32_backend_t crc32_backend = CRC32_SLICE8;
+crc32c_backend_t crc32c_backend = CRC32C_SLICE8;
+
+// table <k> advances a byte by <k> further zero bytes
+static u32 crc32_table[8][256];
+static u32 crc32c_table[8][256];
+
+// folding constants (x^n mod P, bit reflected), see Intel's "Fast CRC Computation Using PCLMULQDQ"
+static ALIGNED(16) u64 crc32_consts[10] = {
+    0x0154442bd4, 0x01c6e41596,     // R1, R2: fold by 512 bits
+    0x01751997d0, 0x00ccaa009e,     // R3, R4: fold by 128 bits
+    0x0163cd6124, 0,                // R5: fold 64 -> 32 bits
+    0xffffffff, 0,                  // mask of the low dword
+    0x01db710641, 0x01f7011641      // P', u: barrett reduction
+};
+
+
+// builds the slicing tables of a (reflected) polynomial
+static void crc32_build_tables(u32 table[8][256], u32 poly) {
+
+    for (u64 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for (u64 bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+        table[0][i] = crc;
+    }
+
+    for (u64 k = 1; k < 8; k++) {
+        for (u64 i = 0; i < 256; i++) {
+            u32 crc = table[k - 1][i];
+            table[k][i] = (crc >> 8) ^ table[0][crc & 0xff];
+        }
+    }
+}
+
+
+// builds the slicing tables and picks the fastest backends
+// cpu_init has to be called before
+void crc32_init(void) {
+
+    crc32_build_tables(crc32_table, CRC32_POLY);
+    crc32_build_tables(crc32c_table, CRC32C_POLY);
+
+    // pextrd is SSE4.1
+    if (cpu_features.pclmul && cpu_features.sse41) crc32_backend = CRC32_PCLMUL;
+    if (cpu_features.sse42) crc32c_backend = CRC32C_SSE42;
+
+    log_info("CRC32 backend: %s, CRC32C backend: %s\n",
+            (crc32_backend == CRC32_PCLMUL) ? "PCLMULQDQ" : "slice-by-8",
+            (crc32c_backend == CRC32C_SSE42) ? "SSE4.2" : "slice-by-8");
+}
+
+
+// slice-by-8 with the tables of either polynomial
+static u32 crc32_slice8(u32 table[8][256], u32 crc, u8 *buf, u64 n_bytes) {
+
+    while (n_bytes >= 8) {
+        u32 lo = *(u32*)buf ^ crc;
+        u32 hi = *(u32*)(buf + 4);
+
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+
+        buf += 8;
+        n_bytes -= 8;
+    }
+
+    while (n_bytes--) crc = (crc >> 8) ^ table[0][(crc ^ *buf++) & 0xff];
+
+    return crc;
+}
+
+
+// updates the (not inverted) CRC register with 8 bytes per step
+u32 crc32_update_slice8(u32 crc, u8 *buf, u64 n_bytes) {
+    return crc32_slice8(crc32_table, crc, buf, n_bytes);
+}
+
+
+// updates the (not inverted) CRC register using carry-less multiplication
+// folds 4 x 128 bits in parallel, the tail of less than 16 bytes is done by slice-by-8
+// only usable with SSE enabled (see cpu_init)
+u32 crc32_update_pclmul(u32 crc, u8 *buf, u64 n_bytes) {
+
+    if (n_bytes < CRC32_PCLMUL_MIN_BYTES) return crc32_update_slice8(crc, buf, n_bytes);
+
+    u64 n_bytes_fold = n_bytes & ~15ULL;
+    u8 *p = buf;
+    u64 n = n_bytes_fold;
+
+    ASM(
+        "movdqu xmm1, [%1]\n"
+        "movdqu xmm2, [%1 + 0x10]\n"
+        "movdqu xmm3, [%1 + 0x20]\n"
+        "movdqu xmm4, [%1 + 0x30]\n"
+        "movd xmm0, %0\n"
+        "pxor xmm1, xmm0\n"
+        "sub %2, 0x40\n"
+        "add %1, 0x40\n"
+        "cmp %2, 0x40\n"
+        "jb 2f\n"
+
+        // fold 512 bits at a time
+        "movdqa xmm0, [%3]\n"
+        "1:\n"
+        "movdqa xmm5, xmm1\n"
+        "movdqa xmm6, xmm2\n"
+        "movdqa xmm7, xmm3\n"
+        "movdqa xmm8, xmm4\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pclmulqdq xmm2, xmm0, 0x00\n"
+        "pclmulqdq xmm3, xmm0, 0x00\n"
+        "pclmulqdq xmm4, xmm0, 0x00\n"
+        "pclmulqdq xmm5, xmm0, 0x11\n"
+        "pclmulqdq xmm6, xmm0, 0x11\n"
+        "pclmulqdq xmm7, xmm0, 0x11\n"
+        "pclmulqdq xmm8, xmm0, 0x11\n"
+        "pxor xmm1, xmm5\n"
+        "pxor xmm2, xmm6\n"
+        "pxor xmm3, xmm7\n"
+        "pxor xmm4, xmm8\n"
+        "movdqu xmm5, [%1]\n"
+        "movdqu xmm6, [%1 + 0x10]\n"
+        "movdqu xmm7, [%1 + 0x20]\n"
+        "movdqu xmm8, [%1 + 0x30]\n"
+        "pxor xmm1, xmm5\n"
+        "pxor xmm2, xmm6\n"
+        "pxor xmm3, xmm7\n"
+        "pxor xmm4, xmm8\n"
+        "sub %2, 0x40\n"
+        "add %1, 0x40\n"
+        "cmp %2, 0x40\n"
+        "jae 1b\n"
+
+        // fold the 4 lanes into one
+        "2:\n"
+        "movdqa xmm0, [%3 + 0x10]\n"
+        "movdqa xmm5, xmm1\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pclmulqdq xmm5, xmm0, 0x11\n"
+        "pxor xmm1, xmm5\n"
+        "pxor xmm1, xmm2\n"
+        "movdqa xmm5, xmm1\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pclmulqdq xmm5, xmm0, 0x11\n"
+        "pxor xmm1, xmm5\n"
+        "pxor xmm1, xmm3\n"
+        "movdqa xmm5, xmm1\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pclmulqdq xmm5, xmm0, 0x11\n"
+        "pxor xmm1, xmm5\n"
+        "pxor xmm1, xmm4\n"
+
+        // fold the remaining 128 bit blocks
+        "cmp %2, 0x10\n"
+        "jb 4f\n"
+        "3:\n"
+        "movdqa xmm5, xmm1\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pclmulqdq xmm5, xmm0, 0x11\n"
+        "pxor xmm1, xmm5\n"
+        "movdqu xmm5, [%1]\n"
+        "pxor xmm1, xmm5\n"
+        "sub %2, 0x10\n"
+        "add %1, 0x10\n"
+        "cmp %2, 0x10\n"
+        "jae 3b\n"
+
+        // 128 -> 64 bits (also appends 32 zero bits)
+        "4:\n"
+        "pclmulqdq xmm0, xmm1, 0x01\n"
+        "psrldq xmm1, 8\n"
+        "pxor xmm1, xmm0\n"
+
+        // 64 -> 32 bits
+        "movdqa xmm2, xmm1\n"
+        "movdqa xmm0, [%3 + 0x20]\n"
+        "movdqa xmm3, [%3 + 0x30]\n"
+        "psrldq xmm2, 4\n"
+        "pand xmm1, xmm3\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pxor xmm1, xmm2\n"
+
+        // barrett reduction
+        "movdqa xmm0, [%3 + 0x40]\n"
+        "movdqa xmm2, xmm1\n"
+        "pand xmm1, xmm3\n"
+        "pclmulqdq xmm1, xmm0, 0x10\n"
+        "pand xmm1, xmm3\n"
+        "pclmulqdq xmm1, xmm0, 0x00\n"
+        "pxor xmm1, xmm2\n"
+        "pextrd %0, xmm1, 1\n"
+        : "+r"(crc), "+r"(p), "+r"(n)
+        : "r"(crc32_consts)
+        : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "cc", "memory");
+
+    return crc32_update_slice8(crc, buf + n_bytes_fold, n_bytes - n_bytes_fold);
+}
+
+
+// updates the (not inverted) CRC register with the selected backend
+u32 crc32_update(u32 crc, u8 *buf, u64 n_bytes) {
+
+    if (crc32_backend == CRC32_PCLMUL) return crc32_update_pclmul(crc, buf, n_bytes);
+
+    return crc32_update_slice8(crc, buf, n_bytes);
+}
+
+
+// CRC-32 of a buffer
+u32 crc32(u8 *buf, u64 n_bytes) {
+    return ~crc32_update(~0U, buf, n_bytes);
+}
+
+
+// updates the (not inverted) CRC-32C register with 8 bytes per step
+u32 crc32c_update_slice8(u32 crc, u8 *buf, u64 n_bytes) {
+    return crc32_slice8(crc32c_table, crc, buf, n_bytes);
+}
+
+
+// updates the (not inverted) CRC-32C register with the SSE4.2 crc32 instruction (8 bytes at a time)
+u32 crc32c_update_sse42(u32 crc, u8 *buf, u64 n_bytes) {
+
+    u64 c = crc;
+    u8 *p = buf;
+    u64 n = n_bytes;
+
+    ASM(
+        "cmp %2, 8\n"
+        "jb 2f\n"
+        "1:\n"
+        "crc32 %0, qword ptr [%1]\n"
+        "add %1, 8\n"
+        "sub %2, 8\n"
+        "cmp %2, 8\n"
+        "jae 1b\n"
+
+        // remaining bytes
+        "2:\n"
+        "test %2, %2\n"
+        "jz 4f\n"
+        "3:\n"
+        "crc32 %k0, byte ptr [%1]\n"
+        "inc %1\n"
+        "dec %2\n"
+        "jnz 3b\n"
+        "4:\n"
+        : "+r"(c), "+r"(p), "+r"(n)
+        :
+        : "cc", "memory");
+
+    return c;
+}
+
+
+// updates the (not inverted) CRC-32C register with the selected backend
+u32 crc32c_update(u32 crc, u8 *buf, u64 n_bytes) {
+
+    if (crc32c_backend == CRC32C_SSE42) return crc32c_update_sse42(crc, buf, n_bytes);
+
+    return crc32c_update_slice8(crc, buf, n_bytes);
+}
+
+
+// CRC-32C of a buffer
+u32 crc32c(u8 *buf, u64 n_bytes) {
+    return ~crc32c_update(~0U, buf, n_bytes);
+}
@@ -0,0 +1,261 @@
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <ide.h>
+#include <ahci.h>
+#include <heap.h>
+#include <utils.h>
+
+
+// stops a port's command processing
+// the command list and FIS area may only be changed afterwards
+void ahci_port_stop(ahci_port_regs_t *port) {
+
+    port->cmd &= ~AHCI_PORT_CMD_ST;
+    while (port->cmd & AHCI_PORT_CMD_CR);
+
+    port->cmd &= ~AHCI_PORT_CMD_FRE;
+    while (port->cmd & AHCI_PORT_CMD_FR);
+}
+
+
+// (re)starts a port's command processing
+void ahci_port_start(ahci_port_regs_t *port) {
+
+    // wait until the device is ready
+    while (port->tfd & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ));
+
+    port->cmd |= AHCI_PORT_CMD_FRE;
+    port->cmd |= AHCI_PORT_CMD_ST;
+}
+
+
+// stops the drive's port, so the HBA no longer uses its command list and FIS area
+void ahci_shutdown(void *self) {
+
+    ahci_drive_t *drive = (ahci_drive_t*)self;
+    ahci_port_stop(drive->port);
+}
+
+
+// fills a command slot and hands it over to the HBA
+// does not wait for completion (see ahci_poll)
+void ahci_issue(ahci_drive_t *drive, u8 slot, u8 cmd, u8 *dest, u64 lba, u64 n_secs) {
+
+    ahci_cmd_header_t *header = &drive->cmd_list[slot];
+    ahci_cmd_table_t *table = &drive->cmd_tables[slot];
+    fis_reg_h2d_t *fis = (fis_reg_h2d_t*)table->cfis;
+
+    // describe the destination buffer
+    u64 addr = (u64)dest;
+    u64 n_bytes_left = n_secs * 512;
+    u16 n_prds = 0;
+
+    while (n_bytes_left > 0) {
+
+        u64 n_bytes = MIN(n_bytes_left, AHCI_PRD_MAX_BYTES);
+
+        table->prdt[n_prds].dba = addr & 0xffffffff;
+        table->prdt[n_prds].dbau = addr >> 32;
+        table->prdt[n_prds].reserved = 0;
+        table->prdt[n_prds].dbc = n_bytes - 1;
+
+        addr += n_bytes;
+        n_bytes_left -= n_bytes;
+        n_prds++;
+    }
+
+    // build the command FIS
+    mem_set((u8*)fis, 0, sizeof(fis_reg_h2d_t));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_CMD;
+    fis->cmd = cmd;
+    fis->device = FIS_DEV_LBA;
+
+    fis->lba0 = lba & 0xff;
+    fis->lba1 = (lba >> 8) & 0xff;
+    fis->lba2 = (lba >> 16) & 0xff;
+    fis->lba3 = (lba >> 24) & 0xff;
+    fis->lba4 = (lba >> 32) & 0xff;
+    fis->lba5 = (lba >> 40) & 0xff;
+
+    // queued commands carry the sector count in the feature register and the tag in count
+    if (cmd == ATA_CMD_READ_FPDMA) {
+        fis->feature_low = n_secs & 0xff;
+        fis->feature_high = (n_secs >> 8) & 0xff;
+        fis->count_low = slot << 3;
+    } else {
+        fis->count_low = n_secs & 0xff;
+        fis->count_high = (n_secs >> 8) & 0xff;
+    }
+
+    header->flags = AHCI_CMD_CFL(sizeof(fis_reg_h2d_t) / sizeof(u32));
+    header->prdtl = n_prds;
+    header->prdbc = 0;
+
+    // the command has to be in memory before the HBA fetches it
+    x86_mfence();
+
+    if (cmd == ATA_CMD_READ_FPDMA) drive->port->sact = 1u << slot;
+    drive->port->ci = 1u << slot;
+}
+
+
+// checks which of the <busy> slots are still being processed
+// returns the slots that have not completed yet
+u32 ahci_poll(ahci_drive_t *drive, u32 busy) {
+
+    u32 active = drive->port->ci | drive->port->sact;
+
+    // error
+    if (drive->port->is & AHCI_PORT_IS_TFES)
+        log_err("AHCI read error:\nPort: tfd=%x is=%x (active=%x)\n",
+                (u64)drive->port->tfd,
+                (u64)drive->port->is,
+                (u64)active);
+
+    return busy & active;
+}
+
+
+// reads sectors from a SATA drive into RAM
+// the request is split into chunks that are issued in parallel on all command slots
+u64 ahci_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    ahci_drive_t *drive = (ahci_drive_t*)self;
+
+    // check if the requested lba is out of bounds
+    if ((lba + n_secs) > drive->base.n_secs)
+        log_err("AHCI read error:\nLBA address exceeds drive size lba=%x size=%x\n",
+                (u64)(lba + n_secs), drive->base.n_secs);
+
+    u8 cmd = drive->ncq ? ATA_CMD_READ_FPDMA : ATA_CMD_READ_DMA48;
+    u64 n_secs_issued = 0;
+    u32 busy = 0;
+
+    while ((n_secs_issued < n_secs) || busy) {
+
+        // fill all free slots
+        for (u8 slot = 0; (slot < drive->n_slots) && (n_secs_issued < n_secs); slot++) {
+
+            if (busy & (1u << slot)) continue;
+
+            u64 n_secs_cmd = MIN(n_secs - n_secs_issued, AHCI_CMD_MAX_SECS);
+
+            ahci_issue(drive, slot, cmd, dest + n_secs_issued * 512, lba + n_secs_issued, n_secs_cmd);
+
+            busy |= 1u << slot;
+            n_secs_issued += n_secs_cmd;
+        }
+
+        busy = ahci_poll(drive, busy);
+    }
+    // return the bytes read
+    return n_secs_issued * 512;
+}
+
+
+// sets up a port's memory structures and identifies the attached drive
+// detected drives are allocated on <heap_drives>
+void ahci_port_init(ahci_regs_t *hba, u8 n_port) {
+
+    ahci_port_regs_t *port = &hba->ports[n_port];
+
+    // nothing attached
+    if (AHCI_SSTS_DET(port->ssts) != AHCI_SSTS_DET_PRESENT) return;
+
+    if (port->sig == AHCI_SIG_ATAPI) {
+        log_warn("Found SATAPI drive (not supported)\n");
+        return;
+    }
+    if (port->sig != AHCI_SIG_ATA) return;
+
+    ahci_port_stop(port);
+
+    u8 n_slots = AHCI_CAP_NCS(hba->cap);
+
+    // allocate a new SATA drive
+    ahci_drive_t *drive = heap_alloc(&heap_drives, sizeof(ahci_drive_t));
+    drive->base.type = DRIVE_SATA;
+    drive->base.size = sizeof(ahci_drive_t);
+    drive->base.read = ahci_read;
+    drive->base.readv = 0;
+    drive->base.submit = 0;
+    drive->base.shutdown = ahci_shutdown;
+    drive->base.n_secs = 0;
+    drive->port = port;
+
+    // command list (1 KiB aligned), received FIS area (256 byte aligned), command tables
+    drive->cmd_list = heap_alloc_aligned(&heap_dma, AHCI_N_SLOTS * sizeof(ahci_cmd_header_t), 1024);
+    u8 *fis_area = heap_alloc_aligned(&heap_dma, 256, 256);
+    drive->cmd_tables = heap_alloc_aligned(&heap_dma, n_slots * sizeof(ahci_cmd_table_t), 128);
+
+    mem_set((u8*)drive->cmd_list, 0, AHCI_N_SLOTS * sizeof(ahci_cmd_header_t));
+    mem_set(fis_area, 0, 256);
+    mem_set((u8*)drive->cmd_tables, 0, n_slots * sizeof(ahci_cmd_table_t));
+
+    for (u8 slot = 0; slot < n_slots; slot++) {
+        drive->cmd_list[slot].ctba = (u64)&drive->cmd_tables[slot] & 0xffffffff;
+        drive->cmd_list[slot].ctbau = (u64)&drive->cmd_tables[slot] >> 32;
+    }
+
+    port->clb = (u64)drive->cmd_list & 0xffffffff;
+    port->clbu = (u64)drive->cmd_list >> 32;
+    port->fb = (u64)fis_area & 0xffffffff;
+    port->fbu = (u64)fis_area >> 32;
+
+    // clear old errors/interrupts
+    port->serr = U32_MAX;
+    port->is = U32_MAX;
+
+    ahci_port_start(port);
+
+    // identify the drive
+    u16 *ident = heap_alloc_aligned(&heap_dma, 512, 2);
+    ahci_issue(drive, 0, ATA_CMD_IDENTIFY, (u8*)ident, 0, 1);
+    while (ahci_poll(drive, 1));
+
+    drive->base.max_secs = AHCI_CMD_MAX_SECS;
+    drive->base.max_call_secs = U64_MAX;     // ahci_read fills all command slots
+    drive->base.n_secs = MAX(
+            DWORD(ident[ATA_IDENT_LBA28 + 1], ident[ATA_IDENT_LBA28]),
+            QWORD(
+                DWORD(ident[ATA_IDENT_LBA48 + 3], ident[ATA_IDENT_LBA48 + 2]),
+                DWORD(ident[ATA_IDENT_LBA48 + 1], ident[ATA_IDENT_LBA48])));
+
+    // use native command queuing if both the HBA and the drive support it
+    drive->ncq = (hba->cap & AHCI_CAP_SNCQ) && (ident[ATA_IDENT_SATA_CAP] & ATA_SATA_CAP_NCQ);
+    drive->n_slots = n_slots;
+    if (drive->ncq)
+        drive->n_slots = MIN(n_slots, (ident[ATA_IDENT_QUEUE_DEPTH] & 0x1f) + 1);
+
+    log_info("Found SATA drive (port %u, %u slots, NCQ=%u)\n",
+            (u64)n_port, (u64)drive->n_slots, (u64)drive->ncq);
+}
+
+
+// takes over an AHCI controller and initializes all implemented ports
+void ahci_initialize(u8 bus, u8 dev, u8 func) {
+
+    ahci_regs_t *hba = (ahci_regs_t*)(u64)(pci_cfg_read(bus, dev, func, PCI_OFF_BAR5) & PCI_BAR_MEM_MASK);
+
+    // allow MMIO and DMA
+    u16 pci_cmd = pci_cfg_read(bus, dev, func, PCI_OFF_CMD);
+    pci_cfg_write(bus, dev, func, PCI_OFF_CMD, pci_cmd | PCI_CMD_MEM | PCI_CMD_BUSMASTER);
+
+    // request ownership from the BIOS
+    if (hba->cap2 & AHCI_CAP2_BOH) {
+        hba->bohc |= AHCI_BOHC_OOS;
+        while (hba->bohc & AHCI_BOHC_BOS);
+    }
+
+    // AHCI mode (instead of legacy IDE emulation)
+    hba->ghc |= AHCI_GHC_AE;
+
+    for (u8 n_port = 0; n_port < AHCI_N_PORTS; n_port++) {
+        if (hba->pi & (1u << n_port)) ahci_port_init(hba, n_port);
+    }
+}
@@ -7,30 +7,26 @@
 #include <drive.h>
 
 
-// reads sectors from an ATA drive into RAM
+// selects the drive and sends a command together with its lba and sector count
 // automatically switches between LBA28 and LBA48 to get the optimal performance
-u64 ata_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
-
-    ata_t *drive = (ata_t*)self;
-
-    // check if the requested lba is out of bounds
-    if ((lba + n_secs) > drive->ide.base.n_secs)
-        log_err("ATA read error:\nLBA address exceeds drive size lba=%x size=%x\n", 
-                (u64)(lba + n_secs), drive->ide.base.n_secs);
-    
+void ata_send_cmd(ata_t *drive, u64 lba, u64 n_secs, u8 cmd28, u8 cmd48) {
 
-    u16 n_secs_read = 0;
     ata_drive_sel_t mode = ATA_SEL_NONE;
     u8 cmd = 0;
 
     // LBA48 is required
-    if ((lba > U28_MAX) || (n_secs > U8_MAX)) {
+    if (((lba + n_secs) > U28_MAX) || (n_secs > ATA_LBA28_MAX_SECS)) {
+
+        // the command would be rejected (or read the wrong sectors)
+        if (!drive->lba48)
+            log_err("ATA read error:\nLBA28 drive can not read lba=%x n_secs=%x\n", lba, n_secs);
+
         mode = ATA_SEL_LBA48;
-        cmd = ATA_CMD_READ48;
+        cmd = cmd48;
     // LBA28 is usually faster
     } else {
         mode = ATA_SEL_LBA28;
-        cmd = ATA_CMD_READ28;
+        cmd = cmd28;
     }
 
     ide_select_drive(drive->ide.cmd, drive->ide.slave, mode, (u32)lba);
@@ -60,33 +56,226 @@ u64 ata_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
 
     // send READ command
     x86_outb(ATA_REG_CMD(drive->ide.cmd), cmd);
+}
+
+
+// fills the drive's PRD table with the memory regions of a request, starting at sector <off>
+// regions are split at 64 KiB boundaries and at the request's segments
+// returns the sectors that fit into the table (at most <n_secs>)
+u64 ata_build_prdt(ata_t *drive, drive_req_t *req, u64 off, u64 n_secs) {
+
+    prd_t *prd = drive->ide.prdt;
+    u64 n_bytes_total = n_secs * 512;
+    u64 n_bytes_done = 0;
+    u64 i = 0;
+
+    while ((n_bytes_done < n_bytes_total) && (i < PRD_N_ENTRIES)) {
 
-    // read each sector
-    while (n_secs_read < n_secs) {
-
-        // wait for drive
-        ide_400ns_delay((ide_drive_t*)drive);
-
-        // poll until BSY bit clears or an error occurs
-        u8 status = x86_inb(ATA_REG_STATUS(drive->ide.cmd));
-        while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01))
-            status = x86_inb(ATA_REG_STATUS(drive->ide.cmd));
-
-        // error
-        if (status & 0x01) 
-            log_err("ATA read error:\nDrive: n_secs=%x (lba=%x n_secs=%x) -> dest=%x\n", 
-                    (u64)drive->ide.base.n_secs,
-                    (u64)lba, 
-                    (u64)n_secs, 
-                    (u64)dest);
-
-        // read data into memory (1 sector)
-        x86_insw(
-                ATA_REG_DATA(drive->ide.cmd), 
-                dest + n_secs_read * 512,
-                256);
-        n_secs_read++;
+        u64 n_bytes_contig;
+        u64 addr = (u64)drive_req_addr(req, off * 512 + n_bytes_done, &n_bytes_contig);
+
+        // bytes until the end of the segment or the next 64 KiB boundary
+        u64 n_bytes = MIN(n_bytes_total - n_bytes_done, n_bytes_contig);
+        n_bytes = MIN(n_bytes, PRD_MAX_BYTES - (addr & (PRD_MAX_BYTES - 1)));
+
+        prd[i].addr = (u32)addr;
+        prd[i].n_bytes = n_bytes & 0xffff;     // 64 KiB -> 0
+        prd[i].flags = 0;
+
+        n_bytes_done += n_bytes;
+        i++;
+    }
+
+    // the table is full -> the command has to end with a whole sector
+    u64 n_bytes_cut = n_bytes_done % 512;
+    n_bytes_done -= n_bytes_cut;
+
+    while (n_bytes_cut) {
+        u64 n_bytes_prd = prd[i - 1].n_bytes ? prd[i - 1].n_bytes : PRD_MAX_BYTES;
+
+        if (n_bytes_prd > n_bytes_cut) {
+            prd[i - 1].n_bytes = n_bytes_prd - n_bytes_cut;
+            break;
+        }
+        n_bytes_cut -= n_bytes_prd;
+        i--;
     }
+
+    // mark the end of the table
+    prd[i - 1].flags = PRD_EOT;
+
+    return n_bytes_done / 512;
+}
+
+
+// enables READ MULTIPLE with the largest block size the drive supports
+// falls back to single sector blocks if the drive rejects it
+void ata_set_multiple(ata_t *drive) {
+
+    if (drive->mult <= 1) {
+        drive->mult = 1;
+        return;
+    }
+
+    ide_select_drive(drive->ide.cmd, drive->ide.slave, ATA_SEL_IDENTIFY, 0);
+    ide_400ns_delay(&drive->ide);
+
+    x86_outb(ATA_REG_SECCOUNT(drive->ide.cmd), drive->mult);
+    x86_outb(ATA_REG_CMD(drive->ide.cmd), ATA_CMD_SET_MULTIPLE);
+
+    ide_400ns_delay(&drive->ide);
+
+    // wait until BSY bit clears
+    u8 status = ide_wait(&drive->ide);
+
+    if (status & ATA_STATUS_ERR) drive->mult = 1;
+}
+
+
+// checks if a request can be transferred with bus master DMA
+// PRDs can only hold even 32-bit addresses and even byte counts
+bool ata_use_dma(ata_t *drive, drive_req_t *req) {
+
+    if (!drive->ide.prdt) return false;
+
+    if (!req->iov)
+        return !((u64)req->dest & 1) && ((u64)req->dest + req->n_secs * 512 <= U32_MAX);
+
+    for (u64 i = 0; i < req->n_iov; i++) {
+        u64 addr = (u64)req->iov[i].addr;
+
+        if ((addr | req->iov[i].n_bytes) & 1) return false;
+        if (addr + req->iov[i].n_bytes > U32_MAX) return false;
+    }
+    return true;
+}
+
+
+// issues the next command of a request
+// requests of any size are split into the largest commands the drive supports
+void ata_start(void *self, drive_req_t *req) {
+
+    ata_t *drive = (ata_t*)self;
+
+    u64 max_secs = drive->ide.base.max_secs;
+    u64 lba = req->lba + req->n_secs_done;
+
+    req->n_secs_cmd = MIN(req->n_secs - req->n_secs_done, max_secs);
+    req->n_secs_xfer = 0;
+    req->status = DRIVE_REQ_ACTIVE;
+
+    // PIO: data is transferred in blocks of <mult> sectors per DRQ (READ MULTIPLE)
+    if (!ata_use_dma(drive, req)) {
+        if (drive->mult > 1)
+            ata_send_cmd(drive, lba, req->n_secs_cmd, ATA_CMD_READ_MULTIPLE28, ATA_CMD_READ_MULTIPLE48);
+        else
+            ata_send_cmd(drive, lba, req->n_secs_cmd, ATA_CMD_READ28, ATA_CMD_READ48);
+        return;
+    }
+
+    // DMA: a single command of up to ATA_LBA48_MAX_SECS sectors (as far as the PRD table reaches)
+    port_t bm = drive->ide.bm;
+
+    req->n_secs_cmd = ata_build_prdt(drive, req, req->n_secs_done, req->n_secs_cmd);
+
+    // stop the controller, set the direction and clear old status bits
+    x86_outb(IDE_BM_REG_CMD(bm), 0);
+    x86_outd(IDE_BM_REG_PRDT(bm), (u32)(u64)drive->ide.prdt);
+    x86_outb(IDE_BM_REG_CMD(bm), IDE_BM_CMD_READ);
+    x86_outb(IDE_BM_REG_STATUS(bm), IDE_BM_STATUS_IRQ | IDE_BM_STATUS_ERR);
+
+    ata_send_cmd(drive, lba, req->n_secs_cmd, ATA_CMD_READ_DMA28, ATA_CMD_READ_DMA48);
+
+    // start the transfer
+    x86_outb(IDE_BM_REG_CMD(bm), IDE_BM_CMD_READ | IDE_BM_CMD_START);
+}
+
+
+// finishes a DMA command once the drive raised its interrupt or the controller failed
+void ata_step_dma(ata_t *drive, drive_req_t *req) {
+
+    port_t bm = drive->ide.bm;
+
+    u8 bm_status = x86_inb(IDE_BM_REG_STATUS(bm));
+    if (!(bm_status & (IDE_BM_STATUS_IRQ | IDE_BM_STATUS_ERR))) return;
+
+    // stop the controller
+    x86_outb(IDE_BM_REG_CMD(bm), 0);
+
+    // reading the status register also acknowledges the drive's interrupt
+    u8 status = ide_poll(&drive->ide);
+
+    x86_outb(IDE_BM_REG_STATUS(bm), IDE_BM_STATUS_IRQ | IDE_BM_STATUS_ERR);
+
+    // error
+    if ((bm_status & IDE_BM_STATUS_ERR) || (status & ATA_STATUS_ERR)) {
+        req->error = x86_inb(ATA_REG_ERROR(drive->ide.cmd));
+        req->status = DRIVE_REQ_ERROR;
+        return;
+    }
+
+    req->n_secs_xfer = req->n_secs_cmd;
+}
+
+
+// transfers the next block of a PIO command if the drive is ready
+void ata_step_pio(ata_t *drive, drive_req_t *req) {
+
+    u8 status = x86_inb(ATA_REG_ALTSTATUS(drive->ide.ctrl));
+    if (status & ATA_STATUS_BSY) return;
+
+    // error
+    if (status & ATA_STATUS_ERR) {
+        req->error = x86_inb(ATA_REG_ERROR(drive->ide.cmd));
+        req->status = DRIVE_REQ_ERROR;
+        return;
+    }
+
+    if (!(status & ATA_STATUS_DRQ)) return;
+
+    // the last block might be shorter
+    u64 n_secs_block = MIN(req->n_secs_cmd - req->n_secs_xfer, drive->mult);
+
+    // read data into memory (1 block)
+    ide_read_data(&drive->ide, req, (req->n_secs_done + req->n_secs_xfer) * 512,
+            n_secs_block * 512, drive->pio32);
+
+    req->n_secs_xfer += n_secs_block;
+
+    // the status is only valid again after a while
+    ide_400ns_delay(&drive->ide);
+}
+
+
+// continues a request once the drive is ready
+// starts the next command when the current one is finished
+void ata_step(void *self, drive_req_t *req) {
+
+    ata_t *drive = (ata_t*)self;
+
+    if (req->status != DRIVE_REQ_ACTIVE) return;
+
+    if (ata_use_dma(drive, req)) ata_step_dma(drive, req);
+    else ata_step_pio(drive, req);
+
+    // command not finished yet
+    if ((req->status != DRIVE_REQ_ACTIVE) || (req->n_secs_xfer < req->n_secs_cmd)) return;
+
+    req->n_secs_done += req->n_secs_cmd;
+
+    if (req->n_secs_done < req->n_secs) ata_start(drive, req);
+    else req->status = DRIVE_REQ_DONE;
+}
+
+
+// reads sectors from an ATA drive into RAM
+// uses bus master DMA if the controller supports it, PIO otherwise
+u64 ata_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    drive_req_t req;
+
+    drive_submit(self, &req, dest, lba, n_secs);
+
     // return the bytes read
-    return n_secs_read * 512;
+    return drive_wait(&req);
 }
@@ -8,127 +8,200 @@
 #include <ide.h>
 
 
-// will be set by an IRQ from the ATAPI drive
-bool atapi_irq = false;
+// selects the drive and sends a PACKET command followed by the packet itself
+// <n_bytes_drq> is the largest byte count the drive may transfer per DRQ block
+// returns the status after the packet has been sent (ERR -> failed)
+u8 atapi_send_packet(atapi_t *drive, u8 *packet, u16 n_bytes_drq) {
 
-
-// returns the capacity of an ATAPI device using the Read Capacity command
-u64 atapi_read_capacity(atapi_t* atapi) {
-
-    // note: I have no idea if this works but the result looks fine (format)
-    // apart from the fact that it does not match with the filesize of my cdrom image file
-
-    u8 atapi_packet[12] = { ATA_CMD_READ_CAPACITY, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    u8 status;
+    // the previous command might still be finishing
+    ide_poll(&drive->ide);
 
     // select ATAPI drive
-    ide_select_drive(atapi->ide.cmd, atapi->ide.slave, ATA_SEL_NONE, 0);
-    ide_400ns_delay(&atapi->ide);
+    ide_select_drive(drive->ide.cmd, drive->ide.slave, ATA_SEL_PACKET, 0);
+    ide_400ns_delay(&drive->ide);
+
+    // PIO transfer with the given byte count limit
+    x86_outb(ATA_REG_FEATURES(drive->ide.cmd), 0);
+    x86_outb(ATA_REG_LBA1(drive->ide.cmd), n_bytes_drq & 0xff);
+    x86_outb(ATA_REG_LBA2(drive->ide.cmd), (n_bytes_drq >> 8) & 0xff);
 
     // send the PACKET command
-    x86_outb(ATA_REG_CMD(atapi->ide.cmd), ATA_CMD_PACKET);
+    x86_outb(ATA_REG_CMD(drive->ide.cmd), ATA_CMD_PACKET);
 
     // poll until BSY bit clears or an error occurs
-    status = x86_inb(ATA_REG_STATUS(atapi->ide.cmd));
-    while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01))
-        status = x86_inb(ATA_REG_STATUS(atapi->ide.cmd));
+    // (the drive does not raise an interrupt before the packet)
+    u8 status = ide_poll(&drive->ide);
 
     // error
-    if (status & 0x01) log_err("ATAPI READ CD-ROM CAPACITY\n");
+    if (status & ATA_STATUS_ERR) return status;
 
-    // send the atapi_packet
-    x86_outsw(ATA_REG_DATA(atapi->ide.cmd), atapi_packet, 6);
+    // send the packet
+    x86_outsw(ATA_REG_DATA(drive->ide.cmd), packet, 6);
 
-    // poll until BSY bit clears or an error occurs
-    status = x86_inb(ATA_REG_STATUS(atapi->ide.cmd));
-    while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01))
-        status = x86_inb(ATA_REG_STATUS(atapi->ide.cmd));
+    return status;
+}
+
+
+// determines the capacity of an ATAPI device using the Read Capacity command
+// sets the drive's block size and returns its size in blocks
+u64 atapi_read_capacity(atapi_t* atapi) {
+
+    u8 atapi_packet[12] = { ATA_CMD_READ_CAPACITY, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    u8 data[8];
 
     // error
-    if (status & 0x01) log_err("ATAPI READ CD-ROM CAPACITY\n");
+    if (atapi_send_packet(atapi, atapi_packet, sizeof(data)) & ATA_STATUS_ERR)
+        log_err("ATAPI READ CD-ROM CAPACITY\n");
 
-    u32 last_lba = DWORD(
-            x86_inw(ATA_REG_DATA(atapi->ide.cmd)),
-            x86_inw(ATA_REG_DATA(atapi->ide.cmd)));
-    
-    u32 blocksize = DWORD(
-            x86_inw(ATA_REG_DATA(atapi->ide.cmd)),
-            x86_inw(ATA_REG_DATA(atapi->ide.cmd)));
+    // sleep until the data is ready or an error occurs
+    u8 status = ide_wait(&atapi->ide);
 
-    return (last_lba - 1) * blocksize;
+    // error (e.g. no medium)
+    if (status & ATA_STATUS_ERR) {
+        atapi->blk_size = ATAPI_DEFAULT_BLK_SIZE;
+        return 0;
+    }
+
+    x86_insw(ATA_REG_DATA(atapi->ide.cmd), data, sizeof(data) / 2);
+
+    // both values are big endian
+    u32 last_lba = DWORD(WORD(data[0], data[1]), WORD(data[2], data[3]));
+    u32 blk_size = DWORD(WORD(data[4], data[5]), WORD(data[6], data[7]));
+
+    // only whole 512 byte sectors can be exposed through drive_t
+    if ((blk_size == 0) || (blk_size % 512) || (blk_size > ATAPI_MAX_DRQ_BYTES))
+        blk_size = ATAPI_DEFAULT_BLK_SIZE;
+    atapi->blk_size = blk_size;
+
+    return (u64)last_lba + 1;
 }
 
 
-// reads sectors from an ATAPI drive into RAM
-u64 atapi_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+// sends the READ(12) packet for a request
+// requests handed to the drive always cover whole blocks
+void atapi_start(void *self, drive_req_t *req) {
 
     atapi_t *drive = (atapi_t*)self;
-    u8 status;
-    u16 n_secs_read = 0;
-    
-    // bytes 2-5    -> LBA 
+
+    u64 blk = req->lba / drive->secs_per_blk;
+    u64 n_blks = req->n_secs / drive->secs_per_blk;
+
+    // bytes 2-5    -> LBA
     // bytes 6-9    -> transfer length
-    u8 atapi_packet[12] = {ATA_CMD_READ, 
+    u8 atapi_packet[12] = {ATA_CMD_READ,
                             0,
-                            (lba >> 0x18) & 0xff, 
-                            (lba >> 0x10) & 0xff, 
-                            (lba >> 0x08) & 0xff,
-                            (lba >> 0x00) & 0xff,
-                            (n_secs >> 0x18) & 0xff, 
-                            (n_secs >> 0x10) & 0xff, 
-                            (n_secs >> 0x08) & 0xff,
-                            (n_secs >> 0x00) & 0xff,
+                            (blk >> 0x18) & 0xff,
+                            (blk >> 0x10) & 0xff,
+                            (blk >> 0x08) & 0xff,
+                            (blk >> 0x00) & 0xff,
+                            (n_blks >> 0x18) & 0xff,
+                            (n_blks >> 0x10) & 0xff,
+                            (n_blks >> 0x08) & 0xff,
+                            (n_blks >> 0x00) & 0xff,
                             0, 0};
 
-    // check if the requested lba is out of bounds
-    if ((lba + n_secs) > drive->ide.base.n_secs)
-        log_err("ATAPI READ(12):\nLBA address exceeds drive size lba=%x size=%x\n", 
-                (u64)(lba + n_secs), drive->ide.base.n_secs);
+    req->n_secs_cmd = req->n_secs;
+    req->n_secs_xfer = 0;
+    req->status = DRIVE_REQ_ACTIVE;
 
-    // select ATAPI drive
-    ide_select_drive(drive->ide.cmd, drive->ide.slave, ATA_SEL_PACKET, 0);
-    ide_400ns_delay(&drive->ide);
-
-    // send the PACKET command
-    x86_outb(ATA_REG_CMD(drive->ide.cmd), ATA_CMD_PACKET);
+    // a DRQ block holds as many whole logical blocks as possible
+    u16 n_bytes_drq = ATAPI_MAX_DRQ_BYTES - ATAPI_MAX_DRQ_BYTES % drive->blk_size;
 
-    // poll until BSY bit clears or an error occurs
-    status = x86_inb(ATA_REG_STATUS(drive->ide.cmd));
-    while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01))
-        status = x86_inb(ATA_REG_STATUS(drive->ide.cmd));
+    u8 status = atapi_send_packet(drive, atapi_packet, n_bytes_drq);
 
     // error
-    if (status & 0x01) log_err("ATAPI READ(12)\n");
+    if (status & ATA_STATUS_ERR) {
+        req->error = x86_inb(ATA_REG_ERROR(drive->ide.cmd));
+        req->status = DRIVE_REQ_ERROR;
+    }
+}
+
 
-    // send the atapi_packet
-    x86_outsw(ATA_REG_DATA(drive->ide.cmd), atapi_packet, 6);
+// transfers the current DRQ block if the drive is ready
+// the drive tells how many bytes it offers (byte count in LBA1/LBA2)
+void atapi_step(void *self, drive_req_t *req) {
 
-    // read each sector
-    while (n_secs_read < n_secs) {
+    atapi_t *drive = (atapi_t*)self;
+
+    if (req->status != DRIVE_REQ_ACTIVE) return;
 
-        // wait for drive
-        ide_400ns_delay((ide_drive_t*)drive);
+    u8 status = x86_inb(ATA_REG_ALTSTATUS(drive->ide.ctrl));
 
-        // poll until BSY bit clears or an error occurs
-        u8 status = x86_inb(ATA_REG_STATUS(drive->ide.cmd));
-        while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01))
-            status = x86_inb(ATA_REG_STATUS(drive->ide.cmd));
+    while (!(status & ATA_STATUS_BSY) && (req->n_secs_xfer < req->n_secs_cmd)) {
 
         // error
-        if (status & 0x01) 
-            log_err("ATAPI READ(12):\nDrive: n_secs=%x (lba=%x n_secs=%x) -> dest=%x\n", 
-                    (u64)drive->ide.base.n_secs,
-                    (u64)lba, 
-                    (u64)n_secs, 
-                    (u64)dest);
-
-        // read data into memory (1 sector)
-        x86_insw(
-                ATA_REG_DATA(drive->ide.cmd), 
-                dest + n_secs_read * 512,
-                256);
-        n_secs_read++;
+        if (status & ATA_STATUS_ERR) {
+            req->error = x86_inb(ATA_REG_ERROR(drive->ide.cmd));
+            req->status = DRIVE_REQ_ERROR;
+            return;
+        }
+
+        if (!(status & ATA_STATUS_DRQ)) return;
+
+        u64 n_bytes = WORD(
+                x86_inb(ATA_REG_LBA2(drive->ide.cmd)),
+                x86_inb(ATA_REG_LBA1(drive->ide.cmd)));
+        u64 n_bytes_left = (req->n_secs_cmd - req->n_secs_xfer) * 512;
+
+        // the drive must not send more than requested
+        if ((n_bytes == 0) || (n_bytes > n_bytes_left) || (n_bytes % 512)) {
+            req->status = DRIVE_REQ_ERROR;
+            return;
+        }
+
+        // read data into memory (1 DRQ block)
+        ide_read_data(&drive->ide, req, req->n_secs_xfer * 512, n_bytes, false);
+        req->n_secs_xfer += n_bytes / 512;
+
+        // the status is only valid again after a while
+        ide_400ns_delay(&drive->ide);
+        status = x86_inb(ATA_REG_ALTSTATUS(drive->ide.ctrl));
+    }
+
+    if (req->n_secs_xfer < req->n_secs_cmd) return;
+
+    req->n_secs_done = req->n_secs_cmd;
+    req->status = DRIVE_REQ_DONE;
+}
+
+
+// queues a request
+// requests that do not cover whole blocks are read synchronously through the bounce buffer
+void atapi_submit(void *self, drive_req_t *req) {
+
+    atapi_t *drive = (atapi_t*)self;
+
+    if ((req->lba % drive->secs_per_blk) || (req->n_secs % drive->secs_per_blk)) {
+        if (req->iov) drive_readv_segments(self, req->iov, req->n_iov, req->lba);
+        else atapi_read(drive, req->dest, req->lba, req->n_secs);
+        req->n_secs_done = req->n_secs;
+        req->status = DRIVE_REQ_DONE;
+        return;
     }
+
+    ide_submit(drive, req);
+}
+
+
+// reads whole logical blocks from an ATAPI drive into RAM
+u64 atapi_read_blocks(void *self, u8 *dest, u64 blk, u64 n_blks) {
+
+    atapi_t *drive = (atapi_t*)self;
+    drive_req_t req;
+
+    drive_submit(self, &req, dest, blk * drive->secs_per_blk, n_blks * drive->secs_per_blk);
+
     // return the bytes read
-    return n_secs_read * 512;
+    return drive_wait(&req);
+}
+
+
+// reads sectors from an ATAPI drive into RAM
+// 512 byte sectors are translated to the drive's logical blocks
+u64 atapi_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    atapi_t *drive = (atapi_t*)self;
+
+    return drive_read_blocks(self, dest, lba, n_secs,
+            drive->secs_per_blk, drive->bounce, atapi_read_blocks);
 }
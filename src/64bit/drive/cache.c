@@ -0,0 +1,367 @@
+#include <types.h>
+#include <drive.h>
+#include <cache.h>
+#include <mmap.h>
+#include <heap.h>
+#include <utils.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <layout.h>
+
+
+cache_t cache = {0};
+
+
+// reserves memory above 1 MiB for the cache and puts all lines on the LRU list
+// the cache stays disabled (n_lines = 0) if there is not enough memory
+void cache_init(void) {
+
+    u64 n_bytes = mmap_usable_bytes() / CACHE_MEM_SHARE;
+    n_bytes = MIN(MAX(n_bytes, CACHE_MIN_BYTES), CACHE_MAX_BYTES);
+
+    u8 *mem = mmap_reserve_high(n_bytes, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!mem) {
+        log_warn("Not enough memory for the block cache\n");
+        return;
+    }
+
+    // read-ahead buffers (at most a quarter of the cache)
+    u64 n_bytes_ra = MIN(CACHE_RA_BUDGET_BYTES, n_bytes / 4);
+    u64 n_bytes_stream = (n_bytes_ra / CACHE_RA_N_STREAMS) & ~((u64)CACHE_LINE_BYTES - 1);
+    if (n_bytes_stream < CACHE_RA_MIN_SECS * 512) n_bytes_stream = 0;
+
+    // every line costs its data, its descriptor and up to two bucket pointers
+    u64 n_bytes_stage = CACHE_STAGE_LINES * CACHE_LINE_BYTES;
+    u64 n_lines = (n_bytes - n_bytes_stage - CACHE_RA_N_STREAMS * n_bytes_stream - PAGE_SIZE) /
+        (CACHE_LINE_BYTES + sizeof(cache_line_t) + 2 * sizeof(cache_line_t*));
+
+    u64 n_buckets = 1;
+    u64 hash_bits = 0;
+    while (n_buckets < n_lines) {
+        n_buckets <<= 1;
+        hash_bits++;
+    }
+
+    heap_t heap_cache = {n_bytes, n_bytes, 0, mem};
+    cache.stage = heap_alloc_aligned(&heap_cache, n_bytes_stage, PAGE_SIZE);
+    u8 *data = heap_alloc_aligned(&heap_cache, n_lines * CACHE_LINE_BYTES, PAGE_SIZE);
+    cache.lines = heap_alloc_aligned(&heap_cache, n_lines * sizeof(cache_line_t), sizeof(u64));
+    cache.buckets = heap_alloc_aligned(&heap_cache, n_buckets * sizeof(cache_line_t*), sizeof(u64));
+    cache.hash_shift = 64 - hash_bits;
+
+    mem_set((u8*)cache.buckets, 0, n_buckets * sizeof(cache_line_t*));
+
+    for (u64 i = 0; i < CACHE_RA_N_STREAMS; i++) {
+        cache.streams[i].drive = 0;
+        cache.streams[i].pending = false;
+        cache.streams[i].buf = n_bytes_stream ? heap_alloc_aligned(&heap_cache, n_bytes_stream, PAGE_SIZE) : 0;
+    }
+
+    // a window must not be able to push the data it is prefetched for out of the cache
+    cache.ra_max_secs = MIN(MIN(CACHE_RA_MAX_SECS, n_bytes_stream / 512), n_lines * CACHE_LINE_SECS / 4);
+    if (cache.ra_max_secs < CACHE_RA_MIN_SECS) cache.ra_max_secs = 0;
+
+    for (u64 i = 0; i < n_lines; i++) {
+        cache_line_t *line = &cache.lines[i];
+        line->drive = 0;
+        line->lba = 0;
+        line->data = data + i * CACHE_LINE_BYTES;
+        line->hash_next = 0;
+        line->prefetched = false;
+        line->lru_prev = (i > 0) ? &cache.lines[i - 1] : 0;
+        line->lru_next = (i < n_lines - 1) ? &cache.lines[i + 1] : 0;
+    }
+    cache.lru_head = &cache.lines[0];
+    cache.lru_tail = &cache.lines[n_lines - 1];
+    cache.n_lines = n_lines;
+
+    log_info("Block cache: %u KiB at %x (%u lines, read-ahead up to %u KiB)\n",
+            n_bytes / 1024, (u64)mem, n_lines, cache.ra_max_secs / 2);
+}
+
+
+// returns the hash bucket of a line
+cache_line_t **cache_bucket(drive_t *drive, u64 lba) {
+
+    // with a single bucket the shift would be 64
+    if (cache.hash_shift == 64) return &cache.buckets[0];
+
+    u64 key = (lba / CACHE_LINE_SECS) ^ ((u64)drive << 16);
+    return &cache.buckets[(key * 0x9e3779b97f4a7c15) >> cache.hash_shift];
+}
+
+
+// returns the line that starts at <lba> (a multiple of CACHE_LINE_SECS) or 0
+cache_line_t *cache_lookup(drive_t *drive, u64 lba) {
+
+    for (cache_line_t *line = *cache_bucket(drive, lba); line; line = line->hash_next) {
+        if ((line->drive == drive) && (line->lba == lba)) return line;
+    }
+    return 0;
+}
+
+
+// moves a line to the head of the LRU list
+void cache_touch(cache_line_t *line) {
+
+    if (line == cache.lru_head) return;
+
+    // unlink
+    line->lru_prev->lru_next = line->lru_next;
+    if (line->lru_next) line->lru_next->lru_prev = line->lru_prev;
+    else cache.lru_tail = line->lru_prev;
+
+    // insert at the head
+    line->lru_prev = 0;
+    line->lru_next = cache.lru_head;
+    cache.lru_head->lru_prev = line;
+    cache.lru_head = line;
+}
+
+
+// takes the least recently used line for the line at <lba> (its data still has to be filled)
+cache_line_t *cache_insert(drive_t *drive, u64 lba) {
+
+    cache_line_t *line = cache.lru_tail;
+
+    // evict the old contents
+    if (line->drive) {
+        cache_line_t **prev = cache_bucket(line->drive, line->lba);
+        while (*prev != line) prev = &(*prev)->hash_next;
+        *prev = line->hash_next;
+
+        cache.stats.evictions++;
+        if (line->prefetched) cache.stats.ra_wasted++;
+    }
+
+    line->drive = drive;
+    line->lba = lba;
+    line->prefetched = false;
+
+    cache_line_t **bucket = cache_bucket(drive, lba);
+    line->hash_next = *bucket;
+    *bucket = line;
+
+    cache_touch(line);
+    return line;
+}
+
+
+// copies the part of a line that lies within [lba, lba + n_secs) to its place in <dest>
+void cache_copy_out(cache_line_t *line, u8 *dest, u64 lba, u64 n_secs) {
+
+    u64 start = MAX(line->lba, lba);
+    u64 end = MIN(line->lba + CACHE_LINE_SECS, lba + n_secs);
+
+    mem_cpy(dest + (start - lba) * 512, line->data + (start - line->lba) * 512, (end - start) * 512);
+}
+
+
+// returns the read-ahead stream of a drive
+// drives without one take over the next stream in turn
+cache_stream_t *cache_stream(drive_t *drive) {
+
+    for (u64 i = 0; i < CACHE_RA_N_STREAMS; i++) {
+        if (cache.streams[i].drive == drive) return &cache.streams[i];
+    }
+
+    cache_stream_t *stream = &cache.streams[cache.next_stream];
+    cache.next_stream = (cache.next_stream + 1) % CACHE_RA_N_STREAMS;
+
+    // the buffer is reused
+    if (stream->pending) cache_ra_complete(stream);
+
+    stream->drive = drive;
+    stream->next_lba = U64_MAX;
+    stream->window = 0;
+    stream->ra_end = 0;
+    return stream;
+}
+
+
+// waits for the prefetch of a stream and moves the data into the cache
+// a failed prefetch is dropped (a read that actually needs the data reports the error)
+void cache_ra_complete(cache_stream_t *stream) {
+
+    drive_req_t *req = &stream->req;
+
+    if (!drive_poll(req)) req->drive->wait(req->drive, req);
+    stream->pending = false;
+
+    if (req->status == DRIVE_REQ_ERROR) {
+        stream->window = 0;
+        stream->ra_end = 0;
+        return;
+    }
+
+    u64 lba = stream->req.lba;
+
+    for (u64 off = 0; off < stream->req.n_secs; off += CACHE_LINE_SECS) {
+
+        // lines that have been read in the meantime are newer anyway
+        if (cache_lookup(stream->drive, lba + off)) continue;
+
+        cache_line_t *line = cache_insert(stream->drive, lba + off);
+        mem_cpy(line->data, stream->buf + off * 512, CACHE_LINE_BYTES);
+        line->prefetched = true;
+        cache.stats.ra_lines++;
+    }
+}
+
+
+// returns where the missing lines of a read may end
+// drives without submit can not prefetch in the background, so a sequential read of them
+// continues with the window of the stream (the lines after the read are fetched with it)
+u64 cache_ra_fold_end(cache_stream_t *stream, u64 lba, u64 n_secs) {
+
+    drive_t *drive = stream->drive;
+    u64 end = lba + n_secs;
+    u64 dist = (lba > stream->next_lba) ? lba - stream->next_lba : stream->next_lba - lba;
+
+    if (drive->submit || (cache.ra_max_secs == 0) || (stream->window == 0) || (dist > CACHE_RA_GAP_SECS)) return end;
+
+    return MAX(end, MIN(end + stream->window, drive->n_secs));
+}
+
+
+// updates the access pattern of a stream after a read and starts the next prefetch
+// the window doubles with every sequential read and is dropped by a random one
+// only drives with submit prefetch here (see cache_ra_fold_end for the others)
+void cache_ra_update(cache_stream_t *stream, u64 lba, u64 n_secs) {
+
+    if (cache.ra_max_secs == 0) return;
+
+    drive_t *drive = stream->drive;
+    u64 dist = (lba > stream->next_lba) ? lba - stream->next_lba : stream->next_lba - lba;
+
+    if (dist <= CACHE_RA_GAP_SECS) {
+        stream->window = stream->window ? MIN(stream->window * 2, cache.ra_max_secs) : CACHE_RA_MIN_SECS;
+    } else {
+        stream->window = 0;
+        stream->ra_end = 0;
+    }
+    stream->next_lba = lba + n_secs;
+
+    if ((stream->window == 0) || stream->pending || !drive->submit) return;
+
+    // stay a window ahead of the reader (continue after the data that has been prefetched already)
+    u64 limit = stream->next_lba + stream->window;
+    u64 start = MAX(stream->ra_end, stream->next_lba - stream->next_lba % CACHE_LINE_SECS);
+
+    while ((start < limit) && (start < drive->n_secs) && cache_lookup(drive, start))
+        start += CACHE_LINE_SECS;
+
+    if ((start >= limit) || (start >= drive->n_secs)) return;
+
+    u64 n_secs_ra = MIN(stream->window, drive->n_secs - start);
+    drive_submit(drive, &stream->req, stream->buf, start, n_secs_ra);
+
+    stream->pending = true;
+    stream->ra_end = start + n_secs_ra;
+}
+
+
+// reads sectors from a drive through the block cache
+// consecutive missing lines are fetched with a single read, large reads bypass the cache
+// sequential reads make the next sectors get prefetched (in the background if the drive has submit)
+// returns the bytes read
+u64 cache_read(drive_t *drive, u8 *dest, u64 lba, u64 n_secs) {
+
+    if (cache.n_lines == 0) {
+        cache.stats.bypassed++;
+        return drive->read(drive, dest, lba, n_secs);
+    }
+
+    cache_stream_t *stream = cache_stream(drive);
+
+    // prefetched data that is needed now (or has already arrived) goes into the cache
+    if (stream->pending) {
+        u64 ra_lba = stream->req.lba;
+        bool overlap = (lba < ra_lba + stream->req.n_secs) && (ra_lba < lba + n_secs);
+
+        if (overlap || drive_poll(&stream->req)) cache_ra_complete(stream);
+    }
+
+    if (n_secs >= CACHE_BYPASS_SECS) {
+        cache.stats.bypassed++;
+        stream->next_lba = lba + n_secs;
+        return drive->read(drive, dest, lba, n_secs);
+    }
+
+    u64 end = lba + n_secs;
+    u64 cur = lba - lba % CACHE_LINE_SECS;
+    u64 fold_end = cache_ra_fold_end(stream, lba, n_secs);
+
+    while (cur < end) {
+
+        cache_line_t *line = cache_lookup(drive, cur);
+
+        if (line) {
+            cache.stats.hits++;
+            if (line->prefetched) {
+                cache.stats.ra_hits++;
+                line->prefetched = false;
+            }
+            cache_touch(line);
+            cache_copy_out(line, dest, lba, n_secs);
+            cur += CACHE_LINE_SECS;
+            continue;
+        }
+
+        // collect the run of missing lines (the last one continues up to <fold_end>)
+        u64 n_lines = 1;
+        while ((n_lines < CACHE_STAGE_LINES) &&
+                (cur + n_lines * CACHE_LINE_SECS < fold_end) &&
+                !cache_lookup(drive, cur + n_lines * CACHE_LINE_SECS)) n_lines++;
+
+        // the last line of a drive might be incomplete
+        u64 n_secs_run = MIN(n_lines * CACHE_LINE_SECS, drive->n_secs - cur);
+        u64 n_secs_got = drive->read(drive, cache.stage, cur, n_secs_run) / 512;
+
+        for (u64 i = 0; i < n_lines; i++) {
+
+            u64 line_lba = cur + i * CACHE_LINE_SECS;
+
+            // short read: lines that did not arrive completely are not cached
+            // returns the bytes up to the first missing line (the read is complete if it is a folded one)
+            if (n_secs_got < MIN((i + 1) * CACHE_LINE_SECS, n_secs_run)) {
+                if (line_lba >= end) break;
+                return (MAX(line_lba, lba) - lba) * 512;
+            }
+
+            line = cache_insert(drive, line_lba);
+            mem_cpy(line->data, cache.stage + i * CACHE_LINE_BYTES, CACHE_LINE_BYTES);
+
+            // lines after the read are read-ahead
+            if (line_lba >= end) {
+                line->prefetched = true;
+                cache.stats.ra_lines++;
+                continue;
+            }
+
+            cache.stats.misses++;
+            cache_copy_out(line, dest, lba, n_secs);
+        }
+        cur += n_lines * CACHE_LINE_SECS;
+    }
+
+    cache_ra_update(stream, lba, n_secs);
+
+    // return the bytes read
+    return n_secs * 512;
+}
+
+
+// prints the counters of the block cache
+void cache_print_stats(void) {
+    log_info("Block cache: %u hits, %u misses, %u evictions, %u bypassed\n",
+            cache.stats.hits,
+            cache.stats.misses,
+            cache.stats.evictions,
+            cache.stats.bypassed);
+    log_info("Read-ahead: %u lines prefetched, %u used, %u wasted\n",
+            cache.stats.ra_lines,
+            cache.stats.ra_hits,
+            cache.stats.ra_wasted);
+}
@@ -0,0 +1,246 @@
+#include <types.h>
+#include <drive.h>
+#include <utils.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+
+
+// reads 512 byte sectors from a drive with larger native blocks
+// whole blocks are read directly into <dest>, partial blocks at the start/end go through <bounce>
+// returns the bytes read
+u64 drive_read_blocks(void *self, u8 *dest, u64 lba, u64 n_secs,
+        u64 secs_per_blk, u8 *bounce, read_blocks_t read_blocks) {
+
+    u64 n_secs_read = 0;
+
+    while (n_secs_read < n_secs) {
+
+        u64 cur_lba = lba + n_secs_read;
+        u64 blk = cur_lba / secs_per_blk;
+        u64 off = cur_lba % secs_per_blk;
+        u64 n_secs_left = n_secs - n_secs_read;
+
+        // unaligned start or less than a block left -> bounce a single block
+        if ((off != 0) || (n_secs_left < secs_per_blk)) {
+
+            u64 n_secs_cur = MIN(secs_per_blk - off, n_secs_left);
+
+            read_blocks(self, bounce, blk, 1);
+            mem_cpy(dest + n_secs_read * 512, bounce + off * 512, n_secs_cur * 512);
+
+            n_secs_read += n_secs_cur;
+            continue;
+        }
+
+        // all remaining whole blocks at once
+        u64 n_blks = n_secs_left / secs_per_blk;
+        read_blocks(self, dest + n_secs_read * 512, blk, n_blks);
+        n_secs_read += n_blks * secs_per_blk;
+    }
+    // return the bytes read
+    return n_secs_read * 512;
+}
+
+
+// returns the bytes a caller should read with a single call (drive_t.max_call_secs, at least a sector)
+u64 drive_max_call_bytes(drive_t *drive) {
+
+    if (drive->max_call_secs >= U64_MAX / 512) return U64_MAX;
+
+    return MAX(drive->max_call_secs, 1) * 512;
+}
+
+
+// returns the total size of a segment list
+u64 drive_iov_bytes(drive_iovec_t *iov, u64 n_iov) {
+
+    u64 n_bytes = 0;
+    for (u64 i = 0; i < n_iov; i++) n_bytes += iov[i].n_bytes;
+
+    return n_bytes;
+}
+
+
+// returns the address of byte <off> of a segment list
+// <n_bytes_contig> is set to the bytes that follow it within the same segment
+u8 *drive_iov_addr(drive_iovec_t *iov, u64 n_iov, u64 off, u64 *n_bytes_contig) {
+
+    for (u64 i = 0; i < n_iov; i++) {
+
+        if (off < iov[i].n_bytes) {
+            *n_bytes_contig = iov[i].n_bytes - off;
+            return iov[i].addr + off;
+        }
+        off -= iov[i].n_bytes;
+    }
+
+    log_err("Offset exceeds the segment list (%x)\n", off);
+}
+
+
+// returns the address of byte <off> of a request's destination (<dest> or its segments)
+u8 *drive_req_addr(drive_req_t *req, u64 off, u64 *n_bytes_contig) {
+
+    if (req->iov) return drive_iov_addr(req->iov, req->n_iov, off, n_bytes_contig);
+
+    *n_bytes_contig = req->n_secs * 512 - off;
+    return req->dest + off;
+}
+
+
+// emulates a vectored read with read
+// whole sectors within a segment are read directly, sectors split between segments are bounced
+// returns the bytes read
+u64 drive_readv_segments(drive_t *drive, drive_iovec_t *iov, u64 n_iov, u64 lba) {
+
+    u8 bounce[512] ALIGNED(16);
+    u64 n_bytes = drive_iov_bytes(iov, n_iov);
+    u64 off = 0;
+
+    while (off < n_bytes) {
+
+        u64 n_bytes_contig;
+        u8 *dest = drive_iov_addr(iov, n_iov, off, &n_bytes_contig);
+
+        // all whole sectors of the segment at once
+        u64 n_secs = MIN(n_bytes_contig, n_bytes - off) / 512;
+        if (n_secs) {
+            drive->read(drive, dest, lba + off / 512, n_secs);
+            off += n_secs * 512;
+            continue;
+        }
+
+        // the sector continues in the next segment(s)
+        drive->read(drive, bounce, lba + off / 512, 1);
+
+        for (u64 i = 0; i < 512; i += n_bytes_contig) {
+            dest = drive_iov_addr(iov, n_iov, off + i, &n_bytes_contig);
+            n_bytes_contig = MIN(n_bytes_contig, 512 - i);
+            mem_cpy(dest, bounce + i, n_bytes_contig);
+        }
+        off += 512;
+    }
+    // return the bytes read
+    return n_bytes;
+}
+
+
+// reads a sector range into a list of segments (their total size has to be a multiple of 512)
+// returns the bytes read
+u64 drive_readv(drive_t *drive, drive_iovec_t *iov, u64 n_iov, u64 lba) {
+
+    if (drive->readv) return drive->readv(drive, iov, n_iov, lba);
+
+    return drive_readv_segments(drive, iov, n_iov, lba);
+}
+
+
+// resets a request for a new range
+void drive_req_init(drive_req_t *req, drive_t *drive, u8 *dest, u64 lba, u64 n_secs) {
+
+    req->drive = drive;
+    req->dest = dest;
+    req->lba = lba;
+    req->n_secs = n_secs;
+    req->iov = 0;
+    req->n_iov = 0;
+    req->error = 0;
+    req->n_secs_done = 0;
+    req->n_secs_cmd = 0;
+    req->n_secs_xfer = 0;
+    req->next = 0;
+}
+
+
+// fills a request and hands it over to the drive
+// drives without asynchronous support finish it immediately using read
+void drive_submit(drive_t *drive, drive_req_t *req, u8 *dest, u64 lba, u64 n_secs) {
+
+    drive_req_init(req, drive, dest, lba, n_secs);
+
+    if (drive->submit) {
+        req->status = DRIVE_REQ_QUEUED;
+        drive->submit(drive, req);
+        return;
+    }
+
+    drive->read(drive, dest, lba, n_secs);
+    req->n_secs_done = n_secs;
+    req->status = DRIVE_REQ_DONE;
+}
+
+
+// same as drive_submit for a vectored read
+void drive_submitv(drive_t *drive, drive_req_t *req, drive_iovec_t *iov, u64 n_iov, u64 lba) {
+
+    u64 n_bytes = drive_iov_bytes(iov, n_iov);
+    if (n_bytes % 512) log_err("Vectored read does not cover whole sectors (%x bytes)\n", n_bytes);
+
+    // a single segment is an ordinary request
+    if (n_iov == 1) {
+        drive_submit(drive, req, iov[0].addr, lba, n_bytes / 512);
+        return;
+    }
+
+    drive_req_init(req, drive, 0, lba, n_bytes / 512);
+    req->iov = iov;
+    req->n_iov = n_iov;
+
+    if (drive->submit) {
+        req->status = DRIVE_REQ_QUEUED;
+        drive->submit(drive, req);
+        return;
+    }
+
+    drive_readv(drive, iov, n_iov, lba);
+    req->n_secs_done = req->n_secs;
+    req->status = DRIVE_REQ_DONE;
+}
+
+
+// checks if a request is finished (without blocking)
+bool drive_poll(drive_req_t *req) {
+
+    if ((req->status == DRIVE_REQ_DONE) || (req->status == DRIVE_REQ_ERROR)) return true;
+
+    return req->drive->poll(req->drive, req);
+}
+
+
+// blocks until a request is finished
+// returns the bytes read
+u64 drive_wait(drive_req_t *req) {
+
+    if (!drive_poll(req)) req->drive->wait(req->drive, req);
+
+    if (req->status == DRIVE_REQ_ERROR)
+        log_err("Drive read error:\nRequest: lba=%x n_secs=%x -> dest=%x (error=%x)\n",
+                req->lba,
+                req->n_secs,
+                (u64)req->dest,
+                (u64)req->error);
+
+    return req->n_secs_done * 512;
+}
+
+
+// iterates over the detected drives on <heap_drives> (0 -> first drive)
+// returns 0 after the last drive
+drive_t *drive_next(drive_t *drive) {
+
+    u8 *next = drive ? (u8*)drive + drive->size : heap_drives.loc;
+
+    if (next >= heap_drives.loc + heap_drives.top) return 0;
+
+    return (drive_t*)next;
+}
+
+
+// stops all drives (see drive_t.shutdown), right before a kernel is started
+void drive_shutdown_all(void) {
+
+    for (drive_t *drive = drive_next(0); drive; drive = drive_next(drive)) {
+        if (drive->shutdown) drive->shutdown(drive);
+    }
+}
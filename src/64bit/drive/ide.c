@@ -8,6 +8,19 @@
 #include <ata.h>
 #include <atapi.h>
 #include <heap.h>
+#include <idt.h>
+#include <pic.h>
+
+
+// channels with at least one drive
+static ide_channel_t ide_channels[IDE_N_CHANNELS];
+static u8 n_ide_channels = 0;
+
+// controllers that handle 32-bit PIO (Intel PIIX3/PIIX4, also what QEMU emulates)
+static const ide_pio32_quirk_t ide_pio32_quirks[] = {
+    { 0x8086, 0x7010 },
+    { 0x8086, 0x7111 }
+};
 
 
 // needed for some operations
@@ -19,11 +32,250 @@ void ide_400ns_delay(ide_drive_t *drive) {
 }
 
 
+// registers a channel and installs the IRQ handler for it
+// channels with <irq> = IDE_NO_IRQ are polled
+ide_channel_t *ide_add_channel(port_t cmd, u8 irq) {
+
+    if (n_ide_channels >= IDE_N_CHANNELS) log_err("Too many IDE channels\n");
+
+    if (irq >= PIC_N_IRQS) irq = IDE_NO_IRQ;
+
+    ide_channel_t *channel = &ide_channels[n_ide_channels++];
+    channel->cmd = cmd;
+    channel->irq = irq;
+    channel->irq_fired = false;
+    channel->head = 0;
+    channel->tail = 0;
+
+    if (irq != IDE_NO_IRQ) idt_set_irq(irq, ide_irq);
+
+    return channel;
+}
+
+
+// IRQ handler of all IDE channels
+// channels can share an IRQ (PCI native mode) -> all of them are woken up
+void ide_irq(u8 irq) {
+
+    for (u8 i = 0; i < n_ide_channels; i++) {
+
+        ide_channel_t *channel = &ide_channels[i];
+        if (channel->irq != irq) continue;
+
+        // reading the status register acknowledges the drive's interrupt
+        x86_inb(ATA_REG_STATUS(channel->cmd));
+        channel->irq_fired = true;
+
+        // continue the request in progress
+        ide_channel_step(channel);
+    }
+}
+
+
+// continues the channel's current request and starts the next one once it is finished
+// has to be called with interrupts disabled
+void ide_channel_step(ide_channel_t *channel) {
+
+    drive_req_t *req = channel->head;
+    if (!req) return;
+
+    ide_drive_t *drive = (ide_drive_t*)req->drive;
+    drive->step(drive, req);
+
+    // remove finished requests from the queue
+    while (req && ((req->status == DRIVE_REQ_DONE) || (req->status == DRIVE_REQ_ERROR))) {
+
+        channel->head = req->next;
+        if (!channel->head) channel->tail = 0;
+
+        req = channel->head;
+        if (req) ((ide_drive_t*)req->drive)->start(req->drive, req);
+    }
+}
+
+
+// reads <n_bytes> from the data port into a request's destination, starting at byte <off>
+// the data goes straight into every segment, words/dwords split between segments are scattered
+void ide_read_data(ide_drive_t *drive, drive_req_t *req, u64 off, u64 n_bytes, bool pio32) {
+
+    port_t port = ATA_REG_DATA(drive->cmd);
+    u64 unit = pio32 ? sizeof(u32) : sizeof(u16);
+    u64 n_bytes_read = 0;
+
+    while (n_bytes_read < n_bytes) {
+
+        u64 n_bytes_contig;
+        u8 *dest = drive_req_addr(req, off + n_bytes_read, &n_bytes_contig);
+        u64 n_units = MIN(n_bytes_contig, n_bytes - n_bytes_read) / unit;
+
+        if (n_units) {
+            if (pio32) x86_insd(port, dest, n_units);
+            else x86_insw(port, dest, n_units);
+
+            n_bytes_read += n_units * unit;
+            continue;
+        }
+
+        // the next word/dword continues in the next segment
+        u32 data = pio32 ? x86_ind(port) : x86_inw(port);
+
+        for (u64 i = 0; i < unit; i++) {
+            dest = drive_req_addr(req, off + n_bytes_read + i, &n_bytes_contig);
+            *dest = (data >> (i * 8)) & 0xff;
+        }
+        n_bytes_read += unit;
+    }
+}
+
+
+// appends a request to the channel's queue
+// it is started right away if the channel is idle
+void ide_submit(void *self, drive_req_t *req) {
+
+    ide_drive_t *drive = (ide_drive_t*)self;
+    ide_channel_t *channel = drive->channel;
+
+    // check if the requested lba is out of bounds
+    if ((req->lba + req->n_secs) > drive->base.n_secs)
+        log_err("IDE read error:\nLBA address exceeds drive size lba=%x size=%x\n",
+                (u64)(req->lba + req->n_secs), drive->base.n_secs);
+
+    if (req->n_secs == 0) {
+        req->status = DRIVE_REQ_DONE;
+        return;
+    }
+
+    x86_cli();
+
+    if (channel->tail) {
+        channel->tail->next = req;
+        channel->tail = req;
+    } else {
+        channel->head = req;
+        channel->tail = req;
+        drive->start(drive, req);
+
+        // the request might have failed right away
+        if (req->status == DRIVE_REQ_ERROR) channel->head = channel->tail = 0;
+    }
+
+    x86_sti();
+}
+
+
+// continues the channel's requests without blocking
+// returns true if <req> is finished
+bool ide_poll_req(void *self, drive_req_t *req) {
+
+    ide_drive_t *drive = (ide_drive_t*)self;
+
+    x86_cli();
+    ide_channel_step(drive->channel);
+    x86_sti();
+
+    return (req->status == DRIVE_REQ_DONE) || (req->status == DRIVE_REQ_ERROR);
+}
+
+
+// blocks until <req> is finished
+// halts between interrupts, channels without an IRQ are polled
+void ide_wait_req(void *self, drive_req_t *req) {
+
+    ide_drive_t *drive = (ide_drive_t*)self;
+    ide_channel_t *channel = drive->channel;
+
+    while (true) {
+
+        // the status is checked with interrupts disabled so that no IRQ gets lost before hlt
+        x86_cli();
+        ide_channel_step(channel);
+
+        if ((req->status == DRIVE_REQ_DONE) || (req->status == DRIVE_REQ_ERROR)) break;
+
+        if (channel->irq != IDE_NO_IRQ) x86_sti_hlt();
+        else x86_sti();
+    }
+    x86_sti();
+}
+
+
+// stops the bus master of the drive's channel (drives without one only use PIO)
+void ide_shutdown(void *self) {
+
+    ide_drive_t *drive = (ide_drive_t*)self;
+    if (drive->bm) x86_outb(IDE_BM_REG_CMD(drive->bm), 0);
+}
+
+
+// reads a sector range into a list of segments with as few commands as possible
+// ATA: one PRD per segment (DMA) or the data port writes into the segments directly (PIO)
+// ATAPI: DRQ blocks are split between the segments
+u64 ide_readv(void *self, drive_iovec_t *iov, u64 n_iov, u64 lba) {
+
+    drive_req_t req;
+
+    drive_submitv(self, &req, iov, n_iov, lba);
+
+    // return the bytes read
+    return drive_wait(&req);
+}
+
+
+// halts until the drive's channel raises its next interrupt
+// returns immediately if the channel has no IRQ
+void ide_sleep(ide_drive_t *drive) {
+
+    ide_channel_t *channel = drive->channel;
+    if (channel->irq == IDE_NO_IRQ) return;
+
+    // the flag is checked with interrupts disabled so that no IRQ gets lost before hlt
+    x86_cli();
+    while (!channel->irq_fired) {
+        x86_sti_hlt();
+        x86_cli();
+    }
+    channel->irq_fired = false;
+    x86_sti();
+}
+
+
+// polls until the BSY bit clears or an error occurs
+// for phases in which the drive does not raise an interrupt
+u8 ide_poll(ide_drive_t *drive) {
+
+    u8 status = x86_inb(ATA_REG_STATUS(drive->cmd));
+    while ((status & ATA_STATUS_BSY) && !(status & ATA_STATUS_ERR))
+        status = x86_inb(ATA_REG_STATUS(drive->cmd));
+
+    return status;
+}
+
+
+// waits until the BSY bit clears or an error occurs
+// sleeps between the channel's interrupts instead of spinning on the status register
+// an interrupt left over from an earlier command only causes another check
+u8 ide_wait(ide_drive_t *drive) {
+
+    u8 status = x86_inb(ATA_REG_ALTSTATUS(drive->ctrl));
+    while ((status & ATA_STATUS_BSY) && !(status & ATA_STATUS_ERR)) {
+        ide_sleep(drive);
+        status = x86_inb(ATA_REG_ALTSTATUS(drive->ctrl));
+    }
+
+    // reading the status register acknowledges the interrupt when polling
+    return x86_inb(ATA_REG_STATUS(drive->cmd));
+}
+
+
 // scan a single channel of an IDE controller
 // detected drives are allocated on <heap_drives>
-void ide_scan_channel(port_t cmd, port_t ctrl) {
+// <bm> is the channel's bus master port (0 -> PIO only)
+// <irq> is the channel's IRQ (IDE_NO_IRQ -> polling)
+// <pio32> -> the controller splits 32-bit data port reads into two 16-bit transfers
+void ide_scan_channel(port_t cmd, port_t ctrl, port_t bm, u8 irq, bool pio32) {
 
     bool slave = false;
+    ide_channel_t *channel = 0;
 
 identify_start:
     ide_select_drive(cmd, slave, ATA_SEL_IDENTIFY, 0);
@@ -72,18 +324,37 @@ identify_start:
         // ATAPI drive detected
         if ((lba1 == ATAPI_LBA1) && (lba2 == ATAPI_LBA2)) {
 
+            if (!channel) channel = ide_add_channel(cmd, irq);
+
             // allocate a new ATAPI drive
             atapi_t *atapi = heap_alloc(&heap_drives, sizeof(atapi_t));
             atapi->ide.base.type = DRIVE_ATAPI;
             atapi->ide.base.size = sizeof(atapi_t);
             atapi->ide.base.read = atapi_read;
+            atapi->ide.base.readv = ide_readv;
             atapi->ide.slave = slave;
             atapi->ide.cmd = cmd;
             atapi->ide.ctrl = ctrl;
+            atapi->ide.bm = 0;
+            atapi->ide.prdt = 0;
+            atapi->ide.base.submit = atapi_submit;
+            atapi->ide.base.poll = ide_poll_req;
+            atapi->ide.base.wait = ide_wait_req;
+            atapi->ide.base.shutdown = ide_shutdown;
+            atapi->ide.channel = channel;
+            atapi->ide.start = atapi_start;
+            atapi->ide.step = atapi_step;
 
             log_info("Found ATAPI drive\n");
 
-            atapi->ide.base.n_secs = atapi_read_capacity(atapi) / 512;
+            u64 n_blks = atapi_read_capacity(atapi);
+            atapi->secs_per_blk = atapi->blk_size / 512;
+            atapi->ide.base.n_secs = n_blks * atapi->secs_per_blk;
+            atapi->ide.base.max_secs = (u64)U32_MAX * atapi->secs_per_blk;
+            atapi->ide.base.max_call_secs = atapi->ide.base.max_secs;
+            atapi->bounce = heap_alloc(&heap_dma, atapi->blk_size);
+
+            log_info("ATAPI drive: %u blocks of %u bytes\n", n_blks, (u64)atapi->blk_size);
 
             return;
         } 
@@ -96,7 +367,12 @@ identify_start:
             sata->base.type = DRIVE_SATA;
             sata->base.size = sizeof(sata_t);
             sata->base.read = 0;
+            sata->base.readv = 0;
+            sata->base.submit = 0;
+            sata->base.shutdown = 0;
             sata->base.n_secs = 0;
+            sata->base.max_secs = 0;
+            sata->base.max_call_secs = 0;
             
             log_info("Found SATA drive\n");
 
@@ -108,15 +384,31 @@ identify_start:
     }
 
     // ATA drive detected
+    if (!channel) channel = ide_add_channel(cmd, irq);
+
     // allocate a new ATA drive
     ata_t *ata = heap_alloc(&heap_drives, sizeof(ata_t));
     ata->ide.base.type = DRIVE_ATA;
     ata->ide.base.size = sizeof(ata_t);
     ata->ide.base.read = ata_read;
+    ata->ide.base.readv = ide_readv;
     ata->ide.base.n_secs = 0;            
     ata->ide.slave = slave;
     ata->ide.cmd = cmd;
     ata->ide.ctrl = ctrl;
+    ata->ide.bm = bm;
+    ata->ide.prdt = 0;
+    ata->ide.base.submit = ide_submit;
+    ata->ide.base.poll = ide_poll_req;
+    ata->ide.base.wait = ide_wait_req;
+    ata->ide.base.shutdown = ide_shutdown;
+    ata->ide.channel = channel;
+    ata->ide.start = ata_start;
+    ata->ide.step = ata_step;
+    ata->dma = false;
+    ata->lba48 = false;
+    ata->mult = 1;
+    ata->pio32 = false;
 
     log_info("Found ATA drive\n");
 
@@ -127,8 +419,23 @@ identify_start:
 
         cur_data = x86_inw(ATA_REG_DATA(cmd));
 
+        // maximum number of sectors per READ MULTIPLE block
+        if (read == ATA_IDENT_MAX_MULTIPLE) {
+            ata->mult = cur_data & 0xff;
+        }
+
+        // check if DMA is supported
+        else if (read == ATA_IDENT_CAPABILITIES) {
+            ata->dma = (cur_data & ATA_CAP_DMA) != 0;
+        }
+
+        // check if LBA48 commands are supported
+        else if (read == ATA_IDENT_CMD_SETS) {
+            ata->lba48 = (cur_data & ATA_CMD_SETS_LBA48) != 0;
+        }
+
         // check if LBA28 is supported
-        if (read == 60) {
+        else if (read == ATA_IDENT_LBA28) {
 
             // only 1 read -> no temporary variables needed
             ata->n_secs28 = DWORD(
@@ -139,7 +446,7 @@ identify_start:
         }
 
         // check if LBA48 is supported
-        else if (read == 100) {
+        else if (read == ATA_IDENT_LBA48) {
 
             // we need some temporary variables here to preserve the correct word order
             // word0 = cur_data
@@ -160,6 +467,21 @@ identify_start:
     }
     // calculate max size
     ata->ide.base.n_secs = MAX(ata->n_secs28, ata->n_secs48);
+    ata->ide.base.max_secs = ata->lba48 ? ATA_LBA48_MAX_SECS : ATA_LBA28_MAX_SECS;
+
+    // one command at a time, a request per command lets the caller work on the previous one
+    ata->ide.base.max_call_secs = ata->ide.base.max_secs;
+
+    // only controllers known to decode 32-bit accesses to the data port
+    ata->pio32 = pio32;
+
+    ata_set_multiple(ata);
+
+    // each drive gets its own PRD table (a page never crosses a 64 KiB boundary)
+    if (ata->dma && bm) {
+        ata->ide.prdt = heap_alloc_aligned(&heap_dma, PAGE_SIZE, PAGE_SIZE);
+        log_info("ATA drive uses bus master DMA\n");
+    }
 
     if (slave) return;
 
@@ -182,6 +504,20 @@ void ide_select_drive(port_t cmd, bool slave, ata_drive_sel_t mode, u32 lba) {
 }
 
 
+// checks the quirk table for controllers that decode 32-bit data port accesses
+// neither the bus master BAR nor IDENTIFY (word 48 is reserved since ATA-2) tell
+bool ide_pio32_supported(u8 bus, u8 dev, u8 func) {
+
+    u16 vendor = pci_cfg_read(bus, dev, func, PCI_OFF_VENDOR_ID);
+    u16 device = pci_cfg_read(bus, dev, func, PCI_OFF_DEVICE_ID);
+
+    for (u64 i = 0; i < sizeof(ide_pio32_quirks) / sizeof(ide_pio32_quirk_t); i++) {
+        if ((ide_pio32_quirks[i].vendor == vendor) && (ide_pio32_quirks[i].device == device)) return true;
+    }
+    return false;
+}
+
+
 // determines the drives' I/O ports and initializes the device
 void ide_initialize(u8 bus, u8 dev, u8 func) {
 
@@ -191,21 +527,52 @@ void ide_initialize(u8 bus, u8 dev, u8 func) {
     port_t cmd2 = IDE_CH2_CMD;
     port_t ctrl2 = IDE_CH2_CTRL;
 
+    port_t bm1 = 0;
+    port_t bm2 = 0;
+
+    u8 irq1 = IDE_CH1_IRQ;
+    u8 irq2 = IDE_CH2_IRQ;
+
+    // native channels share the controller's PCI interrupt (0xff -> not connected)
+    u8 irq_native = pci_cfg_read(bus, dev, func, PCI_OFF_INT_LINE);
+    if (irq_native >= PIC_N_IRQS) irq_native = IDE_NO_IRQ;
+
     // primary channel is in native mode
+    // (the control register is at offset 2 of the control block)
     if (prog_if & IDE_CH1_MODE_PCI_NATIVE) {
         // update ports
-        cmd1 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR0);
-        ctrl1 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR1);
+        cmd1 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR0) & PCI_BAR_IO_MASK;
+        ctrl1 = (pci_cfg_read(bus, dev, func, PCI_OFF_BAR1) & PCI_BAR_IO_MASK) + 2;
+        irq1 = irq_native;
     }
 
     // secondary channel is in native mode
     if (prog_if & IDE_CH2_MODE_PCI_NATIVE) {
         // update ports
-        cmd2 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR2);
-        ctrl2 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR3);
+        cmd2 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR2) & PCI_BAR_IO_MASK;
+        ctrl2 = (pci_cfg_read(bus, dev, func, PCI_OFF_BAR3) & PCI_BAR_IO_MASK) + 2;
+        irq2 = irq_native;
     }
 
+    // controller supports bus master DMA
+    // BAR4 holds 8 ports for each channel
+    if (prog_if & IDE_BUSMASTER) {
+
+        u32 bar4 = pci_cfg_read(bus, dev, func, PCI_OFF_BAR4);
+
+        if (bar4 & PCI_BAR_IO) {
+            bm1 = bar4 & PCI_BAR_IO_MASK;
+            bm2 = bm1 + IDE_BM_CH2_OFF;
+
+            // allow the controller to access memory on its own
+            u16 pci_cmd = pci_cfg_read(bus, dev, func, PCI_OFF_CMD);
+            pci_cfg_write(bus, dev, func, PCI_OFF_CMD, pci_cmd | PCI_CMD_IO | PCI_CMD_BUSMASTER);
+        }
+    }
+
+    bool pio32 = ide_pio32_supported(bus, dev, func);
+
     // scan both channels
-    ide_scan_channel(cmd1, ctrl1);
-    ide_scan_channel(cmd2, ctrl2);
+    ide_scan_channel(cmd1, ctrl1, bm1, irq1, pio32);
+    ide_scan_channel(cmd2, ctrl2, bm2, irq2, pio32);
 }
@@ -0,0 +1,341 @@
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <nvme.h>
+#include <heap.h>
+#include <utils.h>
+#include <layout.h>
+
+
+// allocates a submission/completion queue pair and locates its doorbells
+void nvme_queue_init(nvme_drive_t *drive, nvme_queue_t *queue, u16 id, u16 size) {
+
+    u64 stride = 4 << NVME_CAP_DSTRD(drive->regs->cap);
+    u8 *doorbells = (u8*)drive->regs + NVME_DOORBELL_OFF;
+
+    queue->sq = heap_alloc_aligned(&heap_dma, size * sizeof(nvme_cmd_t), PAGE_SIZE);
+    queue->cq = heap_alloc_aligned(&heap_dma, size * sizeof(nvme_cpl_t), PAGE_SIZE);
+    mem_set((u8*)queue->sq, 0, size * sizeof(nvme_cmd_t));
+    mem_set((u8*)queue->cq, 0, size * sizeof(nvme_cpl_t));
+
+    queue->sq_doorbell = (u32*)(doorbells + (2 * id) * stride);
+    queue->cq_doorbell = (u32*)(doorbells + (2 * id + 1) * stride);
+
+    queue->size = size;
+    queue->sq_tail = 0;
+    queue->cq_head = 0;
+    queue->phase = 1;
+}
+
+
+// copies a command into the next submission queue entry
+// the controller only sees it after nvme_ring (-> many commands per doorbell write)
+// returns the command id (= index of the entry)
+u16 nvme_push(nvme_queue_t *queue, nvme_cmd_t *cmd) {
+
+    u16 cid = queue->sq_tail;
+
+    cmd->cid = cid;
+    mem_cpy((u8*)&queue->sq[cid], (u8*)cmd, sizeof(nvme_cmd_t));
+
+    queue->sq_tail = (queue->sq_tail + 1) % queue->size;
+
+    return cid;
+}
+
+
+// tells the controller about all pushed commands
+void nvme_ring(nvme_queue_t *queue) {
+
+    // the entries have to be in memory before the controller fetches them
+    x86_mfence();
+    *queue->sq_doorbell = queue->sq_tail;
+}
+
+
+// consumes the next completion queue entry
+// returns the command id of the completed command or U16_MAX if none has completed yet
+u16 nvme_reap(nvme_queue_t *queue) {
+
+    volatile nvme_cpl_t *cpl = &queue->cq[queue->cq_head];
+
+    // the phase tag flips every time the controller wraps around the queue
+    if ((cpl->status & NVME_STATUS_PHASE) != queue->phase) return U16_MAX;
+
+    // error
+    if (NVME_STATUS_CODE(cpl->status))
+        log_err("NVMe command failed:\ncid=%x status=%x\n",
+                (u64)cpl->cid,
+                (u64)NVME_STATUS_CODE(cpl->status));
+
+    u16 cid = cpl->cid;
+
+    queue->cq_head++;
+    if (queue->cq_head == queue->size) {
+        queue->cq_head = 0;
+        queue->phase ^= 1;
+    }
+    *queue->cq_doorbell = queue->cq_head;
+
+    return cid;
+}
+
+
+// executes an admin command and waits for its completion
+void nvme_admin(nvme_drive_t *drive, nvme_cmd_t *cmd) {
+
+    nvme_push(&drive->admin, cmd);
+    nvme_ring(&drive->admin);
+
+    while (nvme_reap(&drive->admin) == U16_MAX);
+}
+
+
+// reads a 4 KiB identify data structure into <dest>
+void nvme_identify(nvme_drive_t *drive, u8 cns, u32 nsid, u8 *dest) {
+
+    nvme_cmd_t cmd;
+    mem_set((u8*)&cmd, 0, sizeof(nvme_cmd_t));
+
+    cmd.opc = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = (u64)dest;
+    cmd.cdw10 = cns;
+
+    nvme_admin(drive, &cmd);
+}
+
+
+// describes <dest> with PRP entries
+// transfers spanning more than 2 pages use the PRP list of the command's slot
+void nvme_build_prps(nvme_drive_t *drive, nvme_cmd_t *cmd, u8 *dest, u64 n_bytes) {
+
+    u64 addr = (u64)dest;
+    u64 n_bytes_first = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+
+    cmd->prp1 = addr;
+    cmd->prp2 = 0;
+
+    // fits into the first page
+    if (n_bytes <= n_bytes_first) return;
+
+    // exactly one more page
+    if (n_bytes <= n_bytes_first + PAGE_SIZE) {
+        cmd->prp2 = addr + n_bytes_first;
+        return;
+    }
+
+    // list of all remaining pages
+    u64 *prp_list = drive->prp_lists + cmd->cid * NVME_PRP_LIST_ENTRIES;
+    u64 i = 0;
+
+    for (u64 page = addr + n_bytes_first; page < addr + n_bytes; page += PAGE_SIZE)
+        prp_list[i++] = page;
+
+    cmd->prp2 = (u64)prp_list;
+}
+
+
+// reads logical blocks from an NVMe namespace into RAM
+// the request is split into commands of up to <max_secs> which are all submitted at once
+u64 nvme_read_blocks(void *self, u8 *dest, u64 blk, u64 n_blks) {
+
+    nvme_drive_t *drive = (nvme_drive_t*)self;
+    u64 blk_size = drive->secs_per_blk * 512;
+    u64 max_blks = drive->base.max_secs / drive->secs_per_blk;
+
+    // PRP entries have to be dword aligned -> go through the driver's buffer
+    if ((u64)dest & 3) {
+
+        u64 n_blks_buf = MAX(PAGE_SIZE / blk_size, 1);
+
+        for (u64 i = 0; i < n_blks; i += n_blks_buf) {
+            u64 n_blks_cur = MIN(n_blks - i, n_blks_buf);
+            nvme_read_blocks(self, drive->buf, blk + i, n_blks_cur);
+            mem_cpy(dest + i * blk_size, drive->buf, n_blks_cur * blk_size);
+        }
+        return n_blks * blk_size;
+    }
+
+    nvme_queue_t *io = &drive->io;
+    u64 n_blks_issued = 0;
+    u64 n_inflight = 0;
+    u32 busy = 0;
+
+    while ((n_blks_issued < n_blks) || busy) {
+
+        u64 n_new = 0;
+
+        // fill the submission queue (one entry always stays free)
+        while ((n_blks_issued < n_blks) &&
+                (n_inflight < (u64)io->size - 1) &&
+                !(busy & (1u << io->sq_tail))) {
+
+            u64 n_blks_cmd = MIN(n_blks - n_blks_issued, max_blks);
+            u64 slba = blk + n_blks_issued;
+
+            nvme_cmd_t cmd;
+            mem_set((u8*)&cmd, 0, sizeof(nvme_cmd_t));
+            cmd.opc = NVME_CMD_READ;
+            cmd.cid = io->sq_tail;
+            cmd.nsid = drive->nsid;
+            cmd.cdw10 = slba & 0xffffffff;
+            cmd.cdw11 = slba >> 32;
+            cmd.cdw12 = n_blks_cmd - 1;     // 0-based
+
+            nvme_build_prps(drive, &cmd, dest + n_blks_issued * blk_size, n_blks_cmd * blk_size);
+
+            u16 cid = nvme_push(io, &cmd);
+            busy |= 1u << cid;
+            n_inflight++;
+            n_new++;
+            n_blks_issued += n_blks_cmd;
+        }
+
+        // a single doorbell write for the entire batch
+        if (n_new) nvme_ring(io);
+
+        // collect completions
+        u16 cid;
+        while ((cid = nvme_reap(io)) != U16_MAX) {
+            busy &= ~(1u << cid);
+            n_inflight--;
+        }
+    }
+    // return the bytes read
+    return n_blks * blk_size;
+}
+
+
+// reads sectors from an NVMe namespace into RAM
+u64 nvme_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    nvme_drive_t *drive = (nvme_drive_t*)self;
+
+    // check if the requested lba is out of bounds
+    if ((lba + n_secs) > drive->base.n_secs)
+        log_err("NVMe read error:\nLBA address exceeds drive size lba=%x size=%x\n",
+                (u64)(lba + n_secs), drive->base.n_secs);
+
+    if (drive->secs_per_blk == 1)
+        return nvme_read_blocks(self, dest, lba, n_secs);
+
+    return drive_read_blocks(self, dest, lba, n_secs, drive->secs_per_blk, drive->buf, nvme_read_blocks);
+}
+
+
+// disables the controller, which drops its queues
+void nvme_shutdown(void *self) {
+
+    nvme_drive_t *drive = (nvme_drive_t*)self;
+
+    drive->regs->cc &= ~NVME_CC_EN;
+    while (drive->regs->csts & NVME_CSTS_RDY);
+}
+
+
+// resets an NVMe controller, sets up its queues and identifies the first namespace
+// detected drives are allocated on <heap_drives>
+void nvme_initialize(u8 bus, u8 dev, u8 func) {
+
+    u64 bar = pci_bar(bus, dev, func, 0);
+
+    // only the first 4 GiB are mapped
+    if (bar > U32_MAX) {
+        log_warn("NVMe registers are not mapped (%x)\n", bar);
+        return;
+    }
+
+    // allow MMIO and DMA
+    u16 pci_cmd = pci_cfg_read(bus, dev, func, PCI_OFF_CMD);
+    pci_cfg_write(bus, dev, func, PCI_OFF_CMD, pci_cmd | PCI_CMD_MEM | PCI_CMD_BUSMASTER);
+
+    // allocate a new NVMe drive
+    // it stays DRIVE_NONE until the namespace is usable
+    nvme_drive_t *drive = heap_alloc(&heap_drives, sizeof(nvme_drive_t));
+    drive->base.type = DRIVE_NONE;
+    drive->base.size = sizeof(nvme_drive_t);
+    drive->base.read = nvme_read;
+    drive->base.readv = 0;
+    drive->base.submit = 0;
+    drive->base.shutdown = nvme_shutdown;
+    drive->base.n_secs = 0;
+    drive->regs = (nvme_regs_t*)bar;
+
+    // disable the controller before changing the admin queue
+    drive->regs->cc &= ~NVME_CC_EN;
+    while (drive->regs->csts & NVME_CSTS_RDY);
+
+    nvme_queue_init(drive, &drive->admin, 0, NVME_ADMIN_QUEUE_SIZE);
+    drive->regs->aqa = ((NVME_ADMIN_QUEUE_SIZE - 1) << 16) | (NVME_ADMIN_QUEUE_SIZE - 1);
+    drive->regs->asq = (u64)drive->admin.sq;
+    drive->regs->acq = (u64)drive->admin.cq;
+
+    // 4 KiB pages, NVM command set
+    drive->regs->cc = NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES;
+    while (!(drive->regs->csts & NVME_CSTS_RDY)) {
+        if (drive->regs->csts & NVME_CSTS_CFS) log_err("NVMe controller fatal status\n");
+    }
+
+    drive->buf = heap_alloc_aligned(&heap_dma, PAGE_SIZE, PAGE_SIZE);
+
+    // maximum data transfer size (in units of 4 KiB pages as a power of 2, 0 -> no limit)
+    nvme_identify(drive, NVME_CNS_CONTROLLER, 0, drive->buf);
+    u8 mdts = drive->buf[NVME_IDENT_CTRL_MDTS];
+    drive->base.max_secs = NVME_CMD_MAX_SECS;
+    if (mdts) drive->base.max_secs = MIN(drive->base.max_secs, ((u64)PAGE_SIZE << mdts) / 512);
+
+    // first active namespace
+    nvme_identify(drive, NVME_CNS_ACTIVE_NS_LIST, 0, drive->buf);
+    drive->nsid = *(u32*)drive->buf;
+    if (drive->nsid == 0) {
+        log_warn("NVMe controller without namespaces\n");
+        return;
+    }
+
+    // capacity and LBA format
+    nvme_identify(drive, NVME_CNS_NAMESPACE, drive->nsid, drive->buf);
+    u8 flbas = drive->buf[NVME_IDENT_NS_FLBAS] & 0x0f;
+    u32 lbaf = *(u32*)(drive->buf + NVME_IDENT_NS_LBAF + flbas * sizeof(u32));
+    u64 blk_size = 1 << NVME_LBAF_LBADS(lbaf);
+
+    if ((blk_size < 512) || (blk_size > PAGE_SIZE)) {
+        log_warn("NVMe LBA size not supported (%u)\n", blk_size);
+        return;
+    }
+
+    drive->secs_per_blk = blk_size / 512;
+    drive->base.n_secs = *(u64*)(drive->buf + NVME_IDENT_NS_NSZE) * drive->secs_per_blk;
+
+    // whole commands have to be multiples of the block size
+    drive->base.max_secs -= drive->base.max_secs % drive->secs_per_blk;
+    drive->base.max_call_secs = U64_MAX;     // all commands of a read are queued at once
+
+    // create the I/O queue pair (completion queue first)
+    u16 size = MIN(NVME_IO_QUEUE_SIZE, NVME_CAP_MQES(drive->regs->cap));
+    nvme_queue_init(drive, &drive->io, NVME_IO_QUEUE_ID, size);
+    drive->prp_lists = heap_alloc_aligned(&heap_dma, size * NVME_PRP_LIST_ENTRIES * sizeof(u64), PAGE_SIZE);
+
+    nvme_cmd_t cmd;
+    mem_set((u8*)&cmd, 0, sizeof(nvme_cmd_t));
+    cmd.opc = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = (u64)drive->io.cq;
+    cmd.cdw10 = ((size - 1) << 16) | NVME_IO_QUEUE_ID;
+    cmd.cdw11 = NVME_QUEUE_CONTIGUOUS;
+    nvme_admin(drive, &cmd);
+
+    mem_set((u8*)&cmd, 0, sizeof(nvme_cmd_t));
+    cmd.opc = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = (u64)drive->io.sq;
+    cmd.cdw10 = ((size - 1) << 16) | NVME_IO_QUEUE_ID;
+    cmd.cdw11 = (NVME_IO_QUEUE_ID << 16) | NVME_QUEUE_CONTIGUOUS;
+    nvme_admin(drive, &cmd);
+
+    drive->base.type = DRIVE_NVME;
+
+    log_info("Found NVMe drive (nsid %u, %u byte blocks, %u commands in flight)\n",
+            (u64)drive->nsid, blk_size, (u64)size - 1);
+}
@@ -0,0 +1,383 @@
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <sdhci.h>
+#include <heap.h>
+#include <utils.h>
+#include <layout.h>
+
+
+// resets parts of the host controller (SDHCI_RESET_*)
+void sdhci_reset(sdhci_t *drive, u8 mask) {
+    drive->regs->reset = mask;
+    while (drive->regs->reset & mask);
+}
+
+
+// sets the SD clock to the highest frequency not above <khz>
+void sdhci_set_clock(sdhci_t *drive, u64 khz) {
+
+    sdhci_regs_t *regs = drive->regs;
+    regs->clk_ctrl = 0;
+
+    // SD clock = base clock / (2 * div), div = 0 -> base clock
+    u64 div = 0;
+    if (khz < drive->base_khz) div = (drive->base_khz + 2 * khz - 1) / (2 * khz);
+
+    // version 2 controllers only divide by powers of 2
+    if (drive->v3) {
+        div = MIN(div, SDHCI_CLK_DIV_MAX_V3);
+    } else if (div) {
+        u64 pow = 1;
+        while (pow < div) pow <<= 1;
+        div = MIN(pow, SDHCI_CLK_DIV_MAX_V2);
+    }
+
+    // bits 15-8 -> lower 8 bits of the divider, bits 7-6 -> upper 2 bits (version 3)
+    u16 clk = ((div & 0xff) << 8) | (((div >> 8) & 0x03) << 6) | SDHCI_CLK_INT_EN;
+
+    regs->clk_ctrl = clk;
+    while (!(regs->clk_ctrl & SDHCI_CLK_INT_STABLE));
+    regs->clk_ctrl = clk | SDHCI_CLK_SD_EN;
+}
+
+
+// waits until one of the interrupt status bits in <mask> is set and clears it
+// returns the error status (0 -> success)
+u16 sdhci_wait(sdhci_t *drive, u16 mask) {
+
+    sdhci_regs_t *regs = drive->regs;
+
+    while (!(regs->int_status & (mask | SDHCI_INT_ERROR)));
+
+    if (regs->int_status & SDHCI_INT_ERROR) {
+        u16 err = regs->err_status;
+        regs->err_status = err;
+
+        // the command and data lines have to be reset after an error
+        sdhci_reset(drive, SDHCI_RESET_CMD | SDHCI_RESET_DAT);
+        return err;
+    }
+
+    regs->int_status = mask;
+    return 0;
+}
+
+
+// sends a command to the card and waits for its response
+// <flags> contain the response type (SDHCI_R*) and SDHCI_CMD_DATA for transfers
+// returns the error status (0 -> success)
+u16 sdhci_cmd(sdhci_t *drive, u8 index, u32 arg, u16 flags) {
+
+    sdhci_regs_t *regs = drive->regs;
+    bool busy = (flags & 0x03) == SDHCI_CMD_RESP_48_BUSY;
+
+    // the data lines are needed as well for transfers and busy signaling
+    u32 inhibit = SDHCI_PRESENT_CMD_INHIBIT;
+    if ((flags & SDHCI_CMD_DATA) || busy) inhibit |= SDHCI_PRESENT_DAT_INHIBIT;
+    while (regs->present & inhibit);
+
+    regs->int_status = SDHCI_INT_ALL;
+    regs->err_status = U16_MAX;
+    regs->arg = arg;
+
+    // descriptors have to be in memory before the command starts the DMA engine
+    x86_mfence();
+    regs->cmd = ((u16)index << 8) | flags;
+
+    u16 err = sdhci_wait(drive, SDHCI_INT_CMD_COMPLETE);
+    if (err) return err;
+
+    // R1b: the card signals busy on DAT0
+    if (busy) while (regs->present & SDHCI_PRESENT_DAT_INHIBIT);
+
+    return 0;
+}
+
+
+// sends an application specific command (CMD55 + ACMD)
+u16 sdhci_acmd(sdhci_t *drive, u8 index, u32 arg, u16 flags) {
+
+    u16 err = sdhci_cmd(drive, SD_CMD_APP, (u32)drive->rca << 16, SDHCI_R1);
+    if (err) return err;
+
+    return sdhci_cmd(drive, index, arg, flags);
+}
+
+
+// executes a command that reads <n_blks> blocks of <blk_size> bytes to <dest> (dword aligned)
+// the data is moved with ADMA2 if possible, otherwise through the buffer data port
+// multi block commands are stopped by the controller (auto CMD12)
+// returns the error status (0 -> success)
+u16 sdhci_transfer(sdhci_t *drive, u8 index, u32 arg, u8 *dest, u16 blk_size, u16 n_blks) {
+
+    sdhci_regs_t *regs = drive->regs;
+    u64 n_bytes = (u64)blk_size * n_blks;
+    u16 mode = SDHCI_XFER_READ;
+
+    if (drive->adma) {
+
+        // a single descriptor table for the entire command
+        u64 n_descs = 0;
+        for (u64 off = 0; off < n_bytes; n_descs++) {
+            u64 n_bytes_desc = MIN(n_bytes - off, SDHCI_ADMA2_MAX_BYTES);
+
+            drive->descs[n_descs].attr = ADMA2_VALID | ADMA2_TRAN;
+            drive->descs[n_descs].length = n_bytes_desc & 0xffff;     // 64 KiB -> 0
+            drive->descs[n_descs].addr = (u64)dest + off;
+
+            off += n_bytes_desc;
+        }
+        drive->descs[n_descs - 1].attr |= ADMA2_END;
+
+        regs->adma_addr_low = (u64)drive->descs & 0xffffffff;
+        regs->adma_addr_high = (u64)drive->descs >> 32;
+        mode |= SDHCI_XFER_DMA;
+    }
+
+    if (n_blks > 1) mode |= SDHCI_XFER_MULTI | SDHCI_XFER_BLK_COUNT | SDHCI_XFER_AUTO_CMD12;
+
+    regs->blk_size = blk_size;
+    regs->blk_count = n_blks;
+    regs->xfer_mode = mode;
+
+    u16 err = sdhci_cmd(drive, index, arg, SDHCI_R1 | SDHCI_CMD_DATA);
+    if (err) return err;
+
+    // PIO: one block at a time from the buffer data port
+    if (!drive->adma) {
+        u32 *data = (u32*)dest;
+
+        for (u64 i = 0; i < n_blks; i++) {
+            err = sdhci_wait(drive, SDHCI_INT_BUF_READ_READY);
+            if (err) return err;
+
+            for (u64 j = 0; j < blk_size / sizeof(u32); j++) *data++ = regs->data;
+        }
+    }
+
+    return sdhci_wait(drive, SDHCI_INT_XFER_COMPLETE);
+}
+
+
+// brings the card from idle to the transfer state (4-bit bus, high speed if possible)
+// returns false if the card is not supported
+bool sdhci_card_init(sdhci_t *drive) {
+
+    sdhci_regs_t *regs = drive->regs;
+    drive->rca = 0;
+
+    sdhci_cmd(drive, SD_CMD_GO_IDLE, 0, SDHCI_CMD_RESP_NONE);
+
+    // version 2 cards echo the check pattern (version 1 cards time out)
+    bool v2 = (sdhci_cmd(drive, SD_CMD_SEND_IF_COND, SD_IF_COND_CHECK, SDHCI_R7) == 0)
+        && ((regs->resp[0] & 0xfff) == SD_IF_COND_CHECK);
+
+    // wait until the card has powered up
+    u32 ocr = 0;
+    for (u64 i = 0; i < SDHCI_ACMD41_TRIES; i++) {
+
+        // MMC cards do not know ACMD41
+        if (sdhci_acmd(drive, SD_ACMD_SEND_OP_COND, SD_OCR_VOLTAGES | (v2 ? SD_OCR_HCS : 0), SDHCI_R3))
+            return false;
+
+        ocr = regs->resp[0];
+        if (ocr & SD_OCR_READY) break;
+
+        for (u64 j = 0; j < SDHCI_ACMD41_WAITS; j++) x86_io_wait();
+    }
+    if (!(ocr & SD_OCR_READY)) return false;
+
+    drive->high_capacity = (ocr & SD_OCR_HCS) != 0;
+
+    if (sdhci_cmd(drive, SD_CMD_ALL_SEND_CID, 0, SDHCI_R2)) return false;
+    if (sdhci_cmd(drive, SD_CMD_SEND_RCA, 0, SDHCI_R6)) return false;
+    drive->rca = regs->resp[0] >> 16;
+
+    // capacity
+    if (sdhci_cmd(drive, SD_CMD_SEND_CSD, (u32)drive->rca << 16, SDHCI_R2)) return false;
+    u32 csd[4] = {regs->resp[0], regs->resp[1], regs->resp[2], regs->resp[3]};
+
+    if (SD_CSD_STRUCTURE(csd) == 1) {
+        // SDHC/SDXC: units of 512 KiB
+        drive->base.n_secs = ((u64)SD_CSD2_C_SIZE(csd) + 1) * 1024;
+    } else {
+        u64 shift = SD_CSD1_C_SIZE_MULT(csd) + 2 + SD_CSD1_READ_BL_LEN(csd);
+        drive->base.n_secs = (((u64)SD_CSD1_C_SIZE(csd) + 1) << shift) / 512;
+    }
+
+    if (sdhci_cmd(drive, SD_CMD_SELECT_CARD, (u32)drive->rca << 16, SDHCI_R1B)) return false;
+
+    // standard capacity cards use byte addresses and a variable block length
+    if (!drive->high_capacity && sdhci_cmd(drive, SD_CMD_SET_BLOCKLEN, 512, SDHCI_R1)) return false;
+
+    // 4-bit data bus
+    if (sdhci_acmd(drive, SD_ACMD_SET_BUS_WIDTH, SD_BUS_WIDTH_4, SDHCI_R1) == 0)
+        regs->host_ctrl |= SDHCI_HOST_4BIT;
+
+    // high speed (50 MHz) if both the card and the controller support it
+    u64 khz = SDHCI_CLK_DEFAULT;
+
+    if (v2 && (regs->caps & SDHCI_CAPS_HIGH_SPEED)
+            && (sdhci_transfer(drive, SD_CMD_SWITCH_FUNC, SD_SWITCH_HIGH_SPEED,
+                    drive->buf, SD_SWITCH_STATUS_BYTES, 1) == 0)
+            && (SD_SWITCH_GROUP1(drive->buf) == 1)) {
+        regs->host_ctrl |= SDHCI_HOST_HIGH_SPEED;
+        khz = SDHCI_CLK_HIGH_SPEED;
+    }
+
+    sdhci_set_clock(drive, khz);
+    return true;
+}
+
+
+// reads sectors from an SD card into RAM
+// every command (CMD18) moves up to SDHCI_CMD_MAX_SECS sectors
+u64 sdhci_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    sdhci_t *drive = (sdhci_t*)self;
+
+    // check if the requested lba is out of bounds
+    if ((lba + n_secs) > drive->base.n_secs)
+        log_err("SD read error:\nLBA address exceeds drive size lba=%x size=%x\n",
+                (u64)(lba + n_secs), drive->base.n_secs);
+
+    // ADMA2 addresses and the buffer data port need dword alignment -> go through the driver's buffer
+    if ((u64)dest & 3) {
+
+        u64 n_secs_buf = PAGE_SIZE / 512;
+
+        for (u64 i = 0; i < n_secs; i += n_secs_buf) {
+            u64 n_secs_cur = MIN(n_secs - i, n_secs_buf);
+            sdhci_read(self, drive->buf, lba + i, n_secs_cur);
+            mem_cpy(dest + i * 512, drive->buf, n_secs_cur * 512);
+        }
+        return n_secs * 512;
+    }
+
+    u64 n_secs_read = 0;
+
+    while (n_secs_read < n_secs) {
+
+        u64 cur_lba = lba + n_secs_read;
+        u64 n_secs_cmd = MIN(n_secs - n_secs_read, SDHCI_CMD_MAX_SECS);
+
+        u32 arg = drive->high_capacity ? cur_lba : cur_lba * 512;
+        u8 index = (n_secs_cmd > 1) ? SD_CMD_READ_MULTIPLE : SD_CMD_READ_SINGLE;
+
+        u16 err = sdhci_transfer(drive, index, arg, dest + n_secs_read * 512, 512, n_secs_cmd);
+
+        // error
+        if (err)
+            log_err("SD read error:\nDrive: n_secs=%x (lba=%x n_secs=%x) -> dest=%x (error=%x)\n",
+                    drive->base.n_secs,
+                    cur_lba,
+                    n_secs_cmd,
+                    (u64)dest,
+                    (u64)err);
+
+        n_secs_read += n_secs_cmd;
+    }
+    // return the bytes read
+    return n_secs * 512;
+}
+
+
+// resets the host controller, which also stops its ADMA engine
+void sdhci_shutdown(void *self) {
+    sdhci_reset((sdhci_t*)self, SDHCI_RESET_ALL);
+}
+
+
+// resets an SD host controller (first slot) and initializes the inserted card
+// detected drives are allocated on <heap_drives>
+void sdhci_initialize(u8 bus, u8 dev, u8 func) {
+
+    u64 bar = pci_bar(bus, dev, func, 0);
+
+    // only the first 4 GiB are mapped
+    if (bar > U32_MAX) {
+        log_warn("SD host controller registers are not mapped (%x)\n", bar);
+        return;
+    }
+
+    // allow MMIO and DMA
+    u16 pci_cmd = pci_cfg_read(bus, dev, func, PCI_OFF_CMD);
+    pci_cfg_write(bus, dev, func, PCI_OFF_CMD, pci_cmd | PCI_CMD_MEM | PCI_CMD_BUSMASTER);
+
+    // allocate a new SD drive
+    // it stays DRIVE_NONE until the card is usable
+    sdhci_t *drive = heap_alloc(&heap_drives, sizeof(sdhci_t));
+    drive->base.type = DRIVE_NONE;
+    drive->base.size = sizeof(sdhci_t);
+    drive->base.read = sdhci_read;
+    drive->base.readv = 0;
+    drive->base.submit = 0;
+    drive->base.shutdown = sdhci_shutdown;
+    drive->base.n_secs = 0;
+    drive->regs = (sdhci_regs_t*)bar;
+
+    sdhci_regs_t *regs = drive->regs;
+    sdhci_reset(drive, SDHCI_RESET_ALL);
+
+    drive->v3 = SDHCI_VERSION(regs->version) >= SDHCI_VERSION_3;
+    drive->base_khz = SDHCI_CAPS_BASE_CLK(regs->caps, drive->v3) * 1000;
+    if (drive->base_khz == 0) {
+        log_warn("SD host controller does not report its base clock\n");
+        return;
+    }
+
+    drive->adma = (regs->caps & SDHCI_CAPS_ADMA2) && (SDHCI_VERSION(regs->version) >= SDHCI_VERSION_2);
+#ifdef SDHCI_FORCE_PIO
+    drive->adma = false;
+#endif
+
+    drive->base.max_secs = SDHCI_CMD_MAX_SECS;
+    drive->base.max_call_secs = SDHCI_CMD_MAX_SECS;
+
+    if (!(regs->present & SDHCI_PRESENT_CARD)) {
+        log_info("SD host controller without card\n");
+        return;
+    }
+
+    drive->buf = heap_alloc_aligned(&heap_dma, PAGE_SIZE, PAGE_SIZE);
+    drive->descs = heap_alloc_aligned(&heap_dma, SDHCI_ADMA2_N_DESCS * sizeof(adma2_desc_t), 64);
+
+    // highest supported voltage
+    u8 power = SDHCI_POWER_1V8;
+    if (regs->caps & SDHCI_CAPS_3V0) power = SDHCI_POWER_3V0;
+    if (regs->caps & SDHCI_CAPS_3V3) power = SDHCI_POWER_3V3;
+
+    regs->power_ctrl = power;
+    regs->power_ctrl = power | SDHCI_POWER_ON;
+    for (u64 i = 0; i < SDHCI_POWER_WAITS; i++) x86_io_wait();
+
+    // status bits are latched but do not raise interrupts (polling)
+    regs->int_enable = SDHCI_INT_ALL;
+    regs->err_enable = U16_MAX;
+    regs->int_signal = 0;
+    regs->err_signal = 0;
+
+    regs->timeout_ctrl = SDHCI_TIMEOUT_MAX;
+    regs->host_ctrl = drive->adma ? SDHCI_HOST_ADMA2_32 : 0;
+
+    // identification runs at 400 kHz (the card needs 74 clocks before the first command)
+    sdhci_set_clock(drive, SDHCI_CLK_INIT);
+    for (u64 i = 0; i < SDHCI_POWER_WAITS; i++) x86_io_wait();
+
+    if (!sdhci_card_init(drive)) {
+        log_warn("SD card could not be initialized\n");
+        return;
+    }
+
+    drive->base.type = DRIVE_SD;
+
+    log_info("Found SD card (%u MiB, %s bus, %s, %s)\n",
+            drive->base.n_secs / 2048,
+            (regs->host_ctrl & SDHCI_HOST_4BIT) ? "4-bit" : "1-bit",
+            (regs->host_ctrl & SDHCI_HOST_HIGH_SPEED) ? "high speed" : "default speed",
+            drive->adma ? "ADMA2" : "PIO");
+}
@@ -0,0 +1,207 @@
+#include <types.h>
+#include <drive.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <xhci.h>
+#include <usb_msd.h>
+#include <heap.h>
+#include <utils.h>
+#include <layout.h>
+
+
+// executes a SCSI command using the Bulk-Only Transport (CBW -> data in -> CSW)
+// the data stage is a single chain of bulk TRBs, the CSW is queued right behind it
+// returns the CSW status
+u8 usb_msd_scsi(usb_msd_t *drive, u8 *cb, u8 cb_length, u8 *data, u64 n_bytes) {
+
+    xhci_t *hc = drive->device->hc;
+    u8 slot = drive->device->slot;
+
+    // command block wrapper
+    mem_set((u8*)drive->cbw, 0, sizeof(bot_cbw_t));
+    drive->cbw->signature = BOT_CBW_SIGNATURE;
+    drive->cbw->tag = ++drive->tag;
+    drive->cbw->data_length = n_bytes;
+    drive->cbw->flags = BOT_CBW_DATA_IN;
+    drive->cbw->cb_length = cb_length;
+    mem_cpy(drive->cbw->cb, cb, cb_length);
+
+    xhci_trb_t *last = xhci_queue_td(&drive->bulk_out, (u8*)drive->cbw, sizeof(bot_cbw_t));
+    xhci_doorbell(drive->device, drive->dci_out);
+
+    if (xhci_wait_transfer(hc, slot, last, 0) != XHCI_CC_SUCCESS) return USB_MSD_TRANSPORT_ERROR;
+
+    // data and status stage
+    xhci_trb_t *last_data = 0;
+    if (n_bytes) last_data = xhci_queue_td(&drive->bulk_in, data, n_bytes);
+    xhci_trb_t *last_csw = xhci_queue_td(&drive->bulk_in, (u8*)drive->csw, sizeof(bot_csw_t));
+    xhci_doorbell(drive->device, drive->dci_in);
+
+    if (last_data) {
+        u32 cc = xhci_wait_transfer(hc, slot, last_data, 0);
+        if ((cc != XHCI_CC_SUCCESS) && (cc != XHCI_CC_SHORT_PACKET)) return USB_MSD_TRANSPORT_ERROR;
+    }
+
+    if (xhci_wait_transfer(hc, slot, last_csw, 0) != XHCI_CC_SUCCESS) return USB_MSD_TRANSPORT_ERROR;
+
+    if ((drive->csw->signature != BOT_CSW_SIGNATURE) || (drive->csw->tag != drive->tag))
+        return USB_MSD_TRANSPORT_ERROR;
+
+    return drive->csw->status;
+}
+
+
+// reads whole logical blocks from a USB mass storage device into RAM
+// every READ(10) moves up to USB_MSD_CMD_MAX_BYTES with a single bulk TD
+u64 usb_msd_read_blocks(void *self, u8 *dest, u64 blk, u64 n_blks) {
+
+    usb_msd_t *drive = (usb_msd_t*)self;
+    u64 blk_size = drive->secs_per_blk * 512;
+    u64 n_blks_read = 0;
+
+    while (n_blks_read < n_blks) {
+
+        u64 cur_blk = blk + n_blks_read;
+        u64 n_blks_cmd = MIN(n_blks - n_blks_read, drive->max_blks);
+
+        // bytes 2-5    -> LBA (big endian)
+        // bytes 7-8    -> transfer length
+        u8 cb[10] = {SCSI_READ10,
+                        0,
+                        (cur_blk >> 0x18) & 0xff,
+                        (cur_blk >> 0x10) & 0xff,
+                        (cur_blk >> 0x08) & 0xff,
+                        (cur_blk >> 0x00) & 0xff,
+                        0,
+                        (n_blks_cmd >> 0x08) & 0xff,
+                        (n_blks_cmd >> 0x00) & 0xff,
+                        0};
+
+        u8 status = usb_msd_scsi(drive, cb, sizeof(cb), dest + n_blks_read * blk_size, n_blks_cmd * blk_size);
+
+        // error
+        if (status != USB_MSD_OK)
+            log_err("USB READ(10) error:\nDrive: n_secs=%x (blk=%x n_blks=%x) -> dest=%x (status=%x)\n",
+                    drive->base.n_secs,
+                    cur_blk,
+                    n_blks_cmd,
+                    (u64)dest,
+                    (u64)status);
+
+        n_blks_read += n_blks_cmd;
+    }
+    // return the bytes read
+    return n_blks_read * blk_size;
+}
+
+
+// reads sectors from a USB mass storage device into RAM
+u64 usb_msd_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    usb_msd_t *drive = (usb_msd_t*)self;
+
+    // check if the requested lba is out of bounds
+    if ((lba + n_secs) > drive->base.n_secs)
+        log_err("USB read error:\nLBA address exceeds drive size lba=%x size=%x\n",
+                (u64)(lba + n_secs), drive->base.n_secs);
+
+    if (drive->secs_per_blk == 1) return usb_msd_read_blocks(self, dest, lba, n_secs);
+
+    return drive_read_blocks(self, dest, lba, n_secs,
+            drive->secs_per_blk, drive->bounce, usb_msd_read_blocks);
+}
+
+
+// halts the xHCI controller of the drive (all drives on it stop)
+void usb_msd_shutdown(void *self) {
+
+    usb_msd_t *drive = (usb_msd_t*)self;
+    xhci_halt(drive->device->hc);
+}
+
+
+// configures the bulk endpoints of a mass storage device and determines its capacity
+// detected drives are allocated on <heap_drives>
+void usb_msd_initialize(xhci_device_t *device, u8 ep_in, u16 mps_in, u8 ep_out, u16 mps_out) {
+
+    // allocate a new USB drive
+    // it stays DRIVE_NONE until the medium is usable
+    usb_msd_t *drive = heap_alloc(&heap_drives, sizeof(usb_msd_t));
+    drive->base.type = DRIVE_NONE;
+    drive->base.size = sizeof(usb_msd_t);
+    drive->base.read = usb_msd_read;
+    drive->base.readv = 0;
+    drive->base.submit = 0;
+    drive->base.shutdown = usb_msd_shutdown;
+    drive->base.n_secs = 0;
+    drive->device = device;
+    drive->dci_in = XHCI_DCI(ep_in);
+    drive->dci_out = XHCI_DCI(ep_out);
+    drive->tag = 0;
+
+    device->hc->n_drives++;
+
+    if (!xhci_configure_ep(device, &drive->bulk_in, ep_in, mps_in) ||
+            !xhci_configure_ep(device, &drive->bulk_out, ep_out, mps_out)) {
+        log_warn("USB mass storage: endpoints could not be configured\n");
+        return;
+    }
+
+    drive->cbw = heap_alloc_aligned(&heap_dma, sizeof(bot_cbw_t), 64);
+    drive->csw = heap_alloc_aligned(&heap_dma, sizeof(bot_csw_t), 64);
+
+    // wait until the medium is ready (the first command usually reports UNIT ATTENTION)
+    u8 cb[10];
+    u8 status = USB_MSD_TRANSPORT_ERROR;
+
+    for (u64 i = 0; (i < USB_MSD_READY_TRIES) && (status != USB_MSD_OK); i++) {
+
+        mem_set(cb, 0, sizeof(cb));
+        cb[0] = SCSI_TEST_UNIT_READY;
+        status = usb_msd_scsi(drive, cb, 6, 0, 0);
+        if (status == USB_MSD_TRANSPORT_ERROR) break;
+        if (status == USB_MSD_OK) break;
+
+        // clear the pending sense data
+        mem_set(cb, 0, sizeof(cb));
+        cb[0] = SCSI_REQUEST_SENSE;
+        cb[4] = SCSI_SENSE_BYTES;
+        usb_msd_scsi(drive, cb, 6, device->buf, SCSI_SENSE_BYTES);
+    }
+
+    if (status != USB_MSD_OK) {
+        log_warn("USB mass storage: medium not ready\n");
+        return;
+    }
+
+    // capacity (big endian last LBA and block size)
+    mem_set(cb, 0, sizeof(cb));
+    cb[0] = SCSI_READ_CAPACITY10;
+    if (usb_msd_scsi(drive, cb, sizeof(cb), device->buf, 8) != USB_MSD_OK) {
+        log_warn("USB mass storage: READ CAPACITY failed\n");
+        return;
+    }
+
+    u8 *data = device->buf;
+    u32 last_blk = DWORD(WORD(data[0], data[1]), WORD(data[2], data[3]));
+    u32 blk_size = DWORD(WORD(data[4], data[5]), WORD(data[6], data[7]));
+
+    if ((blk_size < 512) || (blk_size > PAGE_SIZE) || (blk_size % 512)) {
+        log_warn("USB mass storage: block size not supported (%u)\n", (u64)blk_size);
+        return;
+    }
+
+    drive->secs_per_blk = blk_size / 512;
+    drive->max_blks = USB_MSD_CMD_MAX_BYTES / blk_size;
+    drive->base.max_secs = drive->max_blks * drive->secs_per_blk;
+    drive->base.max_call_secs = drive->base.max_secs;
+    drive->base.n_secs = ((u64)last_blk + 1) * drive->secs_per_blk;
+
+    if (drive->secs_per_blk > 1) drive->bounce = heap_alloc_aligned(&heap_dma, blk_size, 64);
+
+    drive->base.type = DRIVE_USB;
+
+    log_info("Found USB mass storage drive (port %u, %u byte blocks)\n",
+            (u64)device->port, (u64)blk_size);
+}
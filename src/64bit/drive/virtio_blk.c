@@ -0,0 +1,350 @@
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <virtio_blk.h>
+#include <heap.h>
+#include <utils.h>
+#include <layout.h>
+
+
+// locates the MMIO structures of a modern device through its vendor specific PCI capabilities
+// returns false if the device only has the legacy interface (or its BARs are not mapped)
+bool virtio_blk_find_modern(virtio_blk_t *drive, u8 bus, u8 dev, u8 func) {
+
+    u64 notify_base = 0;
+    u32 notify_mult = 0;
+    u8 cap = 0;
+
+    drive->common = 0;
+    drive->dev_cfg = 0;
+
+    while ((cap = pci_next_cap(bus, dev, func, cap, PCI_CAP_VENDOR)) != 0) {
+
+        u8 type = pci_cfg_read(bus, dev, func, cap + 3, 0xff);
+        u8 bar = pci_cfg_read(bus, dev, func, cap + 4, 0xff);
+        u64 addr = pci_bar(bus, dev, func, bar) + pci_cfg_read(bus, dev, func, cap + 8, U32_MAX);
+
+        // only the first 4 GiB are mapped
+        if (addr > U32_MAX) return false;
+
+        switch (type) {
+            case VIRTIO_CAP_COMMON:
+                drive->common = (virtio_common_cfg_t*)addr;
+                break;
+            case VIRTIO_CAP_NOTIFY:
+                notify_base = addr;
+                notify_mult = pci_cfg_read(bus, dev, func, cap + 16, U32_MAX);
+                break;
+            case VIRTIO_CAP_DEVICE:
+                drive->dev_cfg = (u8*)addr;
+                break;
+        }
+    }
+
+    if (!drive->common || !drive->dev_cfg || !notify_base) return false;
+
+    // notification address of queue 0
+    drive->common->queue_select = 0;
+    drive->notify = (u16*)(notify_base + drive->common->queue_notify_off * notify_mult);
+
+    return true;
+}
+
+
+// reads a double word from the device specific configuration
+u32 virtio_blk_cfg_read(virtio_blk_t *drive, u8 off) {
+
+    if (drive->modern) return *(volatile u32*)(drive->dev_cfg + off);
+
+    return x86_ind(VIRTIO_REG_DEVICE_CFG(drive->io) + off);
+}
+
+
+// writes the device status register
+void virtio_blk_set_status(virtio_blk_t *drive, u8 status) {
+
+    if (drive->modern) drive->common->device_status = status;
+    else x86_outb(VIRTIO_REG_STATUS(drive->io), status);
+}
+
+
+// reads the device status register
+u8 virtio_blk_get_status(virtio_blk_t *drive) {
+
+    if (drive->modern) return drive->common->device_status;
+
+    return x86_inb(VIRTIO_REG_STATUS(drive->io));
+}
+
+
+// allocates the request queue (queue 0) using the legacy layout
+// descriptors, available ring, used ring (4 KiB aligned)
+void virtio_blk_queue_init(virtio_blk_t *drive) {
+
+    u16 size;
+
+    if (drive->modern) {
+        drive->common->queue_select = 0;
+        size = MIN(drive->common->queue_size, VIRTQ_MAX_SIZE);
+        drive->common->queue_size = size;
+    } else {
+        // the size of legacy queues can not be changed
+        x86_outw(VIRTIO_REG_QUEUE_SELECT(drive->io), 0);
+        size = x86_inw(VIRTIO_REG_QUEUE_SIZE(drive->io));
+    }
+
+    u64 n_bytes_desc = size * sizeof(virtq_desc_t);
+    u64 n_bytes_avail = sizeof(virtq_avail_t) + size * sizeof(u16) + sizeof(u16);
+    u64 off_used = (n_bytes_desc + n_bytes_avail + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+    u64 n_bytes = off_used + sizeof(virtq_used_t) + size * sizeof(virtq_used_elem_t) + sizeof(u16);
+
+    u8 *mem = heap_alloc_aligned(&heap_dma, n_bytes, VIRTQ_ALIGN);
+    mem_set(mem, 0, n_bytes);
+
+    drive->queue_size = size;
+    drive->desc = (virtq_desc_t*)mem;
+    drive->avail = (virtq_avail_t*)(mem + n_bytes_desc);
+    drive->used = (virtq_used_t*)(mem + off_used);
+    drive->avail_idx = 0;
+    drive->last_used = 0;
+
+    // the used ring is polled, nobody handles the interrupts
+    // (every used ring update would raise INTx, which stays asserted as nothing reads the ISR status,
+    // and on an IRQ line shared with IDE it would keep waking ide_wait_req)
+    // the flag is honoured as VIRTIO_F_EVENT_IDX is not negotiated
+    drive->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+    if (drive->modern) {
+        drive->common->queue_desc_low = (u64)drive->desc & 0xffffffff;
+        drive->common->queue_desc_high = (u64)drive->desc >> 32;
+        drive->common->queue_driver_low = (u64)drive->avail & 0xffffffff;
+        drive->common->queue_driver_high = (u64)drive->avail >> 32;
+        drive->common->queue_device_low = (u64)drive->used & 0xffffffff;
+        drive->common->queue_device_high = (u64)drive->used >> 32;
+        drive->common->queue_enable = 1;
+    } else {
+        x86_outd(VIRTIO_REG_QUEUE_PFN(drive->io), (u64)mem / VIRTQ_ALIGN);
+    }
+
+    // every request slot owns a fixed range of descriptors
+    drive->n_reqs = MIN(size / VIRTIO_BLK_DESCS_PER_REQ, VIRTIO_BLK_MAX_REQS);
+    drive->hdrs = heap_alloc_aligned(&heap_dma, drive->n_reqs * sizeof(virtio_blk_req_t), 16);
+    drive->status = heap_alloc(&heap_dma, drive->n_reqs);
+}
+
+
+// tells the device that new requests are available
+void virtio_blk_notify(virtio_blk_t *drive) {
+
+    if (drive->modern) *drive->notify = 0;
+    else x86_outw(VIRTIO_REG_QUEUE_NOTIFY(drive->io), 0);
+}
+
+
+// builds the descriptor chain of request slot <req> and puts it into the available ring
+// the device only sees it after the available index has been published
+void virtio_blk_add_req(virtio_blk_t *drive, u16 req, u8 *dest, u64 lba, u64 n_secs) {
+
+    u16 head = req * VIRTIO_BLK_DESCS_PER_REQ;
+    u16 i = head;
+
+    drive->hdrs[req].type = VIRTIO_BLK_T_IN;
+    drive->hdrs[req].reserved = 0;
+    drive->hdrs[req].sector = lba;
+    drive->status[req] = U8_MAX;
+
+    // header
+    drive->desc[i].addr = (u64)&drive->hdrs[req];
+    drive->desc[i].len = sizeof(virtio_blk_req_t);
+    drive->desc[i].flags = VIRTQ_DESC_F_NEXT;
+    drive->desc[i].next = i + 1;
+    i++;
+
+    // data segments
+    u64 addr = (u64)dest;
+    u64 n_bytes_left = n_secs * 512;
+
+    while (n_bytes_left > 0) {
+
+        u64 n_bytes = MIN(n_bytes_left, drive->seg_bytes);
+
+        drive->desc[i].addr = addr;
+        drive->desc[i].len = n_bytes;
+        drive->desc[i].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
+        drive->desc[i].next = i + 1;
+
+        addr += n_bytes;
+        n_bytes_left -= n_bytes;
+        i++;
+    }
+
+    // status byte
+    drive->desc[i].addr = (u64)&drive->status[req];
+    drive->desc[i].len = 1;
+    drive->desc[i].flags = VIRTQ_DESC_F_WRITE;
+    drive->desc[i].next = 0;
+
+    drive->avail->ring[drive->avail_idx % drive->queue_size] = head;
+    drive->avail_idx++;
+}
+
+
+// reads sectors from a virtio block device into RAM
+// all free request slots are filled before the device is notified once for the entire batch
+u64 virtio_blk_read(void *self, u8 *dest, u64 lba, u64 n_secs) {
+
+    virtio_blk_t *drive = (virtio_blk_t*)self;
+
+    // check if the requested lba is out of bounds
+    if ((lba + n_secs) > drive->base.n_secs)
+        log_err("virtio read error:\nLBA address exceeds drive size lba=%x size=%x\n",
+                (u64)(lba + n_secs), drive->base.n_secs);
+
+    u64 max_secs = drive->base.max_secs;
+    u64 n_secs_issued = 0;
+    u32 busy = 0;
+
+    while ((n_secs_issued < n_secs) || busy) {
+
+        u64 n_new = 0;
+
+        for (u16 req = 0; (req < drive->n_reqs) && (n_secs_issued < n_secs); req++) {
+
+            if (busy & (1u << req)) continue;
+
+            u64 n_secs_req = MIN(n_secs - n_secs_issued, max_secs);
+
+            virtio_blk_add_req(drive, req, dest + n_secs_issued * 512, lba + n_secs_issued, n_secs_req);
+
+            busy |= 1u << req;
+            n_secs_issued += n_secs_req;
+            n_new++;
+        }
+
+        // publish the batch and notify the device once (if it wants to be notified)
+        if (n_new) {
+            x86_mfence();
+            drive->avail->idx = drive->avail_idx;
+            x86_mfence();
+
+            if (!(drive->used->flags & VIRTQ_USED_F_NO_NOTIFY)) virtio_blk_notify(drive);
+        }
+
+        // collect completed requests
+        while (drive->last_used != drive->used->idx) {
+
+            u16 req = drive->used->ring[drive->last_used % drive->queue_size].id / VIRTIO_BLK_DESCS_PER_REQ;
+
+            // error
+            if (drive->status[req] != VIRTIO_BLK_S_OK)
+                log_err("virtio read error:\nstatus=%x (lba=%x n_secs=%x)\n",
+                        (u64)drive->status[req],
+                        (u64)drive->hdrs[req].sector,
+                        n_secs);
+
+            busy &= ~(1u << req);
+            drive->last_used++;
+        }
+    }
+    // return the bytes read
+    return n_secs_issued * 512;
+}
+
+
+// resets the device, so it forgets the queue
+void virtio_blk_shutdown(void *self) {
+    virtio_blk_set_status((virtio_blk_t*)self, 0);
+}
+
+
+// negotiates features, sets up the request queue and reads the capacity of a virtio block device
+// detected drives are allocated on <heap_drives>
+void virtio_blk_initialize(u8 bus, u8 dev, u8 func) {
+
+    // allow I/O, MMIO and DMA
+    u16 pci_cmd = pci_cfg_read(bus, dev, func, PCI_OFF_CMD);
+    pci_cfg_write(bus, dev, func, PCI_OFF_CMD, pci_cmd | PCI_CMD_IO | PCI_CMD_MEM | PCI_CMD_BUSMASTER);
+
+    // allocate a new virtio drive
+    // it stays DRIVE_NONE until the device is usable
+    virtio_blk_t *drive = heap_alloc(&heap_drives, sizeof(virtio_blk_t));
+    drive->base.type = DRIVE_NONE;
+    drive->base.size = sizeof(virtio_blk_t);
+    drive->base.read = virtio_blk_read;
+    drive->base.readv = 0;
+    drive->base.submit = 0;
+    drive->base.shutdown = 0;
+    drive->base.n_secs = 0;
+
+    // prefer the modern interface, transitional devices also have the legacy one
+    drive->modern = virtio_blk_find_modern(drive, bus, dev, func);
+    if (!drive->modern) {
+        if (pci_cfg_read(bus, dev, func, PCI_OFF_DEVICE_ID) == VIRTIO_PCI_BLK_MODERN) {
+            log_warn("virtio registers are not mapped\n");
+            return;
+        }
+        drive->io = pci_bar(bus, dev, func, 0);
+    }
+
+    // reset and acknowledge the device
+    virtio_blk_set_status(drive, 0);
+    drive->base.shutdown = virtio_blk_shutdown;
+    virtio_blk_set_status(drive, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    // only the transfer limits are of interest
+    u32 wanted = VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX;
+    u32 features;
+
+    if (drive->modern) {
+        drive->common->device_feature_select = 0;
+        features = drive->common->device_feature & wanted;
+
+        drive->common->driver_feature_select = 0;
+        drive->common->driver_feature = features;
+        drive->common->driver_feature_select = 1;
+        drive->common->driver_feature = 1 << (VIRTIO_F_VERSION_1 - 32);
+
+        virtio_blk_set_status(drive, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+        if (!(virtio_blk_get_status(drive) & VIRTIO_STATUS_FEATURES_OK)) {
+            log_warn("virtio device rejected the features\n");
+            return;
+        }
+    } else {
+        features = x86_ind(VIRTIO_REG_DEVICE_FEATURES(drive->io)) & wanted;
+        x86_outd(VIRTIO_REG_DRIVER_FEATURES(drive->io), features);
+    }
+
+    // capacity is always in 512 byte sectors
+    drive->base.n_secs = QWORD(
+            virtio_blk_cfg_read(drive, VIRTIO_BLK_CFG_CAPACITY + 4),
+            virtio_blk_cfg_read(drive, VIRTIO_BLK_CFG_CAPACITY));
+
+    // largest segment and number of segments per request
+    drive->seg_bytes = VIRTIO_BLK_SEG_MAX_BYTES;
+    if (features & VIRTIO_BLK_F_SIZE_MAX) {
+        u32 size_max = virtio_blk_cfg_read(drive, VIRTIO_BLK_CFG_SIZE_MAX) & ~511;
+        if (size_max) drive->seg_bytes = size_max;
+    }
+
+    drive->n_segs = 1;
+    if (features & VIRTIO_BLK_F_SEG_MAX)
+        drive->n_segs = MAX(MIN(virtio_blk_cfg_read(drive, VIRTIO_BLK_CFG_SEG_MAX), VIRTIO_BLK_MAX_SEGS), 1);
+
+    drive->base.max_secs = drive->n_segs * drive->seg_bytes / 512;
+    drive->base.max_call_secs = U64_MAX;     // the requests of a read are batched
+
+    virtio_blk_queue_init(drive);
+
+    // legacy devices do not know FEATURES_OK
+    virtio_blk_set_status(drive, virtio_blk_get_status(drive) | VIRTIO_STATUS_DRIVER_OK);
+
+    drive->base.type = DRIVE_VIRTIO;
+
+    log_info("Found virtio block drive (%s, %u requests of %u KiB per notification)\n",
+            drive->modern ? "modern" : "legacy",
+            (u64)drive->n_reqs,
+            drive->n_segs * drive->seg_bytes / 1024);
+}
@@ -0,0 +1,519 @@
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+#include <xhci.h>
+#include <usb_msd.h>
+#include <heap.h>
+#include <utils.h>
+#include <layout.h>
+
+
+// requests ownership of the controller from the BIOS (USB legacy support capability)
+void xhci_bios_handoff(xhci_t *hc, u8 *base) {
+
+    u64 off = XHCI_HCC1_XECP(hc->cap->hccparams1);
+
+    while (off) {
+
+        volatile u32 *cap = (volatile u32*)(base + off);
+
+        if (XHCI_XCAP_ID(*cap) == XHCI_XCAP_LEGACY) {
+            *cap |= XHCI_LEGACY_OS_OWNED;
+            while (*cap & XHCI_LEGACY_BIOS_OWNED);
+
+            // disable all SMIs
+            cap[1] = 0;
+            return;
+        }
+
+        u64 next = XHCI_XCAP_NEXT(*cap);
+        if (!next) return;
+        off += next;
+    }
+}
+
+
+// allocates an empty ring whose last TRB links back to the start
+void xhci_ring_init(xhci_ring_t *ring, u16 size) {
+
+    // aligned to its own size -> never crosses a 64 KiB boundary
+    ring->trbs = heap_alloc_aligned(&heap_dma, size * sizeof(xhci_trb_t), size * sizeof(xhci_trb_t));
+    mem_set((u8*)ring->trbs, 0, size * sizeof(xhci_trb_t));
+
+    ring->size = size;
+    ring->enqueue = 0;
+    ring->cycle = 1;
+
+    ring->trbs[size - 1].param = (u64)ring->trbs;
+    ring->trbs[size - 1].control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC;
+}
+
+
+// writes a TRB to a ring (the controller is not notified)
+// returns the TRB in the ring
+xhci_trb_t *xhci_ring_push(xhci_ring_t *ring, u64 param, u32 status, u32 control) {
+
+    xhci_trb_t *trb = &ring->trbs[ring->enqueue];
+
+    trb->param = param;
+    trb->status = status;
+
+    // the cycle bit hands the TRB over to the controller
+    trb->control = (control & ~XHCI_TRB_CYCLE) | ring->cycle;
+
+    ring->enqueue++;
+
+    // reached the link TRB -> hand it over as well and continue at the start
+    // (a TD can span the link TRB if it is chained)
+    if (ring->enqueue == ring->size - 1) {
+
+        ring->trbs[ring->enqueue].control =
+            XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC | (control & XHCI_TRB_CH) | ring->cycle;
+
+        ring->cycle ^= 1;
+        ring->enqueue = 0;
+    }
+    return trb;
+}
+
+
+// takes the next event from the event ring
+// returns false if there is none
+bool xhci_next_event(xhci_t *hc, xhci_trb_t *event) {
+
+    volatile xhci_trb_t *trb = &hc->events[hc->event_dequeue];
+
+    if ((trb->control & XHCI_TRB_CYCLE) != hc->event_cycle) return false;
+
+    event->param = trb->param;
+    event->status = trb->status;
+    event->control = trb->control;
+
+    hc->event_dequeue++;
+    if (hc->event_dequeue == XHCI_EVENT_RING_SIZE) {
+        hc->event_dequeue = 0;
+        hc->event_cycle ^= 1;
+    }
+
+    // tell the controller which events have been processed
+    u64 erdp = (u64)&hc->events[hc->event_dequeue];
+    hc->rt->ir[0].erdp_low = (erdp & 0xffffffff) | XHCI_ERDP_EHB;
+    hc->rt->ir[0].erdp_high = erdp >> 32;
+
+    return true;
+}
+
+
+// executes a command and waits for its completion
+// returns the Command Completion Event
+xhci_trb_t xhci_cmd(xhci_t *hc, u64 param, u32 status, u32 control) {
+
+    xhci_trb_t *trb = xhci_ring_push(&hc->cmd_ring, param, status, control);
+    xhci_trb_t event;
+
+    x86_mfence();
+    hc->doorbells[0] = 0;
+
+    while (true) {
+        if (!xhci_next_event(hc, &event)) continue;
+
+        if ((XHCI_TRB_GET_TYPE(event.control) == XHCI_TRB_EV_CMD_COMPLETE)
+                && (event.param == (u64)trb)) break;
+    }
+    return event;
+}
+
+
+// waits until the TD that ends with <last> has completed
+// a short packet or an error ends the TD early
+// returns the completion code (and the bytes not transferred of the failed TRB in <residue>)
+u32 xhci_wait_transfer(xhci_t *hc, u8 slot, xhci_trb_t *last, u32 *residue) {
+
+    xhci_trb_t event;
+
+    while (true) {
+        if (!xhci_next_event(hc, &event)) continue;
+
+        if (XHCI_TRB_GET_TYPE(event.control) != XHCI_TRB_EV_TRANSFER) continue;
+        if (XHCI_TRB_GET_SLOT(event.control) != slot) continue;
+
+        u32 cc = XHCI_CC(event.status);
+
+        // events of earlier TDs completing successfully are ignored
+        // (so is the success some controllers report for the last TRB after a short packet)
+        if ((event.param != (u64)last) && (cc == XHCI_CC_SUCCESS)) continue;
+
+        // a short packet in any TRB of the TD ends it, the controller skips the rest without reporting it
+        if (residue) *residue = XHCI_RESIDUE(event.status);
+        return cc;
+    }
+}
+
+
+// returns a context of an input/output device context
+// (input contexts start with the input control context)
+u8 *xhci_ctx(xhci_device_t *device, u8 *ctx, u64 index) {
+    return ctx + index * device->hc->ctx_size;
+}
+
+
+// rings the doorbell of an endpoint
+void xhci_doorbell(xhci_device_t *device, u8 dci) {
+
+    // TRBs have to be in memory before the controller fetches them
+    x86_mfence();
+    device->hc->doorbells[device->slot] = dci;
+}
+
+
+// performs a control transfer on the default endpoint
+// returns the completion code
+u32 xhci_control(xhci_device_t *device, u8 type, u8 request, u16 value, u16 index, u16 length, u8 *data) {
+
+    usb_setup_t setup = {type, request, value, index, length};
+    bool in = (type & USB_DIR_IN) != 0;
+
+    u32 trt = 0;
+    if (length) trt = in ? XHCI_TRB_TRT_IN : XHCI_TRB_TRT_OUT;
+
+    // the setup packet goes into the TRB itself (immediate data)
+    u64 setup_data;
+    mem_cpy((u8*)&setup_data, (u8*)&setup, sizeof(usb_setup_t));
+
+    xhci_ring_push(&device->ep0, setup_data, sizeof(usb_setup_t),
+            XHCI_TRB_TYPE(XHCI_TRB_SETUP) | XHCI_TRB_IDT | trt);
+
+    if (length)
+        xhci_ring_push(&device->ep0, (u64)data, length,
+                XHCI_TRB_TYPE(XHCI_TRB_DATA) | (in ? XHCI_TRB_DIR_IN : 0));
+
+    // the status stage goes into the opposite direction of the data
+    xhci_trb_t *status = xhci_ring_push(&device->ep0, 0, 0,
+            XHCI_TRB_TYPE(XHCI_TRB_STATUS) | XHCI_TRB_IOC | ((length && in) ? 0 : XHCI_TRB_DIR_IN));
+
+    xhci_doorbell(device, 1);
+
+    return xhci_wait_transfer(device->hc, device->slot, status, 0);
+}
+
+
+// sets up a bulk endpoint with its own transfer ring
+// returns false if the controller rejected the endpoint
+bool xhci_configure_ep(xhci_device_t *device, xhci_ring_t *ring, u8 ep_addr, u16 max_packet_size) {
+
+    u8 dci = XHCI_DCI(ep_addr);
+    device->max_dci = MAX(device->max_dci, dci);
+
+    xhci_ring_init(ring, XHCI_BULK_RING_SIZE);
+    ring->max_packet_size = max_packet_size;
+
+    mem_set(device->input_ctx, 0, (XHCI_N_CTX + 1) * device->hc->ctx_size);
+
+    // add the endpoint (and update the slot's number of contexts)
+    u32 *icc = (u32*)xhci_ctx(device, device->input_ctx, 0);
+    icc[1] = (1 << 0) | (1 << dci);
+
+    u32 *slot_ctx = (u32*)xhci_ctx(device, device->input_ctx, 1);
+    slot_ctx[0] = (device->speed << 20) | ((u32)device->max_dci << 27);
+    slot_ctx[1] = (u32)(device->port + 1) << 16;
+
+    u32 *ep_ctx = (u32*)xhci_ctx(device, device->input_ctx, 1 + dci);
+    u32 ep_type = (ep_addr & USB_EP_DIR_IN) ? XHCI_EP_BULK_IN : XHCI_EP_BULK_OUT;
+    ep_ctx[1] = (3 << 1) | (ep_type << 3) | ((u32)max_packet_size << 16);
+    ep_ctx[2] = ((u64)ring->trbs & 0xffffffff) | 1;     // dequeue cycle state
+    ep_ctx[3] = (u64)ring->trbs >> 32;
+    ep_ctx[4] = XHCI_BULK_AVG_TRB_LEN;
+
+    x86_mfence();
+    xhci_trb_t event = xhci_cmd(device->hc, (u64)device->input_ctx, 0,
+            XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_EP) | XHCI_TRB_SLOT(device->slot));
+
+    return XHCI_CC(event.status) == XHCI_CC_SUCCESS;
+}
+
+
+// puts a bulk TD for <n_bytes> at <data> on a transfer ring
+// the buffer is split into as few Normal TRBs as possible (64 KiB boundaries)
+// returns the last TRB of the TD (the controller is not notified)
+xhci_trb_t *xhci_queue_td(xhci_ring_t *ring, u8 *data, u64 n_bytes) {
+
+    u64 addr = (u64)data;
+    u64 n_bytes_left = n_bytes;
+    xhci_trb_t *trb = 0;
+
+    while (n_bytes_left > 0) {
+
+        // bytes until the next 64 KiB boundary
+        u64 n_bytes_trb = MIN(n_bytes_left, XHCI_TRB_MAX_BYTES - (addr & (XHCI_TRB_MAX_BYTES - 1)));
+        n_bytes_left -= n_bytes_trb;
+
+        // packets that remain after this TRB
+        u64 n_packets = (n_bytes_left + ring->max_packet_size - 1) / ring->max_packet_size;
+
+        // a short packet is reported by the TRB it ends in, the TD completes with the last TRB
+        u32 control = XHCI_TRB_TYPE(XHCI_TRB_NORMAL) | XHCI_TRB_ISP;
+        control |= n_bytes_left ? XHCI_TRB_CH : XHCI_TRB_IOC;
+
+        trb = xhci_ring_push(ring, addr, n_bytes_trb | XHCI_TRB_TD_SIZE(n_packets), control);
+
+        addr += n_bytes_trb;
+    }
+    return trb;
+}
+
+
+// enables, addresses and configures the device attached to a root hub port
+// mass storage devices are handed over to the USB mass storage driver
+void xhci_port_init(xhci_t *hc, u8 n_port) {
+
+    xhci_port_regs_t *port = &hc->op->ports[n_port];
+
+    // nothing attached
+    if (!(port->portsc & XHCI_PORTSC_CCS)) return;
+
+    // USB 2 ports have to be reset to get enabled (USB 3 ports enable themselves)
+    if (!(port->portsc & XHCI_PORTSC_PED)) {
+
+        port->portsc = (port->portsc & ~(XHCI_PORTSC_PED | XHCI_PORTSC_CHANGE)) | XHCI_PORTSC_PR;
+        while (!(port->portsc & XHCI_PORTSC_PRC));
+
+        port->portsc = (port->portsc & ~(XHCI_PORTSC_PED | XHCI_PORTSC_CHANGE)) | XHCI_PORTSC_PRC;
+
+        if (!(port->portsc & XHCI_PORTSC_PED)) {
+            log_warn("USB port %u could not be enabled\n", (u64)n_port);
+            return;
+        }
+    }
+
+    // allocate a device slot
+    xhci_trb_t event = xhci_cmd(hc, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_ENABLE_SLOT));
+    if (XHCI_CC(event.status) != XHCI_CC_SUCCESS) {
+        log_warn("USB port %u: no free device slot\n", (u64)n_port);
+        return;
+    }
+
+    xhci_device_t *device = heap_alloc(&heap_dma, sizeof(xhci_device_t));
+    device->hc = hc;
+    device->slot = XHCI_TRB_GET_SLOT(event.control);
+    device->port = n_port;
+    device->speed = XHCI_PORTSC_SPEED(port->portsc);
+    device->max_dci = 1;
+
+    device->input_ctx = heap_alloc_aligned(&heap_dma, (XHCI_N_CTX + 1) * hc->ctx_size, 64);
+    device->output_ctx = heap_alloc_aligned(&heap_dma, XHCI_N_CTX * hc->ctx_size, 64);
+    device->buf = heap_alloc_aligned(&heap_dma, PAGE_SIZE, PAGE_SIZE);
+    mem_set(device->input_ctx, 0, (XHCI_N_CTX + 1) * hc->ctx_size);
+    mem_set(device->output_ctx, 0, XHCI_N_CTX * hc->ctx_size);
+
+    hc->dcbaa[device->slot] = (u64)device->output_ctx;
+
+    xhci_ring_init(&device->ep0, XHCI_CTRL_RING_SIZE);
+
+    // default max packet size of the control endpoint (FS devices report theirs later)
+    u16 mps0 = 8;
+    if (device->speed == XHCI_SPEED_HIGH) mps0 = 64;
+    if (device->speed >= XHCI_SPEED_SUPER) mps0 = 512;
+
+    // input context: slot and control endpoint
+    u32 *icc = (u32*)xhci_ctx(device, device->input_ctx, 0);
+    icc[1] = (1 << 0) | (1 << 1);
+
+    u32 *slot_ctx = (u32*)xhci_ctx(device, device->input_ctx, 1);
+    slot_ctx[0] = (device->speed << 20) | (1 << 27);
+    slot_ctx[1] = (u32)(n_port + 1) << 16;
+
+    u32 *ep0_ctx = (u32*)xhci_ctx(device, device->input_ctx, 2);
+    ep0_ctx[1] = (3 << 1) | (XHCI_EP_CONTROL << 3) | ((u32)mps0 << 16);
+    ep0_ctx[2] = ((u64)device->ep0.trbs & 0xffffffff) | 1;     // dequeue cycle state
+    ep0_ctx[3] = (u64)device->ep0.trbs >> 32;
+    ep0_ctx[4] = 8;
+
+    x86_mfence();
+    event = xhci_cmd(hc, (u64)device->input_ctx, 0,
+            XHCI_TRB_TYPE(XHCI_TRB_ADDRESS_DEVICE) | XHCI_TRB_SLOT(device->slot));
+    if (XHCI_CC(event.status) != XHCI_CC_SUCCESS) {
+        log_warn("USB port %u: ADDRESS DEVICE failed (%u)\n", (u64)n_port, (u64)XHCI_CC(event.status));
+        return;
+    }
+
+    // the first 8 bytes of the device descriptor contain the real max packet size
+    usb_device_desc_t *dev_desc = (usb_device_desc_t*)device->buf;
+    xhci_control(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_DEVICE << 8, 0, 8, device->buf);
+
+    if ((device->speed < XHCI_SPEED_HIGH) && (dev_desc->max_packet_size0 != mps0)) {
+
+        icc[1] = (1 << 1);
+        ep0_ctx[1] = (3 << 1) | (XHCI_EP_CONTROL << 3) | ((u32)dev_desc->max_packet_size0 << 16);
+
+        x86_mfence();
+        xhci_cmd(hc, (u64)device->input_ctx, 0,
+                XHCI_TRB_TYPE(XHCI_TRB_EVALUATE_CTX) | XHCI_TRB_SLOT(device->slot));
+    }
+
+    // configuration descriptor: header first for the total length
+    usb_config_desc_t *cfg = (usb_config_desc_t*)device->buf;
+    xhci_control(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_CONFIG << 8, 0,
+            sizeof(usb_config_desc_t), device->buf);
+
+    u16 cfg_len = MIN(cfg->total_length, PAGE_SIZE);
+    xhci_control(device, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_CONFIG << 8, 0,
+            cfg_len, device->buf);
+
+    // look for a Bulk-Only mass storage interface and its bulk endpoints
+    bool msd = false;
+    bool found = false;
+    usb_endpoint_desc_t *ep_in = 0;
+    usb_endpoint_desc_t *ep_out = 0;
+
+    for (u16 off = cfg->length; off + 2 <= cfg_len; off += device->buf[off]) {
+
+        u8 *desc = device->buf + off;
+        if (desc[0] == 0) break;
+
+        if (desc[1] == USB_DESC_INTERFACE) {
+
+            // only the first matching interface is used
+            if (found) break;
+
+            usb_interface_desc_t *iface = (usb_interface_desc_t*)desc;
+            msd = (iface->class == USB_CLASS_MSD)
+                && (iface->subclass == USB_MSD_SUBCLASS_SCSI)
+                && (iface->protocol == USB_MSD_PROTOCOL_BOT);
+            found = msd;
+        }
+
+        if ((desc[1] == USB_DESC_ENDPOINT) && msd) {
+
+            usb_endpoint_desc_t *ep = (usb_endpoint_desc_t*)desc;
+            if ((ep->attr & 0x03) != USB_EP_TYPE_BULK) continue;
+
+            if (ep->addr & USB_EP_DIR_IN) ep_in = ep;
+            else ep_out = ep;
+        }
+    }
+
+    if (!ep_in || !ep_out) {
+        log_info("Found USB device (port %u, not supported)\n", (u64)n_port);
+        return;
+    }
+
+    u8 config = cfg->config_value;
+    u8 addr_in = ep_in->addr;
+    u8 addr_out = ep_out->addr;
+    u16 mps_in = ep_in->max_packet_size;
+    u16 mps_out = ep_out->max_packet_size;
+
+    xhci_control(device, 0, USB_REQ_SET_CONFIGURATION, config, 0, 0, 0);
+
+    usb_msd_initialize(device, addr_in, mps_in, addr_out, mps_out);
+}
+
+
+// stops the controller's schedules (it does not touch memory afterwards)
+void xhci_halt(xhci_t *hc) {
+
+    hc->op->usbcmd &= ~XHCI_CMD_RS;
+    while (!(hc->op->usbsts & XHCI_STS_HCH));
+}
+
+
+// resets an xHCI controller, sets up its rings and initializes all connected devices
+void xhci_initialize(u8 bus, u8 dev, u8 func) {
+
+    u64 bar = pci_bar(bus, dev, func, 0);
+
+    // only the first 4 GiB are mapped
+    if (bar > U32_MAX) {
+        log_warn("xHCI registers are not mapped (%x)\n", bar);
+        return;
+    }
+
+    // allow MMIO and DMA
+    u16 pci_cmd = pci_cfg_read(bus, dev, func, PCI_OFF_CMD);
+    pci_cfg_write(bus, dev, func, PCI_OFF_CMD, pci_cmd | PCI_CMD_MEM | PCI_CMD_BUSMASTER);
+
+    xhci_t *hc = heap_alloc(&heap_dma, sizeof(xhci_t));
+    hc->n_drives = 0;
+    hc->cap = (xhci_cap_regs_t*)bar;
+    hc->op = (xhci_op_regs_t*)(bar + hc->cap->caplength);
+    hc->rt = (xhci_rt_regs_t*)(bar + (hc->cap->rtsoff & ~0x1f));
+    hc->doorbells = (volatile u32*)(bar + (hc->cap->dboff & ~0x03));
+
+    xhci_bios_handoff(hc, (u8*)bar);
+
+    // stop and reset the controller
+    xhci_halt(hc);
+
+    hc->op->usbcmd |= XHCI_CMD_HCRST;
+    while (hc->op->usbcmd & XHCI_CMD_HCRST);
+    while (hc->op->usbsts & XHCI_STS_CNR);
+
+    hc->ctx_size = (hc->cap->hccparams1 & XHCI_HCC1_CSZ) ? 64 : 32;
+    hc->n_ports = XHCI_HCS1_MAX_PORTS(hc->cap->hcsparams1);
+
+    u8 n_slots = MIN(XHCI_MAX_SLOTS, XHCI_HCS1_MAX_SLOTS(hc->cap->hcsparams1));
+    hc->op->config = n_slots;
+
+    // device context base address array (entry 0 -> scratchpad buffers)
+    hc->dcbaa = heap_alloc_aligned(&heap_dma, (n_slots + 1) * sizeof(u64), 64);
+    mem_set((u8*)hc->dcbaa, 0, (n_slots + 1) * sizeof(u64));
+
+    u64 n_scratchpads = XHCI_HCS2_MAX_SCRATCH(hc->cap->hcsparams2);
+    if (n_scratchpads > XHCI_MAX_SCRATCHPADS) {
+        log_warn("xHCI controller needs too many scratchpad pages (%u)\n", n_scratchpads);
+        return;
+    }
+
+    if (n_scratchpads) {
+        u64 *scratchpads = heap_alloc_aligned(&heap_dma, n_scratchpads * sizeof(u64), 64);
+
+        for (u64 i = 0; i < n_scratchpads; i++) {
+            u8 *page = heap_alloc_aligned(&heap_dma, PAGE_SIZE, PAGE_SIZE);
+            mem_set(page, 0, PAGE_SIZE);
+            scratchpads[i] = (u64)page;
+        }
+        hc->dcbaa[0] = (u64)scratchpads;
+    }
+
+    hc->op->dcbaap_low = (u64)hc->dcbaa & 0xffffffff;
+    hc->op->dcbaap_high = (u64)hc->dcbaa >> 32;
+
+    // command ring
+    xhci_ring_init(&hc->cmd_ring, XHCI_CMD_RING_SIZE);
+    hc->op->crcr_low = ((u64)hc->cmd_ring.trbs & 0xffffffff) | XHCI_CRCR_RCS;
+    hc->op->crcr_high = (u64)hc->cmd_ring.trbs >> 32;
+
+    // event ring with a single segment (polled, no interrupts)
+    hc->events = heap_alloc_aligned(&heap_dma, XHCI_EVENT_RING_SIZE * sizeof(xhci_trb_t), PAGE_SIZE);
+    mem_set((u8*)hc->events, 0, XHCI_EVENT_RING_SIZE * sizeof(xhci_trb_t));
+    hc->event_dequeue = 0;
+    hc->event_cycle = 1;
+
+    xhci_erst_entry_t *erst = heap_alloc_aligned(&heap_dma, sizeof(xhci_erst_entry_t), 64);
+    erst->addr = (u64)hc->events;
+    erst->size = XHCI_EVENT_RING_SIZE;
+    erst->reserved = 0;
+
+    hc->rt->ir[0].erstsz = 1;
+    hc->rt->ir[0].erdp_low = (u64)hc->events & 0xffffffff;
+    hc->rt->ir[0].erdp_high = (u64)hc->events >> 32;
+    hc->rt->ir[0].erstba_low = (u64)erst & 0xffffffff;
+    hc->rt->ir[0].erstba_high = (u64)erst >> 32;
+
+    // run
+    hc->op->usbcmd |= XHCI_CMD_RS;
+    while (hc->op->usbsts & XHCI_STS_HCH);
+
+    // give the ports some time to detect their devices after the reset
+    for (u64 i = 0; i < XHCI_PORT_SETTLE_WAITS; i++) x86_io_wait();
+
+    log_info("Found xHCI controller (%u ports, %u slots)\n", (u64)hc->n_ports, (u64)n_slots);
+
+    for (u8 n_port = 0; n_port < hc->n_ports; n_port++) xhci_port_init(hc, n_port);
+
+    // nothing else uses it, a running controller would keep writing port events to its event ring
+    if (!hc->n_drives) xhci_halt(hc);
+}
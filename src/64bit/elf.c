@@ -0,0 +1,200 @@
+#include <types.h>
+#include <elf.h>
+#include <vfs.h>
+#include <drive.h>
+#include <verify.h>
+#include <mmap.h>
+#include <layout.h>
+#include <utils.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+// the parts of the file between the segments (headers, sections that are not loaded) are only hashed, through this page
+static u8 elf_gap_buf[PAGE_SIZE];
+
+
+// checks that the file is an x86-64 executable this loader can start
+bool elf_check_header(elf_header_t *header) {
+
+    if (header->magic != ELF_MAGIC) return false;
+    if ((header->class != ELF_CLASS_64) || (header->data != ELF_DATA_LSB)) return false;
+    if ((header->ident_version != ELF_VERSION_CURRENT) || (header->version != ELF_VERSION_CURRENT)) return false;
+    if ((header->type != ELF_TYPE_EXEC) || (header->machine != ELF_MACHINE_X86_64)) return false;
+
+    return header->phentsize == sizeof(elf_phdr_t);
+}
+
+
+// hashes <n_bytes> of a file starting at <offset> without keeping them (nothing to do if it is not verified)
+static void elf_hash_gap(file_t *file, verify_t *verify, u64 offset, u64 n_bytes) {
+
+    if (!verify->entry) return;
+
+    while (n_bytes) {
+        u64 n = vfs_read(file, elf_gap_buf, offset, MIN(PAGE_SIZE, n_bytes));
+        if (n == 0) return;
+
+        verify_update(verify, elf_gap_buf, n);
+
+        offset += n;
+        n_bytes -= n;
+    }
+}
+
+
+// loads segments (and the gaps between them) that are contiguous in the file with one vectored read
+static void elf_load_group(file_t *file, drive_iovec_t *iov, u64 n_iov, u64 offset, verify_t *verify, const char *path) {
+
+    if (n_iov == 0) return;
+
+    if (vfs_load_rawv(file, iov, n_iov, offset, verify) != drive_iov_bytes(iov, n_iov))
+        log_err("%s: could not read the segments at offset %x\n", path, offset);
+}
+
+
+// loads the PT_LOAD segments of an ELF64 executable
+// only the headers are buffered, the segments are read straight from the drive to p_paddr
+// and the rest of every segment (.bss) is cleared
+// all segments are checked against the memory map (and reserved) before anything is written
+// the segments are read in file order, so the whole file is verified as it is loaded (the gaps are only hashed)
+// segments with small gaps between them are read together (see elf_load_group)
+// returns the physical address of the entry point, halts if the file can not be loaded
+u64 elf_load(fs_t *fs, const char *path) {
+
+    file_t file;
+    if (!vfs_open(fs, path, &file)) log_err("Could not find file %s\n", path);
+    if (file.dir) log_err("%s is a directory\n", path);
+
+    verify_t verify;
+    verify_open(&verify, fs, path);
+
+    elf_header_t header;
+    if ((vfs_read(&file, (u8*)&header, 0, sizeof(elf_header_t)) != sizeof(elf_header_t)) || !elf_check_header(&header))
+        log_err("%s is not an x86-64 ELF executable\n", path);
+
+    if ((header.phnum == 0) || (header.phnum > ELF_MAX_PHDRS)) log_err("%s: %u program headers\n", path, (u64)header.phnum);
+
+    elf_phdr_t phdrs[ELF_MAX_PHDRS];
+    u64 n_bytes_phdrs = header.phnum * sizeof(elf_phdr_t);
+
+    if (vfs_read(&file, (u8*)phdrs, header.phoff, n_bytes_phdrs) != n_bytes_phdrs)
+        log_err("%s: truncated program headers\n", path);
+
+    // the loader only identity maps, so the entry point (a virtual address) is moved to its physical one
+    u64 entry = 0;
+    bool found = false;
+
+    // indices of the segments that are loaded, sorted by p_offset
+    u64 order[ELF_MAX_PHDRS];
+    u64 n_segments = 0;
+
+    for (u64 i = 0; i < header.phnum; i++) {
+
+        elf_phdr_t *phdr = &phdrs[i];
+        if ((phdr->type != ELF_PT_LOAD) || (phdr->memsz == 0)) continue;
+
+        if ((phdr->filesz > phdr->memsz) || (phdr->offset > file.size) || (phdr->filesz > file.size - phdr->offset))
+            log_err("%s: segment %u is not within the file\n", path, i);
+
+        // also fails if segments overlap, the ones before have been reserved
+        if (!mmap_is_free(phdr->paddr, phdr->memsz))
+            log_err("%s: segment %u at %x (%x bytes) is not in free memory\n", path, i, phdr->paddr, phdr->memsz);
+
+        mmap_reserve(phdr->paddr, phdr->memsz);
+
+        if ((header.entry >= phdr->vaddr) && (header.entry - phdr->vaddr < phdr->memsz)) {
+            entry = phdr->paddr + (header.entry - phdr->vaddr);
+            found = true;
+        }
+
+        u64 j = n_segments++;
+        for (; (j > 0) && (phdrs[order[j - 1]].offset > phdr->offset); j--) order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    if (!found) log_err("%s: the entry point %x is not in a segment\n", path, header.entry);
+
+    u64 n_bytes_read = 0;
+    u64 n_bytes_zero = 0;
+
+    // bytes of the file that have been hashed (or are in the group)
+    u64 pos = 0;
+
+    // segments that follow each other in the file (small gaps between them go to elf_gap_buf)
+    // are loaded as a group, with one vectored read
+    drive_iovec_t group[VFS_MAX_IOV];
+    u64 n_group = 0;
+    u64 group_offset = 0;
+    u64 n_bytes_gap_buf = 0;
+
+    for (u64 j = 0; j < n_segments; j++) {
+
+        u64 i = order[j];
+        elf_phdr_t *phdr = &phdrs[i];
+        u8 *dest = (u8*)phdr->paddr;
+
+        // a segment that overlaps the one before or is too far from it starts a new group
+        u64 n_bytes_gap = (phdr->offset > pos) ? phdr->offset - pos : 0;
+
+        if ((phdr->offset < pos) || (n_bytes_gap > PAGE_SIZE - n_bytes_gap_buf) || (n_group + 2 > VFS_MAX_IOV)) {
+            elf_load_group(&file, group, n_group, group_offset, &verify, path);
+            n_group = 0;
+            n_bytes_gap_buf = 0;
+        }
+
+        // the start of a segment can share bytes of the file with the one before, they are only hashed once
+        u64 n_shared = (phdr->offset < pos) ? MIN(pos - phdr->offset, phdr->filesz) : 0;
+
+        if (vfs_load_raw(&file, dest, phdr->offset, n_shared, 0) != n_shared)
+            log_err("%s: could not read segment %u\n", path, i);
+
+        if (n_group == 0) {
+            elf_hash_gap(&file, &verify, pos, n_bytes_gap);
+            n_bytes_gap = 0;
+            group_offset = MAX(pos, phdr->offset + n_shared);
+        }
+
+        if (n_bytes_gap) {
+            group[n_group++] = (drive_iovec_t){elf_gap_buf + n_bytes_gap_buf, n_bytes_gap};
+            n_bytes_gap_buf += n_bytes_gap;
+        }
+
+        if (phdr->filesz > n_shared) group[n_group++] = (drive_iovec_t){dest + n_shared, phdr->filesz - n_shared};
+
+        pos = MAX(pos, phdr->offset + phdr->filesz);
+
+        mem_zero(dest + phdr->filesz, phdr->memsz - phdr->filesz);
+
+        n_bytes_read += phdr->filesz;
+        n_bytes_zero += phdr->memsz - phdr->filesz;
+    }
+
+    elf_load_group(&file, group, n_group, group_offset, &verify, path);
+
+    // section headers, symbols, ...
+    elf_hash_gap(&file, &verify, pos, file.size - pos);
+
+    vfs_close(&file);
+    verify_close(&verify, path, file.size);
+
+    log_info("%s: %u segments, %u KiB read, %u KiB cleared, entry at %x\n",
+            path, n_segments, n_bytes_read / 1024, n_bytes_zero / 1024, entry);
+
+    return entry;
+}
+
+
+// jumps to a loaded kernel (see elf.h for the state it gets)
+NORETURN void elf_start(u64 entry) {
+
+    // no controller may keep writing to memory the kernel gets
+    drive_shutdown_all();
+
+    x86_cli();
+
+    ASM("jmp %2" : : "D"(MMAP_ENTRIES), "S"((u64)n_mmap_entries), "r"(entry) : "memory");
+
+    x86_hang();
+}
@@ -0,0 +1,206 @@
+#include <types.h>
+#include <dcache.h>
+#include <mmap.h>
+#include <heap.h>
+#include <utils.h>
+#include <layout.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+
+
+dcache_t dcache = {0};
+
+
+// reserves memory above 1 MiB for the dentry cache and puts all entries on the LRU list
+// the cache stays disabled (n_entries = 0) if there is not enough memory
+void dcache_init(void) {
+
+    u64 n_entries = DCACHE_N_ENTRIES;
+    u64 n_buckets = n_entries;
+    u64 hash_bits = 0;
+    while ((1ULL << hash_bits) < n_buckets) hash_bits++;
+
+    u64 n_bytes = n_entries * sizeof(dentry_t) + n_buckets * sizeof(dentry_t*) + PAGE_SIZE;
+
+    u8 *mem = mmap_reserve_high(n_bytes, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!mem) {
+        log_warn("Not enough memory for the dentry cache\n");
+        return;
+    }
+
+    heap_t heap_dcache = {n_bytes, n_bytes, 0, mem};
+    dcache.entries = heap_alloc_aligned(&heap_dcache, n_entries * sizeof(dentry_t), sizeof(u64));
+    dcache.buckets = heap_alloc_aligned(&heap_dcache, n_buckets * sizeof(dentry_t*), sizeof(u64));
+    dcache.hash_shift = 64 - hash_bits;
+
+    mem_set((u8*)dcache.buckets, 0, n_buckets * sizeof(dentry_t*));
+
+    for (u64 i = 0; i < n_entries; i++) {
+        dentry_t *dentry = &dcache.entries[i];
+        dentry->fs = 0;
+        dentry->hash_next = 0;
+        dentry->lru_prev = (i > 0) ? &dcache.entries[i - 1] : 0;
+        dentry->lru_next = (i < n_entries - 1) ? &dcache.entries[i + 1] : 0;
+    }
+    dcache.lru_head = &dcache.entries[0];
+    dcache.lru_tail = &dcache.entries[n_entries - 1];
+    dcache.n_entries = n_entries;
+
+    log_info("Dentry cache: %u entries (%u KiB)\n", n_entries, n_bytes / 1024);
+}
+
+
+// copies <len> bytes of a UTF-8 name to <dest> in the form used as key (null terminated)
+// folds ASCII and Latin-1 letters to upper case (in place if <dest> is <name>)
+// returns the length or 0 if the name is empty or too long
+u64 dcache_normalise(char *dest, const char *name, u64 len) {
+
+    if ((len == 0) || (len > DCACHE_NAME_MAX)) return 0;
+
+    for (u64 i = 0; i < len; i++) {
+        u8 c = name[i];
+
+        // U+00E0 - U+00FE (without U+00F7) -> U+00C0 - U+00DE, encoded as 0xc3 0xa0 - 0xc3 0xbe
+        if ((c >= 0xa0) && (c <= 0xbe) && (c != 0xb7) && (i > 0) && ((u8)name[i - 1] == 0xc3)) c -= 0x20;
+        else if ((c >= 'a') && (c <= 'z')) c -= 'a' - 'A';
+
+        dest[i] = c;
+    }
+    dest[len] = 0;
+
+    return len;
+}
+
+
+// FNV-1a of a normalised name mixed with the directory and the filesystem
+// callers compute it once per name and compare hashes before names
+u64 dcache_hash(void *fs, u64 parent, const char *name) {
+
+    u64 hash = 0xcbf29ce484222325;
+    for (u64 i = 0; name[i]; i++) {
+        hash ^= (u8)name[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash ^ (parent * 0x9e3779b97f4a7c15) ^ ((u64)fs << 16);
+}
+
+
+// returns the hash chain of <hash>
+dentry_t **dcache_bucket(u64 hash) {
+
+    // with a single bucket the shift would be 64
+    if (dcache.hash_shift == 64) return &dcache.buckets[0];
+
+    return &dcache.buckets[(hash * 0x9e3779b97f4a7c15) >> dcache.hash_shift];
+}
+
+
+// returns the entry of a normalised name (hashed with dcache_hash) in directory <parent> or 0
+// negative entries are returned as well (the name is known to be missing)
+dentry_t *dcache_lookup(void *fs, u64 parent, const char *name, u64 hash) {
+
+    if (dcache.n_entries == 0) return 0;
+
+    for (dentry_t *dentry = *dcache_bucket(hash); dentry; dentry = dentry->hash_next) {
+        if ((dentry->hash != hash) || (dentry->fs != fs) || (dentry->parent != parent)) continue;
+
+        u64 i = 0;
+        while (name[i] && (name[i] == dentry->name[i])) i++;
+        if (name[i] != dentry->name[i]) continue;
+
+        if (dentry->negative) dcache.stats.negative_hits++;
+        else dcache.stats.hits++;
+
+        dcache_touch(dentry);
+        return dentry;
+    }
+
+    dcache.stats.misses++;
+    return 0;
+}
+
+
+// moves an entry to the head of the LRU list
+void dcache_touch(dentry_t *dentry) {
+
+    if (dentry == dcache.lru_head) return;
+
+    // unlink
+    dentry->lru_prev->lru_next = dentry->lru_next;
+    if (dentry->lru_next) dentry->lru_next->lru_prev = dentry->lru_prev;
+    else dcache.lru_tail = dentry->lru_prev;
+
+    // insert at the head
+    dentry->lru_prev = 0;
+    dentry->lru_next = dcache.lru_head;
+    dcache.lru_head->lru_prev = dentry;
+    dcache.lru_head = dentry;
+}
+
+
+// adds (or updates) the entry of a normalised name (hashed with dcache_hash)
+// the least recently used entry is replaced
+// returns 0 if the cache is disabled
+dentry_t *dcache_insert(void *fs, u64 parent, const char *name, u64 hash, bool negative, u64 cluster, u64 size, u8 attr) {
+
+    if (dcache.n_entries == 0) return 0;
+
+    dentry_t **bucket = dcache_bucket(hash);
+
+    // already known (e.g. a directory that is scanned again)
+    dentry_t *dentry = 0;
+    for (dentry_t *cur = *bucket; cur; cur = cur->hash_next) {
+        if ((cur->hash != hash) || (cur->fs != fs) || (cur->parent != parent)) continue;
+
+        u64 i = 0;
+        while (name[i] && (name[i] == cur->name[i])) i++;
+        if (name[i] == cur->name[i]) {
+            dentry = cur;
+            break;
+        }
+    }
+
+    if (!dentry) {
+        dentry = dcache.lru_tail;
+
+        // unlink the old entry from its hash chain
+        if (dentry->fs) {
+            dentry_t **prev = dcache_bucket(dentry->hash);
+            while (*prev != dentry) prev = &(*prev)->hash_next;
+            *prev = dentry->hash_next;
+
+            dcache.stats.evictions++;
+        }
+
+        dentry->fs = fs;
+        dentry->parent = parent;
+        dentry->hash = hash;
+
+        u64 i = 0;
+        for (; name[i]; i++) dentry->name[i] = name[i];
+        dentry->name[i] = 0;
+
+        dentry->hash_next = *bucket;
+        *bucket = dentry;
+    }
+
+    dentry->negative = negative;
+    dentry->cluster = cluster;
+    dentry->size = size;
+    dentry->attr = attr;
+
+    dcache_touch(dentry);
+    return dentry;
+}
+
+
+// prints the counters of the dentry cache
+void dcache_print_stats(void) {
+    log_info("Dentry cache: %u hits, %u negative hits, %u misses, %u evictions\n",
+            dcache.stats.hits,
+            dcache.stats.negative_hits,
+            dcache.stats.misses,
+            dcache.stats.evictions);
+}
@@ -0,0 +1,575 @@
+#include <types.h>
+#include <drive.h>
+#include <ext4.h>
+#include <cache.h>
+#include <mmap.h>
+#include <heap.h>
+#include <layout.h>
+#include <vfs.h>
+#include <dcache.h>
+#include <utils.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+static u8 ext4_sb_buf[EXT4_SB_SIZE];
+
+
+// creates and initializes an ext2/3/4 filesystem on a partition
+// the struct is allocated on <heap_filesystems>, its buffers above 1 MiB
+// returns 0 if the partition does not contain ext2/3/4 (or uses features that can not be read)
+ext4_t *ext4_mount(part_t *part) {
+
+    u64 n_secs_sb = EXT4_SB_SIZE / 512;
+    if (cache_read(part->drive, ext4_sb_buf, part->lba_start + EXT4_SB_OFFSET / 512, n_secs_sb) != EXT4_SB_SIZE) return 0;
+
+    ext4_superblock_t *sb = (ext4_superblock_t*)ext4_sb_buf;
+
+    if (sb->magic != EXT4_MAGIC) return 0;
+    if (sb->log_block_size > EXT4_MAX_BLOCK_LOG - EXT4_MIN_BLOCK_LOG) return 0;
+    if ((sb->blocks_per_group == 0) || (sb->inodes_per_group == 0)) return 0;
+
+    if (sb->feature_incompat & ~EXT4_INCOMPAT_SUPPORTED) {
+        log_warn("ext4: unsupported features %x, ignoring partition %u\n",
+                (u64)(sb->feature_incompat & ~EXT4_INCOMPAT_SUPPORTED), part->index);
+        return 0;
+    }
+
+    u64 block_size = 1024 << sb->log_block_size;
+
+    // inodes and descriptors have power of 2 sizes, so they never cross a sector
+    u64 inode_size = (sb->rev_level == 0) ? EXT4_GOOD_OLD_INODE_SIZE : sb->inode_size;
+    u64 desc_size = (sb->feature_incompat & EXT4_INCOMPAT_64BIT) ? sb->desc_size : EXT4_GOOD_OLD_DESC_SIZE;
+
+    if ((inode_size < EXT4_GOOD_OLD_INODE_SIZE) || (inode_size > block_size) || (inode_size & (inode_size - 1))) return 0;
+    if ((desc_size < EXT4_GOOD_OLD_DESC_SIZE) || (desc_size > 512) || (desc_size & (desc_size - 1))) return 0;
+
+    // superblock and a sector for partial reads, extent tree node and directory block
+    u64 n_bytes_buf = MAX(block_size, PAGE_SIZE);
+    u64 n_bytes = PAGE_SIZE + 2 * n_bytes_buf;
+
+    u8 *mem = mmap_reserve_high(n_bytes, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!mem) {
+        log_warn("ext4: not enough memory for the buffers\n");
+        return 0;
+    }
+
+    ext4_t *fs = heap_alloc(&heap_filesystems, sizeof(ext4_t));
+    fs->base.drive = part->drive;
+    fs->base.partition = part;
+    fs->base.init = ext4_init;
+    fs->base.type = FS_EXT4;
+    fs->base.read_file = ext4_load_file;
+    fs->base.open = ext4_open;
+    fs->base.read = ext4_read;
+    fs->base.map = ext4_map_offset;
+
+    fs->sb = (ext4_superblock_t*)mem;
+    fs->sector = mem + EXT4_SB_SIZE;
+    fs->node = mem + PAGE_SIZE;
+    fs->cache_dir = fs->node + n_bytes_buf;
+
+    fs->inode_size = inode_size;
+    fs->desc_size = desc_size;
+
+    ext4_init(fs);
+
+    return fs;
+}
+
+
+// initializes an ext2/3/4 filesystem
+void ext4_init(void *self) {
+
+    ext4_t *fs = (ext4_t*)self;
+
+    // load the superblock
+    cache_read(
+            fs->base.drive,
+            (u8*)fs->sb,
+            fs->base.partition->lba_start + EXT4_SB_OFFSET / 512,
+            EXT4_SB_SIZE / 512);
+
+    ext4_superblock_t *sb = fs->sb;
+
+    fs->block_size = 1024 << sb->log_block_size;
+    fs->secs_per_block = fs->block_size / 512;
+    fs->descs_per_block = fs->block_size / fs->desc_size;
+    fs->n_blocks_loaded = 0;
+    fs->n_reads = 0;
+
+    fs->n_blocks = sb->n_blocks_lo;
+    if (sb->feature_incompat & EXT4_INCOMPAT_64BIT) fs->n_blocks = QWORD(sb->n_blocks_hi, sb->n_blocks_lo);
+
+    fs->n_groups = (fs->n_blocks - sb->first_data_block + sb->blocks_per_group - 1) / sb->blocks_per_group;
+
+    // reading is still possible, but the latest changes might only be in the journal
+    if (sb->feature_incompat & EXT4_INCOMPAT_RECOVER)
+        log_warn("ext4: the journal needs recovery, recent changes may be missing\n");
+
+    log_info("ext4: %u MiB, %u KiB blocks, %u groups%s\n",
+            fs->n_blocks * fs->block_size / 0x100000,
+            fs->block_size / 1024,
+            fs->n_groups,
+            (sb->feature_incompat & EXT4_INCOMPAT_EXTENTS) ? ", extents" : "");
+}
+
+
+// returns the first sector of a filesystem block
+u64 ext4_lba(ext4_t *self, u64 block) {
+    return self->base.partition->lba_start + block * self->secs_per_block;
+}
+
+
+// returns true if a block group starts with a copy of the superblock (and the group descriptors)
+bool ext4_group_has_super(ext4_t *self, u64 group) {
+
+    ext4_superblock_t *sb = self->sb;
+
+    if (group == 0) return true;
+
+    if (sb->feature_compat & EXT4_COMPAT_SPARSE_SUPER2)
+        return (group == sb->backup_bgs[0]) || (group == sb->backup_bgs[1]);
+
+    if ((group == 1) || !(sb->feature_ro_compat & EXT4_RO_COMPAT_SPARSE_SUPER)) return true;
+
+    // sparse_super: only powers of 3, 5 and 7
+    if (!(group & 1)) return false;
+
+    for (u64 base = 3; base <= 7; base += 2) {
+        u64 power = base;
+        while (power < group) power *= base;
+        if (power == group) return true;
+    }
+
+    return false;
+}
+
+
+// returns the block that holds block <n_desc_block> of the group descriptor table
+u64 ext4_desc_block(ext4_t *self, u64 n_desc_block) {
+
+    ext4_superblock_t *sb = self->sb;
+
+    // the table follows the superblock
+    if (!(sb->feature_incompat & EXT4_INCOMPAT_META_BG) || (n_desc_block < sb->first_meta_bg))
+        return sb->first_data_block + 1 + n_desc_block;
+
+    // meta_bg: every meta group (a block of descriptors) keeps its descriptors in its first group
+    u64 group = n_desc_block * self->descs_per_block;
+
+    return sb->first_data_block + group * sb->blocks_per_group + ext4_group_has_super(self, group);
+}
+
+
+// returns the first block of the inode table of a group
+// with flex_bg the tables of several groups are packed together, so the descriptor is the only source
+u64 ext4_inode_table(ext4_t *self, u64 group) {
+
+    u64 off = (group % self->descs_per_block) * self->desc_size;
+    u64 lba = ext4_lba(self, ext4_desc_block(self, group / self->descs_per_block)) + off / 512;
+
+    // descriptors go through the block cache
+    cache_read(self->base.drive, self->sector, lba, 1);
+    ext4_group_desc_t *desc = (ext4_group_desc_t*)(self->sector + off % 512);
+
+    if (self->desc_size < sizeof(ext4_group_desc_t)) return desc->inode_table_lo;
+
+    return QWORD(desc->inode_table_hi, desc->inode_table_lo);
+}
+
+
+// reads the first EXT4_GOOD_OLD_INODE_SIZE bytes of an inode
+// returns false if the inode number is not valid
+bool ext4_read_inode(ext4_t *self, u64 ino, ext4_inode_t *inode) {
+
+    ext4_superblock_t *sb = self->sb;
+
+    if ((ino == 0) || (ino > sb->n_inodes)) return false;
+
+    u64 group = (ino - 1) / sb->inodes_per_group;
+    u64 off = ((ino - 1) % sb->inodes_per_group) * self->inode_size;
+
+    if (group >= self->n_groups) return false;
+
+    cache_read(self->base.drive, self->sector, ext4_lba(self, ext4_inode_table(self, group)) + off / 512, 1);
+    mem_cpy((u8*)inode, self->sector + off % 512, sizeof(ext4_inode_t));
+
+    return true;
+}
+
+
+// returns the number of consecutive pointers from <index> on that point to consecutive blocks (or are all 0)
+// <block> is set to the first one
+u64 ext4_map_run(u32 *ptrs, u64 n_ptrs, u64 index, u64 *block) {
+
+    u64 n_blocks = 1;
+    *block = ptrs[index];
+
+    if (*block == 0) {
+        while ((index + n_blocks < n_ptrs) && (ptrs[index + n_blocks] == 0)) n_blocks++;
+        return n_blocks;
+    }
+
+    while ((index + n_blocks < n_ptrs) && (ptrs[index + n_blocks] == *block + n_blocks)) n_blocks++;
+
+    return n_blocks;
+}
+
+
+// maps a file block through the direct and (single, double, triple) indirect pointers of an inode (ext2/3)
+// <block> is set to the first block of the run (0 -> hole)
+// returns the number of contiguous blocks from <file_block> on (0 -> not mapped)
+u64 ext4_map_indirect(ext4_t *self, ext4_inode_t *inode, u64 file_block, u64 *block) {
+
+    if (file_block < EXT4_N_DIRECT) return ext4_map_run(inode->block, EXT4_N_DIRECT, file_block, block);
+
+    u64 n_ptrs = self->block_size / sizeof(u32);
+    file_block -= EXT4_N_DIRECT;
+
+    // find the tree that covers the block (<span> blocks, <n_levels> deep)
+    u64 n_levels = 1;
+    u64 span = n_ptrs;
+
+    while (file_block >= span) {
+        file_block -= span;
+        span *= n_ptrs;
+        if (++n_levels > 3) return 0;
+    }
+
+    u32 ptr = inode->block[EXT4_N_DIRECT + n_levels - 1];
+
+    while (true) {
+
+        // a missing indirect block is a hole for everything below it
+        if (ptr == 0) {
+            *block = 0;
+            return span - file_block;
+        }
+
+        cache_read(self->base.drive, self->node, ext4_lba(self, ptr), self->secs_per_block);
+
+        span /= n_ptrs;
+        u64 index = file_block / span;
+        file_block %= span;
+
+        if (span == 1) return ext4_map_run((u32*)self->node, n_ptrs, index, block);
+
+        ptr = ((u32*)self->node)[index];
+    }
+}
+
+
+// maps a file block through the extent tree of an inode (ext4)
+// <block> is set to the first block of the extent (0 -> hole or unwritten extent)
+// returns the number of contiguous blocks from <file_block> on (0 -> broken tree)
+u64 ext4_map_extents(ext4_t *self, ext4_inode_t *inode, u64 file_block, u64 *block) {
+
+    ext4_extent_header_t *header = (ext4_extent_header_t*)inode->block;
+    u64 max_entries = (sizeof(inode->block) - sizeof(ext4_extent_header_t)) / sizeof(ext4_extent_t);
+
+    // holes end at the next entry (or never after the last one)
+    u64 n_blocks = U64_MAX;
+    *block = 0;
+
+    for (u64 level = 0; level <= EXT4_EXT_MAX_DEPTH; level++) {
+
+        if ((header->magic != EXT4_EXT_MAGIC) || (header->n_entries > max_entries) || (header->depth > EXT4_EXT_MAX_DEPTH)) break;
+
+        u64 n_entries = header->n_entries;
+
+        if (header->depth == 0) {
+
+            // the last extent that starts at or before the block
+            ext4_extent_t *extents = (ext4_extent_t*)(header + 1);
+
+            u64 i = 0;
+            while ((i < n_entries) && (extents[i].block <= file_block)) i++;
+
+            if (i < n_entries) n_blocks = MIN(n_blocks, extents[i].block - file_block);
+            if (i == 0) return n_blocks;
+
+            ext4_extent_t *extent = &extents[i - 1];
+            u64 len = extent->len;
+            bool unwritten = len > EXT4_EXT_INIT_MAX_LEN;
+            if (unwritten) len -= EXT4_EXT_INIT_MAX_LEN;
+
+            u64 skip = file_block - extent->block;
+            if (skip >= len) return n_blocks;
+
+            // unwritten extents are allocated, but read as zeros
+            if (!unwritten) *block = QWORD(extent->start_hi, extent->start_lo) + skip;
+            return len - skip;
+        }
+
+        // the last child that starts at or before the block
+        ext4_extent_idx_t *indices = (ext4_extent_idx_t*)(header + 1);
+
+        u64 i = 0;
+        while ((i < n_entries) && (indices[i].block <= file_block)) i++;
+
+        if (i < n_entries) n_blocks = MIN(n_blocks, indices[i].block - file_block);
+        if (i == 0) return n_blocks;
+
+        u64 depth = header->depth;
+        cache_read(self->base.drive, self->node, ext4_lba(self, QWORD(indices[i - 1].leaf_hi, indices[i - 1].leaf_lo)),
+                self->secs_per_block);
+
+        header = (ext4_extent_header_t*)self->node;
+        max_entries = (self->block_size - sizeof(ext4_extent_header_t)) / sizeof(ext4_extent_t);
+
+        if (header->depth != depth - 1) break;
+    }
+
+    log_warn("ext4: broken extent tree\n");
+    return 0;
+}
+
+
+// maps a block of an open file, starting at the cached mapping of the file if it covers the block
+// <block> is set to the first block of the run (0 -> hole)
+// returns the number of contiguous blocks from <file_block> on (0 -> not mapped)
+u64 ext4_map(ext4_t *self, file_t *file, u64 file_block, u64 *block) {
+
+    if ((file_block >= file->pos_index) && (file_block - file->pos_index < file->pos_n)) {
+        u64 skip = file_block - file->pos_index;
+
+        *block = file->pos_cluster ? file->pos_cluster + skip : 0;
+        return file->pos_n - skip;
+    }
+
+    ext4_inode_t inode;
+    if (!ext4_read_inode(self, file->first, &inode)) return 0;
+
+    u64 n_blocks;
+    if (inode.flags & EXT4_EXTENTS_FL) n_blocks = ext4_map_extents(self, &inode, file_block, block);
+    else n_blocks = ext4_map_indirect(self, &inode, file_block, block);
+
+    file->pos_index = file_block;
+    file->pos_cluster = *block;
+    file->pos_n = n_blocks;
+
+    return n_blocks;
+}
+
+
+// scans an entire directory for a name with hash <hash> (dcache_hash)
+// names are case sensitive, so they are not normalised
+// every entry on the way is put into the dentry cache (inode number as the cluster, file type as the attributes)
+// returns true if the name has been found (copied to <found>)
+bool ext4_scan_dir(ext4_t *self, u64 dir, const char *name, u64 hash, dentry_t *found) {
+
+    char entry_name[DCACHE_NAME_MAX + 1];
+    file_t file;
+
+    if (!ext4_open_inode(self, dir, &file)) return false;
+
+    bool match = false;
+
+    for (u64 offset = 0; offset < file.size; offset += self->block_size) {
+
+        u64 n_bytes = ext4_read(self, &file, self->cache_dir, offset, MIN(self->block_size, file.size - offset));
+        if (n_bytes == 0) break;
+
+        u64 pos = 0;
+
+        while (pos + EXT4_DIRENT_HEADER <= n_bytes) {
+
+            ext4_dirent_t *dirent = (ext4_dirent_t*)(self->cache_dir + pos);
+
+            // 64 KiB blocks store a record length of 65536 as 0 or 65535
+            u64 rec_len = dirent->rec_len;
+            if ((rec_len == 0) || (rec_len == U16_MAX)) rec_len = 0x10000;
+
+            // a broken entry ends the block
+            if ((rec_len < EXT4_DIRENT_HEADER) || (pos + rec_len > n_bytes)) break;
+            pos += rec_len;
+
+            // unused entries (and the checksum tail of a block)
+            u64 name_len = dirent->name_len;
+            if ((dirent->inode == 0) || (name_len == 0) || (EXT4_DIRENT_HEADER + name_len > rec_len)) continue;
+
+            mem_cpy((u8*)entry_name, (u8*)dirent->name, name_len);
+            entry_name[name_len] = 0;
+
+            u64 entry_hash = dcache_hash(self, dir, entry_name);
+            dcache_insert(self, dir, entry_name, entry_hash, false, dirent->inode, 0, dirent->file_type);
+
+            if (match || (entry_hash != hash)) continue;
+
+            u64 k = 0;
+            while (name[k] && (name[k] == entry_name[k])) k++;
+            if (name[k] != entry_name[k]) continue;
+
+            match = true;
+            found->cluster = dirent->inode;
+            found->size = 0;
+            found->attr = dirent->file_type;
+        }
+    }
+
+    return match;
+}
+
+
+// looks up a name in a directory, through the dentry cache
+// missing names are remembered as negative entries
+// returns true if the name has been found (copied to <found>)
+bool ext4_lookup(ext4_t *self, u64 dir, const char *name, dentry_t *found) {
+
+    u64 hash = dcache_hash(self, dir, name);
+    dentry_t *dentry = dcache_lookup(self, dir, name, hash);
+
+    if (dentry) {
+        if (dentry->negative) return false;
+
+        found->cluster = dentry->cluster;
+        found->size = dentry->size;
+        found->attr = dentry->attr;
+        return true;
+    }
+
+    if (ext4_scan_dir(self, dir, name, hash, found)) return true;
+
+    dcache_insert(self, dir, name, hash, true, 0, 0, 0);
+    return false;
+}
+
+
+// follows an absolute path from the root directory
+// <ino> is set to the inode of the last part
+// returns false if any part of it does not exist
+bool ext4_resolve(ext4_t *self, const char *path, u64 *ino) {
+
+    char name[DCACHE_NAME_MAX + 1];
+    ext4_inode_t inode;
+    dentry_t found;
+
+    *ino = EXT4_ROOT_INODE;
+
+    while (true) {
+
+        // skip separators
+        while (*path == '/') path++;
+        if (*path == 0) return true;
+
+        if (!ext4_read_inode(self, *ino, &inode)) return false;
+        if ((inode.mode & EXT4_S_IFMT) != EXT4_S_IFDIR) return false;
+
+        u64 len = 0;
+        while (path[len] && (path[len] != '/')) len++;
+        if (len > DCACHE_NAME_MAX) return false;
+
+        mem_cpy((u8*)name, (u8*)path, len);
+        name[len] = 0;
+
+        if (!ext4_lookup(self, *ino, name, &found)) return false;
+
+        *ino = found.cluster;
+        path += len;
+    }
+}
+
+
+// opens a file or directory by its inode number
+bool ext4_open_inode(ext4_t *self, u64 ino, file_t *file) {
+
+    ext4_inode_t inode;
+    if (!ext4_read_inode(self, ino, &inode)) return false;
+
+    // small files can be stored in the inode itself (not supported)
+    if (inode.flags & EXT4_INLINE_DATA_FL) {
+        log_warn("ext4: inode %u has inline data\n", ino);
+        return false;
+    }
+
+    file->size = QWORD(inode.size_hi, inode.size_lo);
+    file->dir = (inode.mode & EXT4_S_IFMT) == EXT4_S_IFDIR;
+    file->first = ino;
+    file->pos_index = 0;
+    file->pos_cluster = 0;
+    file->pos_n = 0;
+
+    return true;
+}
+
+
+// opens a file or directory (fs_t.open)
+bool ext4_open(void *self, const char *path, file_t *file) {
+
+    u64 ino;
+    if (!ext4_resolve((ext4_t*)self, path, &ino)) return false;
+
+    return ext4_open_inode((ext4_t*)self, ino, file);
+}
+
+
+// reads a part of an open file (fs_t.read, offset and n_bytes are within the file)
+// every extent (or run of contiguous blocks) is a single read, holes are filled with zeros
+u64 ext4_read(void *self, file_t *file, u8 *dest, u64 offset, u64 n_bytes) {
+
+    ext4_t *fs = (ext4_t*)self;
+    u64 n_read = 0;
+
+    while (n_read < n_bytes) {
+
+        u64 file_block = (offset + n_read) / fs->block_size;
+        u64 off = (offset + n_read) % fs->block_size;
+        u64 n_blocks_left = (off + (n_bytes - n_read) + fs->block_size - 1) / fs->block_size;
+
+        u64 block;
+        u64 n_blocks = MIN(ext4_map(fs, file, file_block, &block), n_blocks_left);
+        if (n_blocks == 0) break;
+
+        u64 n = MIN(n_blocks * fs->block_size - off, n_bytes - n_read);
+
+        if (block) {
+            vfs_read_bytes(fs->base.drive, fs->sector, dest + n_read, ext4_lba(fs, block), off, n);
+            fs->n_blocks_loaded += n_blocks;
+            fs->n_reads++;
+        } else {
+            mem_set(dest + n_read, 0, n);
+        }
+
+        n_read += n;
+    }
+
+    return n_read;
+}
+
+
+// returns the extent of an open file that starts at <offset> (fs_t.map)
+// <lba> is set to the sector of the offset (0 -> hole)
+u64 ext4_map_offset(void *self, file_t *file, u64 offset, u64 *lba) {
+
+    ext4_t *fs = (ext4_t*)self;
+
+    u64 block;
+    u64 n_blocks = ext4_map(fs, file, offset / fs->block_size, &block);
+    if (n_blocks == 0) return 0;
+
+    // holes after the last extent never end
+    n_blocks = MIN(n_blocks, U64_MAX / fs->block_size);
+
+    u64 off = offset % fs->block_size;
+    *lba = block ? ext4_lba(fs, block) + off / 512 : 0;
+
+    return n_blocks * fs->block_size - off;
+}
+
+
+// loads a file into <buf> (<n_blocks> at most)
+// returns the filesize
+u64 ext4_load_file(void *self, const char *path, u8 *buf, u64 n_blocks) {
+
+    ext4_t *fs = (ext4_t*)self;
+    file_t file;
+
+    if (!ext4_open(fs, path, &file)) log_err("Could not find file %s\n", path);
+    if (file.dir) log_err("%s is a directory\n", path);
+
+    ext4_read(fs, &file, buf, 0, MIN(file.size, n_blocks * fs->block_size));
+
+    return file.size;
+}
@@ -1,208 +1,643 @@
 #include <types.h>
 #include <drive.h>
 #include <fat32.h>
+#include <cache.h>
+#include <mmap.h>
+#include <heap.h>
+#include <layout.h>
 #include <vfs.h>
+#include <dcache.h>
+#include <utils.h>
 #include <tty.h>
 #include <log.h>
 #include <x86.h>
 
 
+static u8 fat32_vbr[512];
+
+
+// creates and initializes a FAT32 filesystem on a partition
+// the struct is allocated on <heap_filesystems>, its buffers above 1 MiB
+// returns 0 if the partition does not contain FAT32
+fat32_t *fat32_mount(part_t *part) {
+
+    if (cache_read(part->drive, fat32_vbr, part->lba_start, 1) != 512) return 0;
+
+    bpb_t *bpb = (bpb_t*)fat32_vbr;
+    u8 secs_per_cluster = bpb->secs_per_cluster;
+
+    if (*(u16*)(fat32_vbr + MBR_SIGNATURE_OFFSET) != MBR_SIGNATURE) return 0;
+    if ((bpb->bytes_per_sector != 512) || (bpb->n_fats == 0)) return 0;
+    if ((secs_per_cluster == 0) || (secs_per_cluster & (secs_per_cluster - 1))) return 0;
+
+    // FAT12/16 have a fixed root directory and no FAT32 extension
+    if ((bpb->n_root_entries != 0) || (bpb->fat32_secs_per_fat == 0)) return 0;
+
+    // VBR and a sector for partial reads, root directory and current directory
+    // (the FAT cache is allocated by fat32_fat_init)
+    u64 n_bytes_buf = MAX(secs_per_cluster * 512, PAGE_SIZE);
+    u64 n_bytes = PAGE_SIZE + 2 * n_bytes_buf;
+
+    u8 *mem = mmap_reserve_high(n_bytes, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!mem) {
+        log_warn("FAT32: not enough memory for the buffers\n");
+        return 0;
+    }
+
+    fat32_t *fs = heap_alloc(&heap_filesystems, sizeof(fat32_t));
+    fs->base.drive = part->drive;
+    fs->base.partition = part;
+    fs->base.init = fat32_init;
+    fs->base.type = FS_FAT32;
+    fs->base.read_file = fat32_load_file;
+    fs->base.open = fat32_open;
+    fs->base.read = fat32_read;
+    fs->base.map = fat32_map;
+
+    fs->bpb = (bpb_t*)mem;
+    fs->sector = mem + 512;
+    fs->cache_root = mem + PAGE_SIZE;
+    fs->cache_dir = fs->cache_root + n_bytes_buf;
+
+    fat32_init(fs);
+
+    return fs;
+}
+
+
 // initializes a FAT32 filesystem
 void fat32_init(void *self) {
 
     fat32_t *fs = (fat32_t*)self;
 
     // load the vbr
-    fs->base.drive->read(
-            fs->base.drive, 
-            (u8*)fs->bpb, 
+    cache_read(
+            fs->base.drive,
+            (u8*)fs->bpb,
             fs->base.partition->lba_start, 
             1);
 
-    fs->lba_fat = fs->bpb->lba_partition + fs->bpb->n_reserved_secs;
+    // the hidden sectors in the BPB are not reliable on GPT drives
+    fs->lba_fat = fs->base.partition->lba_start + fs->bpb->n_reserved_secs;
     fs->lba_data = fs->lba_fat + fs->bpb->n_fats * fs->bpb->fat32_secs_per_fat;
     fs->cluster_root = fs->bpb->cluster_root;
     fs->secs_per_fat = fs->bpb->fat32_secs_per_fat;
     fs->secs_per_cluster = fs->bpb->secs_per_cluster;
-    fs->cur_fat_loaded = -1;    // none
+    fs->n_clusters_loaded = 0;
+    fs->n_reads = 0;
+
+    // without mirroring only the active FAT is valid
+    if (fs->bpb->flags & FAT32_FLAGS_NO_MIRROR)
+        fs->lba_fat += FAT32_FLAGS_ACTIVE(fs->bpb->flags) * fs->secs_per_fat;
+
+    fat32_fat_init(fs);
 
     // load root directory
     fat32_load_cluster(fs, fs->cache_root, fs->cluster_root);
 }
 
 
-// loads a FAT cluster into memory
+// sets up the FAT cache
+// the entire FAT is loaded with a single (large) read if it fits, windows are loaded on demand otherwise
+void fat32_fat_init(fat32_t *self) {
+
+    bpb_t *bpb = self->bpb;
+
+    // only the part of the FAT that describes existing clusters is needed
+    u64 n_secs_fs = bpb->fat12_n_secs ? bpb->fat12_n_secs : bpb->fat12_n_secs_large;
+    u64 n_secs_data = n_secs_fs - (self->lba_data - self->base.partition->lba_start);
+
+    self->n_clusters = MIN(n_secs_data / self->secs_per_cluster + 2, self->secs_per_fat * 512 / sizeof(u32));
+    self->secs_fat = (self->n_clusters * sizeof(u32) + 511) / 512;
+    self->fat = 0;
+
+    u64 n_bytes = self->secs_fat * 512;
+
+    if (n_bytes <= mmap_usable_bytes() / FAT32_FAT_MEM_DIV)
+        self->fat = mmap_reserve_high(n_bytes, PAGE_SIZE, MMAP_MAX_ADDR);
+
+    if (self->fat) {
+        if (self->base.drive->read(self->base.drive, (u8*)self->fat, self->lba_fat, self->secs_fat) == n_bytes) {
+            log_info("FAT32: cached the entire FAT (%u KiB)\n", n_bytes / 1024);
+            return;
+        }
+
+        log_warn("FAT32: reading the FAT failed, using windows\n");
+        self->fat = 0;
+    }
+
+    // windows of whole clusters, read with a single command each
+    u64 n_secs_max = MIN(FAT32_WINDOW_MAX_SECS, MAX(self->base.drive->max_secs, self->secs_per_cluster));
+    self->secs_per_window = MIN(n_secs_max - n_secs_max % self->secs_per_cluster, self->secs_fat);
+    self->n_window_uses = 0;
+
+    u8 *mem = mmap_reserve_high(FAT32_N_WINDOWS * self->secs_per_window * 512, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!mem) log_err("FAT32: not enough memory for the FAT cache\n");
+
+    for (u64 i = 0; i < FAT32_N_WINDOWS; i++) {
+        self->windows[i].entries = (u32*)(mem + i * self->secs_per_window * 512);
+        self->windows[i].last_use = 0;
+    }
+
+    log_info("FAT32: caching the FAT in %u windows of %u KiB\n",
+            (u64)FAT32_N_WINDOWS, self->secs_per_window / 2);
+}
+
+
+// returns the entries of FAT window <index>, loads it in place of the least recently used one if necessary
+u32 *fat32_fat_window(fat32_t *self, u64 index) {
+
+    fat32_window_t *lru = &self->windows[0];
+
+    for (u64 i = 0; i < FAT32_N_WINDOWS; i++) {
+        fat32_window_t *window = &self->windows[i];
+
+        if (window->last_use && (window->index == index)) {
+            window->last_use = ++self->n_window_uses;
+            return window->entries;
+        }
+
+        if (window->last_use < lru->last_use) lru = window;
+    }
+
+    // the last window may be shorter
+    u64 lba = index * self->secs_per_window;
+    u64 n_secs = MIN(self->secs_per_window, self->secs_fat - lba);
+
+    self->base.drive->read(self->base.drive, (u8*)lru->entries, self->lba_fat + lba, n_secs);
+
+    lru->index = index;
+    lru->last_use = ++self->n_window_uses;
+
+    return lru->entries;
+}
+
+
+// loads a FAT cluster into memory (through the block cache, used for directories)
 void fat32_load_cluster(fat32_t *self, u8 *dest, u32 cluster) {
 
-    self->base.drive->read(
-            self->base.drive, 
-            dest, 
+    cache_read(
+            self->base.drive,
+            dest,
             self->lba_data + (cluster - 2) * self->secs_per_cluster,  // 2 = first cluster
             self->secs_per_cluster
             );
 }
 
 
+// checks that a cluster of a chain is in the data area
+// free (0), reserved (1), bad and end of chain entries are not, neither are clusters beyond the FAT
+bool fat32_is_data_cluster(fat32_t *self, u32 cluster) {
+    return (cluster >= 2) && (cluster < self->n_clusters);
+}
+
+
 // returns the next cluster in a cluster chain
 u32 fat32_next_cluster(fat32_t *self, u32 cur_cluster) {
 
-    u32 fat_cluster = cur_cluster / FAT_ENTRIES_PER_PAGE;
-    u32 off_entry = cur_cluster % FAT_ENTRIES_PER_PAGE;
+    // entries beyond the data area would be garbage
+    if (cur_cluster >= self->n_clusters) return FAT32_EOF;
+
+    if (self->fat) return self->fat[cur_cluster] & FAT32_CLUSTER_MASK;
+
+    u64 entries_per_window = self->secs_per_window * 512 / sizeof(u32);
+    u32 *entries = fat32_fat_window(self, cur_cluster / entries_per_window);
+
+    return entries[cur_cluster % entries_per_window] & FAT32_CLUSTER_MASK;
+}
+
+
+// starts loading <n_clusters> contiguous clusters into memory without waiting for them
+void fat32_submit_clusters(fat32_t *self, drive_req_t *req, u8 *dest, u32 cluster, u64 n_clusters) {
 
-    // cache the fat cluster
-    if (fat_cluster != self->cur_fat_loaded) {
-            self->base.drive->read(
-                self->base.drive, 
-                (u8*)self->cache_fat, 
-                self->lba_fat + fat_cluster * self->secs_per_cluster,
-                self->secs_per_cluster);
+    drive_submit(
+            self->base.drive,
+            req,
+            dest,
+            self->lba_data + (cluster - 2) * self->secs_per_cluster,  // 2 = first cluster
+            n_clusters * self->secs_per_cluster
+            );
+}
+
+
+// follows a cluster chain as long as the clusters are physically contiguous (<max_clusters> at most)
+// <next> is set to the first cluster after the extent (>= FAT32_EOF at the end of the chain)
+// <cluster> has to be a data cluster, the extent ends before the first one that is not
+// returns the number of clusters in the extent
+u64 fat32_next_extent(fat32_t *self, u32 cluster, u64 max_clusters, u32 *next) {
+
+    u64 n_clusters = 1;
+    u32 cur_cluster = fat32_next_cluster(self, cluster);
+
+    while ((n_clusters < max_clusters) && (cur_cluster == cluster + n_clusters) && fat32_is_data_cluster(self, cur_cluster)) {
+        cur_cluster = fat32_next_cluster(self, cur_cluster);
+        n_clusters++;
     }
 
-    return *(u32*)(self->cache_fat + off_entry * sizeof(u32));
+    *next = cur_cluster;
+    return n_clusters;
 }
 
 
 // follows and loads a cluster chain for <n_clusters>
+// contiguous clusters are merged into a single read (split at the drive's largest call),
+// the next extent is looked up in the FAT while the current one is still being read
+// a broken chain (a cluster outside of the data area) ends the load
 // returns the number of clusters that were actually loaded
 u64 fat32_load_cluster_chain(fat32_t *self, u8 *dest, u32 start_cluster, u64 n_clusters) {
 
+    // two requests in flight at most (the current extent and the previous one)
+    drive_req_t reqs[2];
+    bool busy[2] = {false, false};
+
+    u64 n_bytes_cluster = self->secs_per_cluster * 512;
+    u64 max_clusters = MAX(self->base.drive->max_call_secs / self->secs_per_cluster, 1);
+
     u32 cur_cluster = start_cluster;
+    u64 n_loaded = 0;
+    u64 n_reads = 0;
 
-    for (u64 i = 0; i < n_clusters; i++) {
+    while ((n_loaded < n_clusters) && fat32_is_data_cluster(self, cur_cluster)) {
 
-        fat32_load_cluster(self, dest + i * self->secs_per_cluster * 512, cur_cluster);
+        u32 next_cluster;
+        u64 n_extent = fat32_next_extent(self, cur_cluster, MIN(n_clusters - n_loaded, max_clusters), &next_cluster);
 
-        cur_cluster = fat32_next_cluster(self, cur_cluster);
-        if (cur_cluster >= FAT32_EOF) return i + 1;
+        drive_req_t *req = &reqs[n_reads & 1];
+
+        // reuse the request of extent n_reads - 2
+        if (busy[n_reads & 1]) drive_wait(req);
+
+        fat32_submit_clusters(self, req, dest + n_loaded * n_bytes_cluster, cur_cluster, n_extent);
+        busy[n_reads & 1] = true;
+
+        n_loaded += n_extent;
+        n_reads++;
+        cur_cluster = next_cluster;
     }
-    return n_clusters;
+
+    for (u64 i = 0; i < 2; i++)
+        if (busy[i]) drive_wait(&reqs[i]);
+
+    self->n_clusters_loaded += n_loaded;
+    self->n_reads += n_reads;
+
+    return n_loaded;
 }
 
 
-// compares a string path to the file name in a FAT32 directory entry
-// to the next '/', '\' or '\0'
-// path can be shortened ("NAME.EXT" instead of "NAME    EXT"
-// returns how many character match (can be used to increment a char pointer)
-// -1 -> name does not match
-u8 fat32_cmp_path(const char *path_input, const char *path_entry) {
+// writes the name of a short directory entry as "NAME.EXT" (null terminated)
+// returns the length
+u64 fat32_entry_name(fat32_dir_entry_t *entry, char *dest) {
 
-    // compares the file name
-    for (u64 i = 0; i < FAT32_NAME; i++) {
-        if (path_input[i] == path_entry[i]) continue;
+    u64 len = 0;
 
-        // limiter encountered
-        if ((path_input[i] == '\\') || (path_input[i] == '/') || (path_input[i] == 0)) {
-            for (u64 j = i; j < FAT32_NAME + FAT32_EXT; j++) {
+    for (u64 i = 0; (i < FAT32_NAME) && (entry->name[i] != ' '); i++) dest[len++] = entry->name[i];
 
-                // the rest in the directory entry has to be empty
-                if (path_entry[j] != ' ') return -1;
-            }
-            return i + 1;
+    // 0xe5 marks deleted entries, names starting with it are stored as 0x05
+    if ((len > 0) && ((u8)dest[0] == FAT32_NAME_E5)) dest[0] = (char)FAT32_DELETED;
+
+    if (entry->ext[0] != ' ') {
+        dest[len++] = '.';
+        for (u64 i = 0; (i < FAT32_EXT) && (entry->ext[i] != ' '); i++) dest[len++] = entry->ext[i];
+    }
+
+    dest[len] = 0;
+    return len;
+}
+
+
+// checksum of a short name, stored in all of its long file name entries
+u8 fat32_lfn_checksum(fat32_dir_entry_t *entry) {
+
+    u8 sum = 0;
+    u8 *name = (u8*)entry->name;     // name and extension are consecutive
+
+    for (u64 i = 0; i < FAT32_NAME + FAT32_EXT; i++) sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+
+    return sum;
+}
+
+
+// adds a long file name entry to the name being assembled
+// the entries are stored in reverse order, any gap or checksum change discards the name
+void fat32_lfn_add(fat32_lfn_t *lfn, fat32_lfn_entry_t *entry) {
+
+    u8 ord = entry->ord & FAT32_LFN_ORD_MASK;
+
+    if (entry->ord & FAT32_LFN_LAST) {
+        lfn->next_ord = ord;
+        lfn->checksum = entry->checksum;
+        lfn->n_chars = ord * FAT32_LFN_CHARS;
+    }
+
+    if ((ord == 0) || (ord > FAT32_LFN_MAX_ORD) || (ord != lfn->next_ord) || (entry->checksum != lfn->checksum)) {
+        lfn->next_ord = 0;
+        lfn->complete = false;
+        return;
+    }
+
+    u16 *chars = &lfn->chars[(ord - 1) * FAT32_LFN_CHARS];
+    for (u64 i = 0; i < 5; i++) chars[i] = entry->name1[i];
+    for (u64 i = 0; i < 6; i++) chars[5 + i] = entry->name2[i];
+    for (u64 i = 0; i < 2; i++) chars[11 + i] = entry->name3[i];
+
+    lfn->next_ord--;
+    lfn->complete = (lfn->next_ord == 0);
+}
+
+
+// converts the assembled long name of a short entry from UCS-2 (UTF-16) to UTF-8 (null terminated)
+// returns the length or 0 if there is no valid long name (incomplete, wrong checksum, too long)
+u64 fat32_lfn_name(fat32_lfn_t *lfn, fat32_dir_entry_t *entry, char *dest) {
+
+    if (!lfn->complete || (lfn->checksum != fat32_lfn_checksum(entry))) return 0;
+
+    u64 len = 0;
+
+    for (u64 i = 0; i < lfn->n_chars; i++) {
+
+        u32 c = lfn->chars[i];
+
+        // terminated by 0x0000 (and padded with 0xffff) unless the last entry is full
+        if ((c == 0) || (c == 0xffff)) break;
+
+        // surrogate pair
+        if ((c >= 0xd800) && (c < 0xdc00) && (i + 1 < lfn->n_chars) &&
+            (lfn->chars[i + 1] >= 0xdc00) && (lfn->chars[i + 1] < 0xe000)) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (lfn->chars[++i] - 0xdc00);
         }
 
-        // reached the file extension
-        if (path_input[i] == '.') {
-            for (u64 j = i; j < FAT32_NAME; j++) {
+        u64 n_bytes = (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+        if (len + n_bytes > DCACHE_NAME_MAX) return 0;
 
-                // the remaining characters of the name in the directory entry have to be ' '
-                if (path_entry[j] != ' ') return -1;
-            }
+        if (n_bytes == 1) {
+            dest[len++] = c;
+            continue;
+        }
+
+        // lead byte: n_bytes ones, then the highest bits
+        dest[len++] = (0xf00 >> n_bytes) | (c >> (6 * (n_bytes - 1)));
+        for (u64 j = n_bytes - 1; j > 0; j--) dest[len++] = 0x80 | ((c >> (6 * (j - 1))) & 0x3f);
+    }
+
+    dest[len] = 0;
+    return len;
+}
+
+
+// scans an entire directory for a normalised name with hash <hash> (dcache_hash)
+// entries are matched by their long and their short name, only equal hashes are compared by name
+// every entry on the way is put into the dentry cache, so later lookups of siblings need no disk access
+// returns true if the name has been found (copied to <found>)
+bool fat32_scan_dir(fat32_t *self, u32 dir, const char *name, u64 hash, dentry_t *found) {
 
-            i++;    // skip the '.'
+    char short_name[FAT32_NAME + 1 + FAT32_EXT + 1];
+    char long_name[DCACHE_NAME_MAX + 1];
+    fat32_lfn_t lfn;
+    lfn.next_ord = 0;
+    lfn.complete = false;
 
-            // compares the file extension
-            for (u64 j = FAT32_NAME; j < FAT32_NAME + FAT32_EXT; ++i, ++j) {
-                if (path_input[i] == path_entry[j]) continue;
+    bool match = false;
+    u64 n_entries = self->secs_per_cluster * 512 / sizeof(fat32_dir_entry_t);
 
-                // end of input string
-                if ((path_input[i] == '\\') || (path_input[i] == '/') || (path_input[i] == 0)) {
+    for (u32 cluster = dir; fat32_is_data_cluster(self, cluster); cluster = fat32_next_cluster(self, cluster)) {
 
-                    for (u64 h = j; h < FAT32_NAME + FAT32_EXT; h++) {
+        fat32_load_cluster(self, self->cache_dir, cluster);
+        fat32_dir_entry_t *entries = (fat32_dir_entry_t*)self->cache_dir;
 
-                        // rest has to be empty
-                        if (path_entry[h] != ' ') return -1;
-                    }
-                    return i + 1;
-                }
-                // extension does not match
-                return -1;
+        for (u64 i = 0; i < n_entries; i++) {
+
+            fat32_dir_entry_t *entry = &entries[i];
+
+            // end of the directory
+            if (entry->name[0] == 0) return match;
+
+            // deleted entries break a long name
+            if ((u8)entry->name[0] == FAT32_DELETED) {
+                lfn.complete = false;
+                continue;
             }
 
-            return i + 1;
+            if (entry->attr == FAT32_LFN) {
+                fat32_lfn_add(&lfn, (fat32_lfn_entry_t*)entry);
+                continue;
+            }
+
+            // volume labels
+            if (entry->attr & FAT32_VOLUME_ID) {
+                lfn.complete = false;
+                continue;
+            }
+
+            // ".." of a subdirectory of the root directory points to cluster 0
+            u32 entry_cluster = DWORD(entry->cluster_high, entry->cluster_low);
+            if ((entry_cluster == 0) && (entry->attr & FAT32_DIR)) entry_cluster = self->cluster_root;
+
+            // the short name and the long name (if any) are both keys of the entry
+            char *names[2] = {short_name, long_name};
+            u64 n_names = 1;
+
+            dcache_normalise(short_name, short_name, fat32_entry_name(entry, short_name));
+            if (dcache_normalise(long_name, long_name, fat32_lfn_name(&lfn, entry, long_name))) n_names = 2;
+            lfn.complete = false;
+
+            for (u64 j = 0; j < n_names; j++) {
+
+                u64 entry_hash = dcache_hash(self, dir, names[j]);
+                dcache_insert(self, dir, names[j], entry_hash, false, entry_cluster, entry->filesize, entry->attr);
+
+                if (match || (entry_hash != hash)) continue;
+
+                u64 k = 0;
+                while (name[k] && (name[k] == names[j][k])) k++;
+                if (name[k] != names[j][k]) continue;
+
+                match = true;
+                found->cluster = entry_cluster;
+                found->size = entry->filesize;
+                found->attr = entry->attr;
+            }
         }
-        // name does not match
-        return -1;
     }
-    // string and directoy entry are exactly the same
-    return FAT32_NAME + FAT32_EXT + 1;
+
+    return match;
 }
 
 
-// loads a file into <buf>
+// looks up a normalised name in a directory, through the dentry cache
+// missing names are remembered as negative entries
+// returns true if the name has been found (copied to <found>)
+bool fat32_lookup(fat32_t *self, u32 dir, const char *name, dentry_t *found) {
+
+    u64 hash = dcache_hash(self, dir, name);
+    dentry_t *dentry = dcache_lookup(self, dir, name, hash);
+
+    if (dentry) {
+        if (dentry->negative) return false;
+
+        found->cluster = dentry->cluster;
+        found->size = dentry->size;
+        found->attr = dentry->attr;
+        return true;
+    }
+
+    if (fat32_scan_dir(self, dir, name, hash, found)) return true;
+
+    dcache_insert(self, dir, name, hash, true, 0, 0, 0);
+    return false;
+}
+
+
+// follows an absolute path from the root directory
+// returns false if any part of it does not exist
+bool fat32_resolve(fat32_t *self, const char *path, dentry_t *found) {
+
+    char name[DCACHE_NAME_MAX + 1];
+
+    // the root directory is not in any directory
+    found->cluster = self->cluster_root;
+    found->size = 0;
+    found->attr = FAT32_DIR;
+
+    while (true) {
+
+        // skip separators
+        while ((*path == '/') || (*path == '\\')) path++;
+        if (*path == 0) return true;
+
+        if (!(found->attr & FAT32_DIR)) return false;
+
+        u64 len = 0;
+        while (path[len] && (path[len] != '/') && (path[len] != '\\')) len++;
+
+        if (!dcache_normalise(name, path, len)) return false;
+        if (!fat32_lookup(self, found->cluster, name, found)) return false;
+
+        path += len;
+    }
+}
+
+
+// loads a file into <buf> (<n_clusters> at most)
 // returns the filesize
 u64 fat32_load_file(void *self, const char *path, u8 *buf, u64 n_clusters) {
 
     fat32_t *fs = (fat32_t*)self;
-    fat32_dir_entry_t *cur_entry;
-    u8 skip;
-    u32 start_cluster = 0;
+    dentry_t found;
 
-    path++;     // skip the root '/'
-    fat32_dir_entry_t *cur_dir = (fat32_dir_entry_t*)fs->cache_root;
-    u32 cur_cluster = fs->cluster_root;
+    if (!fat32_resolve(fs, path, &found)) log_err("Could not find file %s\n", path);
+    if (found.attr & FAT32_DIR) log_err("%s is a directory\n", path);
 
-repeat:
-    // loop throug all entries in the current directory
-    for (u64 i = 0; i < (fs->secs_per_cluster * 512 / sizeof(fat32_dir_entry_t)); i++) {
+    // load the entire file
+    u64 n_bytes_cluster = fs->secs_per_cluster * 512;
+    n_clusters = MIN(n_clusters, (found.size + n_bytes_cluster - 1) / n_bytes_cluster);
+    fat32_load_cluster_chain(fs, buf, found.cluster, n_clusters);
 
-        cur_entry = (fat32_dir_entry_t*)cur_dir + i;
-        skip = fat32_cmp_path(path, cur_entry->name);
+    // return the filesize as an u64 (required for VFS compatibility)
+    return found.size;
+}
 
-        // entry does not match
-        if (skip == (u8)-1) continue;
 
-        // entry does match
-        cur_cluster = DWORD(cur_entry->cluster_high, cur_entry->cluster_low);
+// opens a file or directory (fs_t.open)
+bool fat32_open(void *self, const char *path, file_t *file) {
 
-        // entry is a file -> the file we want to load
-        if (!(cur_entry->attr & FAT32_DIR)) {
-            start_cluster = cur_cluster;
-            break;
-        }
+    dentry_t found;
+    if (!fat32_resolve((fat32_t*)self, path, &found)) return false;
+
+    file->size = found.size;
+    file->dir = (found.attr & FAT32_DIR) != 0;
+    file->first = found.cluster;
+    file->pos_index = 0;
+    file->pos_cluster = found.cluster;
+    file->pos_n = 0;
+
+    return true;
+}
+
+
+// returns the cluster with index <index> in the chain of a file
+// starts at the cached position of the file if it is not behind it
+// the result is not a data cluster if the chain ends (or is broken) before <index>
+u32 fat32_seek(fat32_t *self, file_t *file, u64 index) {
 
-        // entry is a subdirectory
-        // put it into the cache
-        fat32_load_cluster(fs, fs->cache_dir, cur_cluster);
-        
-        // next object of the file path
-        path += skip;
+    u64 cur_index = 0;
+    u32 cluster = file->first;
 
-        // select the next directory
-        cur_dir = (fat32_dir_entry_t*)fs->cache_dir;
+    if (file->pos_index <= index) {
+        cur_index = file->pos_index;
+        cluster = file->pos_cluster;
+    }
 
-        // skip . and .. in subdirectory
-        // i will be incremented again by the loop
-        i = 1;
+    while ((cur_index < index) && fat32_is_data_cluster(self, cluster)) {
+        cluster = fat32_next_cluster(self, cluster);
+        cur_index++;
     }
 
-    // match found
-    // (0 is not a valid cluster as they start with 2)
-    if (start_cluster != 0) {
-        // load the entire file  
-        fat32_load_cluster_chain(fs, buf, start_cluster, n_clusters);
+    return cluster;
+}
+
+
+// reads a part of an open file (fs_t.read, offset and n_bytes are within the file)
+// contiguous clusters are read together, the last cluster that has been read is cached in the file
+// a broken chain ends the read early
+u64 fat32_read(void *self, file_t *file, u8 *dest, u64 offset, u64 n_bytes) {
+
+    fat32_t *fs = (fat32_t*)self;
+
+    u64 n_bytes_cluster = fs->secs_per_cluster * 512;
+    u64 max_clusters = MAX(fs->base.drive->max_call_secs / fs->secs_per_cluster, 1);
+
+    u64 index = offset / n_bytes_cluster;
+    u32 cluster = fat32_seek(fs, file, index);
+    u64 n_read = 0;
+
+    while ((n_read < n_bytes) && fat32_is_data_cluster(fs, cluster)) {
+
+        u64 off = (offset + n_read) % n_bytes_cluster;
+        u64 n_clusters = (off + (n_bytes - n_read) + n_bytes_cluster - 1) / n_bytes_cluster;
+
+        u32 next_cluster;
+        u64 n_extent = fat32_next_extent(fs, cluster, MIN(n_clusters, max_clusters), &next_cluster);
+        u64 n = MIN(n_extent * n_bytes_cluster - off, n_bytes - n_read);
 
-        // return the filesize as an u64 (required for VFS compatibility)
-        return (u64)cur_entry->filesize;
+        vfs_read_bytes(fs->base.drive, fs->sector, dest + n_read, fs->lba_data + (cluster - 2) * fs->secs_per_cluster, off, n);
+
+        // the cluster of the last byte that has been read
+        u64 last = (off + n - 1) / n_bytes_cluster;
+        file->pos_index = index + last;
+        file->pos_cluster = cluster + last;
+
+        n_read += n;
+        index += n_extent;
+        cluster = next_cluster;
     }
 
-    // start_cluster still 0 -> no match found in the directory
-    // check the next part of the directory
-    cur_cluster = fat32_next_cluster(fs, cur_cluster);
-    if (cur_cluster >= FAT32_EOF) log_err("Could not find file %s\n", path);
+    return n_read;
+}
+
+
+// returns the extent of an open file that starts at <offset> (fs_t.map)
+// <lba> is set to the sector of the offset, the extent is capped at the drive's largest call
+u64 fat32_map(void *self, file_t *file, u64 offset, u64 *lba) {
+
+    fat32_t *fs = (fat32_t*)self;
+
+    u64 n_bytes_cluster = fs->secs_per_cluster * 512;
+    u64 max_clusters = MAX(fs->base.drive->max_call_secs / fs->secs_per_cluster, 1);
+
+    u64 index = offset / n_bytes_cluster;
+    u32 cluster = fat32_seek(fs, file, index);
+    if (!fat32_is_data_cluster(fs, cluster)) return 0;
+
+    u32 next_cluster;
+    u64 n_extent = fat32_next_extent(fs, cluster, max_clusters, &next_cluster);
+
+    // the last cluster of the extent
+    file->pos_index = index + n_extent - 1;
+    file->pos_cluster = cluster + n_extent - 1;
 
-    // cache the next part
-    fat32_load_cluster(fs, fs->cache_dir, cur_cluster);
-    cur_dir = (fat32_dir_entry_t*)fs->cache_dir;
+    u64 off = offset % n_bytes_cluster;
+    *lba = fs->lba_data + (cluster - 2) * fs->secs_per_cluster + off / 512;
 
-    goto repeat;    // start again
+    return n_extent * n_bytes_cluster - off;
 }
@@ -0,0 +1,139 @@
+#include <types.h>
+#include <gpt.h>
+#include <part.h>
+#include <drive.h>
+#include <cache.h>
+#include <crc32.h>
+#include <utils.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+static u8 gpt_sector[512];
+static u8 gpt_entries[GPT_MAX_ENTRIES_BYTES];
+
+
+// reads and verifies a GPT header at block <lba> (blocks of <secs_per_blk> sectors)
+bool gpt_read_header(drive_t *drive, gpt_header_t *hdr, u64 lba, u64 secs_per_blk) {
+
+    if (cache_read(drive, gpt_sector, lba * secs_per_blk, 1) != 512) return false;
+
+    gpt_header_t *raw = (gpt_header_t*)gpt_sector;
+
+    if (raw->signature != GPT_SIGNATURE) return false;
+    if ((raw->header_size < GPT_HEADER_MIN_SIZE) || (raw->header_size > 512)) return false;
+
+    // the checksum is calculated with the checksum field zeroed
+    u32 crc = raw->header_crc;
+    raw->header_crc = 0;
+
+    if (crc32(gpt_sector, raw->header_size) != crc) {
+        log_warn("GPT: header at LBA %u has a bad checksum\n", lba);
+        return false;
+    }
+
+    raw->header_crc = crc;
+
+    if (raw->my_lba != lba) return false;
+    if ((raw->entry_size < GPT_ENTRY_MIN_SIZE) || (raw->entry_size % 8)) return false;
+
+    mem_cpy((u8*)hdr, gpt_sector, sizeof(gpt_header_t));
+
+    return true;
+}
+
+
+// reads and verifies the partition entries of a header into <gpt_entries>
+bool gpt_read_entries(drive_t *drive, gpt_header_t *hdr, u64 secs_per_blk) {
+
+    u64 n_bytes = (u64)hdr->n_entries * hdr->entry_size;
+
+    if (n_bytes > GPT_MAX_ENTRIES_BYTES) {
+        log_warn("GPT: %u partition entries are not supported\n", (u64)hdr->n_entries);
+        return false;
+    }
+
+    u64 n_secs = (n_bytes + 511) / 512;
+
+    if (cache_read(drive, gpt_entries, hdr->entries_lba * secs_per_blk, n_secs) != n_secs * 512) return false;
+
+    if (crc32(gpt_entries, n_bytes) != hdr->entries_crc) {
+        log_warn("GPT: partition entries at LBA %u have a bad checksum\n", hdr->entries_lba);
+        return false;
+    }
+
+    return true;
+}
+
+
+// loads a valid header and its entries, falls back to the backup at the end of the drive
+bool gpt_load(drive_t *drive, gpt_header_t *hdr, u64 secs_per_blk) {
+
+    if (drive->n_secs / secs_per_blk <= GPT_PRIMARY_LBA) return false;
+
+    u64 lba_backup = drive->n_secs / secs_per_blk - 1;
+
+    if (gpt_read_header(drive, hdr, GPT_PRIMARY_LBA, secs_per_blk)) {
+        if (gpt_read_entries(drive, hdr, secs_per_blk)) return true;
+
+        // the primary header knows where the backup is
+        if (hdr->alternate_lba <= lba_backup) lba_backup = hdr->alternate_lba;
+    }
+
+    if (!gpt_read_header(drive, hdr, lba_backup, secs_per_blk)) return false;
+    if (!gpt_read_entries(drive, hdr, secs_per_blk)) return false;
+
+    log_warn("GPT: primary header or entries are damaged, using the backup at LBA %u\n", lba_backup);
+
+    return true;
+}
+
+
+// adds the partitions of a GPT drive
+// the GPT may use 512 byte or 4 KiB blocks, drives always use 512 byte sectors
+// returns the number of partitions added
+u64 gpt_scan(drive_t *drive) {
+
+    gpt_header_t hdr;
+    u64 secs_per_blk = 1;
+
+    if (!gpt_load(drive, &hdr, secs_per_blk)) {
+        secs_per_blk = 8;
+
+        if (!gpt_load(drive, &hdr, secs_per_blk)) {
+            log_warn("GPT: no valid header found\n");
+            return 0;
+        }
+    }
+
+    u64 n_found = 0;
+
+    for (u64 i = 0; i < hdr.n_entries; i++) {
+
+        gpt_entry_t *entry = (gpt_entry_t*)(gpt_entries + i * hdr.entry_size);
+
+        // unused entries have a zero type GUID
+        bool used = false;
+        for (u64 j = 0; j < 16; j++) used |= entry->type_guid[j] != 0;
+        if (!used) continue;
+
+        if ((entry->last_lba < entry->first_lba) ||
+            (entry->first_lba < hdr.first_usable_lba) ||
+            (entry->last_lba > hdr.last_usable_lba)) {
+
+            log_warn("GPT: partition %u is outside of the usable blocks\n", i);
+            continue;
+        }
+
+        part_t *part = part_add(drive, PART_GPT, i,
+                entry->first_lba * secs_per_blk,
+                (entry->last_lba - entry->first_lba + 1) * secs_per_blk);
+        if (!part) break;
+
+        mem_cpy(part->type_guid, entry->type_guid, 16);
+        n_found++;
+    }
+
+    return n_found;
+}
@@ -0,0 +1,77 @@
+#include <types.h>
+#include <part.h>
+#include <gpt.h>
+#include <drive.h>
+#include <cache.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+part_t parts[PART_MAX];
+u64 n_parts = 0;
+
+static u8 part_sector[512];
+
+
+// appends a partition to the table
+// returns 0 if the table is full
+part_t *part_add(drive_t *drive, part_scheme_t scheme, u64 index, u64 lba_start, u64 n_secs) {
+
+    if (n_parts == PART_MAX) {
+        log_warn("Partition table full, ignoring partition %u\n", index);
+        return 0;
+    }
+
+    part_t *part = &parts[n_parts++];
+    part->drive = drive;
+    part->scheme = scheme;
+    part->index = index;
+    part->lba_start = lba_start;
+    part->n_secs = n_secs;
+    part->mbr_type = MBR_TYPE_NONE;
+
+    log_info("Partition %u (%s): LBA %u, %u sectors\n",
+            index, (scheme == PART_GPT) ? "GPT" : "MBR", lba_start, n_secs);
+
+    return part;
+}
+
+
+// finds the partitions of a drive (GPT behind a protective MBR, MBR primary partitions otherwise)
+// returns the number of partitions added
+u64 part_scan(drive_t *drive) {
+
+    if (cache_read(drive, part_sector, 0, 1) != 512) {
+        log_warn("Partition scan: reading the MBR failed\n");
+        return 0;
+    }
+
+    if (*(u16*)(part_sector + MBR_SIGNATURE_OFFSET) != MBR_SIGNATURE) return 0;
+
+    partition_t *entries = (partition_t*)(part_sector + MBR_PART_OFFSET);
+
+    for (u64 i = 0; i < MBR_N_PARTS; i++) {
+        if (entries[i].type == MBR_TYPE_GPT) return gpt_scan(drive);
+    }
+
+    u64 n_found = 0;
+
+    for (u64 i = 0; i < MBR_N_PARTS; i++) {
+
+        partition_t *entry = &entries[i];
+
+        if ((entry->type == MBR_TYPE_NONE) || (entry->num_sectors == 0)) continue;
+
+        // logical partitions are not supported
+        if ((entry->type == MBR_TYPE_EXTENDED_CHS) || (entry->type == MBR_TYPE_EXTENDED_LBA)) continue;
+
+        part_t *part = part_add(drive, PART_MBR, i, entry->lba_start, entry->num_sectors);
+        if (!part) break;
+
+        part->mbr_type = entry->type;
+        n_found++;
+    }
+
+    return n_found;
+}
@@ -0,0 +1,463 @@
+#include <types.h>
+#include <vfs.h>
+#include <part.h>
+#include <fat32.h>
+#include <ext4.h>
+#include <lz4.h>
+#include <verify.h>
+#include <mmap.h>
+#include <layout.h>
+#include <cache.h>
+#include <utils.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+fs_t *vfs_mounts[VFS_MAX_MOUNTS];
+u64 n_vfs_mounts = 0;
+
+// buffer of all streams (allocated by the first one)
+static u8 *vfs_stream_buf = 0;
+
+
+// mounts the filesystem on a partition (if it is supported)
+// returns 0 if the partition does not contain a known filesystem
+fs_t *vfs_mount(part_t *part) {
+
+    if (n_vfs_mounts == VFS_MAX_MOUNTS) {
+        log_warn("Too many filesystems, ignoring partition %u\n", part->index);
+        return 0;
+    }
+
+    fs_t *fs = 0;
+
+    fat32_t *fat32 = fat32_mount(part);
+    if (fat32) fs = &fat32->base;
+
+    ext4_t *ext4 = fs ? 0 : ext4_mount(part);
+    if (ext4) fs = &ext4->base;
+
+    if (fs) vfs_mounts[n_vfs_mounts++] = fs;
+
+    return fs;
+}
+
+
+// mounts the filesystems of all partitions that have been found
+void vfs_mount_all(void) {
+    for (u64 i = 0; i < n_parts; i++) vfs_mount(&parts[i]);
+}
+
+
+// opens a file or directory by its absolute path
+// returns false if it does not exist
+bool vfs_open(fs_t *fs, const char *path, file_t *file) {
+
+    file->fs = 0;
+    if (!fs->open(fs, path, file)) return false;
+
+    file->fs = fs;
+    return true;
+}
+
+
+// returns the size and the type of a file without keeping it open
+bool vfs_stat(fs_t *fs, const char *path, fs_stat_t *stat) {
+
+    file_t file;
+    if (!vfs_open(fs, path, &file)) return false;
+
+    stat->size = file.size;
+    stat->dir = file.dir;
+
+    vfs_close(&file);
+    return true;
+}
+
+
+// reads up to <n_bytes> starting at <offset> of an open file directly into <dest>
+// returns the bytes read (less at the end of the file)
+u64 vfs_read(file_t *file, u8 *dest, u64 offset, u64 n_bytes) {
+
+    if (!file->fs || file->dir || (offset >= file->size)) return 0;
+
+    n_bytes = MIN(n_bytes, file->size - offset);
+    if (n_bytes == 0) return 0;
+
+    return file->fs->read(file->fs, file, dest, offset, n_bytes);
+}
+
+
+// reads <n_bytes> starting <off> bytes into the sectors at <lba>
+// whole sectors go directly into <dest>, partial ones through <sector> (one sector)
+void vfs_read_bytes(drive_t *drive, u8 *sector, u8 *dest, u64 lba, u64 off, u64 n_bytes) {
+
+    lba += off / 512;
+    off %= 512;
+
+    // partial first sector
+    if (off || (n_bytes < 512)) {
+        u64 n = MIN(512 - off, n_bytes);
+
+        cache_read(drive, sector, lba, 1);
+        mem_cpy(dest, sector + off, n);
+
+        dest += n;
+        n_bytes -= n;
+        lba++;
+    }
+
+    u64 n_secs = n_bytes / 512;
+    if (n_secs) cache_read(drive, dest, lba, n_secs);
+
+    // partial last sector
+    if (n_bytes % 512) {
+        cache_read(drive, sector, lba + n_secs, 1);
+        mem_cpy(dest + n_secs * 512, sector, n_bytes % 512);
+    }
+}
+
+
+void vfs_close(file_t *file) {
+    file->fs = 0;
+}
+
+
+// loads a file into <dest> (<max_bytes> at most)
+// LZ4 compressed files are decompressed while they are read, without a copy of the compressed file
+// <verify> (0 -> none) hashes the file as it is stored, per run as the data arrives
+// returns the (decompressed) size
+u64 vfs_load(file_t *file, u8 *dest, u64 max_bytes, struct Verify *verify) {
+
+    u32 magic = 0;
+    vfs_read(file, (u8*)&magic, 0, sizeof(u32));
+
+    if (lz4_is_compressed(magic)) return lz4_load(file, dest, max_bytes, verify);
+
+    return vfs_load_raw(file, dest, 0, max_bytes, verify);
+}
+
+
+// copies <n_bytes> from <src> (0 -> zeros) to a segment list, starting <off> bytes into it
+static void vfs_iov_copy(drive_iovec_t *iov, u64 n_iov, u64 off, u8 *src, u64 n_bytes) {
+
+    while (n_bytes) {
+        u64 n;
+        u8 *dest = drive_iov_addr(iov, n_iov, off, &n);
+        n = MIN(n, n_bytes);
+
+        if (src) mem_cpy(dest, src, n);
+        else mem_set(dest, 0, n);
+
+        if (src) src += n;
+        off += n;
+        n_bytes -= n;
+    }
+}
+
+
+// hashes <n_bytes> of a segment list, starting <off> bytes into it
+static void vfs_iov_hash(struct Verify *verify, drive_iovec_t *iov, u64 n_iov, u64 off, u64 n_bytes) {
+
+    while (n_bytes) {
+        u64 n;
+        u8 *data = drive_iov_addr(iov, n_iov, off, &n);
+        n = MIN(n, n_bytes);
+
+        verify_update(verify, data, n);
+
+        off += n;
+        n_bytes -= n;
+    }
+}
+
+
+// fills <out> with the segments that hold <n_bytes> starting <off> bytes into a segment list
+// returns the number of segments, VFS_MAX_IOV at most (they may hold less than <n_bytes>)
+static u64 vfs_iov_slice(drive_iovec_t *iov, u64 n_iov, u64 off, u64 n_bytes, drive_iovec_t *out) {
+
+    u64 n_out = 0;
+
+    while (n_bytes && (n_out < VFS_MAX_IOV)) {
+        u64 n;
+        out[n_out].addr = drive_iov_addr(iov, n_iov, off, &n);
+        out[n_out].n_bytes = MIN(n, n_bytes);
+
+        off += out[n_out].n_bytes;
+        n_bytes -= out[n_out].n_bytes;
+        n_out++;
+    }
+    return n_out;
+}
+
+
+// reads <n_bytes> of a file starting at <offset> straight into <dest>
+// returns the bytes loaded (see vfs_load_rawv)
+u64 vfs_load_raw(file_t *file, u8 *dest, u64 offset, u64 n_bytes, struct Verify *verify) {
+
+    drive_iovec_t iov = {dest, n_bytes};
+
+    return vfs_load_rawv(file, &iov, 1, offset, verify);
+}
+
+
+// reads the bytes of a file starting at <offset> straight into a list of segments (in order)
+// one (vectored) read per run of contiguous sectors, the next run is in flight while the previous one
+// is hashed by <verify> (0 -> none)
+// partial sectors at either end go through vfs_read
+// returns the bytes loaded (less at the end of the file or if it could not be mapped)
+u64 vfs_load_rawv(file_t *file, drive_iovec_t *iov, u64 n_iov, u64 offset, struct Verify *verify) {
+
+    if (!file->fs || file->dir || (offset >= file->size)) return 0;
+
+    u64 n_bytes = MIN(drive_iov_bytes(iov, n_iov), file->size - offset);
+    u8 sector[512];
+
+    // partial first sector
+    u64 n_head = MIN((512 - offset % 512) % 512, n_bytes);
+    if (n_head) {
+        vfs_read(file, sector, offset, n_head);
+        vfs_iov_copy(iov, n_iov, 0, sector, n_head);
+        verify_update(verify, sector, n_head);
+    }
+
+    // two requests in flight at most (the current run and the previous one)
+    drive_req_t reqs[2];
+    drive_iovec_t run_iov[2][VFS_MAX_IOV];
+    bool busy[2] = {false, false};
+    u64 run_pos[2];
+    u64 run_bytes[2];
+
+    fs_t *fs = file->fs;
+    drive_t *drive = fs->drive;
+    u64 max_bytes_read = drive_max_call_bytes(drive);
+
+    // <pos> counts the bytes from <offset>
+    u64 n_whole = n_head + ((n_bytes - n_head) & ~511ULL);
+    u64 pos = n_head;
+    u64 n_reads = 0;
+
+    while (pos < n_whole) {
+
+        u64 lba;
+        u64 n = fs->map(fs, file, offset + pos, &lba) & ~511ULL;
+
+        if (n == 0) {
+            log_warn("Could not map offset %x of a file, it ends there\n", offset + pos);
+            n_bytes = pos;
+            n_whole = pos;
+            break;
+        }
+
+        n = MIN(MIN(n, n_whole - pos), max_bytes_read);
+
+        // reuse the request of run n_reads - 2 (the older one, so the runs are hashed in order)
+        u64 i = n_reads & 1;
+        if (busy[i]) {
+            drive_wait(&reqs[i]);
+            vfs_iov_hash(verify, iov, n_iov, run_pos[i], run_bytes[i]);
+            busy[i] = false;
+        }
+
+        // holes are hashed after the run before them
+        if (lba == 0) {
+            if (busy[i ^ 1]) {
+                drive_wait(&reqs[i ^ 1]);
+                vfs_iov_hash(verify, iov, n_iov, run_pos[i ^ 1], run_bytes[i ^ 1]);
+                busy[i ^ 1] = false;
+            }
+
+            vfs_iov_copy(iov, n_iov, pos, 0, n);
+            vfs_iov_hash(verify, iov, n_iov, pos, n);
+
+            pos += n;
+            continue;
+        }
+
+        // a read that would scatter to more segments is cut after the last whole sector of them
+        u64 n_run_iov = vfs_iov_slice(iov, n_iov, pos, n, run_iov[i]);
+        u64 n_run = drive_iov_bytes(run_iov[i], n_run_iov);
+
+        if (n_run < n) {
+            n = n_run & ~511ULL;
+            if (n == 0) log_err("A sector of a file is split among more than %u segments\n", (u64)VFS_MAX_IOV);
+
+            n_run_iov = vfs_iov_slice(iov, n_iov, pos, n, run_iov[i]);
+        }
+
+        drive_submitv(drive, &reqs[i], run_iov[i], n_run_iov, lba);
+        busy[i] = true;
+        run_pos[i] = pos;
+        run_bytes[i] = n;
+
+        pos += n;
+        n_reads++;
+    }
+
+    // older run first
+    for (u64 j = 0; j < 2; j++) {
+        u64 i = (n_reads + j) & 1;
+        if (!busy[i]) continue;
+
+        drive_wait(&reqs[i]);
+        vfs_iov_hash(verify, iov, n_iov, run_pos[i], run_bytes[i]);
+    }
+
+    // partial last sector
+    if (n_bytes > n_whole) {
+        vfs_read(file, sector, offset + n_whole, n_bytes - n_whole);
+        vfs_iov_copy(iov, n_iov, n_whole, sector, n_bytes - n_whole);
+        verify_update(verify, sector, n_bytes - n_whole);
+    }
+
+    return n_bytes;
+}
+
+
+// starts streaming an open file from its beginning
+// <verify> (0 -> none) is updated with every chunk of the file that arrives
+void vfs_stream_init(vfs_stream_t *stream, file_t *file, struct Verify *verify) {
+
+    if (!vfs_stream_buf) vfs_stream_buf = mmap_reserve_high(VFS_STREAM_BYTES, PAGE_SIZE, MMAP_MAX_ADDR);
+    if (!vfs_stream_buf) log_err("Not enough memory for streaming files\n");
+
+    stream->file = file;
+    stream->size = file->size;
+    stream->buf = vfs_stream_buf;
+    stream->start = 0;
+    stream->end = 0;
+    stream->offset = 0;
+    stream->busy = false;
+    stream->n_busy = 0;
+    stream->n_reads = 0;
+    stream->verify = verify;
+    stream->n_hashed = 0;
+
+    vfs_stream_submit(stream);
+}
+
+
+// starts reading the next chunk (one extent of it) unless a read is in flight or the buffer is full
+// the data that has not been consumed is moved to the start of the buffer if there is no room behind it
+void vfs_stream_submit(vfs_stream_t *stream) {
+
+    if (stream->busy || (stream->offset >= stream->size)) return;
+
+    if (VFS_STREAM_BYTES - stream->end < VFS_STREAM_CHUNK) {
+
+        // moved by whole pages, so reads stay aligned
+        u64 shift = stream->start - stream->start % PAGE_SIZE;
+        if (shift == 0) return;
+
+        // the data before start is dropped
+        vfs_stream_hash(stream);
+
+        mem_cpy(stream->buf + stream->start - shift, stream->buf + stream->start, stream->end - stream->start);
+        stream->start -= shift;
+        stream->end -= shift;
+    }
+
+    fs_t *fs = stream->file->fs;
+    drive_t *drive = fs->drive;
+
+    u64 lba;
+    u64 n_bytes = fs->map(fs, stream->file, stream->offset, &lba);
+
+    if (n_bytes == 0) {
+        log_warn("Could not map offset %x of a file, it ends there\n", stream->offset);
+        stream->size = stream->offset;
+        return;
+    }
+
+    // whole sectors, the last one may extend beyond the end of the file
+    n_bytes = MIN(MIN(n_bytes, VFS_STREAM_CHUNK), drive_max_call_bytes(drive));
+    u64 n_bytes_file = MIN(n_bytes, stream->size - stream->offset);
+
+    if (lba == 0) {
+        mem_set(stream->buf + stream->end, 0, n_bytes_file);
+        stream->end += n_bytes_file;
+        stream->offset += n_bytes_file;
+        return;
+    }
+
+    drive_submit(drive, &stream->req, stream->buf + stream->end, lba, (n_bytes_file + 511) / 512);
+    stream->busy = true;
+    stream->n_busy = n_bytes_file;
+    stream->n_reads++;
+}
+
+
+// waits for the read in flight (if any)
+void vfs_stream_wait(vfs_stream_t *stream) {
+
+    if (!stream->busy) return;
+
+    drive_wait(&stream->req);
+    stream->busy = false;
+    stream->end += stream->n_busy;
+    stream->offset += stream->n_busy;
+
+    // the next chunk is read while this one is hashed
+    if (stream->verify) {
+        vfs_stream_submit(stream);
+        vfs_stream_hash(stream);
+    }
+}
+
+
+// hashes the data that has arrived since the last call (in file order, holes included)
+void vfs_stream_hash(vfs_stream_t *stream) {
+
+    u64 n = stream->offset - stream->n_hashed;
+    if (n) verify_update(stream->verify, stream->buf + stream->end - n, n);
+
+    stream->n_hashed = stream->offset;
+}
+
+
+// returns the next <n_bytes> of the stream (contiguous, valid until the next call) without consuming them
+// the next chunk is submitted before returning, so it is read while the caller works on these bytes
+// returns 0 if the file ends before
+u8 *vfs_stream_get(vfs_stream_t *stream, u64 n_bytes) {
+
+    if (n_bytes > VFS_STREAM_MAX_GET) log_err("Stream read of %x bytes is too large\n", n_bytes);
+
+    while (stream->end - stream->start < n_bytes) {
+
+        if (stream->busy) {
+            vfs_stream_wait(stream);
+            continue;
+        }
+
+        if (stream->offset >= stream->size) return 0;
+
+        vfs_stream_submit(stream);
+    }
+
+    vfs_stream_submit(stream);
+
+    return stream->buf + stream->start;
+}
+
+
+// consumes <n_bytes> that have been returned by vfs_stream_get
+void vfs_stream_skip(vfs_stream_t *stream, u64 n_bytes) {
+    stream->start += MIN(n_bytes, stream->end - stream->start);
+}
+
+
+// waits for the read in flight, so the buffer can be used by the next stream
+// with a hash, the rest of the file is read and hashed first
+void vfs_stream_close(vfs_stream_t *stream) {
+
+    while (stream->verify && (stream->busy || (stream->offset < stream->size))) {
+        vfs_stream_skip(stream, stream->end - stream->start);
+
+        if (stream->busy) vfs_stream_wait(stream);
+        else vfs_stream_submit(stream);
+    }
+
+    vfs_stream_wait(stream);
+    vfs_stream_hash(stream);
+}
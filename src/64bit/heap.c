@@ -16,3 +16,16 @@ void *heap_alloc(heap_t *self, u64 n_bytes) {
 
     return res;
 }
+
+
+// allocate <n_bytes> on the heap starting at a multiple of <align> (power of 2)
+void *heap_alloc_aligned(heap_t *self, u64 n_bytes, u64 align) {
+
+    u64 addr = (u64)(self->loc + self->top);
+    u64 pad = ((addr + align - 1) & ~(align - 1)) - addr;
+
+    // skip the padding
+    heap_alloc(self, pad);
+
+    return heap_alloc(self, n_bytes);
+}
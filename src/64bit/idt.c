@@ -1,5 +1,6 @@
 #include <types.h>
 #include <idt.h>
+#include <pic.h>
 #include <layout.h>
 #include <log.h>
 #include <tty.h>
@@ -13,6 +14,9 @@ ALIGNED(PAGE_SIZE) idt_desc_t idt[N_IDT_ENTRIES];
 // used to load an IDT
 static idtr_t idtr = {0};
 
+// C handlers of the IRQs
+static irq_handler_t irq_handlers[PIC_N_IRQS] = {0};
+
 
 // initializes the IDT
 void idt_init(void) {
@@ -40,3 +44,25 @@ void idt_set_desc(u8 vec, u64 isr, u8 attr, u8 ist) {
     desc->base_high = (isr >> 32) & 0xffffffff;
     desc->zero = 0;
 }
+
+
+// installs a handler for an IRQ and unmasks it
+void idt_set_irq(u8 irq, irq_handler_t handler) {
+
+    irq_handlers[irq] = handler;
+    idt_set_desc(IDT_IRQ_VEC(irq), irq_stubs[irq], IDT_INT_GATE, 0);
+
+    // IRQs of the slave PIC arrive through the cascade
+    if (irq >= 8) pic_unmask_irq(PIC_IRQ_CASCADE);
+    pic_unmask_irq(irq);
+}
+
+
+// called by the IRQ stubs
+// dispatches an IRQ to its handler and acknowledges it
+void irq_handle(u64 irq) {
+
+    if (irq_handlers[irq]) irq_handlers[irq](irq);
+
+    pic_eoi(irq);
+}
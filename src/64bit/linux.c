@@ -0,0 +1,255 @@
+#include <types.h>
+#include <linux.h>
+#include <vfs.h>
+#include <drive.h>
+#include <verify.h>
+#include <mmap.h>
+#include <layout.h>
+#include <utils.h>
+#include <tsc.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+// the boot parameters and the command line stay in the loader's memory below 1 MiB
+ALIGNED(PAGE_SIZE) linux_boot_params_t linux_boot_params;
+static char linux_cmdline[LINUX_CMDLINE_MAX];
+
+// the setup code is read through this page (only its header is kept)
+static u8 linux_setup_buf[PAGE_SIZE];
+
+// two null descriptors, then flat 64-bit code (LINUX_BOOT_CS) and data (LINUX_BOOT_DS)
+static u64 linux_gdt[4] = {
+    0,
+    0,
+    0x00af9a000000ffff,
+    0x00cf92000000ffff
+};
+static linux_gdtr_t linux_gdtr;
+
+
+// loads the kernel, the initrd and the command line from a filesystem and fills linux_boot_params
+// returns the address of the protected-mode kernel (for linux_start)
+u64 linux_load(fs_t *fs) {
+
+    u64 kernel = linux_load_kernel(fs);
+
+    linux_load_initrd(fs);
+    linux_load_cmdline(fs);
+    linux_setup_e820();
+
+    return kernel;
+}
+
+
+// parses the setup header of LINUX_KERNEL_PATH (a bzImage) and reads its protected-mode part
+// straight to the preferred address (or the highest free memory if that is taken and it is relocatable)
+// the setup code is only hashed, so the file is verified in order without holding it
+// returns the address of the protected-mode kernel, halts if it can not be loaded
+u64 linux_load_kernel(fs_t *fs) {
+
+    const char *path = LINUX_KERNEL_PATH;
+
+    file_t file;
+    if (!vfs_open(fs, path, &file)) log_err("Could not find file %s\n", path);
+    if (file.dir) log_err("%s is a directory\n", path);
+
+    verify_t verify;
+    verify_open(&verify, fs, path);
+
+    u64 n = vfs_read(&file, linux_setup_buf, 0, PAGE_SIZE);
+    if (n < LINUX_SETUP_HEADER_OFFSET + sizeof(linux_setup_header_t)) log_err("%s is not a bzImage\n", path);
+
+    linux_setup_header_t *hdr = (linux_setup_header_t*)(linux_setup_buf + LINUX_SETUP_HEADER_OFFSET);
+
+    if ((hdr->boot_flag != LINUX_BOOT_FLAG) || (hdr->header != LINUX_HEADER_MAGIC) || !(hdr->loadflags & LINUX_LOADED_HIGH))
+        log_err("%s is not a bzImage\n", path);
+
+    if (hdr->version < LINUX_MIN_VERSION) log_err("%s: boot protocol %x is too old\n", path, (u64)hdr->version);
+    if (!(hdr->xloadflags & LINUX_XLF_KERNEL_64)) log_err("%s has no 64-bit entry point\n", path);
+
+    u64 setup_sects = hdr->setup_sects ? hdr->setup_sects : LINUX_DEFAULT_SETUP_SECTS;
+    u64 n_bytes_setup = (setup_sects + 1) * 512;
+    if (n_bytes_setup >= file.size) log_err("%s is truncated\n", path);
+
+    // everything the boot loader does not fill in is 0
+    mem_zero((u8*)&linux_boot_params, sizeof(linux_boot_params_t));
+
+    u64 n_bytes_hdr = LINUX_SETUP_HEADER_END + (hdr->jump >> 8) - LINUX_SETUP_HEADER_OFFSET;
+    mem_cpy((u8*)&linux_boot_params.hdr, (u8*)hdr, MIN(n_bytes_hdr, sizeof(linux_setup_header_t)));
+    hdr = &linux_boot_params.hdr;
+
+    verify_update(&verify, linux_setup_buf, MIN(n, n_bytes_setup));
+
+    for (u64 off = PAGE_SIZE; off < n_bytes_setup; off += PAGE_SIZE) {
+        u64 n_chunk = vfs_read(&file, linux_setup_buf, off, MIN(PAGE_SIZE, n_bytes_setup - off));
+        verify_update(&verify, linux_setup_buf, n_chunk);
+    }
+
+    // the kernel decompresses itself within init_size bytes from its load address
+    u64 n_bytes_kernel = file.size - n_bytes_setup;
+    u64 n_bytes_init = MAX(hdr->init_size, n_bytes_kernel);
+    u64 kernel = hdr->pref_address;
+
+    if (mmap_is_free(kernel, n_bytes_init)) mmap_reserve(kernel, n_bytes_init);
+    else if (hdr->relocatable_kernel) kernel = (u64)mmap_reserve_high(n_bytes_init, MAX(hdr->kernel_alignment, PAGE_SIZE), MMAP_MAX_ADDR);
+    else kernel = 0;
+
+    if (!kernel) log_err("%s: no free memory at %x for %u KiB\n", path, hdr->pref_address, n_bytes_init / 1024);
+
+    if (vfs_load_raw(&file, (u8*)kernel, n_bytes_setup, n_bytes_kernel, &verify) != n_bytes_kernel)
+        log_err("%s: could not read the kernel\n", path);
+
+    vfs_close(&file);
+    verify_close(&verify, path, file.size);
+
+    hdr->code32_start = kernel;
+    hdr->type_of_loader = LINUX_LOADER_UNDEFINED;
+
+    log_info("%s: boot protocol %u.%u, %u KiB at %x (%u KiB reserved)\n",
+            path,
+            (u64)(hdr->version >> 8),
+            (u64)(hdr->version & 0xff),
+            n_bytes_kernel / 1024,
+            kernel,
+            n_bytes_init / 1024);
+
+    return kernel;
+}
+
+
+// reads LINUX_INITRD_PATH (if there is one) as it is stored to the highest free memory below initrd_addr_max
+// it goes straight from the drive to its final place, so the time only depends on the drive
+void linux_load_initrd(fs_t *fs) {
+
+    const char *path = LINUX_INITRD_PATH;
+    linux_setup_header_t *hdr = &linux_boot_params.hdr;
+
+    file_t file;
+    if (!vfs_open(fs, path, &file)) return;
+    if (file.dir || (file.size == 0)) return;
+
+    u8 *initrd = mmap_reserve_high(file.size, PAGE_SIZE, (u64)hdr->initrd_addr_max + 1);
+    if (!initrd) log_err("%s: no free memory below %x for %u KiB\n", path, (u64)hdr->initrd_addr_max + 1, file.size / 1024);
+
+    verify_t verify;
+    verify_open(&verify, fs, path);
+
+    u64 start = x86_rdtsc();
+
+    // not decompressed, the kernel does that
+    if (vfs_load_raw(&file, initrd, 0, file.size, &verify) != file.size) log_err("%s: could not read it\n", path);
+
+    u64 ticks = x86_rdtsc() - start;
+
+    vfs_close(&file);
+    verify_close(&verify, path, file.size);
+
+    hdr->ramdisk_image = (u64)initrd;
+    hdr->ramdisk_size = file.size;
+
+    log_info("%s: %u KiB at %x (%u MB/s)\n", path, file.size / 1024, (u64)initrd, file.size / MAX(tsc_us(ticks), 1));
+}
+
+
+// reads the first line of LINUX_CMDLINE_PATH (empty if there is none), cmdline_size bytes at most
+// the file is verified as a whole, so with a manifest entry it has to fit
+void linux_load_cmdline(fs_t *fs) {
+
+    const char *path = LINUX_CMDLINE_PATH;
+    linux_setup_header_t *hdr = &linux_boot_params.hdr;
+
+    u64 n = 0;
+    file_t file;
+
+    if (vfs_open(fs, path, &file)) {
+        verify_t verify;
+        verify_open(&verify, fs, path);
+
+        n = vfs_read(&file, (u8*)linux_cmdline, 0, MIN(hdr->cmdline_size, LINUX_CMDLINE_MAX - 1));
+        verify_update(&verify, (u8*)linux_cmdline, n);
+
+        vfs_close(&file);
+        verify_close(&verify, path, file.size);
+    }
+
+    for (u64 i = 0; i < n; i++) {
+        if ((linux_cmdline[i] == '\n') || (linux_cmdline[i] == '\r')) {
+            n = i;
+            break;
+        }
+    }
+
+    linux_cmdline[n] = 0;
+    hdr->cmd_line_ptr = (u64)linux_cmdline;
+
+    log_info("Command line: %s\n", linux_cmdline);
+}
+
+
+// the VGA text mode the loader runs in (it never switches modes)
+// and the cursor, so the kernel continues below the loader's output
+void linux_setup_video(void) {
+
+    u64 cursor = tty_get_cursor();
+
+    linux_boot_params.orig_x = cursor % MAX_COLS;
+    linux_boot_params.orig_y = cursor / MAX_COLS;
+
+    linux_boot_params.orig_video_mode = LINUX_VIDEO_MODE_TEXT;
+    linux_boot_params.orig_video_cols = LINUX_VIDEO_COLS;
+    linux_boot_params.orig_video_lines = LINUX_VIDEO_LINES;
+    linux_boot_params.orig_video_is_vga = 1;
+    linux_boot_params.orig_video_points = LINUX_VIDEO_POINTS;
+}
+
+
+// copies the memory map of mmap_detect (E820) to the boot parameters
+void linux_setup_e820(void) {
+
+    u64 n = MIN(n_mmap_entries, LINUX_E820_MAX);
+    if (n_mmap_entries > LINUX_E820_MAX) log_warn("Only the first %u memory map entries are passed to Linux\n", n);
+
+    for (u64 i = 0; i < n; i++) {
+        linux_boot_params.e820_table[i].addr = MMAP_ENTRIES[i].base;
+        linux_boot_params.e820_table[i].size = MMAP_ENTRIES[i].length;
+        linux_boot_params.e820_table[i].type = MMAP_ENTRIES[i].type;
+    }
+
+    linux_boot_params.e820_entries = n;
+}
+
+
+// jumps to the 64-bit entry point of a loaded kernel with rsi = linux_boot_params
+// it needs interrupts disabled and its own GDT (cs = LINUX_BOOT_CS, the data segments LINUX_BOOT_DS)
+NORETURN void linux_start(u64 kernel) {
+
+    // no controller may keep writing to memory the kernel gets (heap_dma is usable RAM for it)
+    drive_shutdown_all();
+
+    // after the last message of the loader
+    linux_setup_video();
+
+    x86_cli();
+
+    linux_gdtr.limit = sizeof(linux_gdt) - 1;
+    linux_gdtr.base = (u64)linux_gdt;
+
+    ASM(
+        "lgdt [%0]\n"
+        "mov ax, %3\n"
+        "mov ds, ax\n"
+        "mov es, ax\n"
+        "mov ss, ax\n"
+
+        // cs can only be reloaded by a far jump (or return)
+        "push %4\n"
+        "push %1\n"
+        "retfq\n"
+        :
+        : "r"(&linux_gdtr), "r"(kernel + LINUX_ENTRY_64), "S"(&linux_boot_params), "i"(LINUX_BOOT_DS), "i"(LINUX_BOOT_CS)
+        : "rax", "memory");
+
+    x86_hang();
+}
@@ -0,0 +1,292 @@
+#include <types.h>
+#include <lz4.h>
+#include <vfs.h>
+#include <utils.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+// returns true if a file starting with <magic> can be decompressed by lz4_load
+bool lz4_is_compressed(u32 magic) {
+    return (magic == LZ4_MAGIC) || (magic == LZ4_LEGACY_MAGIC) || ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC);
+}
+
+
+static u32 lz4_rotl(u32 val, u64 n) {
+    return (val << n) | (val >> (32 - n));
+}
+
+
+// xxHash32 (only used for frame header checksums, so it is kept simple)
+u32 lz4_xxh32(u8 *data, u64 n_bytes, u32 seed) {
+
+    u64 i = 0;
+    u32 hash;
+
+    if (n_bytes >= 16) {
+        u32 acc[4] = {seed + LZ4_XXH_PRIME1 + LZ4_XXH_PRIME2, seed + LZ4_XXH_PRIME2, seed, seed - LZ4_XXH_PRIME1};
+
+        for (; i + 16 <= n_bytes; i += 16)
+            for (u64 j = 0; j < 4; j++)
+                acc[j] = lz4_rotl(acc[j] + *(u32*)(data + i + 4 * j) * LZ4_XXH_PRIME2, 13) * LZ4_XXH_PRIME1;
+
+        hash = lz4_rotl(acc[0], 1) + lz4_rotl(acc[1], 7) + lz4_rotl(acc[2], 12) + lz4_rotl(acc[3], 18);
+    } else {
+        hash = seed + LZ4_XXH_PRIME5;
+    }
+
+    hash += n_bytes;
+
+    for (; i + 4 <= n_bytes; i += 4) hash = lz4_rotl(hash + *(u32*)(data + i) * LZ4_XXH_PRIME3, 17) * LZ4_XXH_PRIME4;
+    for (; i < n_bytes; i++) hash = lz4_rotl(hash + data[i] * LZ4_XXH_PRIME5, 11) * LZ4_XXH_PRIME1;
+
+    hash ^= hash >> 15;
+    hash *= LZ4_XXH_PRIME2;
+    hash ^= hash >> 13;
+    hash *= LZ4_XXH_PRIME3;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+
+// copies literals and matches, 8 bytes at a time unless the source is less than 8 bytes behind
+// (a match closer than 8 bytes repeats its pattern, so it is copied byte by byte)
+void lz4_copy(u8 *dest, u8 *src, u64 n_bytes) {
+
+    u64 i = 0;
+
+    if ((src > dest) || (dest - src >= 8))
+        for (; i + 8 <= n_bytes; i += 8) *(u64*)(dest + i) = *(u64*)(src + i);
+
+    for (; i < n_bytes; i++) dest[i] = src[i];
+}
+
+
+// decodes a compressed block of <n_src> bytes into <dest> (<n_dest> at most)
+// matches may reach back into earlier blocks down to <window>
+// returns the decompressed size or U64_MAX if the block is corrupt
+u64 lz4_decode_block(u8 *src, u64 n_src, u8 *dest, u64 n_dest, u8 *window) {
+
+    u8 *in = src;
+    u8 *in_end = src + n_src;
+    u8 *out = dest;
+    u8 *out_end = dest + n_dest;
+
+    while (in < in_end) {
+
+        u8 token = *in++;
+
+        // literals: 4 bits, 15 -> more length bytes follow (255 -> even more)
+        u64 n_literals = token >> 4;
+        if (n_literals == LZ4_RUN_MASK) {
+            u8 b;
+            do {
+                if (in == in_end) return U64_MAX;
+                b = *in++;
+                n_literals += b;
+            } while (b == 255);
+        }
+
+        if ((n_literals > (u64)(in_end - in)) || (n_literals > (u64)(out_end - out))) return U64_MAX;
+
+        lz4_copy(out, in, n_literals);
+        in += n_literals;
+        out += n_literals;
+
+        // the last sequence only has literals
+        if (in == in_end) break;
+
+        if (in_end - in < 2) return U64_MAX;
+        u64 offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        if ((offset == 0) || (offset > (u64)(out - window))) return U64_MAX;
+
+        u64 n_match = token & LZ4_RUN_MASK;
+        if (n_match == LZ4_RUN_MASK) {
+            u8 b;
+            do {
+                if (in == in_end) return U64_MAX;
+                b = *in++;
+                n_match += b;
+            } while (b == 255);
+        }
+        n_match += LZ4_MIN_MATCH;
+
+        if (n_match > (u64)(out_end - out)) return U64_MAX;
+
+        lz4_copy(out, out - offset, n_match);
+        out += n_match;
+    }
+
+    return out - dest;
+}
+
+
+// decompresses a frame (after its magic number) to <dest> + <n_out>
+// the blocks are decoded straight from the stream buffer while the following data is read
+// returns the decompressed size so far
+u64 lz4_load_frame(vfs_stream_t *stream, u8 *dest, u64 max_bytes, u64 n_out) {
+
+    u8 *header = vfs_stream_get(stream, 2);
+    if (!header) log_err("LZ4: truncated frame header\n");
+
+    u8 flg = header[0];
+    u8 bd = header[1];
+
+    if (LZ4_FLG_VERSION(flg) != 1) log_err("LZ4: unsupported frame version %u\n", (u64)LZ4_FLG_VERSION(flg));
+    if (flg & (LZ4_FLG_RESERVED | LZ4_FLG_DICT_ID)) log_err("LZ4: dictionaries are not supported\n");
+    if (LZ4_BD_MAX_SIZE(bd) < 4) log_err("LZ4: invalid block size\n");
+
+    // 64 KiB, 256 KiB, 1 MiB or 4 MiB
+    u64 max_block = 1 << (2 * LZ4_BD_MAX_SIZE(bd) + 8);
+    u64 n_block_checksum = (flg & LZ4_FLG_BLOCK_CHECKSUM) ? sizeof(u32) : 0;
+
+    // FLG, BD, content size and the header checksum (second byte of the xxHash32 of the descriptor)
+    u64 n_header = 2 + ((flg & LZ4_FLG_CONTENT_SIZE) ? sizeof(u64) : 0) + 1;
+
+    header = vfs_stream_get(stream, n_header);
+    if (!header) log_err("LZ4: truncated frame header\n");
+
+    if (((lz4_xxh32(header, n_header - 1, 0) >> 8) & 0xff) != header[n_header - 1])
+        log_err("LZ4: frame header checksum mismatch\n");
+
+    if ((flg & LZ4_FLG_CONTENT_SIZE) && (*(u64*)(header + 2) > max_bytes - n_out))
+        log_err("LZ4: %u decompressed bytes do not fit\n", *(u64*)(header + 2));
+
+    vfs_stream_skip(stream, n_header);
+
+    while (true) {
+
+        u8 *block = vfs_stream_get(stream, sizeof(u32));
+        if (!block) log_err("LZ4: truncated frame\n");
+
+        u32 size = *(u32*)block;
+        vfs_stream_skip(stream, sizeof(u32));
+
+        // end mark
+        if (size == 0) break;
+
+        u64 n_src = size & ~LZ4_BLOCK_UNCOMPRESSED;
+        if (n_src > max_block) log_err("LZ4: block of %u bytes is too large\n", n_src);
+
+        block = vfs_stream_get(stream, n_src + n_block_checksum);
+        if (!block) log_err("LZ4: truncated frame\n");
+
+        u64 n;
+
+        if (size & LZ4_BLOCK_UNCOMPRESSED) {
+            if (n_src > max_bytes - n_out) log_err("LZ4: decompressed data does not fit\n");
+            lz4_copy(dest + n_out, block, n_src);
+            n = n_src;
+        } else {
+            n = lz4_decode_block(block, n_src, dest + n_out, MIN(max_block, max_bytes - n_out), dest);
+            if (n == U64_MAX) log_err("LZ4: corrupt block at decompressed offset %x\n", n_out);
+        }
+
+        n_out += n;
+        vfs_stream_skip(stream, n_src + n_block_checksum);
+    }
+
+    // the content checksum is not verified
+    if (flg & LZ4_FLG_CONTENT_CHECKSUM) {
+        if (!vfs_stream_get(stream, sizeof(u32))) log_err("LZ4: truncated frame\n");
+        vfs_stream_skip(stream, sizeof(u32));
+    }
+
+    return n_out;
+}
+
+
+// decompresses legacy blocks (after the magic number) to <dest> + <n_out>
+// they have no end mark, so anything that is not a block size ends them (the next frame or padding)
+// returns the decompressed size so far
+u64 lz4_load_legacy(vfs_stream_t *stream, u8 *dest, u64 max_bytes, u64 n_out) {
+
+    while (true) {
+
+        u8 *block = vfs_stream_get(stream, sizeof(u32));
+        if (!block) break;
+
+        u32 size = *(u32*)block;
+
+        // concatenated files repeat the magic number
+        if (size == LZ4_LEGACY_MAGIC) {
+            vfs_stream_skip(stream, sizeof(u32));
+            continue;
+        }
+
+        if ((size == 0) || (size > LZ4_LEGACY_MAX_COMPRESSED)) break;
+        vfs_stream_skip(stream, sizeof(u32));
+
+        block = vfs_stream_get(stream, size);
+        if (!block) log_err("LZ4: truncated block\n");
+
+        // blocks are independent
+        u64 n = lz4_decode_block(block, size, dest + n_out, MIN(LZ4_LEGACY_BLOCK, max_bytes - n_out), dest + n_out);
+        if (n == U64_MAX) log_err("LZ4: corrupt block at decompressed offset %x\n", n_out);
+
+        n_out += n;
+        vfs_stream_skip(stream, size);
+    }
+
+    return n_out;
+}
+
+
+// loads an LZ4 compressed file (frames, legacy blocks and skippable frames) into <dest> (<max_bytes> at most)
+// the file is streamed, so the compressed data never has to fit into memory at once
+// <verify> (0 -> none) hashes the compressed file as it arrives
+// returns the decompressed size
+u64 lz4_load(file_t *file, u8 *dest, u64 max_bytes, struct Verify *verify) {
+
+    vfs_stream_t stream;
+    vfs_stream_init(&stream, file, verify);
+
+    u64 n_out = 0;
+
+    while (true) {
+
+        u8 *header = vfs_stream_get(&stream, sizeof(u32));
+        if (!header) break;
+
+        u32 magic = *(u32*)header;
+
+        if (magic == LZ4_MAGIC) {
+            vfs_stream_skip(&stream, sizeof(u32));
+            n_out = lz4_load_frame(&stream, dest, max_bytes, n_out);
+            continue;
+        }
+
+        if (magic == LZ4_LEGACY_MAGIC) {
+            vfs_stream_skip(&stream, sizeof(u32));
+            n_out = lz4_load_legacy(&stream, dest, max_bytes, n_out);
+            continue;
+        }
+
+        // padding after the last frame
+        if ((magic & LZ4_SKIPPABLE_MASK) != LZ4_SKIPPABLE_MAGIC) break;
+
+        header = vfs_stream_get(&stream, 2 * sizeof(u32));
+        if (!header) break;
+
+        u64 n_skip = *(u32*)(header + sizeof(u32));
+        vfs_stream_skip(&stream, 2 * sizeof(u32));
+
+        while (n_skip) {
+            u64 n = MIN(n_skip, VFS_STREAM_CHUNK);
+            if (!vfs_stream_get(&stream, n)) log_err("LZ4: truncated skippable frame\n");
+
+            vfs_stream_skip(&stream, n);
+            n_skip -= n;
+        }
+    }
+
+    vfs_stream_close(&stream);
+
+    log_info("LZ4: %u KiB decompressed from %u KiB (%u reads)\n", n_out / 1024, file->size / 1024, stream.n_reads);
+
+    return n_out;
+}
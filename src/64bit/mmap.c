@@ -0,0 +1,99 @@
+#include <types.h>
+#include <mmap.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+
+
+static mmap_range_t mmap_reserved[MMAP_MAX_RESERVED];
+static u64 n_mmap_reserved = 0;
+
+
+// returns the index of the first reserved range that overlaps [addr, addr + n_bytes)
+// returns MMAP_MAX_RESERVED if there is none
+u64 mmap_overlap(u64 addr, u64 n_bytes) {
+
+    for (u64 i = 0; i < n_mmap_reserved; i++) {
+        if ((addr < mmap_reserved[i].end) && (mmap_reserved[i].start < addr + n_bytes)) return i;
+    }
+    return MMAP_MAX_RESERVED;
+}
+
+
+// returns the amount of usable memory between MMAP_MIN_ADDR and MMAP_MAX_ADDR
+u64 mmap_usable_bytes(void) {
+
+    u64 n_bytes = 0;
+
+    for (u64 i = 0; i < n_mmap_entries; i++) {
+        mmap_entry_t *entry = &MMAP_ENTRIES[i];
+        if (entry->type != MMAP_USABLE) continue;
+
+        u64 start = MAX(entry->base, MMAP_MIN_ADDR);
+        u64 end = MIN(entry->base + entry->length, MMAP_MAX_ADDR);
+        if (end > start) n_bytes += end - start;
+    }
+    return n_bytes;
+}
+
+
+// checks if [addr, addr + n_bytes) lies within a single usable region and has not been reserved
+bool mmap_is_free(u64 addr, u64 n_bytes) {
+
+    if ((addr < MMAP_MIN_ADDR) || (addr + n_bytes > MMAP_MAX_ADDR)) return false;
+    if (mmap_overlap(addr, n_bytes) != MMAP_MAX_RESERVED) return false;
+
+    for (u64 i = 0; i < n_mmap_entries; i++) {
+        mmap_entry_t *entry = &MMAP_ENTRIES[i];
+        if (entry->type != MMAP_USABLE) continue;
+
+        if ((addr >= entry->base) && (addr + n_bytes <= entry->base + entry->length)) return true;
+    }
+    return false;
+}
+
+
+// marks [addr, addr + n_bytes) as used
+void mmap_reserve(u64 addr, u64 n_bytes) {
+
+    if (n_mmap_reserved == MMAP_MAX_RESERVED) log_err("Too many reserved memory ranges\n");
+
+    mmap_reserved[n_mmap_reserved].start = addr;
+    mmap_reserved[n_mmap_reserved].end = addr + n_bytes;
+    n_mmap_reserved++;
+}
+
+
+// reserves the highest free range of <n_bytes> (aligned to <align>, a power of 2) below <max_addr>
+// returns 0 if there is not enough memory
+void *mmap_reserve_high(u64 n_bytes, u64 align, u64 max_addr) {
+
+    u64 best = 0;
+
+    for (u64 i = 0; i < n_mmap_entries; i++) {
+        mmap_entry_t *entry = &MMAP_ENTRIES[i];
+        if (entry->type != MMAP_USABLE) continue;
+
+        u64 start = MAX(entry->base, MMAP_MIN_ADDR);
+        u64 end = MIN(entry->base + entry->length, MIN(max_addr, MMAP_MAX_ADDR));
+
+        // move down past reserved ranges until the memory fits
+        while ((end > start) && (end - start >= n_bytes)) {
+
+            u64 addr = (end - n_bytes) & ~(align - 1);
+            if (addr < start) break;
+
+            u64 overlap = mmap_overlap(addr, n_bytes);
+            if (overlap == MMAP_MAX_RESERVED) {
+                best = MAX(best, addr);
+                break;
+            }
+            end = mmap_reserved[overlap].start;
+        }
+    }
+
+    if (best == 0) return 0;
+
+    mmap_reserve(best, n_bytes);
+    return (void*)best;
+}
@@ -4,6 +4,11 @@
 #include <x86.h>
 #include <pci.h>
 #include <ide.h>
+#include <ahci.h>
+#include <nvme.h>
+#include <virtio_blk.h>
+#include <xhci.h>
+#include <sdhci.h>
 
 
 // scans all PCI devices and initializes them if possible
@@ -35,6 +40,17 @@ void pci_scan_all(void) {
 // tries to identify/initialize a PCI device
 void pci_drive_identify(u16 bus, u8 dev, u8 func) {
 
+    // virtio devices are identified by their IDs
+    u16 vendor_id = pci_cfg_read(bus, dev, func, PCI_OFF_VENDOR_ID);
+    u16 device_id = pci_cfg_read(bus, dev, func, PCI_OFF_DEVICE_ID);
+
+    if ((vendor_id == VIRTIO_PCI_VENDOR) &&
+            ((device_id == VIRTIO_PCI_BLK_LEGACY) || (device_id == VIRTIO_PCI_BLK_MODERN))) {
+        log_info("Found virtio block device\n");
+        virtio_blk_initialize(bus, dev, func);
+        return;
+    }
+
     // get the device type
     u16 class = pci_cfg_read(bus, dev, func, PCI_OFF_CLASS_ALL);
 
@@ -48,15 +64,24 @@ void pci_drive_identify(u16 bus, u8 dev, u8 func) {
             break;
         case PCI_CLASS_SATA:
             log_info("Found SATA device\n");
+            if (pci_cfg_read(bus, dev, func, PCI_OFF_PROG_IF) == AHCI_PROG_IF)
+                ahci_initialize(bus, dev, func);
+            break;
+        case PCI_CLASS_NVME:
+            log_info("Found NVMe controller\n");
+            nvme_initialize(bus, dev, func);
             break;
         case PCI_CLASS_FLOPPY:
             log_info("Found floppy drive\n");
             break;
         case PCI_CLASS_USB:
             log_info("Found USB controller\n");
+            if (pci_cfg_read(bus, dev, func, PCI_OFF_PROG_IF) == XHCI_PROG_IF)
+                xhci_initialize(bus, dev, func);
             break;
         case PCI_CLASS_SD:
             log_info("Found SD controller\n");
+            sdhci_initialize(bus, dev, func);
             break;
     }
 }
@@ -80,8 +105,67 @@ u32 pci_cfg_read(u8 bus, u8 dev, u8 func, u8 off, u32 mask) {
 
     // extract the correct part of the data
     u32 data = x86_ind(PCI_CFG_DATA);
-    data >>= ((off & 2) * 8);
+    data >>= ((off & 3) * 8);
     data &= mask;
 
     return data;
 }
+
+
+// writes information to a PCI device's configuration address space
+// the bits outside of <mask> (at <off>) keep their current value
+void pci_cfg_write(u8 bus, u8 dev, u8 func, u8 off, u32 mask, u32 data) {
+
+    u32 addr = (u32)(
+            (bus << 16) | 
+            (dev << 11) |
+            (func << 8) | 
+            (off & 0xfc) | 
+            ((u32)0x80000000) // enable bit
+            );
+
+    u8 shift = (off & 3) * 8;
+
+    // read-modify-write the entire double word
+    x86_outd(PCI_CFG_ADDR, addr);
+    u32 cur = x86_ind(PCI_CFG_DATA);
+    cur &= ~(mask << shift);
+    cur |= (data & mask) << shift;
+
+    x86_outd(PCI_CFG_ADDR, addr);
+    x86_outd(PCI_CFG_DATA, cur);
+}
+
+
+// returns the address of a BAR (I/O port or memory)
+// 64-bit memory BARs take up the next BAR as well
+u64 pci_bar(u8 bus, u8 dev, u8 func, u8 n) {
+
+    u32 bar = pci_cfg_read(bus, dev, func, PCI_OFF_BAR(n));
+
+    if (bar & PCI_BAR_IO) return bar & PCI_BAR_IO_MASK;
+
+    if (bar & PCI_BAR_MEM_64)
+        return QWORD(pci_cfg_read(bus, dev, func, PCI_OFF_BAR(n + 1)), bar & PCI_BAR_MEM_MASK);
+
+    return bar & PCI_BAR_MEM_MASK;
+}
+
+
+// returns the offset of the next capability with the ID <id> after <off>
+// start with <off> = 0, returns 0 if there are no more
+u8 pci_next_cap(u8 bus, u8 dev, u8 func, u8 off, u8 id) {
+
+    // device has no capability list
+    if (!(pci_cfg_read(bus, dev, func, PCI_OFF_STATUS) & PCI_STATUS_CAP_LIST)) return 0;
+
+    // first capability or the one after <off>
+    if (off == 0) off = pci_cfg_read(bus, dev, func, PCI_OFF_CAP_PTR);
+    else off = pci_cfg_read(bus, dev, func, off + 1, 0xff);
+
+    while (off != 0) {
+        if (pci_cfg_read(bus, dev, func, off, 0xff) == id) return off;
+        off = pci_cfg_read(bus, dev, func, off + 1, 0xff);
+    }
+    return 0;
+}
@@ -19,7 +19,7 @@ void pic_init(void) {
 
     // INT 0x20-0x27    -> master PIC's IRQs
     // INT 0x28-0x2f    -> slave PIC's IRQs
-    pic_remap(0x20, 0x28);
+    pic_remap(PIC_MASTER_OFF, PIC_SLAVE_OFF);
 
     log_info("Initialized 8259 PIC\n");
 }
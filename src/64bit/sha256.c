@@ -0,0 +1,409 @@
+#include <types.h>
+#include <sha256.h>
+#include <cpu.h>
+#include <utils.h>
+#include <log.h>
+#include <tty.h>
+#include <x86.h>
+
+
+sha256_backend_t sha256_backend = SHA256_GENERIC;
+
+// round constants (also read 4 at a time by the SHA-NI backend)
+static ALIGNED(16) u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// initial hash value
+static u32 sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// pshufb mask that turns the big endian message words around
+static ALIGNED(16) u8 sha256_byte_swap[16] = {
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+};
+
+
+// picks the fastest backend
+// cpu_init has to be called before
+void sha256_init(void) {
+
+    // pshufb and palignr are SSSE3, pblendw is SSE4.1
+    if (cpu_features.sha && cpu_features.ssse3 && cpu_features.sse41) sha256_backend = SHA256_SHANI;
+
+    log_info("SHA-256 backend: %s\n", (sha256_backend == SHA256_SHANI) ? "SHA-NI" : "generic");
+}
+
+
+static u32 sha256_rotr(u32 val, u64 n) {
+    return (val >> n) | (val << (32 - n));
+}
+
+
+static u32 sha256_load_be(u8 *p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+
+// compresses whole 64 byte blocks into <state>
+void sha256_blocks_generic(u32 *state, u8 *data, u64 n_blocks) {
+
+    u32 w[64];
+
+    for (; n_blocks; n_blocks--, data += SHA256_BLOCK_BYTES) {
+
+        // message schedule
+        for (u64 i = 0; i < 16; i++) w[i] = sha256_load_be(data + 4 * i);
+
+        for (u64 i = 16; i < 64; i++) {
+            u32 s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            u32 s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        u32 a = state[0], b = state[1], c = state[2], d = state[3];
+        u32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (u64 i = 0; i < 64; i++) {
+            u32 s1 = sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25);
+            u32 ch = (e & f) ^ (~e & g);
+            u32 t1 = h + s1 + ch + sha256_k[i] + w[i];
+            u32 s0 = sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22);
+            u32 maj = (a & b) ^ (a & c) ^ (b & c);
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + s0 + maj;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+
+// compresses whole 64 byte blocks into <state> with the SHA extensions (see Intel's "New Instructions
+// Supporting the Secure Hash Algorithm on Intel Architecture Processors")
+// the state is kept as ABEF/CDGH in xmm1/xmm2, sha256rnds2 takes the message + constants from xmm0
+// only usable with SSE enabled (see cpu_init)
+void sha256_blocks_shani(u32 *state, u8 *data, u64 n_blocks) {
+
+    if (n_blocks == 0) return;
+
+    u8 *p = data;
+    u64 n = n_blocks;
+
+    ASM(
+        // DCBA, HGFE -> ABEF, CDGH
+        "movdqu xmm1, [%2]\n"
+        "movdqu xmm2, [%2 + 0x10]\n"
+        "pshufd xmm1, xmm1, 0xb1\n"
+        "pshufd xmm2, xmm2, 0x1b\n"
+        "movdqa xmm7, xmm1\n"
+        "palignr xmm1, xmm2, 8\n"
+        "pblendw xmm2, xmm7, 0xf0\n"
+        "movdqa xmm8, [%4]\n"
+
+        "1:\n"
+        "movdqa xmm9, xmm1\n"
+        "movdqa xmm10, xmm2\n"
+
+        // message words 4i..4i+3 end up in xmm3 + i % 4 (scheduled by sha256msg1/2 from round 16 on)
+
+        // rounds 0-3
+        "movdqu xmm0, [%0]\n"
+        "pshufb xmm0, xmm8\n"
+        "movdqa xmm3, xmm0\n"
+        "paddd xmm0, [%3]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+
+        // rounds 4-7
+        "movdqu xmm0, [%0 + 0x10]\n"
+        "pshufb xmm0, xmm8\n"
+        "movdqa xmm4, xmm0\n"
+        "paddd xmm0, [%3 + 0x10]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm3, xmm4\n"
+
+        // rounds 8-11
+        "movdqu xmm0, [%0 + 0x20]\n"
+        "pshufb xmm0, xmm8\n"
+        "movdqa xmm5, xmm0\n"
+        "paddd xmm0, [%3 + 0x20]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm4, xmm5\n"
+
+        // rounds 12-15
+        "movdqu xmm0, [%0 + 0x30]\n"
+        "pshufb xmm0, xmm8\n"
+        "movdqa xmm6, xmm0\n"
+        "paddd xmm0, [%3 + 0x30]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm6\n"
+        "palignr xmm7, xmm5, 4\n"
+        "paddd xmm3, xmm7\n"
+        "sha256msg2 xmm3, xmm6\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm5, xmm6\n"
+
+        // rounds 16-19
+        "movdqa xmm0, xmm3\n"
+        "paddd xmm0, [%3 + 0x40]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm3\n"
+        "palignr xmm7, xmm6, 4\n"
+        "paddd xmm4, xmm7\n"
+        "sha256msg2 xmm4, xmm3\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm6, xmm3\n"
+
+        // rounds 20-23
+        "movdqa xmm0, xmm4\n"
+        "paddd xmm0, [%3 + 0x50]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm4\n"
+        "palignr xmm7, xmm3, 4\n"
+        "paddd xmm5, xmm7\n"
+        "sha256msg2 xmm5, xmm4\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm3, xmm4\n"
+
+        // rounds 24-27
+        "movdqa xmm0, xmm5\n"
+        "paddd xmm0, [%3 + 0x60]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm5\n"
+        "palignr xmm7, xmm4, 4\n"
+        "paddd xmm6, xmm7\n"
+        "sha256msg2 xmm6, xmm5\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm4, xmm5\n"
+
+        // rounds 28-31
+        "movdqa xmm0, xmm6\n"
+        "paddd xmm0, [%3 + 0x70]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm6\n"
+        "palignr xmm7, xmm5, 4\n"
+        "paddd xmm3, xmm7\n"
+        "sha256msg2 xmm3, xmm6\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm5, xmm6\n"
+
+        // rounds 32-35
+        "movdqa xmm0, xmm3\n"
+        "paddd xmm0, [%3 + 0x80]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm3\n"
+        "palignr xmm7, xmm6, 4\n"
+        "paddd xmm4, xmm7\n"
+        "sha256msg2 xmm4, xmm3\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm6, xmm3\n"
+
+        // rounds 36-39
+        "movdqa xmm0, xmm4\n"
+        "paddd xmm0, [%3 + 0x90]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm4\n"
+        "palignr xmm7, xmm3, 4\n"
+        "paddd xmm5, xmm7\n"
+        "sha256msg2 xmm5, xmm4\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm3, xmm4\n"
+
+        // rounds 40-43
+        "movdqa xmm0, xmm5\n"
+        "paddd xmm0, [%3 + 0xa0]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm5\n"
+        "palignr xmm7, xmm4, 4\n"
+        "paddd xmm6, xmm7\n"
+        "sha256msg2 xmm6, xmm5\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm4, xmm5\n"
+
+        // rounds 44-47
+        "movdqa xmm0, xmm6\n"
+        "paddd xmm0, [%3 + 0xb0]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm6\n"
+        "palignr xmm7, xmm5, 4\n"
+        "paddd xmm3, xmm7\n"
+        "sha256msg2 xmm3, xmm6\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm5, xmm6\n"
+
+        // rounds 48-51
+        "movdqa xmm0, xmm3\n"
+        "paddd xmm0, [%3 + 0xc0]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm3\n"
+        "palignr xmm7, xmm6, 4\n"
+        "paddd xmm4, xmm7\n"
+        "sha256msg2 xmm4, xmm3\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+        "sha256msg1 xmm6, xmm3\n"
+
+        // rounds 52-55
+        "movdqa xmm0, xmm4\n"
+        "paddd xmm0, [%3 + 0xd0]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm4\n"
+        "palignr xmm7, xmm3, 4\n"
+        "paddd xmm5, xmm7\n"
+        "sha256msg2 xmm5, xmm4\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+
+        // rounds 56-59
+        "movdqa xmm0, xmm5\n"
+        "paddd xmm0, [%3 + 0xe0]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "movdqa xmm7, xmm5\n"
+        "palignr xmm7, xmm4, 4\n"
+        "paddd xmm6, xmm7\n"
+        "sha256msg2 xmm6, xmm5\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+
+        // rounds 60-63
+        "movdqa xmm0, xmm6\n"
+        "paddd xmm0, [%3 + 0xf0]\n"
+        "sha256rnds2 xmm2, xmm1\n"
+        "pshufd xmm0, xmm0, 0x0e\n"
+        "sha256rnds2 xmm1, xmm2\n"
+
+        "paddd xmm1, xmm9\n"
+        "paddd xmm2, xmm10\n"
+        "add %0, 0x40\n"
+        "dec %1\n"
+        "jnz 1b\n"
+
+        // ABEF, CDGH -> DCBA, HGFE
+        "pshufd xmm1, xmm1, 0x1b\n"
+        "pshufd xmm2, xmm2, 0xb1\n"
+        "movdqa xmm7, xmm1\n"
+        "pblendw xmm1, xmm2, 0xf0\n"
+        "palignr xmm2, xmm7, 8\n"
+        "movdqu [%2], xmm1\n"
+        "movdqu [%2 + 0x10], xmm2\n"
+        : "+r"(p), "+r"(n)
+        : "r"(state), "r"(sha256_k), "r"(sha256_byte_swap)
+        : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "cc", "memory");
+}
+
+
+// compresses whole blocks with the selected backend
+void sha256_blocks(u32 *state, u8 *data, u64 n_blocks) {
+
+    if (sha256_backend == SHA256_SHANI) {
+        sha256_blocks_shani(state, data, n_blocks);
+        return;
+    }
+
+    sha256_blocks_generic(state, data, n_blocks);
+}
+
+
+void sha256_start(sha256_ctx_t *ctx) {
+
+    for (u64 i = 0; i < 8; i++) ctx->state[i] = sha256_iv[i];
+
+    ctx->n_block = 0;
+    ctx->n_bytes = 0;
+}
+
+
+// hashes the next <n_bytes> of the message
+// whole blocks are compressed straight from <data>, only a partial block is copied
+void sha256_update(sha256_ctx_t *ctx, u8 *data, u64 n_bytes) {
+
+    ctx->n_bytes += n_bytes;
+
+    if (ctx->n_block) {
+        u64 n = MIN(SHA256_BLOCK_BYTES - ctx->n_block, n_bytes);
+
+        mem_cpy(ctx->block + ctx->n_block, data, n);
+        ctx->n_block += n;
+        data += n;
+        n_bytes -= n;
+
+        if (ctx->n_block < SHA256_BLOCK_BYTES) return;
+
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->n_block = 0;
+    }
+
+    u64 n_blocks = n_bytes / SHA256_BLOCK_BYTES;
+    if (n_blocks) sha256_blocks(ctx->state, data, n_blocks);
+
+    data += n_blocks * SHA256_BLOCK_BYTES;
+    n_bytes %= SHA256_BLOCK_BYTES;
+
+    mem_cpy(ctx->block, data, n_bytes);
+    ctx->n_block = n_bytes;
+}
+
+
+// pads the message and writes the big endian digest (SHA256_DIGEST_BYTES)
+void sha256_final(sha256_ctx_t *ctx, u8 *digest) {
+
+    u64 n_bits = ctx->n_bytes * 8;
+
+    // 0x80, zeros and the length in bits (in a second block if it does not fit)
+    ctx->block[ctx->n_block++] = 0x80;
+
+    if (ctx->n_block > SHA256_BLOCK_BYTES - sizeof(u64)) {
+        mem_set(ctx->block + ctx->n_block, 0, SHA256_BLOCK_BYTES - ctx->n_block);
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->n_block = 0;
+    }
+
+    mem_set(ctx->block + ctx->n_block, 0, SHA256_BLOCK_BYTES - sizeof(u64) - ctx->n_block);
+    for (u64 i = 0; i < 8; i++) ctx->block[SHA256_BLOCK_BYTES - 8 + i] = n_bits >> (56 - 8 * i);
+
+    sha256_blocks(ctx->state, ctx->block, 1);
+
+    for (u64 i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
@@ -0,0 +1,85 @@
+#include <types.h>
+#include <tsc.h>
+#include <x86.h>
+#include <log.h>
+#include <tty.h>
+
+
+u64 tsc_khz = 0;
+
+
+// measures the TSC frequency against PIT channel 2 (not connected to an IRQ)
+// falls back to cpuid (or a default) if OUT2 never goes high
+void tsc_init(void) {
+
+    u16 count = PIT_HZ * TSC_CALIBRATE_MS / 1000;
+
+    // gate high, speaker off
+    x86_outb(PIT_PORT_CTRL, (x86_inb(PIT_PORT_CTRL) & ~PIT_CTRL_SPEAKER) | PIT_CTRL_GATE2);
+
+    // the count starts when its high byte is written, OUT2 goes high when it reaches 0
+    x86_outb(PIT_PORT_CMD, PIT_CMD_CH2_MODE0);
+    x86_outb(PIT_PORT_CH2, count & 0xff);
+    x86_outb(PIT_PORT_CH2, count >> 8);
+
+    u64 start = x86_rdtsc();
+    u64 end = start;
+    bool timeout = false;
+
+    while (!(x86_inb(PIT_PORT_CTRL) & PIT_CTRL_OUT2)) {
+        end = x86_rdtsc();
+        if (end - start > TSC_CALIBRATE_TIMEOUT) {
+            timeout = true;
+            break;
+        }
+    }
+
+    tsc_khz = timeout ? 0 : (end - start) / TSC_CALIBRATE_MS;
+
+    // no PIT (or OUT2 was high right away)
+    if (tsc_khz == 0) {
+        tsc_khz = tsc_cpuid_khz();
+        log_warn("PIT calibration failed, TSC: %u kHz (%s)\n", tsc_khz,
+                (tsc_khz == TSC_DEFAULT_KHZ) ? "default" : "cpuid");
+        return;
+    }
+
+    log_info("TSC: %u kHz\n", tsc_khz);
+}
+
+
+// returns the TSC frequency reported by cpuid (leaf 0x15, then 0x16), TSC_DEFAULT_KHZ if there is none
+u64 tsc_cpuid_khz(void) {
+
+    u32 max_leaf, eax, ebx, ecx, edx;
+    x86_cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+    // TSC = crystal * ebx / eax
+    if (max_leaf >= CPUID_LEAF_TSC) {
+        x86_cpuid(CPUID_LEAF_TSC, 0, &eax, &ebx, &ecx, &edx);
+        if (eax && ebx && ecx) return (u64)ecx * ebx / eax / 1000;
+    }
+
+    if (max_leaf >= CPUID_LEAF_FREQ) {
+        x86_cpuid(CPUID_LEAF_FREQ, 0, &eax, &ebx, &ecx, &edx);
+        if (eax & 0xffff) return (u64)(eax & 0xffff) * 1000;
+    }
+
+    return TSC_DEFAULT_KHZ;
+}
+
+
+// converts TSC ticks to nanoseconds
+// (0 before tsc_init)
+u64 tsc_ns(u64 ticks) {
+    if (!tsc_khz) return 0;
+    return ticks * 1000000 / tsc_khz;
+}
+
+
+// converts TSC ticks to microseconds
+// (0 before tsc_init)
+u64 tsc_us(u64 ticks) {
+    if (!tsc_khz) return 0;
+    return ticks * 1000 / tsc_khz;
+}
@@ -1,4 +1,5 @@
 #include <types.h>
+#include <x86.h>
 
 
 // writes <n_bytes> times <val> to <dest>
@@ -17,3 +18,15 @@ void mem_cpy(u8 *dest, u8 *src, u64 n_bytes) {
           *(dest + i) = *(src + i);
      }
 }
+
+
+// clears <n_bytes> at <dest> with string stores (8 bytes at a time, the rest byte by byte)
+// for large ranges like .bss, which would take ages with mem_set
+void mem_zero(u8 *dest, u64 n_bytes) {
+
+    u64 n_qwords = n_bytes / 8;
+    u64 n_rest = n_bytes % 8;
+
+    ASM("rep stosq" : "+D"(dest), "+c"(n_qwords) : "a"(0ULL) : "memory");
+    ASM("rep stosb" : "+D"(dest), "+c"(n_rest) : "a"(0ULL) : "memory");
+}
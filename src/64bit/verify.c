@@ -0,0 +1,282 @@
+#include <types.h>
+#include <verify.h>
+#include <vfs.h>
+#include <sha256.h>
+#include <crc32.h>
+#include <tsc.h>
+#include <tty.h>
+#include <log.h>
+#include <x86.h>
+
+
+verify_entry_t verify_entries[VERIFY_MAX_ENTRIES];
+u64 n_verify_entries = 0;
+
+// manifest that is being parsed, also hashed by the throughput report
+static u8 verify_buf[VERIFY_MANIFEST_BYTES];
+
+
+// reports the throughput of the hash backends and reads the manifests of all mounted filesystems
+// vfs_mount_all and tsc_init have to be called before
+void verify_init(void) {
+
+    verify_report();
+
+    for (u64 i = 0; i < n_vfs_mounts; i++) {
+        u64 n = verify_load_manifest(vfs_mounts[i]);
+        if (n) log_info("Manifest of filesystem %u: %u files\n", i, n);
+    }
+}
+
+
+static u64 verify_mb_s(u64 ticks) {
+    return VERIFY_BENCH_BYTES / MAX(tsc_us(ticks), 1);
+}
+
+
+// hashes VERIFY_BENCH_BYTES with every backend the CPU supports and logs the throughput
+void verify_report(void) {
+
+    u64 n_rounds = VERIFY_BENCH_BYTES / VERIFY_MANIFEST_BYTES;
+    u64 n_blocks = VERIFY_MANIFEST_BYTES / SHA256_BLOCK_BYTES;
+
+    u32 state[8] = {0};
+    u32 crc = 0;
+
+    u64 start = x86_rdtsc();
+    for (u64 i = 0; i < n_rounds; i++) sha256_blocks_generic(state, verify_buf, n_blocks);
+    log_info("SHA-256 generic: %u MB/s\n", verify_mb_s(x86_rdtsc() - start));
+
+    if (sha256_backend == SHA256_SHANI) {
+        start = x86_rdtsc();
+        for (u64 i = 0; i < n_rounds; i++) sha256_blocks_shani(state, verify_buf, n_blocks);
+        log_info("SHA-256 SHA-NI: %u MB/s\n", verify_mb_s(x86_rdtsc() - start));
+    }
+
+    start = x86_rdtsc();
+    for (u64 i = 0; i < n_rounds; i++) crc = crc32c_update_slice8(crc, verify_buf, VERIFY_MANIFEST_BYTES);
+    log_info("CRC-32C slice-by-8: %u MB/s\n", verify_mb_s(x86_rdtsc() - start));
+
+    if (crc32c_backend == CRC32C_SSE42) {
+        start = x86_rdtsc();
+        for (u64 i = 0; i < n_rounds; i++) crc = crc32c_update_sse42(crc, verify_buf, VERIFY_MANIFEST_BYTES);
+        log_info("CRC-32C SSE4.2: %u MB/s\n", verify_mb_s(x86_rdtsc() - start));
+    }
+}
+
+
+// reads VERIFY_MANIFEST_PATH of a filesystem (if it has one) into the next free entries
+// returns the number of entries that have been added
+u64 verify_load_manifest(fs_t *fs) {
+
+    file_t file;
+    if (!vfs_open(fs, VERIFY_MANIFEST_PATH, &file)) return 0;
+
+    if (file.size > VERIFY_MANIFEST_BYTES) log_warn("Manifest: only the first %u bytes are used\n", (u64)VERIFY_MANIFEST_BYTES);
+
+    u64 n_bytes = vfs_read(&file, verify_buf, 0, VERIFY_MANIFEST_BYTES);
+    vfs_close(&file);
+
+    u64 n_added = 0;
+    u64 line = 1;
+
+    for (u64 i = 0; i < n_bytes; i++, line++) {
+
+        char *start = (char*)verify_buf + i;
+        while ((i < n_bytes) && (verify_buf[i] != '\n')) i++;
+
+        // CRLF
+        u64 n_chars = (char*)verify_buf + i - start;
+        if (n_chars && (start[n_chars - 1] == '\r')) n_chars--;
+
+        if ((n_chars == 0) || (start[0] == '#')) continue;
+
+        if (n_verify_entries == VERIFY_MAX_ENTRIES) {
+            log_warn("Manifest: more than %u files\n", (u64)VERIFY_MAX_ENTRIES);
+            break;
+        }
+
+        verify_entry_t *entry = &verify_entries[n_verify_entries];
+
+        if (!verify_parse_line(start, n_chars, entry)) {
+            log_warn("Manifest: line %u is invalid\n", line);
+            continue;
+        }
+
+        entry->fs = fs;
+        n_verify_entries++;
+        n_added++;
+    }
+
+    return n_added;
+}
+
+
+// value of a hex digit, 16 if it is none
+static u64 verify_hex(char c) {
+
+    if ((c >= '0') && (c <= '9')) return c - '0';
+    if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+
+    return 16;
+}
+
+
+// parses "<digest> <path>" (not null terminated)
+// the binary mode marker of sha256sum ("*path") and a leading "." ("./path") are accepted
+// returns false if the line is invalid
+bool verify_parse_line(char *line, u64 n_chars, verify_entry_t *entry) {
+
+    u64 n_digits = 0;
+    while ((n_digits < n_chars) && (verify_hex(line[n_digits]) < 16)) n_digits++;
+
+    if (n_digits == 2 * SHA256_DIGEST_BYTES) entry->algo = VERIFY_SHA256;
+    else if (n_digits == 2 * sizeof(u32)) entry->algo = VERIFY_CRC32C;
+    else return false;
+
+    for (u64 i = 0; i < n_digits / 2; i++) entry->digest[i] = (verify_hex(line[2 * i]) << 4) | verify_hex(line[2 * i + 1]);
+
+    u64 i = n_digits;
+    if ((i == n_chars) || ((line[i] != ' ') && (line[i] != '\t'))) return false;
+
+    while ((i < n_chars) && ((line[i] == ' ') || (line[i] == '\t'))) i++;
+
+    if ((i < n_chars) && (line[i] == '*')) i++;
+    if ((n_chars - i >= 2) && (line[i] == '.') && (line[i + 1] == '/')) i++;
+
+    if ((i == n_chars) || (line[i] != '/') || (n_chars - i >= VERIFY_PATH_MAX)) return false;
+
+    u64 n = 0;
+    for (; i < n_chars; i++) entry->path[n++] = line[i];
+    entry->path[n] = 0;
+
+    return true;
+}
+
+
+// returns the manifest entry of a file or 0 if it has none
+verify_entry_t *verify_find(fs_t *fs, const char *path) {
+
+    for (u64 i = 0; i < n_verify_entries; i++) {
+
+        verify_entry_t *entry = &verify_entries[i];
+        if (entry->fs != fs) continue;
+
+        u64 j = 0;
+        while (entry->path[j] && (entry->path[j] == path[j])) j++;
+
+        if (entry->path[j] == path[j]) return entry;
+    }
+
+    return 0;
+}
+
+
+// starts the hash of a file (entry = 0 -> the file is not verified)
+void verify_start(verify_t *verify, verify_entry_t *entry) {
+
+    verify->entry = entry;
+    verify->crc32c = ~0U;
+    verify->n_bytes = 0;
+    verify->ticks = 0;
+
+    sha256_start(&verify->sha256);
+}
+
+
+// hashes the next <n_bytes> of the file (does nothing if verify or its entry is 0)
+void verify_update(verify_t *verify, u8 *data, u64 n_bytes) {
+
+    if (!verify || !verify->entry) return;
+
+    u64 start = x86_rdtsc();
+
+    if (verify->entry->algo == VERIFY_SHA256) sha256_update(&verify->sha256, data, n_bytes);
+    else verify->crc32c = crc32c_update(verify->crc32c, data, n_bytes);
+
+    verify->n_bytes += n_bytes;
+    verify->ticks += x86_rdtsc() - start;
+}
+
+
+// compares the hash with the manifest
+// returns false on a mismatch
+bool verify_finish(verify_t *verify) {
+
+    verify_entry_t *entry = verify->entry;
+    if (!entry) return true;
+
+    u8 digest[SHA256_DIGEST_BYTES];
+    u64 n_digest;
+
+    if (entry->algo == VERIFY_SHA256) {
+        sha256_final(&verify->sha256, digest);
+        n_digest = SHA256_DIGEST_BYTES;
+    } else {
+        u32 crc = ~verify->crc32c;
+        for (u64 i = 0; i < sizeof(u32); i++) digest[i] = crc >> (24 - 8 * i);
+        n_digest = sizeof(u32);
+    }
+
+    for (u64 i = 0; i < n_digest; i++) {
+        if (digest[i] != entry->digest[i]) {
+            log_warn("%s: %s mismatch\n", entry->path, (entry->algo == VERIFY_SHA256) ? "SHA-256" : "CRC-32C");
+            return false;
+        }
+    }
+
+    // the time spent hashing, most of it while the following reads were in flight
+    log_info("%s: %s verified (%u KiB, %u MB/s)\n",
+            entry->path,
+            (entry->algo == VERIFY_SHA256) ? "SHA-256" : "CRC-32C",
+            verify->n_bytes / 1024,
+            verify->n_bytes / MAX(tsc_us(verify->ticks), 1));
+
+    return true;
+}
+
+
+// starts the hash of a file if the manifest of its filesystem has an entry for it
+// halts if there is none with VERIFY_REQUIRED
+void verify_open(verify_t *verify, fs_t *fs, const char *path) {
+
+    verify_entry_t *entry = verify_find(fs, path);
+
+#ifdef VERIFY_REQUIRED
+    if (!entry) log_err("%s is not in a manifest\n", path);
+#endif
+
+    verify_start(verify, entry);
+}
+
+
+// checks the hash of a file of <n_bytes_file> bytes that has been loaded entirely
+// halts if it does not match
+void verify_close(verify_t *verify, const char *path, u64 n_bytes_file) {
+
+    // the digest is of the whole file
+    if (verify->entry && (verify->n_bytes != n_bytes_file)) log_err("%s does not fit, it can not be verified\n", path);
+    if (!verify_finish(verify)) log_err("%s does not match the manifest\n", path);
+}
+
+
+// loads a file like vfs_load and verifies it against the manifest while it is read
+// halts if it does not match (or is not in a manifest with VERIFY_REQUIRED)
+// returns the (decompressed) size
+u64 verify_load(fs_t *fs, const char *path, u8 *dest, u64 max_bytes) {
+
+    file_t file;
+    if (!vfs_open(fs, path, &file)) log_err("Could not find file %s\n", path);
+    if (file.dir) log_err("%s is a directory\n", path);
+
+    verify_t verify;
+    verify_open(&verify, fs, path);
+
+    u64 n_bytes = vfs_load(&file, dest, max_bytes, &verify);
+    vfs_close(&file);
+
+    verify_close(&verify, path, file.size);
+
+    return n_bytes;
+}
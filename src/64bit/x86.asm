@@ -1,6 +1,9 @@
 bits    64
 
 global  idt_load
+global  irq_stubs
+
+extern  irq_handle
 
 section .text
 
@@ -9,3 +12,88 @@ section .text
 idt_load:
     lidt    [rdi]
     ret
+
+
+; entry points of the 16 PIC IRQs
+; every stub passes its IRQ number to irq_handle (in rdi)
+%macro IRQ_STUB 1
+irq_stub_%1:
+    push    rdi
+    mov     rdi, %1
+    jmp     irq_common
+%endmacro
+
+IRQ_STUB 0
+IRQ_STUB 1
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+
+; saves the state of the interrupted code and calls the C handler
+; the C code (handlers, compiler generated copies) may use the SSE registers, so the x87/SSE state is saved too
+irq_common:
+    ; scratch registers (rdi has been pushed by the stub)
+    push    rax
+    push    rcx
+    push    rdx
+    push    rsi
+    push    r8
+    push    r9
+    push    r10
+    push    r11
+
+    ; the stack is 16 byte aligned here (as fxsave needs it)
+    sub     rsp, 512
+    fxsave  [rsp]
+
+    cld
+    mov     rax, irq_handle
+    call    rax
+
+    fxrstor [rsp]
+    add     rsp, 512
+
+    pop     r11
+    pop     r10
+    pop     r9
+    pop     r8
+    pop     rsi
+    pop     rdx
+    pop     rcx
+    pop     rax
+    pop     rdi
+    iretq
+
+
+section .data
+
+; addresses of the IRQ stubs (used to fill the IDT)
+irq_stubs:
+    dq      irq_stub_0
+    dq      irq_stub_1
+    dq      irq_stub_2
+    dq      irq_stub_3
+    dq      irq_stub_4
+    dq      irq_stub_5
+    dq      irq_stub_6
+    dq      irq_stub_7
+    dq      irq_stub_8
+    dq      irq_stub_9
+    dq      irq_stub_10
+    dq      irq_stub_11
+    dq      irq_stub_12
+    dq      irq_stub_13
+    dq      irq_stub_14
+    dq      irq_stub_15
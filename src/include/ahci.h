@@ -0,0 +1,177 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+
+
+// PCI prog_if of an AHCI controller (PCI_CLASS_SATA)
+#define AHCI_PROG_IF                0x01
+
+#define AHCI_N_PORTS                32
+#define AHCI_N_SLOTS                32
+#define AHCI_N_PRDS                 8
+
+// a PRD can describe up to 4 MiB
+#define AHCI_PRD_MAX_BYTES          0x400000
+#define AHCI_PRD_IRQ                (1u << 31)
+
+// sectors moved by a single command slot
+// large reads are spread over all slots to keep the drive's queue full
+#define AHCI_CMD_MAX_SECS           2048
+
+// HBA capabilities/control
+#define AHCI_CAP_NCS(cap)           ((((cap) >> 8) & 0x1f) + 1)
+#define AHCI_CAP_SNCQ               (1 << 30)
+#define AHCI_CAP2_BOH               (1 << 0)
+#define AHCI_BOHC_BOS               (1 << 0)
+#define AHCI_BOHC_OOS               (1 << 1)
+#define AHCI_GHC_AE                 (1u << 31)
+
+// port registers
+#define AHCI_PORT_CMD_ST            (1 << 0)
+#define AHCI_PORT_CMD_FRE           (1 << 4)
+#define AHCI_PORT_CMD_FR            (1 << 14)
+#define AHCI_PORT_CMD_CR            (1 << 15)
+#define AHCI_PORT_IS_TFES           (1 << 30)
+#define AHCI_PORT_TFD_ERR           (1 << 0)
+#define AHCI_PORT_TFD_DRQ           (1 << 3)
+#define AHCI_PORT_TFD_BSY           (1 << 7)
+#define AHCI_SSTS_DET(ssts)         ((ssts) & 0x0f)
+#define AHCI_SSTS_DET_PRESENT       0x03
+
+// device signatures
+#define AHCI_SIG_ATA                0x00000101
+#define AHCI_SIG_ATAPI              0xeb140101
+
+// command header flags
+#define AHCI_CMD_CFL(n_dwords)      ((n_dwords) & 0x1f)
+
+// FIS
+#define FIS_TYPE_REG_H2D            0x27
+#define FIS_H2D_CMD                 (1 << 7)
+#define FIS_DEV_LBA                 (1 << 6)
+
+// ATA commands only available through AHCI
+#define ATA_CMD_READ_FPDMA          0x60
+
+// IDENTIFY data (word offsets)
+#define ATA_IDENT_QUEUE_DEPTH       75
+#define ATA_IDENT_SATA_CAP          76
+#define ATA_SATA_CAP_NCQ            (1 << 8)
+
+
+// registers of a single port
+typedef volatile struct PACKED AHCIPortRegs {
+    u32 clb;
+    u32 clbu;
+    u32 fb;
+    u32 fbu;
+    u32 is;
+    u32 ie;
+    u32 cmd;
+    u32 reserved0;
+    u32 tfd;
+    u32 sig;
+    u32 ssts;
+    u32 sctl;
+    u32 serr;
+    u32 sact;
+    u32 ci;
+    u32 sntf;
+    u32 fbs;
+    u32 reserved1[15];
+} ahci_port_regs_t;
+
+// memory mapped registers of the HBA (ABAR)
+typedef volatile struct PACKED AHCIRegs {
+    u32 cap;
+    u32 ghc;
+    u32 is;
+    u32 pi;
+    u32 vs;
+    u32 ccc_ctl;
+    u32 ccc_ports;
+    u32 em_loc;
+    u32 em_ctl;
+    u32 cap2;
+    u32 bohc;
+    u8  reserved[0xd4];
+    ahci_port_regs_t ports[AHCI_N_PORTS];
+} ahci_regs_t;
+
+// entry in a port's command list (one per slot)
+typedef struct PACKED AHCICmdHeader {
+    u16 flags;
+    u16 prdtl;      // number of PRDs
+    volatile u32 prdbc;
+    u32 ctba;
+    u32 ctbau;
+    u32 reserved[4];
+} ahci_cmd_header_t;
+
+typedef struct PACKED AHCIPRD {
+    u32 dba;
+    u32 dbau;
+    u32 reserved;
+    u32 dbc;        // byte count - 1
+} ahci_prd_t;
+
+// command table of a slot (128 byte aligned)
+typedef struct PACKED AHCICmdTable {
+    u8 cfis[64];
+    u8 acmd[16];
+    u8 reserved[48];
+    ahci_prd_t prdt[AHCI_N_PRDS];
+} ahci_cmd_table_t;
+
+// register FIS (host to device)
+typedef struct PACKED FISRegH2D {
+    u8 type;
+    u8 flags;
+    u8 cmd;
+    u8 feature_low;
+
+    u8 lba0;
+    u8 lba1;
+    u8 lba2;
+    u8 device;
+
+    u8 lba3;
+    u8 lba4;
+    u8 lba5;
+    u8 feature_high;
+
+    u8 count_low;
+    u8 count_high;
+    u8 icc;
+    u8 control;
+
+    u32 reserved;
+} fis_reg_h2d_t;
+
+
+// a SATA drive attached to an AHCI port
+typedef struct AHCIDrive {
+    drive_t base;
+
+    ahci_port_regs_t *port;
+    ahci_cmd_header_t *cmd_list;
+    ahci_cmd_table_t *cmd_tables;
+
+    // usable command slots
+    u8 n_slots;
+    // READ FPDMA QUEUED (native command queuing)
+    bool ncq;
+} ahci_drive_t;
+
+
+void ahci_initialize(u8 bus, u8 dev, u8 func);
+void ahci_port_init(ahci_regs_t *hba, u8 n_port);
+void ahci_port_stop(ahci_port_regs_t *port);
+void ahci_port_start(ahci_port_regs_t *port);
+void ahci_shutdown(void *self);
+void ahci_issue(ahci_drive_t *drive, u8 slot, u8 cmd, u8 *dest, u64 lba, u64 n_secs);
+u32 ahci_poll(ahci_drive_t *drive, u32 busy);
+u64 ahci_read(void *self, u8 *dest, u64 lba, u64 n_secs);
@@ -6,4 +6,18 @@
 #include <ide.h>
 
 
+// sectors per command (count 0 -> 256/65536 sectors)
+// a single LBA48 DMA command fills one PRD table
+#define ATA_LBA28_MAX_SECS      0x100
+#define ATA_LBA48_MAX_SECS      0x10000
+
+
+void ata_send_cmd(ata_t *drive, u64 lba, u64 n_secs, u8 cmd28, u8 cmd48);
+u64 ata_build_prdt(ata_t *drive, drive_req_t *req, u64 off, u64 n_secs);
+void ata_set_multiple(ata_t *drive);
+bool ata_use_dma(ata_t *drive, drive_req_t *req);
+void ata_start(void *self, drive_req_t *req);
+void ata_step_dma(ata_t *drive, drive_req_t *req);
+void ata_step_pio(ata_t *drive, drive_req_t *req);
+void ata_step(void *self, drive_req_t *req);
 u64 ata_read(void *self, u8 *dest, u64 lba, u64 n_secs);
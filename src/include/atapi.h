@@ -5,5 +5,17 @@
 #include <ide.h>
 
 
+// largest byte count per DRQ block that is requested from the drive (multiple of 2048, even)
+#define ATAPI_MAX_DRQ_BYTES     0xf800
+
+// block size if READ CAPACITY fails to report one
+#define ATAPI_DEFAULT_BLK_SIZE  2048
+
+
 u64 atapi_read_capacity(atapi_t* atapi);
+u8 atapi_send_packet(atapi_t *drive, u8 *packet, u16 n_bytes_drq);
+void atapi_submit(void *self, drive_req_t *req);
+u64 atapi_read_blocks(void *self, u8 *dest, u64 blk, u64 n_blks);
+void atapi_start(void *self, drive_req_t *req);
+void atapi_step(void *self, drive_req_t *req);
 u64 atapi_read(void *self, u8 *dest, u64 lba, u64 n_secs);
@@ -0,0 +1,46 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <fat32.h>
+
+
+// build with -DBENCH (make bench) to benchmark every drive after the partition scan
+// the results are written to the debug port as lines of space separated key=value pairs:
+//     bench drive=<n> type=<type> test=<seq|rand|file|file_load> op_bytes=<n> ops=<n> bytes=<n> us=<n>
+//           mb_s=<n.nn> iops=<n> lat_min_ns=<n> lat_p50_ns=<n> lat_p90_ns=<n> lat_p99_ns=<n> lat_max_ns=<n>
+// the file test is followed by the number of data reads it needed:
+//     bench drive=<n> test=file_reads clusters=<n> reads=<n>
+// file_load loads the same file with vfs_load, its bytes are the decompressed size if it is LZ4 compressed
+// (which has to fit into BENCH_BUF_BYTES as well)
+
+// sequential reads: transfer sizes and bytes per size at most
+#define BENCH_SEQ_SIZES         { 0x1000, 0x10000, 0x100000, 0x400000 }
+#define BENCH_SEQ_N_SIZES       4
+#define BENCH_SEQ_BYTES         0x2000000
+
+// random reads
+#define BENCH_RAND_BYTES        0x1000
+#define BENCH_RAND_OPS          512
+#define BENCH_SEED              0x2545f4914f6cdd1d
+
+// latencies that are recorded per test
+#define BENCH_MAX_OPS           1024
+
+// destination of all reads, also the largest file that is loaded
+#define BENCH_BUF_BYTES         0x1000000
+
+
+void bench_run_all(void);
+void bench_drive(drive_t *drive, u64 index);
+void bench_seq(drive_t *drive, u64 index, u64 n_bytes_op);
+void bench_rand(drive_t *drive, u64 index);
+void bench_file(fat32_t *fs, u64 index);
+void bench_report(drive_t *drive, u64 index, const char *test, u64 n_bytes_op, u64 n_ops, u64 ticks);
+void bench_sort(u64 *vals, u64 n);
+u64 bench_rand_next(void);
+
+void bench_puts(const char *str);
+void bench_putu(u64 num);
+void bench_field(const char *key, u64 val);
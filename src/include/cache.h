@@ -0,0 +1,118 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+
+
+// sectors per cache line (lines start at multiples of this)
+#define CACHE_LINE_SECS         8
+#define CACHE_LINE_BYTES        (CACHE_LINE_SECS * 512)
+
+// the cache gets 1/CACHE_MEM_SHARE of the usable memory within these limits
+#define CACHE_MEM_SHARE         32
+#define CACHE_MIN_BYTES         0x40000
+#define CACHE_MAX_BYTES         0x4000000
+
+// larger reads (file data) go straight to the drive
+#define CACHE_BYPASS_SECS       256
+
+// missing lines that are fetched with a single read
+#define CACHE_STAGE_LINES       32
+
+// read-ahead: memory for all prefetch buffers and the largest window (sectors)
+// windows start at CACHE_RA_MIN_SECS and double with every sequential read
+#define CACHE_RA_BUDGET_BYTES   0x100000
+#define CACHE_RA_MAX_SECS       512
+#define CACHE_RA_MIN_SECS       (2 * CACHE_LINE_SECS)
+
+// drives that are tracked at the same time
+#define CACHE_RA_N_STREAMS      4
+
+// a read counts as sequential if it starts at most this far away from the end of the previous one
+#define CACHE_RA_GAP_SECS       CACHE_LINE_SECS
+
+
+typedef struct CacheLine {
+    drive_t *drive;     // 0 -> unused
+    u64 lba;
+    u8 *data;
+
+    struct CacheLine *hash_next;
+
+    // most recently used lines are at the head
+    struct CacheLine *lru_prev;
+    struct CacheLine *lru_next;
+
+    // filled by read-ahead and not used yet
+    bool prefetched;
+} cache_line_t;
+
+typedef struct CacheStats {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 bypassed;
+
+    // read-ahead (in lines)
+    u64 ra_lines;       // prefetched
+    u64 ra_hits;        // prefetched and used
+    u64 ra_wasted;      // prefetched and evicted without being used
+} cache_stats_t;
+
+// sequential access detection and prefetching of a drive
+typedef struct CacheStream {
+    drive_t *drive;     // 0 -> unused
+
+    // where the previous read ended
+    u64 next_lba;
+    // sectors of the next prefetch (0 -> not sequential)
+    u64 window;
+
+    // prefetch in flight (or finished but not moved into the cache yet)
+    bool pending;
+    drive_req_t req;
+    u8 *buf;
+
+    // end of the data that has been prefetched so far
+    u64 ra_end;
+} cache_stream_t;
+
+// block cache shared by all drives, keyed by (drive, lba)
+typedef struct Cache {
+    u64 n_lines;
+    cache_line_t *lines;
+
+    cache_line_t **buckets;
+    u64 hash_shift;     // 64 - log2(number of buckets)
+
+    cache_line_t *lru_head;
+    cache_line_t *lru_tail;
+
+    // missing lines are read here first
+    u8 *stage;
+
+    // read-ahead
+    cache_stream_t streams[CACHE_RA_N_STREAMS];
+    u64 next_stream;
+    u64 ra_max_secs;
+
+    cache_stats_t stats;
+} cache_t;
+
+
+extern cache_t cache;
+
+
+void cache_init(void);
+cache_line_t **cache_bucket(drive_t *drive, u64 lba);
+cache_line_t *cache_lookup(drive_t *drive, u64 lba);
+cache_line_t *cache_insert(drive_t *drive, u64 lba);
+void cache_touch(cache_line_t *line);
+void cache_copy_out(cache_line_t *line, u8 *dest, u64 lba, u64 n_secs);
+cache_stream_t *cache_stream(drive_t *drive);
+void cache_ra_complete(cache_stream_t *stream);
+u64 cache_ra_fold_end(cache_stream_t *stream, u64 lba, u64 n_secs);
+void cache_ra_update(cache_stream_t *stream, u64 lba, u64 n_secs);
+u64 cache_read(drive_t *drive, u8 *dest, u64 lba, u64 n_secs);
+void cache_print_stats(void);
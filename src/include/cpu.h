@@ -0,0 +1,39 @@
+#pragma once
+
+
+#include <types.h>
+
+
+// cpuid leaf 1
+#define CPUID_1_ECX_PCLMUL      (1 << 1)
+#define CPUID_1_ECX_SSSE3       (1 << 9)
+#define CPUID_1_ECX_SSE41       (1 << 19)
+#define CPUID_1_ECX_SSE42       (1 << 20)
+#define CPUID_1_EDX_FXSR        (1 << 24)
+#define CPUID_1_EDX_SSE2        (1 << 26)
+
+// cpuid leaf 7 (subleaf 0)
+#define CPUID_7_EBX_SHA         (1 << 29)
+
+// control register bits
+#define CR0_MP                  (1 << 1)
+#define CR0_EM                  (1 << 2)
+#define CR4_OSFXSR              (1 << 9)
+#define CR4_OSXMMEXCPT          (1 << 10)
+
+
+// optional instruction set extensions that can be used
+typedef struct CPUFeatures {
+    bool sse;       // SSE2 is enabled (required by everything below)
+    bool ssse3;
+    bool sse41;
+    bool sse42;
+    bool pclmul;
+    bool sha;
+} cpu_features_t;
+
+
+extern cpu_features_t cpu_features;
+
+
+void cpu_init(void);
@@ -0,0 +1,41 @@
+#pragma once
+
+
+#include <types.h>
+
+
+// reflected polynomial of CRC-32 (IEEE 802.3, used by GPT, zip, ...)
+#define CRC32_POLY                  0xedb88320
+
+// reflected polynomial of CRC-32C (Castagnoli, iSCSI, ext4 metadata, the SSE4.2 crc32 instruction)
+#define CRC32C_POLY                 0x82f63b78
+
+// the PCLMULQDQ backend folds whole 64 byte blocks
+#define CRC32_PCLMUL_MIN_BYTES      64
+
+
+typedef enum CRC32_BACKEND {
+    CRC32_SLICE8,
+    CRC32_PCLMUL
+} crc32_backend_t;
+
+typedef enum CRC32C_BACKEND {
+    CRC32C_SLICE8,
+    CRC32C_SSE42
+} crc32c_backend_t;
+
+
+extern crc32_backend_t crc32_backend;
+extern crc32c_backend_t crc32c_backend;
+
+
+void crc32_init(void);
+u32 crc32_update_slice8(u32 crc, u8 *buf, u64 n_bytes);
+u32 crc32_update_pclmul(u32 crc, u8 *buf, u64 n_bytes);
+u32 crc32_update(u32 crc, u8 *buf, u64 n_bytes);
+u32 crc32(u8 *buf, u64 n_bytes);
+
+u32 crc32c_update_slice8(u32 crc, u8 *buf, u64 n_bytes);
+u32 crc32c_update_sse42(u32 crc, u8 *buf, u64 n_bytes);
+u32 crc32c_update(u32 crc, u8 *buf, u64 n_bytes);
+u32 crc32c(u8 *buf, u64 n_bytes);
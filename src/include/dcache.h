@@ -0,0 +1,69 @@
+#pragma once
+
+
+#include <types.h>
+
+
+// longest name that can be looked up (bytes, without the null terminator)
+#define DCACHE_NAME_MAX         255
+
+// number of entries shared by all filesystems
+#define DCACHE_N_ENTRIES        4096
+
+
+// a directory entry that has been looked up (or found missing)
+typedef struct Dentry {
+    void *fs;           // 0 -> unused
+    u64 parent;         // directory the entry is in (first cluster)
+    u64 hash;
+
+    // the directory has no entry with this name
+    bool negative;
+
+    u64 cluster;
+    u64 size;
+    u8 attr;
+
+    struct Dentry *hash_next;
+
+    // most recently used entries are at the head
+    struct Dentry *lru_prev;
+    struct Dentry *lru_next;
+
+    // normalised (see dcache_normalise)
+    char name[DCACHE_NAME_MAX + 1];
+} dentry_t;
+
+typedef struct DCacheStats {
+    u64 hits;
+    u64 negative_hits;
+    u64 misses;
+    u64 evictions;
+} dcache_stats_t;
+
+// dentry cache shared by all filesystems, keyed by (fs, parent directory, normalised name)
+typedef struct DCache {
+    u64 n_entries;
+    dentry_t *entries;
+
+    dentry_t **buckets;
+    u64 hash_shift;     // 64 - log2(number of buckets)
+
+    dentry_t *lru_head;
+    dentry_t *lru_tail;
+
+    dcache_stats_t stats;
+} dcache_t;
+
+
+extern dcache_t dcache;
+
+
+void dcache_init(void);
+u64 dcache_normalise(char *dest, const char *name, u64 len);
+u64 dcache_hash(void *fs, u64 parent, const char *name);
+dentry_t **dcache_bucket(u64 hash);
+dentry_t *dcache_lookup(void *fs, u64 parent, const char *name, u64 hash);
+void dcache_touch(dentry_t *dentry);
+dentry_t *dcache_insert(void *fs, u64 parent, const char *name, u64 hash, bool negative, u64 cluster, u64 size, u8 attr);
+void dcache_print_stats(void);
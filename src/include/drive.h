@@ -9,20 +9,120 @@ typedef enum DRIVE_TYPE {
     DRIVE_NONE,
     DRIVE_ATA,
     DRIVE_SATA,
-    DRIVE_ATAPI
+    DRIVE_ATAPI,
+    DRIVE_NVME,
+    DRIVE_VIRTIO,
+    DRIVE_USB,
+    DRIVE_SD
 } drive_type_t;
 
 
+// state of an asynchronous request
+typedef enum DRIVE_REQ_STATUS {
+    DRIVE_REQ_NONE,
+    DRIVE_REQ_QUEUED,       // waiting for the drive
+    DRIVE_REQ_ACTIVE,       // being processed by the drive
+    DRIVE_REQ_DONE,
+    DRIVE_REQ_ERROR
+} drive_req_status_t;
+
+
+// a destination segment of a vectored read
+typedef struct DriveIOVec {
+    u8 *addr;
+    u64 n_bytes;
+} drive_iovec_t;
+
+
+// an asynchronous read request
+// has to stay in memory until it is finished (drive_wait/drive_poll)
+typedef struct DriveReq {
+    struct DRIVE *drive;
+    u8 *dest;
+    u64 lba;
+    u64 n_secs;
+
+    // vectored requests scatter the sectors over these segments instead of <dest>
+    drive_iovec_t *iov;
+    u64 n_iov;
+
+    // updated by the driver (possibly from an IRQ handler)
+    volatile drive_req_status_t status;
+    u8 error;               // driver specific error code
+
+    // progress of the driver
+    u64 n_secs_done;        // sectors of all finished commands
+    u64 n_secs_cmd;         // sectors of the current command
+    u64 n_secs_xfer;        // sectors of the current command that have been transferred
+
+    // next request in the drive's queue
+    struct DriveReq *next;
+} drive_req_t;
+
+
 // this can be used as an abstract base for other drive type
 typedef struct DRIVE {
     drive_type_t type;
     u16 size;   // size of the entire struct in bytes
     u64 n_secs;
 
+    // sectors a single command can move (larger reads are split by the driver)
+    u64 max_secs;
+
+    // sectors callers should pass to a single read/submit (larger reads are split by the caller)
+    // U64_MAX -> the driver splits large reads itself and keeps several commands in flight
+    u64 max_call_secs;
+
     // read(void* self, u8* dest, u64 lba, u64 n_sec;
     u64 (*read)(void*, u8*, u64, u64);
 
+    // vectored read, one sector range into many segments (0 -> emulated with read)
+    // readv(void* self, drive_iovec_t* iov, u64 n_iov, u64 lba)
+    u64 (*readv)(void*, drive_iovec_t*, u64, u64);
+
+    // asynchronous requests (0 -> drive only supports read)
+    // submit has to handle vectored requests as well
+    // submit(void* self, drive_req_t* req)
+    void (*submit)(void*, drive_req_t*);
+    // poll(void* self, drive_req_t* req) -> true if the request is finished
+    bool (*poll)(void*, drive_req_t*);
+    // wait(void* self, drive_req_t* req) -> blocks until the request is finished
+    void (*wait)(void*, drive_req_t*);
+
+    // stops the controller's DMA before a kernel gets the memory (0 -> nothing to stop)
+    // the drive can not be read afterwards
+    // shutdown(void* self)
+    void (*shutdown)(void*);
+
 } drive_t;
 
 
+// reads whole native blocks (<secs_per_blk> sectors each) of a drive
+// read_blocks(void* self, u8* dest, u64 blk, u64 n_blks)
+typedef u64 (*read_blocks_t)(void*, u8*, u64, u64);
+
+
+u64 drive_read_blocks(void *self, u8 *dest, u64 lba, u64 n_secs,
+        u64 secs_per_blk, u8 *bounce, read_blocks_t read_blocks);
+
+u64 drive_max_call_bytes(drive_t *drive);
+u64 drive_iov_bytes(drive_iovec_t *iov, u64 n_iov);
+u8 *drive_iov_addr(drive_iovec_t *iov, u64 n_iov, u64 off, u64 *n_bytes_contig);
+u8 *drive_req_addr(drive_req_t *req, u64 off, u64 *n_bytes_contig);
+u64 drive_readv_segments(drive_t *drive, drive_iovec_t *iov, u64 n_iov, u64 lba);
+u64 drive_readv(drive_t *drive, drive_iovec_t *iov, u64 n_iov, u64 lba);
+
+void drive_req_init(drive_req_t *req, drive_t *drive, u8 *dest, u64 lba, u64 n_secs);
+void drive_submit(drive_t *drive, drive_req_t *req, u8 *dest, u64 lba, u64 n_secs);
+void drive_submitv(drive_t *drive, drive_req_t *req, drive_iovec_t *iov, u64 n_iov, u64 lba);
+bool drive_poll(drive_req_t *req);
+u64 drive_wait(drive_req_t *req);
+
+drive_t *drive_next(drive_t *drive);
+void drive_shutdown_all(void);
+
+
 extern heap_t heap_drives;
+
+// physically contiguous memory for controller data structures (PRD tables, ...)
+extern heap_t heap_dma;
@@ -0,0 +1,65 @@
+#pragma once
+
+
+#include <types.h>
+#include <vfs.h>
+
+
+// ELF64 executables for x86-64 (statically linked kernels)
+// the PT_LOAD segments are loaded to their physical addresses (p_paddr), which have to be free memory
+// elf_start jumps to the entry point in long mode with interrupts disabled and the first 4 GiB identity mapped:
+//     rdi = E820 memory map (mmap_entry_t[]), rsi = number of entries
+#define ELF_KERNEL_PATH             "/boot/kernel.elf"
+
+#define ELF_MAGIC                   0x464c457f  // "\x7fELF"
+#define ELF_CLASS_64                2
+#define ELF_DATA_LSB                1
+#define ELF_VERSION_CURRENT         1
+#define ELF_TYPE_EXEC               2
+#define ELF_MACHINE_X86_64          0x3e
+
+// program header types
+#define ELF_PT_LOAD                 1
+
+// program headers that are read
+#define ELF_MAX_PHDRS               32
+
+
+typedef struct PACKED ElfHeader {
+    u32 magic;
+    u8  class;
+    u8  data;
+    u8  ident_version;
+    u8  osabi;
+    u8  ident_pad[8];
+    u16 type;
+    u16 machine;
+    u32 version;
+    u64 entry;
+    u64 phoff;
+    u64 shoff;
+    u32 flags;
+    u16 ehsize;
+    u16 phentsize;
+    u16 phnum;
+    u16 shentsize;
+    u16 shnum;
+    u16 shstrndx;
+} elf_header_t;
+
+
+typedef struct PACKED ElfPhdr {
+    u32 type;
+    u32 flags;
+    u64 offset;
+    u64 vaddr;
+    u64 paddr;
+    u64 filesz;
+    u64 memsz;                  // > filesz -> the rest is cleared (.bss)
+    u64 align;
+} elf_phdr_t;
+
+
+bool elf_check_header(elf_header_t *header);
+u64 elf_load(fs_t *fs, const char *path);
+NORETURN void elf_start(u64 entry);
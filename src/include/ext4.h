@@ -0,0 +1,294 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <part.h>
+#include <vfs.h>
+#include <dcache.h>
+
+
+// ext2/3/4 (the ext4 layout is a superset of the older ones)
+
+// the superblock is always 1024 bytes into the partition
+#define EXT4_SB_OFFSET              1024
+#define EXT4_SB_SIZE                1024
+#define EXT4_MAGIC                  0xef53
+
+#define EXT4_MIN_BLOCK_LOG          10      // 1 KiB
+#define EXT4_MAX_BLOCK_LOG          16      // 64 KiB
+
+#define EXT4_ROOT_INODE             2
+#define EXT4_GOOD_OLD_INODE_SIZE    128     // revision 0, only these bytes are used
+#define EXT4_GOOD_OLD_DESC_SIZE     32      // without the 64bit feature
+#define EXT4_N_BLOCKS               15      // pointers (or extent tree root) in an inode
+
+// compatible features
+#define EXT4_COMPAT_SPARSE_SUPER2   0x0200
+
+// incompatible features
+#define EXT4_INCOMPAT_FILETYPE      0x0002
+#define EXT4_INCOMPAT_RECOVER       0x0004  // the journal has not been replayed
+#define EXT4_INCOMPAT_META_BG       0x0010
+#define EXT4_INCOMPAT_EXTENTS       0x0040
+#define EXT4_INCOMPAT_64BIT         0x0080
+#define EXT4_INCOMPAT_MMP           0x0100
+#define EXT4_INCOMPAT_FLEX_BG       0x0200
+#define EXT4_INCOMPAT_EA_INODE      0x0400
+#define EXT4_INCOMPAT_CSUM_SEED     0x2000
+#define EXT4_INCOMPAT_LARGEDIR      0x4000
+
+// everything else (compression, journal devices, inline data, encryption, casefolded names, ...) can not be read
+#define EXT4_INCOMPAT_SUPPORTED     (EXT4_INCOMPAT_FILETYPE | EXT4_INCOMPAT_RECOVER | EXT4_INCOMPAT_META_BG | \
+                                     EXT4_INCOMPAT_EXTENTS | EXT4_INCOMPAT_64BIT | EXT4_INCOMPAT_MMP | \
+                                     EXT4_INCOMPAT_FLEX_BG | EXT4_INCOMPAT_EA_INODE | EXT4_INCOMPAT_CSUM_SEED | \
+                                     EXT4_INCOMPAT_LARGEDIR)
+
+// read-only compatible features
+#define EXT4_RO_COMPAT_SPARSE_SUPER 0x0001
+
+// inode modes and flags
+#define EXT4_S_IFMT                 0xf000
+#define EXT4_S_IFDIR                0x4000
+#define EXT4_EXTENTS_FL             0x00080000
+#define EXT4_INLINE_DATA_FL         0x10000000
+
+// extent trees
+#define EXT4_EXT_MAGIC              0xf30a
+#define EXT4_EXT_MAX_DEPTH          5
+#define EXT4_EXT_INIT_MAX_LEN       32768   // longer extents are unwritten (read as zeros)
+
+// indirect block maps: 12 direct pointers, then single, double and triple indirect blocks
+#define EXT4_N_DIRECT               12
+
+// directory entries
+#define EXT4_DIRENT_HEADER          8
+
+
+typedef struct PACKED Ext4Superblock {
+    u32 n_inodes;
+    u32 n_blocks_lo;
+    u32 n_reserved_blocks_lo;
+    u32 n_free_blocks_lo;
+    u32 n_free_inodes;
+    u32 first_data_block;
+    u32 log_block_size;         // block size = 1024 << log_block_size
+    u32 log_cluster_size;
+    u32 blocks_per_group;
+    u32 clusters_per_group;
+    u32 inodes_per_group;
+    u32 mtime;
+    u32 wtime;
+    u16 mnt_count;
+    u16 max_mnt_count;
+    u16 magic;
+    u16 state;
+    u16 errors;
+    u16 minor_rev_level;
+    u32 lastcheck;
+    u32 checkinterval;
+    u32 creator_os;
+    u32 rev_level;
+    u16 def_resuid;
+    u16 def_resgid;
+
+    // revision 1 (dynamic)
+    u32 first_ino;
+    u16 inode_size;
+    u16 block_group_nr;
+    u32 feature_compat;
+    u32 feature_incompat;
+    u32 feature_ro_compat;
+    u8  uuid[16];
+    char volume_name[16];
+    char last_mounted[64];
+    u32 algorithm_usage_bitmap;
+    u8  prealloc_blocks;
+    u8  prealloc_dir_blocks;
+    u16 reserved_gdt_blocks;
+    u8  journal_uuid[16];
+    u32 journal_inum;
+    u32 journal_dev;
+    u32 last_orphan;
+    u32 hash_seed[4];
+    u8  def_hash_version;
+    u8  jnl_backup_type;
+    u16 desc_size;
+    u32 default_mount_opts;
+    u32 first_meta_bg;
+    u32 mkfs_time;
+    u32 jnl_blocks[17];
+
+    // 64bit
+    u32 n_blocks_hi;
+    u32 n_reserved_blocks_hi;
+    u32 n_free_blocks_hi;
+    u16 min_extra_isize;
+    u16 want_extra_isize;
+    u32 flags;
+    u16 raid_stride;
+    u16 mmp_interval;
+    u64 mmp_block;
+    u32 raid_stripe_width;
+    u8  log_groups_per_flex;
+    u8  checksum_type;
+    u16 reserved_pad;
+    u64 kbytes_written;
+    u32 snapshot_inum;
+    u32 snapshot_id;
+    u64 snapshot_r_blocks_count;
+    u32 snapshot_list;
+    u32 error_count;
+    u32 first_error_time;
+    u32 first_error_ino;
+    u64 first_error_block;
+    u8  first_error_func[32];
+    u32 first_error_line;
+    u32 last_error_time;
+    u32 last_error_ino;
+    u32 last_error_line;
+    u64 last_error_block;
+    u8  last_error_func[32];
+    u8  mount_opts[64];
+    u32 usr_quota_inum;
+    u32 grp_quota_inum;
+    u32 overhead_blocks;
+    u32 backup_bgs[2];          // sparse_super2: the only groups with backups (0 -> none)
+
+    // remaining fields are not used
+} ext4_superblock_t;
+
+
+// block group descriptor (32 bytes, 64 with the 64bit feature)
+typedef struct PACKED Ext4GroupDesc {
+    u32 block_bitmap_lo;
+    u32 inode_bitmap_lo;
+    u32 inode_table_lo;
+    u16 n_free_blocks_lo;
+    u16 n_free_inodes_lo;
+    u16 n_used_dirs_lo;
+    u16 flags;
+    u32 exclude_bitmap_lo;
+    u16 block_bitmap_csum_lo;
+    u16 inode_bitmap_csum_lo;
+    u16 itable_unused_lo;
+    u16 checksum;
+
+    // 64bit
+    u32 block_bitmap_hi;
+    u32 inode_bitmap_hi;
+    u32 inode_table_hi;
+
+    // remaining fields are not used
+} ext4_group_desc_t;
+
+
+// first EXT4_GOOD_OLD_INODE_SIZE bytes of an inode
+// all fields are naturally aligned (not packed, so the block pointers can be passed around)
+typedef struct Ext4Inode {
+    u16 mode;
+    u16 uid;
+    u32 size_lo;
+    u32 atime;
+    u32 ctime;
+    u32 mtime;
+    u32 dtime;
+    u16 gid;
+    u16 links_count;
+    u32 blocks_lo;
+    u32 flags;
+    u32 osd1;
+    u32 block[EXT4_N_BLOCKS];   // block map or extent tree root
+    u32 generation;
+    u32 file_acl_lo;
+    u32 size_hi;
+    u32 obso_faddr;
+    u8  osd2[12];
+} ext4_inode_t;
+
+
+// extent tree nodes: a header followed by indices (inner nodes) or extents (leaves)
+typedef struct PACKED Ext4ExtentHeader {
+    u16 magic;
+    u16 n_entries;
+    u16 max_entries;
+    u16 depth;                  // 0 -> leaf
+    u32 generation;
+} ext4_extent_header_t;
+
+typedef struct PACKED Ext4ExtentIdx {
+    u32 block;                  // first file block covered by the child
+    u32 leaf_lo;
+    u16 leaf_hi;
+    u16 unused;
+} ext4_extent_idx_t;
+
+typedef struct PACKED Ext4Extent {
+    u32 block;                  // first file block
+    u16 len;                    // > EXT4_EXT_INIT_MAX_LEN -> unwritten
+    u16 start_hi;
+    u32 start_lo;
+} ext4_extent_t;
+
+
+typedef struct PACKED Ext4Dirent {
+    u32 inode;                  // 0 -> unused
+    u16 rec_len;
+    u8  name_len;
+    u8  file_type;              // high byte of name_len without the filetype feature
+    char name[];
+} ext4_dirent_t;
+
+
+typedef struct Ext4 {
+
+    fs_t base;
+    ext4_superblock_t *sb;
+
+    // partial sectors, inodes and group descriptors
+    u8 *sector;
+
+    // extent tree node or indirect block that is being followed
+    u8 *node;
+
+    // directory block that is being scanned
+    u8 *cache_dir;
+
+    u64 block_size;
+    u64 secs_per_block;
+    u64 n_blocks;
+    u64 n_groups;
+    u64 inode_size;
+    u64 desc_size;
+    u64 descs_per_block;
+
+    // statistics of ext4_read (every extent is a single read)
+    u64 n_blocks_loaded;
+    u64 n_reads;
+
+} ext4_t;
+
+
+ext4_t *ext4_mount(part_t *part);
+void ext4_init(void *self);
+
+u64 ext4_lba(ext4_t *self, u64 block);
+bool ext4_group_has_super(ext4_t *self, u64 group);
+u64 ext4_desc_block(ext4_t *self, u64 n_desc_block);
+u64 ext4_inode_table(ext4_t *self, u64 group);
+bool ext4_read_inode(ext4_t *self, u64 ino, ext4_inode_t *inode);
+
+u64 ext4_map_run(u32 *ptrs, u64 n_ptrs, u64 index, u64 *block);
+u64 ext4_map_indirect(ext4_t *self, ext4_inode_t *inode, u64 file_block, u64 *block);
+u64 ext4_map_extents(ext4_t *self, ext4_inode_t *inode, u64 file_block, u64 *block);
+u64 ext4_map(ext4_t *self, file_t *file, u64 file_block, u64 *block);
+
+bool ext4_scan_dir(ext4_t *self, u64 dir, const char *name, u64 hash, dentry_t *found);
+bool ext4_lookup(ext4_t *self, u64 dir, const char *name, dentry_t *found);
+bool ext4_resolve(ext4_t *self, const char *path, u64 *ino);
+
+bool ext4_open_inode(ext4_t *self, u64 ino, file_t *file);
+bool ext4_open(void *self, const char *path, file_t *file);
+u64 ext4_read(void *self, file_t *file, u8 *dest, u64 offset, u64 n_bytes);
+u64 ext4_map_offset(void *self, file_t *file, u64 offset, u64 *lba);
+u64 ext4_load_file(void *self, const char *path, u8 *buf, u64 n_blocks);
@@ -5,19 +5,43 @@
 #include <drive.h>
 #include <part.h>
 #include <vfs.h>
+#include <dcache.h>
 
 
-#define FAT_ENTRIES_PER_PAGE    1024
 #define FAT32_EOF               0x0ffffff8
+#define FAT32_CLUSTER_MASK      0x0fffffff  // the upper 4 bits of an entry are reserved
 #define FAT32_NAME              8
 #define FAT32_EXT               3
 
+// first byte of a name
+#define FAT32_DELETED           0xe5
+#define FAT32_NAME_E5           0x05    // the name really starts with 0xe5
+
 
 #define FAT32_READONLY          0x01
 #define FAT32_HIDDEN            0x02
 #define FAT32_SYSTEM            0x03
+#define FAT32_VOLUME_ID         0x08    // also set in long file name entries
 #define FAT32_DIR               0x10
 #define FAT32_ARCHIVE           0x20
+#define FAT32_LFN               0x0f    // attributes of a long file name entry
+
+// long file names (VFAT): up to 20 entries of 13 UCS-2 characters precede the short entry
+#define FAT32_LFN_CHARS         13
+#define FAT32_LFN_MAX_ORD       20
+#define FAT32_LFN_LAST          0x40    // first entry in the directory, holds the end of the name
+#define FAT32_LFN_ORD_MASK      0x1f
+
+
+// BPB flags
+#define FAT32_FLAGS_ACTIVE(f)   ((f) & 0x0f)
+#define FAT32_FLAGS_NO_MIRROR   (1 << 7)    // only the active FAT is up to date
+
+// FAT cache: the entire FAT if it takes less than 1/FAT32_FAT_MEM_DIV of the usable memory,
+// FAT32_N_WINDOWS windows (LRU) of up to FAT32_WINDOW_MAX_SECS otherwise
+#define FAT32_FAT_MEM_DIV       8
+#define FAT32_N_WINDOWS         16
+#define FAT32_WINDOW_MAX_SECS   512
 
      
 // structure of a BIOS Parameter Block
@@ -83,17 +107,55 @@ typedef struct PACKED FAT32DirEntry {
 } fat32_dir_entry_t;
 
 
+// part of the FAT that is cached if the entire FAT does not fit
+typedef struct FAT32Window {
+    u32 *entries;
+    u64 index;          // window number in the FAT
+    u64 last_use;       // 0 -> empty
+} fat32_window_t;
+
+
+// long file name entry
+typedef struct PACKED FAT32LFNEntry {
+    u8  ord;
+    u16 name1[5];
+    u8  attr;
+    u8  type;
+    u8  checksum;       // of the short name
+    u16 name2[6];
+    u16 cluster_low;    // always 0
+    u16 name3[2];
+} fat32_lfn_entry_t;
+
+// long file name that is being assembled during a directory scan
+typedef struct FAT32LFN {
+    u16 chars[FAT32_LFN_MAX_ORD * FAT32_LFN_CHARS];
+    u64 n_chars;
+    u8 checksum;
+    u8 next_ord;        // ordinal of the next entry (0 -> no valid name, 1 -> complete after the next entry)
+    bool complete;
+} fat32_lfn_t;
+
+
 typedef struct FAT32 {
 
     fs_t base;
     bpb_t *bpb;
 
-    u8 *cache_fat;
+    // partial sectors of fat32_read
+    u8 *sector;
+
     u8 *cache_root;
     u8 *cache_dir;
 
-    // cluster-sized part of the FAT that is currently cached
-    u32 cur_fat_loaded;
+    // entries of all clusters (0 -> the windows are used instead)
+    u32 *fat;
+    u64 n_clusters;     // including the reserved clusters 0 and 1
+    u64 secs_fat;       // sectors of the FAT that contain cluster entries
+
+    u64 secs_per_window;
+    u64 n_window_uses;
+    fat32_window_t windows[FAT32_N_WINDOWS];
 
     u8 secs_per_cluster;
     u32 secs_per_fat;
@@ -101,15 +163,36 @@ typedef struct FAT32 {
     u64 lba_fat;
     u32 cluster_root;
 
+    // statistics of fat32_load_cluster_chain (without merging, every cluster would be a read)
+    u64 n_clusters_loaded;
+    u64 n_reads;
+
 } fat32_t;
 
 
+fat32_t *fat32_mount(part_t *part);
 void fat32_init(void *self);
+void fat32_fat_init(fat32_t *self);
+u32 *fat32_fat_window(fat32_t *self, u64 index);
 
 void fat32_load_cluster(fat32_t *self, u8 *dest, u32 cluster);
+void fat32_submit_clusters(fat32_t *self, drive_req_t *req, u8 *dest, u32 cluster, u64 n_clusters);
+u64 fat32_next_extent(fat32_t *self, u32 cluster, u64 max_clusters, u32 *next);
 u64 fat32_load_cluster_chain(fat32_t *self, u8 *dest, u32 start_cluster, u64 n_clusters);
 
+bool fat32_is_data_cluster(fat32_t *self, u32 cluster);
 u32 fat32_next_cluster(fat32_t *self, u32 cur_cluster);
-u8 fat32_cmp_path(const char *path_input, const char *path_entry);
-
+u64 fat32_entry_name(fat32_dir_entry_t *entry, char *dest);
+u8 fat32_lfn_checksum(fat32_dir_entry_t *entry);
+void fat32_lfn_add(fat32_lfn_t *lfn, fat32_lfn_entry_t *entry);
+u64 fat32_lfn_name(fat32_lfn_t *lfn, fat32_dir_entry_t *entry, char *dest);
+bool fat32_scan_dir(fat32_t *self, u32 dir, const char *name, u64 hash, dentry_t *found);
+bool fat32_lookup(fat32_t *self, u32 dir, const char *name, dentry_t *found);
+
+bool fat32_resolve(fat32_t *self, const char *path, dentry_t *found);
 u64 fat32_load_file(void *self, const char *path, u8 *buf, u64 n_clusters);
+
+bool fat32_open(void *self, const char *path, file_t *file);
+u32 fat32_seek(fat32_t *self, file_t *file, u64 index);
+u64 fat32_read(void *self, file_t *file, u8 *dest, u64 offset, u64 n_bytes);
+u64 fat32_map(void *self, file_t *file, u64 offset, u64 *lba);
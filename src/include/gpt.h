@@ -0,0 +1,51 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+
+
+// "EFI PART"
+#define GPT_SIGNATURE           0x5452415020494645
+
+// the primary header is in the second block, the backup header in the last one
+#define GPT_PRIMARY_LBA         1
+
+#define GPT_HEADER_MIN_SIZE     92
+#define GPT_ENTRY_MIN_SIZE      128
+
+// size of the entry array that is supported (128 entries of 128 bytes, the usual size)
+#define GPT_MAX_ENTRIES_BYTES   0x4000
+
+
+typedef struct PACKED GPTHeader {
+    u64 signature;
+    u32 revision;
+    u32 header_size;
+    u32 header_crc;
+    u32 reserved;
+    u64 my_lba;
+    u64 alternate_lba;
+    u64 first_usable_lba;
+    u64 last_usable_lba;
+    u8  disk_guid[16];
+    u64 entries_lba;
+    u32 n_entries;
+    u32 entry_size;
+    u32 entries_crc;
+} gpt_header_t;
+
+typedef struct PACKED GPTEntry {
+    u8  type_guid[16];
+    u8  part_guid[16];
+    u64 first_lba;
+    u64 last_lba;       // inclusive
+    u64 attr;
+    u16 name[36];       // UTF-16LE
+} gpt_entry_t;
+
+
+bool gpt_read_header(drive_t *drive, gpt_header_t *hdr, u64 lba, u64 secs_per_blk);
+bool gpt_read_entries(drive_t *drive, gpt_header_t *hdr, u64 secs_per_blk);
+bool gpt_load(drive_t *drive, gpt_header_t *hdr, u64 secs_per_blk);
+u64 gpt_scan(drive_t *drive);
@@ -12,3 +12,4 @@ typedef struct Heap {
 } heap_t;
 
 void *heap_alloc(heap_t *self, u64 n_bytes);
+void *heap_alloc_aligned(heap_t *self, u64 n_bytes, u64 align);
@@ -6,6 +6,7 @@
 #include <drive.h>
 #include <pci.h>
 #include <x86.h>
+#include <layout.h>
 
 
 // identify SATA/ATAPI drive
@@ -27,6 +28,14 @@
 #define IDE_CH2_CMD                     0x170
 #define IDE_CH2_CTRL                    0x376
 
+// default IRQs (for compatibility mode)
+#define IDE_CH1_IRQ                     14
+#define IDE_CH2_IRQ                     15
+#define IDE_NO_IRQ                      0       // IRQ 0 is the PIT -> never used by IDE
+
+// two controllers with two channels each
+#define IDE_N_CHANNELS                  4
+
 // IDE register ports
 #define ATA_REG_DATA(cmd)               ((cmd) + 0x00)
 #define ATA_REG_ERROR(cmd)              ((cmd) + 0x01)
@@ -41,10 +50,43 @@
 #define ATA_REG_ALTSTATUS(ctrl)         ((ctrl) + 0x00)
 #define ATA_REG_DEVCTRL(ctrl)           ((ctrl) + 0x00)
 
+// bus master registers (BAR4, secondary channel at +8)
+#define IDE_BM_CH2_OFF                  0x08
+#define IDE_BM_REG_CMD(bm)              ((bm) + 0x00)
+#define IDE_BM_REG_STATUS(bm)           ((bm) + 0x02)
+#define IDE_BM_REG_PRDT(bm)             ((bm) + 0x04)
+
+// bus master command/status bits
+#define IDE_BM_CMD_START                (1 << 0)
+#define IDE_BM_CMD_READ                 (1 << 3)    // device -> memory
+#define IDE_BM_STATUS_ACTIVE            (1 << 0)
+#define IDE_BM_STATUS_ERR               (1 << 1)
+#define IDE_BM_STATUS_IRQ               (1 << 2)
+
+// ATA status bits
+#define ATA_STATUS_ERR                  (1 << 0)
+#define ATA_STATUS_DRQ                  (1 << 3)
+#define ATA_STATUS_BSY                  (1 << 7)
+
 // ATA commands
 #define ATA_CMD_IDENTIFY            0xec
 #define ATA_CMD_READ28              0x20
 #define ATA_CMD_READ48              0x24
+#define ATA_CMD_READ_DMA28          0xc8
+#define ATA_CMD_READ_DMA48          0x25
+#define ATA_CMD_READ_MULTIPLE28     0xc4
+#define ATA_CMD_READ_MULTIPLE48     0x29
+#define ATA_CMD_SET_MULTIPLE        0xc6
+
+// IDENTIFY data (word offsets)
+#define ATA_IDENT_MAX_MULTIPLE      47
+#define ATA_IDENT_CAPABILITIES      49
+#define ATA_IDENT_LBA28             60
+#define ATA_IDENT_CMD_SETS          83
+#define ATA_IDENT_LBA48             100
+
+#define ATA_CAP_DMA                 (1 << 8)
+#define ATA_CMD_SETS_LBA48          (1 << 10)
 
 // ATAPI commands
 #define ATA_CMD_READ_CAPACITY       0x25
@@ -64,6 +106,40 @@ typedef enum ATA_DRIVE_SEL {
 
 
 
+// Physical Region Descriptor
+// describes one memory region of a bus master DMA transfer
+// a region must not cross a 64 KiB boundary
+typedef struct PACKED PRD {
+    u32 addr;
+    u16 n_bytes;    // 0 -> 64 KiB
+    u16 flags;
+} prd_t;
+
+#define PRD_EOT                     0x8000      // last entry of the table
+#define PRD_MAX_BYTES               0x10000
+#define PRD_N_ENTRIES               (PAGE_SIZE / sizeof(prd_t))
+
+
+// PCI IDE controller that decodes 32-bit accesses to the data port
+typedef struct IDEPIO32Quirk {
+    u16 vendor;
+    u16 device;
+} ide_pio32_quirk_t;
+
+
+// an IDE channel and the IRQ it raises
+// <irq_fired> is set by the IRQ handler and cleared by the waiting driver
+typedef struct IDEChannel {
+    port_t cmd;
+    u8 irq;
+    volatile bool irq_fired;
+
+    // requests of both drives, only the first one is processed at a time
+    drive_req_t *head;
+    drive_req_t *tail;
+} ide_channel_t;
+
+
 // there are 2 IDE channels with 2 drives each -> 4 drives
 // primary/secondary channel
 // master/slave drive
@@ -74,6 +150,18 @@ typedef struct IDEDrive {
     // command/control I/O ports
     port_t cmd;
     port_t ctrl;
+
+    // bus master I/O port of the channel (0 -> no bus mastering)
+    port_t bm;
+    prd_t *prdt;
+
+    // request queue and interrupts of the channel
+    ide_channel_t *channel;
+
+    // start(void* self, drive_req_t* req) -> issues the next command of a request
+    void (*start)(void*, drive_req_t*);
+    // step(void* self, drive_req_t* req) -> continues a request once the drive is ready
+    void (*step)(void*, drive_req_t*);
 } ide_drive_t;
 
 
@@ -83,10 +171,25 @@ typedef struct ATA {
     // size (LBA28/LBA48)
     u32 n_secs28;
     u64 n_secs48;
+
+    // drive supports DMA transfers
+    bool dma;
+    bool lba48;
+
+    // PIO: sectors per DRQ block (READ MULTIPLE) and 32-bit data port transfers
+    u8 mult;
+    bool pio32;
 } ata_t;
 
 typedef struct ATAPI {
     ide_drive_t ide;
+
+    // logical block size reported by READ CAPACITY (2048 for CDs)
+    u32 blk_size;
+    u64 secs_per_blk;
+
+    // single block for requests that do not start/end at a block boundary
+    u8 *bounce;
 } atapi_t;
 
 typedef struct SATA {
@@ -97,5 +200,18 @@ typedef struct SATA {
 void ide_initialize(u8 bus, u8 dev, u8 func);
 void ide_400ns_delay(ide_drive_t *drive);
 void ide_select_drive(port_t cmd, bool slave, ata_drive_sel_t mode, u32 lba);
-void ide_scan_channels(port_t cmd1, port_t ctrl1, port_t cmd2, port_t ctrl2);
+void ide_scan_channel(port_t cmd, port_t ctrl, port_t bm, u8 irq, bool pio32);
+bool ide_pio32_supported(u8 bus, u8 dev, u8 func);
+ide_channel_t *ide_add_channel(port_t cmd, u8 irq);
+void ide_irq(u8 irq);
+void ide_sleep(ide_drive_t *drive);
+u8 ide_poll(ide_drive_t *drive);
+u8 ide_wait(ide_drive_t *drive);
+void ide_channel_step(ide_channel_t *channel);
+void ide_read_data(ide_drive_t *drive, drive_req_t *req, u64 off, u64 n_bytes, bool pio32);
+void ide_submit(void *self, drive_req_t *req);
+bool ide_poll_req(void *self, drive_req_t *req);
+void ide_wait_req(void *self, drive_req_t *req);
+void ide_shutdown(void *self);
+u64 ide_readv(void *self, drive_iovec_t *iov, u64 n_iov, u64 lba);
 drive_type_t ide_drive_identify(ide_drive_t *drive);
@@ -2,6 +2,7 @@
 
 
 #include <types.h>
+#include <pic.h>
 
 
 #define N_IDT_ENTRIES           256
@@ -9,6 +10,9 @@
 #define IDT_PRESENT             0x01
 #define IDT_INT_GATE            0x8E
 
+// system interrupt of an IRQ
+#define IDT_IRQ_VEC(irq)        ((irq) < 8 ? PIC_MASTER_OFF + (irq) : PIC_SLAVE_OFF + (irq) - 8)
+
 
 // structure of an IDT entry
 typedef struct PACKED IDTDescriptor {
@@ -39,8 +43,16 @@ typedef struct TrapFrame {
 } tf_t;
 
 
+// called with interrupts disabled, the EOI is sent afterwards
+typedef void (*irq_handler_t)(u8 irq);
+
+// entry points of the IRQs (x86.asm)
+extern u64 irq_stubs[PIC_N_IRQS];
+
 
 void idt_init(void);
 void idt_set_desc(u8 vec, u64 isr, u8 attr, u8 ist);
+void idt_set_irq(u8 irq, irq_handler_t handler);
+void irq_handle(u64 irq);
 
 void idt_load(idtr_t *idtr);
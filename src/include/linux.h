@@ -0,0 +1,142 @@
+#pragma once
+
+
+#include <types.h>
+#include <vfs.h>
+
+
+// Linux x86 boot protocol (Documentation/arch/x86/boot.rst), 64-bit entry point
+// the protected-mode part of a bzImage is loaded to its preferred address (or anywhere if it is relocatable)
+// and the initrd to the highest memory below initrd_addr_max, both straight from the drive
+#define LINUX_KERNEL_PATH           "/boot/vmlinuz"
+#define LINUX_INITRD_PATH           "/boot/initrd.img"
+#define LINUX_CMDLINE_PATH          "/boot/cmdline"     // first line, optional
+
+// setup header
+#define LINUX_SETUP_HEADER_OFFSET   0x1f1
+#define LINUX_SETUP_HEADER_END      0x202               // + the high byte of jump
+#define LINUX_BOOT_FLAG             0xaa55
+#define LINUX_HEADER_MAGIC          0x53726448          // "HdrS"
+#define LINUX_MIN_VERSION           0x20c               // 2.12: xloadflags
+#define LINUX_DEFAULT_SETUP_SECTS   4                   // setup_sects = 0
+#define LINUX_LOADER_UNDEFINED      0xff
+
+// loadflags
+#define LINUX_LOADED_HIGH           (1 << 0)
+
+// xloadflags
+#define LINUX_XLF_KERNEL_64         (1 << 0)
+
+// the 64-bit entry point is 0x200 bytes into the protected-mode kernel
+#define LINUX_ENTRY_64              0x200
+
+// it expects a flat GDT with these selectors
+#define LINUX_BOOT_CS               0x10
+#define LINUX_BOOT_DS               0x18
+
+#define LINUX_E820_MAX              128
+#define LINUX_CMDLINE_MAX           2048
+
+// screen_info of the VGA text mode the loader runs in
+#define LINUX_VIDEO_MODE_TEXT       3
+#define LINUX_VIDEO_COLS            80
+#define LINUX_VIDEO_LINES           25
+#define LINUX_VIDEO_POINTS          16
+
+
+typedef struct PACKED LinuxSetupHeader {
+    u8  setup_sects;            // 0x1f1
+    u16 root_flags;
+    u32 syssize;
+    u16 ram_size;
+    u16 vid_mode;
+    u16 root_dev;
+    u16 boot_flag;              // 0x1fe
+    u16 jump;                   // 0x200, the header ends at 0x202 + its high byte
+    u32 header;                 // 0x202
+    u16 version;
+    u32 realmode_swtch;
+    u16 start_sys_seg;
+    u16 kernel_version;
+    u8  type_of_loader;         // 0x210
+    u8  loadflags;
+    u16 setup_move_size;
+    u32 code32_start;
+    u32 ramdisk_image;          // 0x218
+    u32 ramdisk_size;
+    u32 bootsect_kludge;
+    u16 heap_end_ptr;
+    u8  ext_loader_ver;
+    u8  ext_loader_type;
+    u32 cmd_line_ptr;           // 0x228
+    u32 initrd_addr_max;        // last byte the initrd may use
+    u32 kernel_alignment;
+    u8  relocatable_kernel;
+    u8  min_alignment;
+    u16 xloadflags;             // 0x236
+    u32 cmdline_size;           // without the terminating 0
+    u32 hardware_subarch;
+    u64 hardware_subarch_data;
+    u32 payload_offset;
+    u32 payload_length;
+    u64 setup_data;
+    u64 pref_address;           // 0x258
+    u32 init_size;              // memory the kernel needs from its load address on (while it decompresses)
+    u32 handover_offset;
+    u32 kernel_info_offset;
+} linux_setup_header_t;
+
+
+typedef struct PACKED LinuxE820Entry {
+    u64 addr;
+    u64 size;
+    u32 type;
+} linux_e820_entry_t;
+
+
+// "zero page"
+typedef struct PACKED LinuxBootParams {
+
+    // screen_info
+    u8  orig_x;                 // 0x000
+    u8  orig_y;
+    u16 ext_mem_k;
+    u16 orig_video_page;
+    u8  orig_video_mode;
+    u8  orig_video_cols;
+    u8  flags;
+    u8  unused2;
+    u16 orig_video_ega_bx;
+    u16 unused3;
+    u8  orig_video_lines;
+    u8  orig_video_is_vga;
+    u16 orig_video_points;
+    u8  screen_info_rest[0x40 - 0x12];
+
+    u8  pad0[0x1e8 - 0x40];
+    u8  e820_entries;           // 0x1e8
+    u8  pad1[LINUX_SETUP_HEADER_OFFSET - 0x1e9];
+    linux_setup_header_t hdr;   // 0x1f1
+    u8  pad2[0x2d0 - LINUX_SETUP_HEADER_OFFSET - sizeof(linux_setup_header_t)];
+    linux_e820_entry_t e820_table[LINUX_E820_MAX];  // 0x2d0
+    u8  pad3[0x1000 - 0x2d0 - LINUX_E820_MAX * sizeof(linux_e820_entry_t)];
+} linux_boot_params_t;
+
+
+// descriptor table register operand of lgdt
+typedef struct PACKED LinuxGDTR {
+    u16 limit;
+    u64 base;
+} linux_gdtr_t;
+
+
+extern linux_boot_params_t linux_boot_params;
+
+
+u64 linux_load(fs_t *fs);
+u64 linux_load_kernel(fs_t *fs);
+void linux_load_initrd(fs_t *fs);
+void linux_load_cmdline(fs_t *fs);
+void linux_setup_video(void);
+void linux_setup_e820(void);
+NORETURN void linux_start(u64 kernel);
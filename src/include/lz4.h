@@ -0,0 +1,47 @@
+#pragma once
+
+
+#include <types.h>
+#include <vfs.h>
+
+
+// LZ4 frame format (lz4 CLI) and the legacy format (lz4 -l, used for Linux kernels and initrds)
+#define LZ4_MAGIC                   0x184d2204
+#define LZ4_LEGACY_MAGIC            0x184c2102
+#define LZ4_SKIPPABLE_MAGIC         0x184d2a50
+#define LZ4_SKIPPABLE_MASK          0xfffffff0  // 16 magic numbers
+
+// frame descriptor
+#define LZ4_FLG_VERSION(flg)        ((flg) >> 6)
+#define LZ4_FLG_BLOCK_CHECKSUM      (1 << 4)
+#define LZ4_FLG_CONTENT_SIZE        (1 << 3)
+#define LZ4_FLG_CONTENT_CHECKSUM    (1 << 2)
+#define LZ4_FLG_RESERVED            (1 << 1)
+#define LZ4_FLG_DICT_ID             (1 << 0)
+#define LZ4_BD_MAX_SIZE(bd)         (((bd) >> 4) & 7)
+
+// block sizes
+#define LZ4_BLOCK_UNCOMPRESSED      0x80000000  // flag in the size of a block
+#define LZ4_MAX_BLOCK               0x400000
+#define LZ4_LEGACY_BLOCK            0x800000    // decompressed size of every legacy block but the last
+#define LZ4_LEGACY_MAX_COMPRESSED   (LZ4_LEGACY_BLOCK + LZ4_LEGACY_BLOCK / 255 + 16)
+
+// sequences
+#define LZ4_MIN_MATCH               4
+#define LZ4_RUN_MASK                15
+
+// xxHash32
+#define LZ4_XXH_PRIME1              0x9e3779b1
+#define LZ4_XXH_PRIME2              0x85ebca77
+#define LZ4_XXH_PRIME3              0xc2b2ae3d
+#define LZ4_XXH_PRIME4              0x27d4eb2f
+#define LZ4_XXH_PRIME5              0x165667b1
+
+
+bool lz4_is_compressed(u32 magic);
+u32 lz4_xxh32(u8 *data, u64 n_bytes, u32 seed);
+void lz4_copy(u8 *dest, u8 *src, u64 n_bytes);
+u64 lz4_decode_block(u8 *src, u64 n_src, u8 *dest, u64 n_dest, u8 *window);
+u64 lz4_load_frame(vfs_stream_t *stream, u8 *dest, u64 max_bytes, u64 n_out);
+u64 lz4_load_legacy(vfs_stream_t *stream, u8 *dest, u64 max_bytes, u64 n_out);
+u64 lz4_load(file_t *file, u8 *dest, u64 max_bytes, struct Verify *verify);
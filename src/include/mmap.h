@@ -0,0 +1,41 @@
+#pragma once
+
+
+#include <types.h>
+
+
+// memory map (E820) written by the 16-bit loader
+#define MMAP_BUFFER             0x1000
+#define MMAP_ENTRIES            ((mmap_entry_t*)MMAP_BUFFER)
+
+#define MMAP_USABLE             1
+
+// everything below 1 MiB belongs to the loader, only the first 4 GiB are mapped
+#define MMAP_MIN_ADDR           0x100000
+#define MMAP_MAX_ADDR           0x100000000
+
+#define MMAP_MAX_RESERVED       64
+
+
+typedef struct PACKED MmapEntry {
+    u64 base;
+    u64 length;
+    u32 type;
+    u32 acpi;
+} mmap_entry_t;
+
+// memory that has been handed out (start inclusive, end exclusive)
+typedef struct MmapRange {
+    u64 start;
+    u64 end;
+} mmap_range_t;
+
+
+extern u32 n_mmap_entries;
+
+
+u64 mmap_overlap(u64 addr, u64 n_bytes);
+u64 mmap_usable_bytes(void);
+bool mmap_is_free(u64 addr, u64 n_bytes);
+void mmap_reserve(u64 addr, u64 n_bytes);
+void *mmap_reserve_high(u64 n_bytes, u64 align, u64 max_addr);
@@ -0,0 +1,148 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+
+
+// queue sizes (entries)
+// the I/O queue allows NVME_IO_QUEUE_SIZE - 1 commands in flight
+#define NVME_ADMIN_QUEUE_SIZE       16
+#define NVME_IO_QUEUE_SIZE          32
+#define NVME_IO_QUEUE_ID            1
+
+// every I/O command slot owns a PRP list of this many entries (2 KiB)
+#define NVME_PRP_LIST_ENTRIES       256
+
+// sectors (512 bytes) moved by a single command, further limited by the controller's MDTS
+#define NVME_CMD_MAX_SECS           2048
+
+// controller capabilities
+#define NVME_CAP_MQES(cap)          (((cap) & 0xffff) + 1)
+#define NVME_CAP_DSTRD(cap)         (((cap) >> 32) & 0x0f)
+
+// controller configuration/status
+#define NVME_CC_EN                  (1 << 0)
+#define NVME_CC_IOSQES              (6 << 16)   // 64 byte submission entries
+#define NVME_CC_IOCQES              (4 << 20)   // 16 byte completion entries
+#define NVME_CSTS_RDY               (1 << 0)
+#define NVME_CSTS_CFS               (1 << 1)
+
+// doorbells start at offset 0x1000
+#define NVME_DOORBELL_OFF           0x1000
+
+// admin commands
+#define NVME_ADMIN_CREATE_SQ        0x01
+#define NVME_ADMIN_CREATE_CQ        0x05
+#define NVME_ADMIN_IDENTIFY         0x06
+
+// identify CNS values
+#define NVME_CNS_NAMESPACE          0x00
+#define NVME_CNS_CONTROLLER         0x01
+#define NVME_CNS_ACTIVE_NS_LIST     0x02
+
+// identify data (byte offsets)
+#define NVME_IDENT_CTRL_MDTS        77
+#define NVME_IDENT_NS_NSZE          0
+#define NVME_IDENT_NS_FLBAS         26
+#define NVME_IDENT_NS_LBAF          128
+#define NVME_LBAF_LBADS(lbaf)       (((lbaf) >> 16) & 0xff)
+
+// queue flags
+#define NVME_QUEUE_CONTIGUOUS       (1 << 0)
+
+// I/O commands
+#define NVME_CMD_READ               0x02
+
+// completion status (bit 0 is the phase tag)
+#define NVME_STATUS_PHASE           (1 << 0)
+#define NVME_STATUS_CODE(status)    ((status) >> 1)
+
+
+// memory mapped controller registers (BAR0)
+typedef volatile struct PACKED NVMeRegs {
+    u64 cap;
+    u32 vs;
+    u32 intms;
+    u32 intmc;
+    u32 cc;
+    u32 reserved;
+    u32 csts;
+    u32 nssr;
+    u32 aqa;
+    u64 asq;
+    u64 acq;
+} nvme_regs_t;
+
+// submission queue entry
+typedef struct PACKED NVMeCmd {
+    u8  opc;
+    u8  flags;
+    u16 cid;
+    u32 nsid;
+    u64 reserved;
+    u64 mptr;
+    u64 prp1;
+    u64 prp2;
+    u32 cdw10;
+    u32 cdw11;
+    u32 cdw12;
+    u32 cdw13;
+    u32 cdw14;
+    u32 cdw15;
+} nvme_cmd_t;
+
+// completion queue entry
+typedef struct PACKED NVMeCompletion {
+    u32 result;
+    u32 reserved;
+    u16 sq_head;
+    u16 sq_id;
+    u16 cid;
+    u16 status;
+} nvme_cpl_t;
+
+// a submission queue together with its completion queue
+typedef struct NVMeQueue {
+    nvme_cmd_t *sq;
+    volatile nvme_cpl_t *cq;
+    volatile u32 *sq_doorbell;
+    volatile u32 *cq_doorbell;
+
+    u16 size;
+    u16 sq_tail;
+    u16 cq_head;
+    u16 phase;
+} nvme_queue_t;
+
+
+// namespace of an NVMe controller
+typedef struct NVMeDrive {
+    drive_t base;
+
+    nvme_regs_t *regs;
+    nvme_queue_t admin;
+    nvme_queue_t io;
+
+    u32 nsid;
+    // sectors (512 bytes) per logical block
+    u64 secs_per_blk;
+
+    // one PRP list per I/O command slot
+    u64 *prp_lists;
+    u8 *buf;
+} nvme_drive_t;
+
+
+void nvme_initialize(u8 bus, u8 dev, u8 func);
+void nvme_queue_init(nvme_drive_t *drive, nvme_queue_t *queue, u16 id, u16 size);
+u16 nvme_push(nvme_queue_t *queue, nvme_cmd_t *cmd);
+void nvme_ring(nvme_queue_t *queue);
+u16 nvme_reap(nvme_queue_t *queue);
+void nvme_admin(nvme_drive_t *drive, nvme_cmd_t *cmd);
+void nvme_identify(nvme_drive_t *drive, u8 cns, u32 nsid, u8 *dest);
+void nvme_build_prps(nvme_drive_t *drive, nvme_cmd_t *cmd, u8 *dest, u64 n_bytes);
+u64 nvme_read_blocks(void *self, u8 *dest, u64 blk, u64 n_blks);
+u64 nvme_read(void *self, u8 *dest, u64 lba, u64 n_secs);
+void nvme_shutdown(void *self);
@@ -2,8 +2,26 @@
 
 
 #include <types.h>
+#include <drive.h>
 
 
+// MBR layout
+#define MBR_PART_OFFSET         0x1be
+#define MBR_SIGNATURE_OFFSET    0x1fe
+#define MBR_SIGNATURE           0xaa55
+#define MBR_N_PARTS             4
+
+// MBR partition types
+#define MBR_TYPE_NONE           0x00
+#define MBR_TYPE_EXTENDED_CHS   0x05
+#define MBR_TYPE_EXTENDED_LBA   0x0f
+#define MBR_TYPE_GPT            0xee    // protective MBR
+
+// partitions of all drives that are remembered
+#define PART_MAX                32
+
+
+// MBR partition table entry
 typedef struct PACKED Partition {
     u8  attr;
     u8  c_start;
@@ -16,3 +34,33 @@ typedef struct PACKED Partition {
     u32 lba_start;
     u32 num_sectors;
 } partition_t;
+
+
+typedef enum PART_SCHEME {
+    PART_MBR,
+    PART_GPT
+} part_scheme_t;
+
+
+// a partition found on any drive, independent of the partitioning scheme
+typedef struct Part {
+    drive_t *drive;
+    part_scheme_t scheme;
+    u64 index;          // entry in the partition table
+
+    // in 512 byte sectors of the drive
+    u64 lba_start;
+    u64 n_secs;
+
+    // MBR: partition type, GPT: partition type GUID
+    u8 mbr_type;
+    u8 type_guid[16];
+} part_t;
+
+
+extern part_t parts[PART_MAX];
+extern u64 n_parts;
+
+
+part_t *part_add(drive_t *drive, part_scheme_t scheme, u64 index, u64 lba_start, u64 n_secs);
+u64 part_scan(drive_t *drive);
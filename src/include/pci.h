@@ -28,18 +28,36 @@
 #define PCI_OFF_HEADER_TYPE     0x0e, 0xff
 #define PCI_OFF_BIST            0x0f, 0xff
 
-#define PCI_OFF_BAR0            0x0f, 0xff
-#define PCI_OFF_BAR1            0x0f, 0xff
-#define PCI_OFF_BAR2            0x0f, 0xff
-#define PCI_OFF_BAR3            0x0f, 0xff
-#define PCI_OFF_BAR4            0x0f, 0xff
-#define PCI_OFF_BAR5            0x0f, 0xff
+#define PCI_OFF_BAR0            0x10, 0xffffffff
+#define PCI_OFF_BAR1            0x14, 0xffffffff
+#define PCI_OFF_BAR2            0x18, 0xffffffff
+#define PCI_OFF_BAR3            0x1c, 0xffffffff
+#define PCI_OFF_BAR4            0x20, 0xffffffff
+#define PCI_OFF_BAR5            0x24, 0xffffffff
+#define PCI_OFF_BAR(n)          (0x10 + (n) * 4), 0xffffffff
+#define PCI_OFF_CAP_PTR         0x34, 0xff
+#define PCI_OFF_INT_LINE        0x3c, 0xff
+
+// command register bits
+#define PCI_CMD_IO              (1 << 0)
+#define PCI_CMD_MEM             (1 << 1)
+#define PCI_CMD_BUSMASTER       (1 << 2)
+
+// status register bits
+#define PCI_STATUS_CAP_LIST     (1 << 4)
+
+// I/O space BARs have the lowest bit set, the rest is the port base
+#define PCI_BAR_IO              (1 << 0)
+#define PCI_BAR_IO_MASK         0xfffffffc
+#define PCI_BAR_MEM_MASK        0xfffffff0
+#define PCI_BAR_MEM_64          (2 << 1)
 
 // device classification
 #define PCI_CLASS_IDE           0x0101
 #define PCI_CLASS_FLOPPY        0x0102
 #define PCI_CLASS_ATA           0x0105
 #define PCI_CLASS_SATA          0x0106
+#define PCI_CLASS_NVME          0x0108
 #define PCI_CLASS_USB           0x0c03
 #define PCI_CLASS_SD            0x0805
 
@@ -50,5 +68,9 @@
 
 void pci_scan_all(void);
 u32 pci_cfg_read(u8 bus, u8 dev, u8 func, u8 off, u32 mask);
+void pci_cfg_write(u8 bus, u8 dev, u8 func, u8 off, u32 mask, u32 data);
+
+u64 pci_bar(u8 bus, u8 dev, u8 func, u8 n);
+u8 pci_next_cap(u8 bus, u8 dev, u8 func, u8 off, u8 id);
 
 void pci_drive_identify(u16 bus, u8 dev, u8 func);
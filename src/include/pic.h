@@ -7,8 +7,14 @@
 // I/O ports
 #define PIC_MASTER_CMD	    0x20
 #define PIC_MASTER_DATA	    0x21
-#define PIC_SLAVE_CMD	    0x10
-#define PIC_SLAVE_DATA	    0x11
+#define PIC_SLAVE_CMD	    0xa0
+#define PIC_SLAVE_DATA	    0xa1
+
+// system interrupt offsets of the IRQs
+#define PIC_MASTER_OFF      0x20
+#define PIC_SLAVE_OFF       0x28
+#define PIC_N_IRQS          16
+#define PIC_IRQ_CASCADE     2
 
 // commands
 #define PIC_EOI		        0x20
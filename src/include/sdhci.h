@@ -0,0 +1,218 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+
+
+// define SDHCI_FORCE_PIO to read through the buffer data port even if ADMA2 is supported
+// (for comparing both paths)
+
+// ADMA2 descriptors per command (each moves up to 64 KiB)
+#define SDHCI_ADMA2_N_DESCS         128
+#define SDHCI_ADMA2_MAX_BYTES       0x10000
+
+// sectors moved by a single CMD18 (limited by the descriptor table and the 16-bit block count)
+#define SDHCI_CMD_MAX_SECS          MIN(SDHCI_ADMA2_N_DESCS * SDHCI_ADMA2_MAX_BYTES / 512, U16_MAX)
+
+// clocks in kHz
+#define SDHCI_CLK_INIT              400
+#define SDHCI_CLK_DEFAULT           25000
+#define SDHCI_CLK_HIGH_SPEED        50000
+
+// I/O delays (~1 us each)
+#define SDHCI_POWER_WAITS           1000
+#define SDHCI_ACMD41_WAITS          1000
+#define SDHCI_ACMD41_TRIES          1000
+
+// capabilities
+#define SDHCI_CAPS_BASE_CLK(caps, v3)   (((caps) >> 8) & ((v3) ? 0xff : 0x3f))     // MHz
+#define SDHCI_CAPS_ADMA2            (1 << 19)
+#define SDHCI_CAPS_HIGH_SPEED       (1 << 21)
+#define SDHCI_CAPS_3V3              (1 << 24)
+#define SDHCI_CAPS_3V0              (1 << 25)
+#define SDHCI_CAPS_1V8              (1 << 26)
+
+// host controller version
+#define SDHCI_VERSION(version)      ((version) & 0xff)
+#define SDHCI_VERSION_2             1
+#define SDHCI_VERSION_3             2
+
+// present state
+#define SDHCI_PRESENT_CMD_INHIBIT   (1 << 0)
+#define SDHCI_PRESENT_DAT_INHIBIT   (1 << 1)
+#define SDHCI_PRESENT_CARD          (1 << 16)
+
+// host control 1
+#define SDHCI_HOST_4BIT             (1 << 1)
+#define SDHCI_HOST_HIGH_SPEED       (1 << 2)
+#define SDHCI_HOST_ADMA2_32         (2 << 3)
+
+// power control
+#define SDHCI_POWER_ON              (1 << 0)
+#define SDHCI_POWER_3V3             (7 << 1)
+#define SDHCI_POWER_3V0             (6 << 1)
+#define SDHCI_POWER_1V8             (5 << 1)
+
+// clock control
+#define SDHCI_CLK_INT_EN            (1 << 0)
+#define SDHCI_CLK_INT_STABLE        (1 << 1)
+#define SDHCI_CLK_SD_EN             (1 << 2)
+#define SDHCI_CLK_DIV_MAX_V2        0x80
+#define SDHCI_CLK_DIV_MAX_V3        0x3ff
+
+#define SDHCI_TIMEOUT_MAX           0x0e
+
+// software reset
+#define SDHCI_RESET_ALL             (1 << 0)
+#define SDHCI_RESET_CMD             (1 << 1)
+#define SDHCI_RESET_DAT             (1 << 2)
+
+// normal interrupt status
+#define SDHCI_INT_CMD_COMPLETE      (1 << 0)
+#define SDHCI_INT_XFER_COMPLETE     (1 << 1)
+#define SDHCI_INT_BUF_READ_READY    (1 << 5)
+#define SDHCI_INT_ERROR             (1 << 15)
+#define SDHCI_INT_ALL               0xffff
+
+// transfer mode
+#define SDHCI_XFER_DMA              (1 << 0)
+#define SDHCI_XFER_BLK_COUNT        (1 << 1)
+#define SDHCI_XFER_AUTO_CMD12       (1 << 2)
+#define SDHCI_XFER_READ             (1 << 4)
+#define SDHCI_XFER_MULTI            (1 << 5)
+
+// command register
+#define SDHCI_CMD_RESP_NONE         0
+#define SDHCI_CMD_RESP_136          1
+#define SDHCI_CMD_RESP_48           2
+#define SDHCI_CMD_RESP_48_BUSY      3
+#define SDHCI_CMD_CRC               (1 << 3)
+#define SDHCI_CMD_INDEX             (1 << 4)
+#define SDHCI_CMD_DATA              (1 << 5)
+
+// response types
+#define SDHCI_R1                    (SDHCI_CMD_RESP_48 | SDHCI_CMD_CRC | SDHCI_CMD_INDEX)
+#define SDHCI_R1B                   (SDHCI_CMD_RESP_48_BUSY | SDHCI_CMD_CRC | SDHCI_CMD_INDEX)
+#define SDHCI_R2                    (SDHCI_CMD_RESP_136 | SDHCI_CMD_CRC)
+#define SDHCI_R3                    SDHCI_CMD_RESP_48
+#define SDHCI_R6                    SDHCI_R1
+#define SDHCI_R7                    SDHCI_R1
+
+// ADMA2 descriptor attributes
+#define ADMA2_VALID                 (1 << 0)
+#define ADMA2_END                   (1 << 1)
+#define ADMA2_TRAN                  (2 << 4)
+
+// SD commands
+#define SD_CMD_GO_IDLE              0
+#define SD_CMD_ALL_SEND_CID         2
+#define SD_CMD_SEND_RCA             3
+#define SD_CMD_SWITCH_FUNC          6
+#define SD_CMD_SELECT_CARD          7
+#define SD_CMD_SEND_IF_COND         8
+#define SD_CMD_SEND_CSD             9
+#define SD_CMD_SET_BLOCKLEN         16
+#define SD_CMD_READ_SINGLE          17
+#define SD_CMD_READ_MULTIPLE        18
+#define SD_CMD_APP                  55
+#define SD_ACMD_SET_BUS_WIDTH       6
+#define SD_ACMD_SEND_OP_COND        41
+
+// arguments and responses
+#define SD_IF_COND_CHECK            0x1aa
+#define SD_OCR_VOLTAGES             0x00ff8000
+#define SD_OCR_HCS                  (1 << 30)
+#define SD_OCR_READY                (1u << 31)
+#define SD_BUS_WIDTH_4              2
+#define SD_SWITCH_HIGH_SPEED        0x80fffff1
+#define SD_SWITCH_STATUS_BYTES      64
+#define SD_SWITCH_GROUP1(status)    ((status)[16] & 0x0f)
+
+// CSD fields (the response registers do not contain the CRC -> CSD bit n is response bit n - 8)
+#define SD_CSD_STRUCTURE(r)         (((r)[3] >> 22) & 0x03)
+#define SD_CSD2_C_SIZE(r)           (((r)[1] >> 8) & 0x3fffff)
+#define SD_CSD1_C_SIZE(r)           ((((r)[1] >> 22) | ((r)[2] << 10)) & 0xfff)
+#define SD_CSD1_C_SIZE_MULT(r)      (((r)[1] >> 7) & 0x07)
+#define SD_CSD1_READ_BL_LEN(r)      (((r)[2] >> 8) & 0x0f)
+
+
+// host controller registers (a single slot)
+typedef volatile struct PACKED SDHCIRegs {
+    u32 sdma_addr;
+    u16 blk_size;
+    u16 blk_count;
+    u32 arg;
+    u16 xfer_mode;
+    u16 cmd;
+    u32 resp[4];
+    u32 data;
+    u32 present;
+    u8  host_ctrl;
+    u8  power_ctrl;
+    u8  gap_ctrl;
+    u8  wakeup_ctrl;
+    u16 clk_ctrl;
+    u8  timeout_ctrl;
+    u8  reset;
+    u16 int_status;
+    u16 err_status;
+    u16 int_enable;
+    u16 err_enable;
+    u16 int_signal;
+    u16 err_signal;
+    u16 acmd_err;
+    u16 host_ctrl2;
+    u32 caps;
+    u32 caps1;
+    u32 max_current[2];
+    u16 force_acmd_err;
+    u16 force_err;
+    u8  adma_err;
+    u8  reserved0[3];
+    u32 adma_addr_low;
+    u32 adma_addr_high;
+    u8  reserved1[0x9c];
+    u16 slot_int;
+    u16 version;
+} sdhci_regs_t;
+
+// 32-bit ADMA2 descriptor (length 0 -> 64 KiB)
+typedef struct PACKED ADMA2Desc {
+    u16 attr;
+    u16 length;
+    u32 addr;
+} adma2_desc_t;
+
+
+typedef struct SDHCI {
+    drive_t base;
+
+    sdhci_regs_t *regs;
+    bool v3;
+    u64 base_khz;
+
+    // card
+    u16 rca;
+    bool high_capacity;     // block instead of byte addresses
+
+    // ADMA2 or buffer data port
+    bool adma;
+    adma2_desc_t *descs;
+
+    // page for small transfers and unaligned requests
+    u8 *buf;
+} sdhci_t;
+
+
+void sdhci_initialize(u8 bus, u8 dev, u8 func);
+void sdhci_reset(sdhci_t *drive, u8 mask);
+void sdhci_set_clock(sdhci_t *drive, u64 khz);
+u16 sdhci_wait(sdhci_t *drive, u16 mask);
+u16 sdhci_cmd(sdhci_t *drive, u8 index, u32 arg, u16 flags);
+u16 sdhci_acmd(sdhci_t *drive, u8 index, u32 arg, u16 flags);
+u16 sdhci_transfer(sdhci_t *drive, u8 index, u32 arg, u8 *dest, u16 blk_size, u16 n_blks);
+bool sdhci_card_init(sdhci_t *drive);
+u64 sdhci_read(void *self, u8 *dest, u64 lba, u64 n_secs);
+void sdhci_shutdown(void *self);
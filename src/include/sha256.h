@@ -0,0 +1,36 @@
+#pragma once
+
+
+#include <types.h>
+
+
+#define SHA256_BLOCK_BYTES          64
+#define SHA256_DIGEST_BYTES         32
+
+
+typedef enum SHA256_BACKEND {
+    SHA256_GENERIC,
+    SHA256_SHANI
+} sha256_backend_t;
+
+
+// hash of a message that is passed in pieces of any size
+typedef struct SHA256Ctx {
+    u32 state[8];
+    u8 block[SHA256_BLOCK_BYTES];   // partial block
+    u64 n_block;
+    u64 n_bytes;                    // message length so far
+} sha256_ctx_t;
+
+
+extern sha256_backend_t sha256_backend;
+
+
+void sha256_init(void);
+void sha256_blocks_generic(u32 *state, u8 *data, u64 n_blocks);
+void sha256_blocks_shani(u32 *state, u8 *data, u64 n_blocks);
+void sha256_blocks(u32 *state, u8 *data, u64 n_blocks);
+
+void sha256_start(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, u8 *data, u64 n_bytes);
+void sha256_final(sha256_ctx_t *ctx, u8 *digest);
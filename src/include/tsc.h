@@ -0,0 +1,38 @@
+#pragma once
+
+
+#include <types.h>
+
+
+// PIT channel 2 is used to measure the TSC frequency
+#define PIT_HZ                  1193182
+#define PIT_PORT_CH2            0x42
+#define PIT_PORT_CMD            0x43
+#define PIT_CMD_CH2_MODE0       0xb0    // channel 2, low/high byte, interrupt on terminal count
+#define PIT_PORT_CTRL           0x61
+#define PIT_CTRL_GATE2          (1 << 0)
+#define PIT_CTRL_SPEAKER        (1 << 1)
+#define PIT_CTRL_OUT2           (1 << 5)
+
+// calibration interval
+#define TSC_CALIBRATE_MS        10
+
+// the PIT is given up on after this many ticks (100 ms at 10 GHz)
+#define TSC_CALIBRATE_TIMEOUT   1000000000ULL
+
+// cpuid leaves that report the frequency
+#define CPUID_LEAF_TSC          0x15    // TSC/crystal ratio and crystal Hz
+#define CPUID_LEAF_FREQ         0x16    // base frequency in MHz
+
+// without the PIT and cpuid
+#define TSC_DEFAULT_KHZ         2000000
+
+
+// TSC ticks per millisecond
+extern u64 tsc_khz;
+
+
+void tsc_init(void);
+u64 tsc_cpuid_khz(void);
+u64 tsc_ns(u64 ticks);
+u64 tsc_us(u64 ticks);
@@ -28,7 +28,7 @@ typedef signed      long long   s64;
 
 #define U8_MAX      0xff
 #define U16_MAX     0xffff
-#define U28_MAX     0xffffff
+#define U28_MAX     0xfffffff
 #define U32_MAX     0xffffffff
 #define U48_MAX     0xffffffffffff
 #define U64_MAX     0xffffffffffffffff
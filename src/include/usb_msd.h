@@ -0,0 +1,83 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <xhci.h>
+
+
+// interface class/subclass/protocol
+#define USB_CLASS_MSD               0x08
+#define USB_MSD_SUBCLASS_SCSI       0x06
+#define USB_MSD_PROTOCOL_BOT        0x50
+
+// Bulk-Only Transport
+#define BOT_CBW_SIGNATURE           0x43425355
+#define BOT_CSW_SIGNATURE           0x53425355
+#define BOT_CBW_DATA_IN             0x80
+
+// SCSI commands
+#define SCSI_TEST_UNIT_READY        0x00
+#define SCSI_REQUEST_SENSE          0x03
+#define SCSI_READ_CAPACITY10        0x25
+#define SCSI_READ10                 0x28
+
+#define SCSI_SENSE_BYTES            18
+
+// status of a SCSI command (CSW status, U8_MAX -> transport error)
+#define USB_MSD_OK                  0
+#define USB_MSD_TRANSPORT_ERROR     U8_MAX
+
+// bytes moved by a single SCSI command (one chain of bulk TRBs)
+#define USB_MSD_CMD_MAX_BYTES       0x400000
+
+// attempts to get the medium ready after attaching
+#define USB_MSD_READY_TRIES         8
+
+
+// Command Block Wrapper
+typedef struct PACKED BOTCBW {
+    u32 signature;
+    u32 tag;
+    u32 data_length;
+    u8  flags;
+    u8  lun;
+    u8  cb_length;
+    u8  cb[16];
+} bot_cbw_t;
+
+// Command Status Wrapper
+typedef struct PACKED BOTCSW {
+    u32 signature;
+    u32 tag;
+    u32 residue;
+    u8  status;
+} bot_csw_t;
+
+
+// a USB mass storage device (Bulk-Only Transport, SCSI)
+typedef struct USBMassStorage {
+    drive_t base;
+
+    xhci_device_t *device;
+    xhci_ring_t bulk_in;
+    xhci_ring_t bulk_out;
+    u8 dci_in;
+    u8 dci_out;
+
+    u32 tag;
+    bot_cbw_t *cbw;
+    bot_csw_t *csw;
+
+    // sectors (512 bytes) per logical block
+    u64 secs_per_blk;
+    u64 max_blks;
+    u8 *bounce;
+} usb_msd_t;
+
+
+void usb_msd_initialize(xhci_device_t *device, u8 ep_in, u16 mps_in, u8 ep_out, u16 mps_out);
+u8 usb_msd_scsi(usb_msd_t *drive, u8 *cb, u8 cb_length, u8 *data, u64 n_bytes);
+u64 usb_msd_read_blocks(void *self, u8 *dest, u64 blk, u64 n_blks);
+u64 usb_msd_read(void *self, u8 *dest, u64 lba, u64 n_secs);
+void usb_msd_shutdown(void *self);
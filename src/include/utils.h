@@ -5,5 +5,6 @@
 #include <types.h>
 
 
-void mem_set(u8 *dest, u8 val, u32 n_bytes);
-void mem_cpy(u8 *dest, u8 *src, u32 n_bytes);
+void mem_set(u8 *dest, u8 val, u64 n_bytes);
+void mem_cpy(u8 *dest, u8 *src, u64 n_bytes);
+void mem_zero(u8 *dest, u64 n_bytes);
@@ -0,0 +1,63 @@
+#pragma once
+
+
+#include <types.h>
+#include <vfs.h>
+#include <sha256.h>
+
+
+// files are verified while they are loaded against the manifest of their filesystem
+// every line of it is "<digest in hex> <absolute path>" (the output of sha256sum with absolute paths):
+//     64 hex digits -> SHA-256, 8 hex digits -> CRC-32C (as printed by "%08x")
+// lines that are empty or start with '#' are ignored
+// build with -DVERIFY_REQUIRED to refuse loading files that are not in a manifest
+#define VERIFY_MANIFEST_PATH        "/boot/manifest"
+#define VERIFY_MANIFEST_BYTES       0x4000
+#define VERIFY_MAX_ENTRIES          64
+#define VERIFY_PATH_MAX             128
+
+// bytes hashed by every backend for the throughput report
+#define VERIFY_BENCH_BYTES          0x40000
+
+
+typedef enum VERIFY_ALGO {
+    VERIFY_NONE,
+    VERIFY_SHA256,
+    VERIFY_CRC32C
+} verify_algo_t;
+
+
+typedef struct VerifyEntry {
+    fs_t *fs;
+    char path[VERIFY_PATH_MAX];
+    verify_algo_t algo;
+    u8 digest[SHA256_DIGEST_BYTES];     // CRC-32C: the first 4 bytes (big endian)
+} verify_entry_t;
+
+
+// hash of a file that is being loaded (updated per run of sectors as they arrive)
+typedef struct Verify {
+    verify_entry_t *entry;              // 0 -> nothing to verify
+    sha256_ctx_t sha256;
+    u32 crc32c;
+    u64 n_bytes;
+    u64 ticks;                          // spent hashing
+} verify_t;
+
+
+extern verify_entry_t verify_entries[VERIFY_MAX_ENTRIES];
+extern u64 n_verify_entries;
+
+
+void verify_init(void);
+void verify_report(void);
+u64 verify_load_manifest(fs_t *fs);
+bool verify_parse_line(char *line, u64 n_chars, verify_entry_t *entry);
+verify_entry_t *verify_find(fs_t *fs, const char *path);
+
+void verify_start(verify_t *verify, verify_entry_t *entry);
+void verify_update(verify_t *verify, u8 *data, u64 n_bytes);
+bool verify_finish(verify_t *verify);
+void verify_open(verify_t *verify, fs_t *fs, const char *path);
+void verify_close(verify_t *verify, const char *path, u64 n_bytes_file);
+u64 verify_load(fs_t *fs, const char *path, u8 *dest, u64 max_bytes);
@@ -6,19 +6,118 @@
 #include <drive.h>
 
 
+// filesystems that can be mounted at the same time
+#define VFS_MAX_MOUNTS      16
+
+// streams read ahead in chunks of VFS_STREAM_CHUNK into a buffer of VFS_STREAM_BYTES
+// a consumer can look at up to VFS_STREAM_MAX_GET contiguous bytes at once (a whole compressed block)
+#define VFS_STREAM_CHUNK    0x100000
+#define VFS_STREAM_BYTES    0xc00000
+#define VFS_STREAM_MAX_GET  (VFS_STREAM_BYTES - 2 * VFS_STREAM_CHUNK)
+
+// segments a single read of vfs_load_rawv scatters to (a sector may not be split among more)
+#define VFS_MAX_IOV         16
+
+
 typedef enum FS_TYPE {
     FS_NONE,
-    FS_FAT32
+    FS_FAT32,
+    FS_EXT4     // ext2/3/4
 } fs_type_t;
 
 
+// an open file (or directory)
+typedef struct File {
+    struct FS *fs;      // 0 -> closed
+    u64 size;
+    bool dir;
+
+    // filesystem specific location of the data (FAT32: first cluster, ext4: inode)
+    u64 first;
+
+    // position cache: the cluster (block, ...) that contains the file offset pos_index * cluster size
+    // sequential and nearby reads continue from here instead of the start of the file
+    u64 pos_index;
+    u64 pos_cluster;
+
+    // blocks from pos_index on that are known to be contiguous (ext4: rest of the extent, 0 -> none)
+    u64 pos_n;
+} file_t;
+
+typedef struct FSStat {
+    u64 size;
+    bool dir;
+} fs_stat_t;
+
+
 typedef struct FS {
+    fs_type_t type;
     drive_t *drive;
-    partition_t *partition;
+    part_t *partition;
 
     // init(void* self, void* info)
     void (*init)(void*);
     // read_file(void* self, const char* path, u8* buf, u64 size) // size might not be fixed
     u64 (*read_file)(void*, const char*, u8*, u64);
 
+    // open(void* self, const char* path, file_t* file) -> false if the path does not exist
+    bool (*open)(void*, const char*, file_t*);
+    // read(void* self, file_t* file, u8* dest, u64 offset, u64 n_bytes) -> bytes read
+    // offset and n_bytes are within the file
+    u64 (*read)(void*, file_t*, u8*, u64, u64);
+    // map(void* self, file_t* file, u64 offset, u64* lba) -> bytes from <offset> on that are contiguous at <lba>
+    // offset is sector aligned and within the file, lba = 0 -> hole (zeros), returns 0 if it can not be mapped
+    u64 (*map)(void*, file_t*, u64, u64*);
+
 } fs_t;
+
+
+// sequential reader of a file that keeps the next chunk in flight while the data before it is used
+// (one stream at a time, they share a buffer)
+typedef struct VFSStream {
+    file_t *file;
+    u64 size;           // less than the file size if the file could not be mapped
+
+    u8 *buf;
+    u64 start;          // first byte that has not been consumed
+    u64 end;            // end of the data that has arrived
+    u64 offset;         // file offset of buf[end]
+
+    // read in flight into buf[end]
+    drive_req_t req;
+    bool busy;
+    u64 n_busy;         // bytes of the file it covers
+
+    u64 n_reads;
+
+    // hash that is updated as the data arrives (0 -> none)
+    // with it, the whole file is read even if the consumer stops early
+    struct Verify *verify;
+    u64 n_hashed;       // file offset up to which the data has been hashed
+} vfs_stream_t;
+
+
+extern heap_t heap_filesystems;
+
+extern fs_t *vfs_mounts[VFS_MAX_MOUNTS];
+extern u64 n_vfs_mounts;
+
+
+fs_t *vfs_mount(part_t *part);
+void vfs_mount_all(void);
+bool vfs_open(fs_t *fs, const char *path, file_t *file);
+bool vfs_stat(fs_t *fs, const char *path, fs_stat_t *stat);
+u64 vfs_read(file_t *file, u8 *dest, u64 offset, u64 n_bytes);
+void vfs_read_bytes(drive_t *drive, u8 *sector, u8 *dest, u64 lba, u64 off, u64 n_bytes);
+void vfs_close(file_t *file);
+u64 vfs_load(file_t *file, u8 *dest, u64 max_bytes, struct Verify *verify);
+u64 vfs_load_raw(file_t *file, u8 *dest, u64 offset, u64 n_bytes, struct Verify *verify);
+u64 vfs_load_rawv(file_t *file, drive_iovec_t *iov, u64 n_iov, u64 offset, struct Verify *verify);
+
+void vfs_stream_init(vfs_stream_t *stream, file_t *file, struct Verify *verify);
+void vfs_stream_submit(vfs_stream_t *stream);
+void vfs_stream_wait(vfs_stream_t *stream);
+void vfs_stream_hash(vfs_stream_t *stream);
+u8 *vfs_stream_get(vfs_stream_t *stream, u64 n_bytes);
+void vfs_stream_skip(vfs_stream_t *stream, u64 n_bytes);
+void vfs_stream_close(vfs_stream_t *stream);
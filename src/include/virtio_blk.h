@@ -0,0 +1,163 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+#include <x86.h>
+
+
+// PCI IDs
+#define VIRTIO_PCI_VENDOR           0x1af4
+#define VIRTIO_PCI_BLK_LEGACY       0x1001      // transitional device
+#define VIRTIO_PCI_BLK_MODERN       0x1042
+
+// legacy I/O registers (BAR0)
+#define VIRTIO_REG_DEVICE_FEATURES(io)  ((io) + 0x00)
+#define VIRTIO_REG_DRIVER_FEATURES(io)  ((io) + 0x04)
+#define VIRTIO_REG_QUEUE_PFN(io)        ((io) + 0x08)
+#define VIRTIO_REG_QUEUE_SIZE(io)       ((io) + 0x0c)
+#define VIRTIO_REG_QUEUE_SELECT(io)     ((io) + 0x0e)
+#define VIRTIO_REG_QUEUE_NOTIFY(io)     ((io) + 0x10)
+#define VIRTIO_REG_STATUS(io)           ((io) + 0x12)
+#define VIRTIO_REG_DEVICE_CFG(io)       ((io) + 0x14)
+
+// modern PCI capabilities (vendor specific)
+#define PCI_CAP_VENDOR                  0x09
+#define VIRTIO_CAP_COMMON               1
+#define VIRTIO_CAP_NOTIFY               2
+#define VIRTIO_CAP_DEVICE               4
+
+// device status
+#define VIRTIO_STATUS_ACK               (1 << 0)
+#define VIRTIO_STATUS_DRIVER            (1 << 1)
+#define VIRTIO_STATUS_DRIVER_OK         (1 << 2)
+#define VIRTIO_STATUS_FEATURES_OK       (1 << 3)
+
+// features
+#define VIRTIO_BLK_F_SIZE_MAX           (1 << 1)
+#define VIRTIO_BLK_F_SEG_MAX            (1 << 2)
+#define VIRTIO_F_VERSION_1              32      // bit in the second feature dword
+
+// virtio-blk device configuration (byte offsets)
+#define VIRTIO_BLK_CFG_CAPACITY         0x00
+#define VIRTIO_BLK_CFG_SIZE_MAX         0x08
+#define VIRTIO_BLK_CFG_SEG_MAX          0x0c
+
+// requests
+#define VIRTIO_BLK_T_IN                 0
+#define VIRTIO_BLK_S_OK                 0
+
+// descriptor flags
+#define VIRTQ_DESC_F_NEXT               (1 << 0)
+#define VIRTQ_DESC_F_WRITE              (1 << 1)
+#define VIRTQ_USED_F_NO_NOTIFY          (1 << 0)
+#define VIRTQ_AVAIL_F_NO_INTERRUPT      (1 << 0)
+
+// legacy queues have a fixed layout aligned to 4 KiB
+#define VIRTQ_ALIGN                     0x1000
+#define VIRTQ_MAX_SIZE                  256
+
+// every request is a descriptor chain: header, up to VIRTIO_BLK_MAX_SEGS data segments, status
+#define VIRTIO_BLK_MAX_SEGS             8
+#define VIRTIO_BLK_DESCS_PER_REQ        (VIRTIO_BLK_MAX_SEGS + 2)
+#define VIRTIO_BLK_MAX_REQS             32
+
+// segment size if the device does not report size_max
+#define VIRTIO_BLK_SEG_MAX_BYTES        0x400000
+
+
+typedef struct PACKED VirtqDesc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+} virtq_desc_t;
+
+typedef struct PACKED VirtqAvail {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+} virtq_avail_t;
+
+typedef struct PACKED VirtqUsedElem {
+    u32 id;
+    u32 len;
+} virtq_used_elem_t;
+
+typedef struct PACKED VirtqUsed {
+    u16 flags;
+    u16 idx;
+    virtq_used_elem_t ring[];
+} virtq_used_t;
+
+// common configuration of a modern device (MMIO)
+typedef volatile struct PACKED VirtioCommonCfg {
+    u32 device_feature_select;
+    u32 device_feature;
+    u32 driver_feature_select;
+    u32 driver_feature;
+    u16 msix_config;
+    u16 num_queues;
+    u8  device_status;
+    u8  config_generation;
+    u16 queue_select;
+    u16 queue_size;
+    u16 queue_msix_vector;
+    u16 queue_enable;
+    u16 queue_notify_off;
+    u32 queue_desc_low;
+    u32 queue_desc_high;
+    u32 queue_driver_low;
+    u32 queue_driver_high;
+    u32 queue_device_low;
+    u32 queue_device_high;
+} virtio_common_cfg_t;
+
+// request header (device readable)
+typedef struct PACKED VirtioBlkReq {
+    u32 type;
+    u32 reserved;
+    u64 sector;
+} virtio_blk_req_t;
+
+
+typedef struct VirtioBlk {
+    drive_t base;
+
+    // legacy devices are programmed through I/O ports, modern ones through MMIO
+    bool modern;
+    port_t io;
+    virtio_common_cfg_t *common;
+    volatile u16 *notify;
+    volatile u8 *dev_cfg;
+
+    // split virtqueue
+    u16 queue_size;
+    u16 avail_idx;
+    u16 last_used;
+    virtq_desc_t *desc;
+    virtq_avail_t *avail;
+    volatile virtq_used_t *used;
+
+    // one header and status byte per request slot
+    u16 n_reqs;
+    virtio_blk_req_t *hdrs;
+    volatile u8 *status;
+
+    // limits of a single request
+    u64 n_segs;
+    u64 seg_bytes;
+} virtio_blk_t;
+
+
+void virtio_blk_initialize(u8 bus, u8 dev, u8 func);
+bool virtio_blk_find_modern(virtio_blk_t *drive, u8 bus, u8 dev, u8 func);
+u32 virtio_blk_cfg_read(virtio_blk_t *drive, u8 off);
+void virtio_blk_set_status(virtio_blk_t *drive, u8 status);
+u8 virtio_blk_get_status(virtio_blk_t *drive);
+void virtio_blk_queue_init(virtio_blk_t *drive);
+void virtio_blk_notify(virtio_blk_t *drive);
+void virtio_blk_add_req(virtio_blk_t *drive, u16 req, u8 *dest, u64 lba, u64 n_secs);
+u64 virtio_blk_read(void *self, u8 *dest, u64 lba, u64 n_secs);
+void virtio_blk_shutdown(void *self);
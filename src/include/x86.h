@@ -100,6 +100,13 @@ static INLINE void x86_hlt(void) {
 }
 
 
+// enables interrupts and halts until the next one arrives
+// sti only takes effect after the following instruction -> no interrupt can get lost in between
+static INLINE void x86_sti_hlt(void) {
+    ASM("sti; hlt" : : : "memory");
+}
+
+
 // stops the CPU entirely
 // nothing will happen any more (no interrupts either)
 static INLINE NORETURN void x86_hang(void) {
@@ -108,6 +115,13 @@ static INLINE NORETURN void x86_hang(void) {
 }
 
 
+// makes sure all previous memory accesses are visible before continuing
+// (e.g. before handing a descriptor over to a DMA controller)
+static INLINE void x86_mfence(void) {
+    ASM("mfence" : : : "memory");
+}
+
+
 // blocks for a few ms
 // useful for i/o operations
 static INLINE void x86_io_wait(void) {
@@ -145,3 +159,56 @@ static INLINE void x86_insw(port_t port, const void *dest, u64 n_words) {
 			: "d"(port)
             : "memory");
 }
+
+
+// reads multiple double words of data from an I/O port into memory
+static INLINE void x86_insd(port_t port, const void *dest, u64 n_dwords) {
+
+    // same as x86_insw but 4 bytes per transfer
+	ASM("cld; rep; insd"
+			: "+D"(dest), "+c"(n_dwords)
+			: "d"(port)
+            : "memory");
+}
+
+
+// executes cpuid for <leaf> and <subleaf>
+static INLINE void x86_cpuid(u32 leaf, u32 subleaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx) {
+
+    // "0"/"2" -> the inputs share eax/ecx with the outputs
+    ASM("cpuid"
+            : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+            : "0"(leaf), "2"(subleaf));
+}
+
+
+// reads/writes the control registers 0 and 4
+static INLINE u64 x86_get_cr0(void) {
+    u64 cr0;
+    ASM("mov %0, cr0" : "=r"(cr0));
+    return cr0;
+}
+
+static INLINE void x86_set_cr0(u64 cr0) {
+    ASM("mov cr0, %0" : : "r"(cr0) : "memory");
+}
+
+static INLINE u64 x86_get_cr4(void) {
+    u64 cr4;
+    ASM("mov %0, cr4" : "=r"(cr4));
+    return cr4;
+}
+
+static INLINE void x86_set_cr4(u64 cr4) {
+    ASM("mov cr4, %0" : : "r"(cr4) : "memory");
+}
+
+
+// reads the time stamp counter (lfence -> earlier instructions have finished)
+static INLINE u64 x86_rdtsc(void) {
+    u32 low, high;
+    ASM("lfence\n"
+        "rdtsc"
+        : "=a"(low), "=d"(high));
+    return QWORD(high, low);
+}
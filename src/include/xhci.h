@@ -0,0 +1,326 @@
+#pragma once
+
+
+#include <types.h>
+#include <drive.h>
+#include <pci.h>
+
+
+// PCI prog_if of xHCI controllers
+#define XHCI_PROG_IF                0x30
+
+// ring sizes (TRBs, including the link TRB)
+#define XHCI_CMD_RING_SIZE          64
+#define XHCI_EVENT_RING_SIZE        256
+#define XHCI_CTRL_RING_SIZE         64
+#define XHCI_BULK_RING_SIZE         256
+
+// device slots that are enabled
+#define XHCI_MAX_SLOTS              16
+
+// scratchpad pages that will be provided for the controller at most
+#define XHCI_MAX_SCRATCHPADS        16
+
+// a Normal TRB must not cross a 64 KiB boundary
+#define XHCI_TRB_MAX_BYTES          0x10000
+
+// contexts of a device (slot + 31 endpoints)
+#define XHCI_N_CTX                  32
+#define XHCI_BULK_AVG_TRB_LEN       3072
+
+// I/O delays (~1 us each) until the ports are ready after a controller reset
+#define XHCI_PORT_SETTLE_WAITS      100000
+
+// capability registers
+#define XHCI_HCS1_MAX_SLOTS(hcs1)   ((hcs1) & 0xff)
+#define XHCI_HCS1_MAX_PORTS(hcs1)   ((hcs1) >> 24)
+#define XHCI_HCS2_MAX_SCRATCH(hcs2) ((((hcs2) >> 16) & 0x3e0) | ((hcs2) >> 27))
+#define XHCI_HCC1_CSZ               (1 << 2)    // 64 byte contexts
+#define XHCI_HCC1_XECP(hcc1)        (((hcc1) >> 16) << 2)
+
+// extended capabilities
+#define XHCI_XCAP_ID(cap)           ((cap) & 0xff)
+#define XHCI_XCAP_NEXT(cap)         ((((cap) >> 8) & 0xff) << 2)
+#define XHCI_XCAP_LEGACY            1
+#define XHCI_LEGACY_BIOS_OWNED      (1 << 16)
+#define XHCI_LEGACY_OS_OWNED        (1 << 24)
+
+// operational registers
+#define XHCI_CMD_RS                 (1 << 0)
+#define XHCI_CMD_HCRST              (1 << 1)
+#define XHCI_STS_HCH                (1 << 0)
+#define XHCI_STS_CNR                (1 << 11)
+#define XHCI_CRCR_RCS               (1 << 0)
+
+// port status and control
+#define XHCI_PORTSC_CCS             (1 << 0)
+#define XHCI_PORTSC_PED             (1 << 1)
+#define XHCI_PORTSC_PR              (1 << 4)
+#define XHCI_PORTSC_PP              (1 << 9)
+#define XHCI_PORTSC_SPEED(portsc)   (((portsc) >> 10) & 0x0f)
+#define XHCI_PORTSC_PRC             (1 << 21)
+#define XHCI_PORTSC_CHANGE          (0x7f << 17)    // write 1 to clear
+
+// port speeds
+#define XHCI_SPEED_FULL             1
+#define XHCI_SPEED_LOW              2
+#define XHCI_SPEED_HIGH             3
+#define XHCI_SPEED_SUPER            4
+
+// interrupter registers
+#define XHCI_ERDP_EHB               (1 << 3)
+
+// TRB types
+#define XHCI_TRB_NORMAL             1
+#define XHCI_TRB_SETUP              2
+#define XHCI_TRB_DATA               3
+#define XHCI_TRB_STATUS             4
+#define XHCI_TRB_LINK               6
+#define XHCI_TRB_ENABLE_SLOT        9
+#define XHCI_TRB_ADDRESS_DEVICE     11
+#define XHCI_TRB_CONFIGURE_EP       12
+#define XHCI_TRB_EVALUATE_CTX       13
+#define XHCI_TRB_EV_TRANSFER        32
+#define XHCI_TRB_EV_CMD_COMPLETE    33
+
+// TRB control fields
+#define XHCI_TRB_CYCLE              (1 << 0)
+#define XHCI_TRB_TC                 (1 << 1)    // link TRB: toggle cycle
+#define XHCI_TRB_ISP                (1 << 2)
+#define XHCI_TRB_CH                 (1 << 4)
+#define XHCI_TRB_IOC                (1 << 5)
+#define XHCI_TRB_IDT                (1 << 6)
+#define XHCI_TRB_TYPE(type)         ((type) << 10)
+#define XHCI_TRB_GET_TYPE(control)  (((control) >> 10) & 0x3f)
+#define XHCI_TRB_DIR_IN             (1 << 16)
+#define XHCI_TRB_TRT_OUT            (2 << 16)
+#define XHCI_TRB_TRT_IN             (3 << 16)
+#define XHCI_TRB_SLOT(slot)         ((u32)(slot) << 24)
+#define XHCI_TRB_GET_SLOT(control)  ((control) >> 24)
+#define XHCI_TRB_TD_SIZE(n)         ((u32)MIN(n, 31) << 17)
+
+// completion codes
+#define XHCI_CC(status)             ((status) >> 24)
+#define XHCI_CC_SUCCESS             1
+#define XHCI_CC_SHORT_PACKET        13
+#define XHCI_RESIDUE(status)        ((status) & 0xffffff)
+
+// endpoint types
+#define XHCI_EP_BULK_OUT            2
+#define XHCI_EP_CONTROL             4
+#define XHCI_EP_BULK_IN             6
+
+// device context index of an endpoint
+#define XHCI_DCI(ep_addr)           ((((ep_addr) & 0x0f) << 1) | (((ep_addr) & 0x80) ? 1 : 0))
+
+
+// USB requests and descriptors
+#define USB_REQ_GET_DESCRIPTOR      6
+#define USB_REQ_SET_CONFIGURATION   9
+#define USB_DESC_DEVICE             1
+#define USB_DESC_CONFIG             2
+#define USB_DESC_INTERFACE          4
+#define USB_DESC_ENDPOINT           5
+#define USB_EP_DIR_IN               0x80
+#define USB_EP_TYPE_BULK            2
+#define USB_DIR_IN                  0x80
+
+
+// capability registers
+typedef volatile struct PACKED XHCICapRegs {
+    u8  caplength;
+    u8  reserved;
+    u16 hciversion;
+    u32 hcsparams1;
+    u32 hcsparams2;
+    u32 hcsparams3;
+    u32 hccparams1;
+    u32 dboff;
+    u32 rtsoff;
+    u32 hccparams2;
+} xhci_cap_regs_t;
+
+// port register set
+typedef volatile struct PACKED XHCIPortRegs {
+    u32 portsc;
+    u32 portpmsc;
+    u32 portli;
+    u32 porthlpmc;
+} xhci_port_regs_t;
+
+// operational registers
+typedef volatile struct PACKED XHCIOpRegs {
+    u32 usbcmd;
+    u32 usbsts;
+    u32 pagesize;
+    u32 reserved0[2];
+    u32 dnctrl;
+    u32 crcr_low;
+    u32 crcr_high;
+    u32 reserved1[4];
+    u32 dcbaap_low;
+    u32 dcbaap_high;
+    u32 config;
+    u32 reserved2[241];
+    xhci_port_regs_t ports[];
+} xhci_op_regs_t;
+
+// interrupter register set
+typedef volatile struct PACKED XHCIInterrupter {
+    u32 iman;
+    u32 imod;
+    u32 erstsz;
+    u32 reserved;
+    u32 erstba_low;
+    u32 erstba_high;
+    u32 erdp_low;
+    u32 erdp_high;
+} xhci_interrupter_t;
+
+// runtime registers
+typedef volatile struct PACKED XHCIRuntimeRegs {
+    u32 mfindex;
+    u32 reserved[7];
+    xhci_interrupter_t ir[];
+} xhci_rt_regs_t;
+
+
+// Transfer Request Block
+typedef struct PACKED XHCITRB {
+    u64 param;
+    u32 status;
+    u32 control;
+} xhci_trb_t;
+
+// event ring segment table entry
+typedef struct PACKED XHCIERSTEntry {
+    u64 addr;
+    u32 size;
+    u32 reserved;
+} xhci_erst_entry_t;
+
+// USB setup packet
+typedef struct PACKED USBSetup {
+    u8  type;
+    u8  request;
+    u16 value;
+    u16 index;
+    u16 length;
+} usb_setup_t;
+
+typedef struct PACKED USBDeviceDesc {
+    u8  length;
+    u8  type;
+    u16 usb_version;
+    u8  class;
+    u8  subclass;
+    u8  protocol;
+    u8  max_packet_size0;
+    u16 vendor_id;
+    u16 product_id;
+    u16 device_version;
+    u8  manufacturer;
+    u8  product;
+    u8  serial;
+    u8  n_configs;
+} usb_device_desc_t;
+
+typedef struct PACKED USBConfigDesc {
+    u8  length;
+    u8  type;
+    u16 total_length;
+    u8  n_interfaces;
+    u8  config_value;
+    u8  config;
+    u8  attr;
+    u8  max_power;
+} usb_config_desc_t;
+
+typedef struct PACKED USBInterfaceDesc {
+    u8  length;
+    u8  type;
+    u8  number;
+    u8  alt_setting;
+    u8  n_endpoints;
+    u8  class;
+    u8  subclass;
+    u8  protocol;
+    u8  interface;
+} usb_interface_desc_t;
+
+typedef struct PACKED USBEndpointDesc {
+    u8  length;
+    u8  type;
+    u8  addr;
+    u8  attr;
+    u16 max_packet_size;
+    u8  interval;
+} usb_endpoint_desc_t;
+
+
+// producer side of a command/transfer ring
+typedef struct XHCIRing {
+    xhci_trb_t *trbs;
+    u16 size;
+    u16 enqueue;
+    u32 cycle;
+
+    // transfer rings: max packet size of the endpoint
+    u16 max_packet_size;
+} xhci_ring_t;
+
+
+typedef struct XHCI {
+    xhci_cap_regs_t *cap;
+    xhci_op_regs_t *op;
+    xhci_rt_regs_t *rt;
+    volatile u32 *doorbells;
+
+    // context size in bytes (32 or 64)
+    u64 ctx_size;
+    u8 n_ports;
+
+    u64 *dcbaa;
+    xhci_ring_t cmd_ring;
+
+    // consumer side of the event ring
+    xhci_trb_t *events;
+    u16 event_dequeue;
+    u32 event_cycle;
+
+    // mass storage drives on the controller (none -> it is halted after the scan)
+    u8 n_drives;
+} xhci_t;
+
+
+// a device attached to a root hub port
+typedef struct XHCIDevice {
+    xhci_t *hc;
+    u8 slot;
+    u8 port;
+    u8 speed;
+    u8 max_dci;
+
+    u8 *input_ctx;
+    u8 *output_ctx;
+    xhci_ring_t ep0;
+
+    // page for descriptors and other small control transfers
+    u8 *buf;
+} xhci_device_t;
+
+
+void xhci_initialize(u8 bus, u8 dev, u8 func);
+void xhci_bios_handoff(xhci_t *hc, u8 *base);
+void xhci_ring_init(xhci_ring_t *ring, u16 size);
+xhci_trb_t *xhci_ring_push(xhci_ring_t *ring, u64 param, u32 status, u32 control);
+bool xhci_next_event(xhci_t *hc, xhci_trb_t *event);
+xhci_trb_t xhci_cmd(xhci_t *hc, u64 param, u32 status, u32 control);
+u32 xhci_wait_transfer(xhci_t *hc, u8 slot, xhci_trb_t *last, u32 *residue);
+u8 *xhci_ctx(xhci_device_t *device, u8 *ctx, u64 index);
+void xhci_doorbell(xhci_device_t *device, u8 dci);
+u32 xhci_control(xhci_device_t *device, u8 type, u8 request, u16 value, u16 index, u16 length, u8 *data);
+bool xhci_configure_ep(xhci_device_t *device, xhci_ring_t *ring, u8 ep_addr, u16 max_packet_size);
+xhci_trb_t *xhci_queue_td(xhci_ring_t *ring, u8 *data, u64 n_bytes);
+void xhci_port_init(xhci_t *hc, u8 n_port);
+void xhci_halt(xhci_t *hc);